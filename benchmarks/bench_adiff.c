@@ -0,0 +1,406 @@
+/*
+ * End to end timings of adiff() and apatch() over a generated corpus of
+ * audio files, one CSV row per pair of files:
+ *
+ *     format,channels,seconds,edit,bytes,hunks,diff_s,patch_s,
+ *     diff_x_realtime,peak_rss_kib,bytes_fetched,seeks
+ *
+ * bytes is the size of the original file on disk, bytes_fetched and seeks
+ * count the reads of both files whilst diffing (see bdiff_stats) and
+ * peak_rss_kib is the high water mark of the process whilst diffing and
+ * patching that pair.
+ *
+ * Usage: bench_adiff [-d corpus_dir] [-c channels,...] [length ...]
+ *
+ * Lengths are given in seconds, or with an m or h suffix (default 1m). Files
+ * already in corpus_dir are reused, so long corpora need only be generated
+ * once; without it the corpus goes in a temporary directory that is removed
+ * afterwards.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib.h>
+#include <sndfile.h>
+#include "../include/adiff.h"
+
+#define sample_rate 44100
+#define write_frames 4096
+#define note_frames (sample_rate / 2)
+#define default_channels "1,2,8,16"
+#define default_length "1m"
+
+static struct {
+    char const * name;
+    char const * extension;
+    int format;
+} const formats[] = {
+    {"wav", "wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16},
+    {"flac", "flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_16},
+    {"float", "wav", SF_FORMAT_WAV | SF_FORMAT_FLOAT}};
+
+/*
+ * The modified files are described as a list of segments, each taken from
+ * the original, new material or silence.
+ */
+typedef enum {
+    SEGMENT_A,
+    SEGMENT_NEW,
+    SEGMENT_SILENCE,
+} segment_kind;
+
+typedef struct {
+    segment_kind kind;
+    sample_pos start;
+    sample_pos length;
+} segment;
+
+typedef struct {
+    segment * segments;
+    unsigned n;
+} segment_list;
+
+static void add_segment(
+        segment_list * const l, segment_kind const kind,
+        sample_pos const start, sample_pos const length) {
+    l->segments = g_renew(segment, l->segments, l->n + 1);
+    l->segments[l->n++] = (segment) {
+        .kind = kind, .start = start, .length = length};
+}
+
+static void insert_edit(segment_list * const l, sample_pos const n) {
+    sample_pos const span = n / 16;
+    add_segment(l, SEGMENT_A, 0, n / 3);
+    add_segment(l, SEGMENT_NEW, 0, span);
+    add_segment(l, SEGMENT_A, n / 3, n - n / 3);
+}
+
+static void delete_edit(segment_list * const l, sample_pos const n) {
+    sample_pos const span = n / 16;
+    add_segment(l, SEGMENT_A, 0, n / 2);
+    add_segment(l, SEGMENT_A, n / 2 + span, n - n / 2 - span);
+}
+
+static void move_edit(segment_list * const l, sample_pos const n) {
+    sample_pos const span = n / 16;
+    add_segment(l, SEGMENT_A, 0, n / 4);
+    add_segment(l, SEGMENT_A, n / 4 + span, n / 2 - span);
+    add_segment(l, SEGMENT_A, n / 4, span);
+    add_segment(l, SEGMENT_A, 3 * n / 4, n - 3 * n / 4);
+}
+
+static void silence_edit(segment_list * const l, sample_pos const n) {
+    sample_pos const span = n / 8;
+    add_segment(l, SEGMENT_A, 0, n / 2);
+    add_segment(l, SEGMENT_SILENCE, 0, span);
+    add_segment(l, SEGMENT_A, n / 2 + span, n - n / 2 - span);
+}
+
+/*
+ * Replace a section with a one second loop of the audio before it.
+ */
+static void loop_edit(segment_list * const l, sample_pos const n) {
+    sample_pos const span = n / 8;
+    sample_pos const loop = MIN(sample_rate, span);
+    add_segment(l, SEGMENT_A, 0, n / 2);
+    for (sample_pos done = 0; done < span; done += loop) {
+        add_segment(l, SEGMENT_A, n / 2 - loop, MIN(loop, span - done));
+    }
+    add_segment(l, SEGMENT_A, n / 2 + span, n - n / 2 - span);
+}
+
+static struct {
+    char const * name;
+    void (*segments)(segment_list * l, sample_pos n);
+} const edits[] = {
+    {"insert", insert_edit},
+    {"delete", delete_edit},
+    {"move", move_edit},
+    {"silence", silence_edit},
+    {"loop", loop_edit}};
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+/*
+ * Something a bit like music, so compressed formats compress: a decaying
+ * note per channel, changing pitch every half second, over quiet noise.
+ */
+static float synth(
+        uint64_t const seed, sample_pos const frame, unsigned const channel) {
+    sample_pos const note = frame / note_frames;
+    sample_pos const in_note = frame % note_frames;
+    uint64_t const key = mix(seed ^ mix(note * 64 + channel)) % 36;
+    double const pitch = 110 * pow(2, key / 12.0);
+    double const envelope = exp(-3.0 * in_note / note_frames);
+    double const phase = fmod(pitch * in_note / sample_rate, 1);
+    uint64_t const noise = mix(seed ^ mix(frame * 64 + channel + 1));
+    return 0.5 * envelope * sin(2 * M_PI * phase) +
+        0.02 * ((double) noise / UINT64_MAX - 0.5);
+}
+
+static void write_segments(
+        char const * const path, SF_INFO info, segment_list const * const l) {
+    SNDFILE * const f = sf_open(path, SFM_WRITE, &info);
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, sf_strerror(NULL));
+        exit(EXIT_FAILURE);
+    }
+    float * const buffer = g_new(float, write_frames * info.channels);
+    for (unsigned s = 0; s < l->n; s++) {
+        segment const seg = l->segments[s];
+        uint64_t const seed = (seg.kind == SEGMENT_NEW) ? 2 : 1;
+        for (sample_pos done = 0; done < seg.length; ) {
+            unsigned const n = MIN(write_frames, seg.length - done);
+            for (unsigned i = 0; i < n; i++) {
+                for (int c = 0; c < info.channels; c++) {
+                    buffer[i * info.channels + c] =
+                        (seg.kind == SEGMENT_SILENCE) ? 0 :
+                        synth(seed, seg.start + done + i, c);
+                }
+            }
+            sf_writef_float(f, buffer, n);
+            done += n;
+        }
+    }
+    g_free(buffer);
+    sf_close(f);
+}
+
+typedef struct {
+    char * dir;
+    gboolean temporary;
+    GPtrArray * generated;
+} corpus;
+
+/*
+ * The path of a corpus file, generating it first unless it already exists.
+ */
+static char * corpus_file(
+        corpus * const c, char const * const name, SF_INFO const info,
+        segment_list const * const l) {
+    char * const path = g_build_filename(c->dir, name, NULL);
+    if (access(path, F_OK) != 0) {
+        write_segments(path, info, l);
+        g_ptr_array_add(c->generated, g_strdup(path));
+    }
+    return path;
+}
+
+/*
+ * Reset the peak resident set size (Linux only; elsewhere the peak is for
+ * the whole run so far).
+ */
+static void reset_peak_rss() {
+    FILE * const f = fopen("/proc/self/clear_refs", "w");
+    if (f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long peak_rss_kib() {
+    FILE * const f = fopen("/proc/self/status", "r");
+    if (f != NULL) {
+        char line[256];
+        long kib;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "VmHWM: %ld kB", &kib) == 1) {
+                fclose(f);
+                return kib;
+            }
+        }
+        fclose(f);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static uint64_t count_hunks(hunk const * h) {
+    uint64_t n = 0;
+    for (; h != NULL; h = h->next) {
+        n++;
+    }
+    return n;
+}
+
+static off_t file_size(char const * const path) {
+    struct stat st;
+    return (stat(path, &st) == 0) ? st.st_size : -1;
+}
+
+static void run_pair(
+        corpus * const c, char const * const format, unsigned const channels,
+        sample_pos const seconds, char const * const edit,
+        char const * const a_path, char const * const b_path) {
+    char * const out_name = g_strdup_printf(
+        "patched_%s", strrchr(b_path, G_DIR_SEPARATOR) + 1);
+    char * const out_path = g_build_filename(c->dir, out_name, NULL);
+    bdiff_stats stats = {};
+    adiff_options const opts = {.bdiff = {.stats = &stats}};
+
+    reset_peak_rss();
+    gint64 const start = g_get_monotonic_time();
+    diff d = adiff_with_options(a_path, b_path, &opts);
+    gint64 const diffed = g_get_monotonic_time();
+    if (d.code != ADIFF_OK) {
+        fprintf(stderr, "%s: diff failed (%d)\n", b_path, d.code);
+        exit(EXIT_FAILURE);
+    }
+    apatch_return_code const patched = apatch_with_options(
+        d.hunks, a_path, b_path, out_path, &opts);
+    gint64 const end = g_get_monotonic_time();
+    if (patched != APATCH_OK) {
+        fprintf(stderr, "%s: patch failed (%d)\n", b_path, patched);
+        exit(EXIT_FAILURE);
+    }
+
+    double const diff_s = (diffed - start) / 1e6;
+    printf(
+        "%s,%u,%" PRIu64 ",%s,%lld,%" PRIu64 ",%.3f,%.3f,%.1f,%ld,%" PRIu64
+        ",%" PRIu64 "\n",
+        format, channels, seconds, edit, (long long) file_size(a_path),
+        count_hunks(d.hunks), diff_s, (end - diffed) / 1e6,
+        2 * seconds / diff_s, peak_rss_kib(),
+        stats.a.bytes_fetched + stats.b.bytes_fetched,
+        stats.a.seeks + stats.b.seeks);
+    fflush(stdout);
+    diff_free(&d);
+    remove(out_path);
+    g_free(out_path);
+    g_free(out_name);
+}
+
+static void run_corpus(
+        corpus * const c, unsigned const format, unsigned const channels,
+        sample_pos const seconds) {
+    SF_INFO const info = {
+        .channels = channels, .samplerate = sample_rate,
+        .format = formats[format].format};
+    if (!sf_format_check(&info)) {
+        // FLAC only goes up to 8 channels
+        return;
+    }
+    sample_pos const n = seconds * sample_rate;
+    char * const prefix = g_strdup_printf(
+        "%s_%uch_%" PRIu64 "s", formats[format].name, channels, seconds);
+    char * const a_name = g_strdup_printf(
+        "%s.%s", prefix, formats[format].extension);
+    segment_list original = {};
+    add_segment(&original, SEGMENT_A, 0, n);
+    char * const a_path = corpus_file(c, a_name, info, &original);
+    for (unsigned e = 0; e < G_N_ELEMENTS(edits); e++) {
+        char * const b_name = g_strdup_printf(
+            "%s_%s.%s", prefix, edits[e].name, formats[format].extension);
+        segment_list edited = {};
+        edits[e].segments(&edited, n);
+        char * const b_path = corpus_file(c, b_name, info, &edited);
+        run_pair(
+            c, formats[format].name, channels, seconds, edits[e].name,
+            a_path, b_path);
+        g_free(edited.segments);
+        g_free(b_path);
+        g_free(b_name);
+    }
+    g_free(original.segments);
+    g_free(a_path);
+    g_free(a_name);
+    g_free(prefix);
+}
+
+static sample_pos parse_length(char const * const arg) {
+    char * end;
+    errno = 0;
+    sample_pos seconds = strtoull(arg, &end, 10);
+    if (*end == 'm') {
+        seconds *= 60;
+        end++;
+    } else if (*end == 'h') {
+        seconds *= 60 * 60;
+        end++;
+    }
+    if (errno || end == arg || *end != '\0' || seconds == 0) {
+        fprintf(stderr, "Invalid length: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return seconds;
+}
+
+static void usage(char const * const name) {
+    fprintf(
+        stderr, "Usage: %s [-d corpus_dir] [-c channels,...] [length ...]\n",
+        name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv) {
+    corpus c = {.generated = g_ptr_array_new_with_free_func(g_free)};
+    char const * channel_list = default_channels;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:c:")) != -1) {
+        switch (opt) {
+            case 'd':
+                c.dir = g_strdup(optarg);
+                break;
+            case 'c':
+                channel_list = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (c.dir == NULL) {
+        GError * err = NULL;
+        c.dir = g_dir_make_tmp("bench_adiff_XXXXXX", &err);
+        c.temporary = TRUE;
+        if (c.dir == NULL) {
+            fprintf(stderr, "%s\n", err->message);
+            return EXIT_FAILURE;
+        }
+    }
+    static char * default_lengths[] = {default_length};
+    char * const * const lengths =
+        (optind < argc) ? argv + optind : default_lengths;
+    unsigned const n_lengths = (optind < argc) ? argc - optind : 1;
+
+    printf(
+        "format,channels,seconds,edit,bytes,hunks,diff_s,patch_s,"
+        "diff_x_realtime,peak_rss_kib,bytes_fetched,seeks\n");
+    for (unsigned l = 0; l < n_lengths; l++) {
+        sample_pos const seconds = parse_length(lengths[l]);
+        for (unsigned f = 0; f < G_N_ELEMENTS(formats); f++) {
+            char const * channels = channel_list;
+            while (*channels) {
+                char * end;
+                unsigned long const n_channels = strtoul(channels, &end, 10);
+                if (end == channels || n_channels == 0) {
+                    usage(argv[0]);
+                }
+                run_corpus(&c, f, n_channels, seconds);
+                channels = (*end == ',') ? end + 1 : end;
+            }
+        }
+    }
+
+    if (c.temporary) {
+        for (unsigned i = 0; i < c.generated->len; i++) {
+            remove(g_ptr_array_index(c.generated, i));
+        }
+        rmdir(c.dir);
+    }
+    g_ptr_array_free(c.generated, TRUE);
+    g_free(c.dir);
+    return 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * Throughput of the core kernels over synthetic data, one CSV row per kernel
+ * and sample size:
+ *
+ *     kernel,sample_size,bytes,runs,seconds_per_run,mb_per_s,ns_per_byte
+ *
+ * bytes is the data processed by one run. Usage: bench_kernels [MiB of data]
+ */
+#include <glib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rabin.h"
+#include "chunk.h"
+#include "hunk.h"
+#include "hash_counting_table.h"
+#include "bdiff_defs.h"
+
+// Each kernel is repeated until it has run for at least this long:
+#define min_bench_us 250000
+#define default_data_mib 16
+
+static unsigned const sample_sizes[] = {1, 2, 4, 8};
+
+// Somewhere for results to go, so that the work isn't optimised away:
+static volatile uint64_t sink;
+
+static unsigned char * random_bytes(size_t const n, guint32 const seed) {
+    unsigned char * const data = malloc(n);
+    GRand * const g_rand = g_rand_new_with_seed(seed);
+    for (size_t i = 0; i < n; i++) {
+        data[i] = g_rand_int(g_rand);
+    }
+    g_rand_free(g_rand);
+    return data;
+}
+
+/*
+ * Edit one sample in every stride, so there is something to diff.
+ */
+static unsigned char * edited_copy(
+        unsigned char const * const data, size_t const n,
+        size_t const stride) {
+    unsigned char * const copy = malloc(n);
+    memcpy(copy, data, n);
+    for (size_t i = stride / 2; i < n; i += stride) {
+        copy[i]++;
+    }
+    return copy;
+}
+
+typedef struct {
+    unsigned char const * data;
+    unsigned sample_size;
+    sample_pos length;
+    sample_pos pos;
+} bench_source;
+
+static unsigned bench_fetcher(
+        void * const source, char * const buffer, unsigned const n_items) {
+    bench_source * const bs = source;
+    sample_pos const left = bs->length - bs->pos;
+    unsigned const n = (left < n_items) ? left : n_items;
+    memcpy(
+        buffer, bs->data + bs->pos * bs->sample_size,
+        (size_t) n * bs->sample_size);
+    bs->pos += n;
+    return n;
+}
+
+static void bench_seeker(void * const source, sample_pos const pos) {
+    ((bench_source *) source)->pos = pos;
+}
+
+static bench_source source_of(
+        unsigned char const * const data, size_t const n,
+        unsigned const sample_size) {
+    return (bench_source) {
+        .data = data, .sample_size = sample_size,
+        .length = n / sample_size};
+}
+
+typedef void (*kernel)(void * state);
+
+static void run_kernel(
+        char const * const name, unsigned const sample_size,
+        uint64_t const bytes, kernel const k, void * const state) {
+    k(state);  // Warm up
+    unsigned runs = 0;
+    gint64 const start = g_get_monotonic_time();
+    gint64 elapsed;
+    do {
+        k(state);
+        runs++;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < min_bench_us);
+    double const seconds = elapsed / 1e6 / runs;
+    printf(
+        "%s,%u,%" PRIu64 ",%u,%.6f,%.1f,%.3f\n", name, sample_size, bytes,
+        runs, seconds, bytes / seconds / 1e6, seconds * 1e9 / bytes);
+    fflush(stdout);
+}
+
+typedef struct {
+    unsigned char const * data;
+    size_t n;
+} buffer_state;
+
+static void hash_kernel(void * const state) {
+    buffer_state const * const bs = state;
+    hash_data hd = hash_data_init(141);
+    for (size_t i = 0; i < bs->n; i++) {
+        hash_data_update(&hd, bs->data[i]);
+    }
+    sink += hd.h;
+}
+
+static void window_kernel(void * const state) {
+    buffer_state const * const bs = state;
+    hash_data const hd = hash_data_init(141);
+    unsigned char window[default_window_length * sizeof(guint32)];
+    window_data wd = window_data_init(&hd, window, sizeof(window));
+    for (size_t i = 0; i < bs->n; i++) {
+        window_data_update(&wd, bs->data[i]);
+    }
+    sink += wd.h;
+}
+
+typedef struct {
+    bench_source a;
+    bench_source b;
+    bdiff_options opts;
+} split_state;
+
+static void split_kernel(void * const state) {
+    split_state * const s = state;
+    s->a.pos = 0;
+    chunks const c = split_data(
+        s->a.sample_size, bench_fetcher, &s->a, &s->opts);
+    sink += c->hash;
+    chunk_free(c);
+}
+
+static void split_pair_kernel(void * const state) {
+    split_state * const s = state;
+    s->a.pos = s->b.pos = 0;
+    chunks a, b;
+    split_data_pair(
+        s->a.sample_size, bench_fetcher, &s->a, &s->b, &s->opts, &a, &b);
+    sink += a->hash + b->hash;
+    chunk_free(a);
+    chunk_free(b);
+}
+
+typedef void (*many_splitter)(
+    unsigned sample_size, data_fetcher df, void * const * sources,
+    unsigned n_sources, bdiff_options const * opts, chunks * out);
+
+typedef struct {
+    bench_source sources[max_split_lanes];
+    unsigned n_sources;
+    many_splitter split;
+    bdiff_options opts;
+} many_state;
+
+static void split_many_kernel(void * const state) {
+    many_state * const s = state;
+    void * sources[max_split_lanes];
+    chunks out[max_split_lanes];
+    for (unsigned j = 0; j < s->n_sources; j++) {
+        s->sources[j].pos = 0;
+        sources[j] = &s->sources[j];
+    }
+    s->split(
+        s->sources[0].sample_size, bench_fetcher, sources, s->n_sources,
+        &s->opts, out);
+    for (unsigned j = 0; j < s->n_sources; j++) {
+        sink += out[j]->hash;
+        chunk_free(out[j]);
+    }
+}
+
+/*
+ * Splitting several sources together, by the AVX2 splitters (where the CPU
+ * has them) or the portable ones.
+ */
+static struct {
+    char const * name;
+    unsigned n_sources;
+    many_splitter split;
+} const many_kernels[] = {
+    {"split_data_many_4", 4, split_data_many},
+    {"split_data_many_8", 8, split_data_many},
+    {"split_data_many_generic_4", 4, split_data_many_generic},
+    {"split_data_many_generic_8", 8, split_data_many_generic}};
+
+typedef struct {
+    hash const * hashes;
+    unsigned n;
+} table_state;
+
+static void counting_table_kernel(void * const state) {
+    table_state const * const ts = state;
+    hash_counting_table tab = hash_counting_table_new();
+    for (unsigned i = 0; i < ts->n; i++) {
+        hash_counting_table_inc(tab, ts->hashes[i]);
+    }
+    for (unsigned i = 0; i < ts->n; i++) {
+        sink += hash_counting_table_get(tab, ts->hashes[i]);
+    }
+    for (unsigned i = 0; i < ts->n; i++) {
+        hash_counting_table_dec(tab, ts->hashes[i]);
+    }
+    hash_counting_table_destroy(tab);
+}
+
+typedef struct {
+    chunks a;
+    chunks b;
+} match_state;
+
+static void diff_chunks_kernel(void * const state) {
+    match_state const * const ms = state;
+    hunk * const h = diff_chunks(ms->a, ms->b);
+    sink += (h != NULL);
+    hunk_free(h);
+}
+
+typedef struct {
+    split_state * split;
+    hunk * rough;
+} narrow_state;
+
+static void narrow_kernel(void * const state) {
+    narrow_state * const ns = state;
+    split_state * const s = ns->split;
+    hunk * const h = bdiff_narrow_with_options(
+        ns->rough, s->a.sample_size, bench_seeker, bench_fetcher, &s->a,
+        &s->b, &s->opts);
+    sink += (h != NULL);
+    hunk_free(h);
+}
+
+static uint64_t count_chunks(chunk const * c) {
+    uint64_t n = 0;
+    for (; c != NULL; c = c->next) {
+        n++;
+    }
+    return n;
+}
+
+static void usage(char const * const name) {
+    fprintf(stderr, "Usage: %s [MiB of data (at least 1)]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * The size of the data, in bytes, from a whole number of MiB. Anything less
+ * than 1 MiB would leave nothing to hash.
+ */
+static size_t parse_size(char const * const name, char const * const arg) {
+    char * end;
+    errno = 0;
+    unsigned long long const mib = strtoull(arg, &end, 10);
+    if (
+            errno || end == arg || *end != '\0' || arg[0] == '-' ||
+            mib == 0 || mib > (SIZE_MAX >> 20)) {
+        usage(name);
+    }
+    return (size_t) mib << 20;
+}
+
+int main(int argc, char ** argv) {
+    if (argc > 2) {
+        usage(argv[0]);
+    }
+    size_t const n = (argc > 1) ?
+        parse_size(argv[0], argv[1]) : (size_t) default_data_mib << 20;
+    unsigned char * const a_data = random_bytes(n, 1);
+    unsigned char * const b_data = edited_copy(a_data, n, 1 << 16);
+    // Unrelated data for each source split together, like channels:
+    unsigned char * lane_data[max_split_lanes] = {a_data};
+    for (unsigned j = 1; j < max_split_lanes; j++) {
+        lane_data[j] = random_bytes(n, j + 1);
+    }
+    printf("kernel,sample_size,bytes,runs,seconds_per_run,mb_per_s,"
+        "ns_per_byte\n");
+
+    buffer_state bs = {.data = a_data, .n = n};
+    run_kernel("hash_data_update", 1, n, hash_kernel, &bs);
+    run_kernel("window_data_update", 1, n, window_kernel, &bs);
+
+    for (unsigned i = 0; i < G_N_ELEMENTS(sample_sizes); i++) {
+        unsigned const sample_size = sample_sizes[i];
+        split_state s = {
+            .a = source_of(a_data, n, sample_size),
+            .b = source_of(b_data, n, sample_size),
+            .opts = bdiff_options_complete(NULL, bdiff_options_default())};
+        uint64_t const bytes = s.a.length * sample_size;
+        run_kernel("split_data", sample_size, bytes, split_kernel, &s);
+        run_kernel(
+            "split_data_pair", sample_size, 2 * bytes, split_pair_kernel,
+            &s);
+        for (unsigned k = 0; k < G_N_ELEMENTS(many_kernels); k++) {
+            many_state ms = {
+                .n_sources = many_kernels[k].n_sources,
+                .split = many_kernels[k].split, .opts = s.opts};
+            for (unsigned j = 0; j < ms.n_sources; j++) {
+                ms.sources[j] = source_of(lane_data[j], n, sample_size);
+            }
+            run_kernel(
+                many_kernels[k].name, sample_size, ms.n_sources * bytes,
+                split_many_kernel, &ms);
+        }
+
+        s.a.pos = s.b.pos = 0;
+        match_state ms;
+        split_data_pair(
+            sample_size, bench_fetcher, &s.a, &s.b, &s.opts, &ms.a, &ms.b);
+        run_kernel(
+            "diff_chunks", sample_size, 2 * bytes, diff_chunks_kernel, &ms);
+
+        unsigned const n_hashes = count_chunks(ms.a);
+        hash * const hashes = malloc(n_hashes * sizeof(hash));
+        unsigned h = 0;
+        for (chunk const * c = ms.a; c != NULL; c = c->next) {
+            hashes[h++] = c->hash;
+        }
+        table_state ts = {.hashes = hashes, .n = n_hashes};
+        run_kernel(
+            "hash_counting_table", sample_size, n_hashes * sizeof(hash),
+            counting_table_kernel, &ts);
+        free(hashes);
+
+        // Narrowing is measured against the bytes it actually compares:
+        narrow_state ns = {.split = &s, .rough = diff_chunks(ms.a, ms.b)};
+        bdiff_stats stats = {};
+        s.opts.stats = &stats;
+        narrow_kernel(&ns);
+        s.opts.stats = NULL;
+        run_kernel(
+            "narrowing", sample_size, stats.bytes_compared, narrow_kernel,
+            &ns);
+        hunk_free(ns.rough);
+        chunk_free(ms.a);
+        chunk_free(ms.b);
+    }
+    for (unsigned j = 0; j < max_split_lanes; j++) {
+        free(lane_data[j]);
+    }
+    free(b_data);
+    return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * Replay the reads recorded in a trace (see trace_source.h), printing how
+ * long each kind of call took originally and when replayed:
+ *
+ *     op,calls,bytes,recorded_s,replayed_s
+ *
+ * Usage: replay_trace [-o offset] [-s seek_us] [-r mb_per_s] trace [file ...]
+ *
+ * Given files (one per source in the trace, read as raw samples after offset
+ * bytes of header), the trace is replayed against them with raw_source.
+ * Otherwise each source is simulated in memory, every seek costing seek_us
+ * and every fetch taking as long as reading at mb_per_s would. A prefetch
+ * costs one seek per range plus the time to read the ranges, after which
+ * reads inside them are free.
+ *
+ * Calls are replayed one after another, in the order they were recorded,
+ * even if they were originally made on several threads.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+#include "../include/raw_source.h"
+#include "../include/trace_source.h"
+
+#define max_sources 64
+#define default_seek_us 100
+#define default_mb_per_s 100
+
+typedef struct {
+    sample_pos length;
+    unsigned sample_size;
+    sample_pos pos;
+    view * prefetched;
+    unsigned n_prefetched;
+} simulated_source;
+
+static uint64_t seek_ns = default_seek_us * 1000;
+static double ns_per_byte = 1000.0 / default_mb_per_s;
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void delay(uint64_t const ns) {
+    uint64_t const end = now_ns() + ns;
+    struct timespec const t = {
+        .tv_sec = end / 1000000000, .tv_nsec = end % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL)) {
+    }
+}
+
+static int prefetched(
+        simulated_source const * const ss, sample_pos const start,
+        sample_pos const end) {
+    for (unsigned r = 0; r < ss->n_prefetched; r++) {
+        if (ss->prefetched[r].start <= start && end <= ss->prefetched[r].end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned simulated_fetcher(
+        void * const source, char * const buffer, unsigned const n_items) {
+    simulated_source * const ss = source;
+    sample_pos const left = (ss->pos < ss->length) ?
+        ss->length - ss->pos : 0;
+    unsigned const n = (left < n_items) ? left : n_items;
+    memset(buffer, 0, (size_t) n * ss->sample_size);
+    if (!prefetched(ss, ss->pos, ss->pos + n)) {
+        delay((uint64_t) (ns_per_byte * n * ss->sample_size));
+    }
+    ss->pos += n;
+    return n;
+}
+
+static void simulated_seeker(void * const source, sample_pos const pos) {
+    simulated_source * const ss = source;
+    if (pos != ss->pos) {
+        delay(seek_ns);
+    }
+    ss->pos = pos;
+}
+
+static void simulated_prefetcher(
+        void * const source, view const * const ranges,
+        unsigned const n_ranges) {
+    simulated_source * const ss = source;
+    ss->prefetched = g_renew(view, ss->prefetched, n_ranges);
+    memcpy(ss->prefetched, ranges, n_ranges * sizeof(view));
+    ss->n_prefetched = n_ranges;
+    uint64_t bytes = 0;
+    for (unsigned r = 0; r < n_ranges; r++) {
+        bytes += (ranges[r].end - ranges[r].start) * ss->sample_size;
+    }
+    delay(n_ranges * seek_ns + (uint64_t) (ns_per_byte * bytes));
+}
+
+typedef struct {
+    data_seeker ds;
+    data_fetcher df;
+    data_prefetcher dp;
+    void * source;
+    unsigned sample_size;
+} replay_source;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t recorded_ns;
+    uint64_t replayed_ns;
+} op_totals;
+
+static char const * const op_names[] = {
+    [TRACE_FETCH] = "fetch", [TRACE_SEEK] = "seek",
+    [TRACE_PREFETCH] = "prefetch"};
+
+static void usage(char const * const name) {
+    fprintf(
+        stderr,
+        "Usage: %s [-o offset] [-s seek_us] [-r mb_per_s] trace [file ...]\n",
+        name);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Find the sample size and extent of each source in the trace, so it can be
+ * simulated.
+ */
+static unsigned scan_trace(
+        FILE * const f, simulated_source * const simulated,
+        size_t * const max_fetch) {
+    unsigned n_sources = 0;
+    trace_event e;
+    while (trace_read_event(f, &e)) {
+        if (e.source >= max_sources) {
+            fprintf(stderr, "Too many sources in trace\n");
+            exit(EXIT_FAILURE);
+        }
+        simulated_source * const ss = &simulated[e.source];
+        if (e.op == TRACE_SOURCE) {
+            ss->sample_size = e.n;
+            n_sources = MAX(n_sources, e.source + 1);
+        } else if (e.op == TRACE_FETCH || e.op == TRACE_RANGE) {
+            ss->length = MAX(ss->length, e.v.end);
+        }
+        if (e.op == TRACE_FETCH) {
+            *max_fetch = MAX(*max_fetch, (size_t) e.n * ss->sample_size);
+        }
+    }
+    rewind(f);
+    return n_sources;
+}
+
+static int read_ranges(
+        FILE * const f, view * const ranges, unsigned const n_ranges) {
+    trace_event e;
+    for (unsigned r = 0; r < n_ranges; r++) {
+        if (!trace_read_event(f, &e) || e.op != TRACE_RANGE) {
+            return 0;
+        }
+        ranges[r] = e.v;
+    }
+    return 1;
+}
+
+int main(int argc, char ** argv) {
+    sample_pos offset = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:r:")) != -1) {
+        switch (opt) {
+            case 'o':
+                offset = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                seek_ns = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'r':
+                ns_per_byte = 1000.0 / atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+    FILE * const f = fopen(argv[optind], "r");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    static simulated_source simulated[max_sources];
+    size_t max_fetch = 0;
+    unsigned const n_sources = scan_trace(f, simulated, &max_fetch);
+    unsigned const n_files = argc - optind - 1;
+    if (n_files && n_files != n_sources) {
+        fprintf(stderr, "Trace has %u sources\n", n_sources);
+        return EXIT_FAILURE;
+    }
+
+    replay_source sources[max_sources];
+    for (unsigned s = 0; s < n_sources; s++) {
+        unsigned const sample_size = simulated[s].sample_size;
+        if (n_files) {
+            char const * const path = argv[optind + 1 + s];
+            raw_source * const rs = raw_source_open(path, sample_size, offset);
+            if (rs == NULL) {
+                perror(path);
+                return EXIT_FAILURE;
+            }
+            sources[s] = (replay_source) {
+                .ds = raw_source_seeker, .df = raw_source_fetcher,
+                .dp = raw_source_prefetcher, .source = rs,
+                .sample_size = sample_size};
+        } else {
+            sources[s] = (replay_source) {
+                .ds = simulated_seeker, .df = simulated_fetcher,
+                .dp = simulated_prefetcher, .source = &simulated[s],
+                .sample_size = sample_size};
+        }
+    }
+
+    op_totals totals[G_N_ELEMENTS(op_names)] = {};
+    unsigned short_reads = 0;
+    char * const buffer = g_malloc(max_fetch);
+    view * ranges = NULL;
+    trace_event e;
+    while (trace_read_event(f, &e)) {
+        if (e.op == TRACE_PREFETCH) {
+            ranges = g_renew(view, ranges, e.n);
+            if (!read_ranges(f, ranges, e.n)) {
+                fprintf(stderr, "Prefetch missing ranges\n");
+                return EXIT_FAILURE;
+            }
+        }
+        if (e.source >= n_sources || e.op >= G_N_ELEMENTS(op_names)) {
+            continue;
+        }
+        replay_source const * const rs = &sources[e.source];
+        op_totals * const t = &totals[e.op];
+        uint64_t const start = now_ns();
+        switch (e.op) {
+            case TRACE_FETCH: {
+                unsigned const n_read = rs->df(rs->source, buffer, e.n);
+                short_reads += (n_read != e.v.end - e.v.start);
+                t->bytes += (uint64_t) n_read * rs->sample_size;
+                break;
+            }
+            case TRACE_SEEK:
+                rs->ds(rs->source, e.v.start);
+                break;
+            case TRACE_PREFETCH:
+                rs->dp(rs->source, ranges, e.n);
+                for (unsigned r = 0; r < e.n; r++) {
+                    t->bytes +=
+                        (ranges[r].end - ranges[r].start) * rs->sample_size;
+                }
+                break;
+            default:
+                continue;
+        }
+        t->replayed_ns += now_ns() - start;
+        t->calls++;
+        t->recorded_ns += e.ns;
+    }
+
+    printf("op,calls,bytes,recorded_s,replayed_s\n");
+    for (unsigned op = 0; op < G_N_ELEMENTS(op_names); op++) {
+        if (op_names[op] != NULL) {
+            printf(
+                "%s,%" PRIu64 ",%" PRIu64 ",%.6f,%.6f\n", op_names[op],
+                totals[op].calls, totals[op].bytes,
+                totals[op].recorded_ns / 1e9, totals[op].replayed_ns / 1e9);
+        }
+    }
+    if (short_reads) {
+        fprintf(
+            stderr, "%u fetches read a different amount than recorded\n",
+            short_reads);
+    }
+    for (unsigned s = 0; s < n_sources; s++) {
+        if (n_files) {
+            raw_source_close(sources[s].source);
+        }
+        g_free(simulated[s].prefetched);
+    }
+    g_free(buffer);
+    g_free(ranges);
+    fclose(f);
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <inttypes.h>
 #include "../include/adiff.h"
 
 int main(int argc, char ** argv) {
@@ -23,6 +24,9 @@ int main(int argc, char ** argv) {
         case ADIFF_ERR_SAMPLE_FORMAT:
             fprintf(stderr, "Files have different sample formats\n");
             break;
+        case ADIFF_ERR_READ:
+            fprintf(stderr, "Failed to read the files' channels\n");
+            break;
         case ADIFF_OK:
             if (d.hunks == NULL) {
                 fprintf(stderr, "No changes found\n");
@@ -30,8 +34,9 @@ int main(int argc, char ** argv) {
                 hunk const * h = d.hunks;
                 for (; h != NULL; h = h->next) {
                     printf(
-                        "%d %d %d %d\n", h->a.start, h->a.end, h->b.start,
-                        h->b.end);
+                        "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "%s\n",
+                        h->a.start, h->a.end, h->b.start,
+                        h->b.end, (h->source == HUNK_SOURCE_A) ? " a" : "");
                 }
             }
     }
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include "../include/adiff.h"
 
 static hunk * load_diff_file(char const * path) {
@@ -8,15 +9,25 @@ static hunk * load_diff_file(char const * path) {
         fprintf(stderr, "Unable to open diff file: %s\n", path);
         return NULL;
     }
-    unsigned a_start, a_end, b_start, b_end;
+    sample_pos a_start, a_end, b_start, b_end;
+    char source;
+    char line[128];
     hunk * head = NULL, * tail = NULL;
-    while (
-            fscanf(
-                diff_file, "%u %u %u %u\n",
-                &a_start, &a_end, &b_start, &b_end)
-            == 4) {
-        append_hunk(&head, &tail, a_start, a_end, b_start, b_end);
+    while (fgets(line, sizeof(line), diff_file) != NULL) {
+        int const n_read = sscanf(
+            line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %c",
+            &a_start, &a_end, &b_start, &b_end,
+            &source);
+        if (n_read == 5 && source == 'a') {
+            // Lines ending in "a" copy b_start to b_end from file a
+            append_copy_hunk(&head, &tail, a_start, b_start, b_end);
+        } else if (n_read >= 4) {
+            append_hunk(&head, &tail, a_start, a_end, b_start, b_end);
+        } else {
+            break;
+        }
     }
+    fclose(diff_file);
     return head;
 }
 
@@ -44,6 +55,19 @@ int main(int argc, char ** argv) {
         case APATCH_ERR_OPEN_OUTPUT:
             fprintf(stderr, "Failed to open (write) %s\n", argv[4]);
             break;
+        case APATCH_ERR_CHANNELS:
+            fprintf(stderr, "Files have different numbers of channels\n");
+            break;
+        case APATCH_ERR_CHANNEL_LENGTHS:
+            fprintf(stderr, "Patched channels differ in length\n");
+            break;
+        case APATCH_ERR_READ:
+            fprintf(stderr, "Files are shorter than the diff expects\n");
+            break;
+        case APATCH_ERR_OPEN_PATCH:
+        case APATCH_ERR_BAD_PATCH:
+            // Only returned for patch files
+            break;
     }
     hunk_free(h);
     return code;
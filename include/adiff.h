@@ -10,6 +10,7 @@
  */
 
 #include "diff_types.h"
+#include "bdiff.h"
 
 /** \brief Codes for errors that may be encountered whilst diffing.
  */
@@ -20,6 +21,8 @@ typedef enum {
     ADIFF_ERR_CHANNELS,
     ADIFF_ERR_SAMPLE_RATE,
     ADIFF_ERR_SAMPLE_FORMAT,
+    /** A file's channels couldn't be split out into temporary files. */
+    ADIFF_ERR_READ,
 } adiff_return_code;
 
 /** \brief Codes for errors that may be encountered whilst patching.
@@ -29,8 +32,27 @@ typedef enum {
     APATCH_ERR_OPEN_A,
     APATCH_ERR_OPEN_B,
     APATCH_ERR_OPEN_OUTPUT,
+    APATCH_ERR_CHANNELS,
+    APATCH_ERR_CHANNEL_LENGTHS,
+    APATCH_ERR_OPEN_PATCH,
+    /** The patch file is corrupt, or its hunks don't fit the files. */
+    APATCH_ERR_BAD_PATCH,
+    /** A file was shorter than its hunks said. */
+    APATCH_ERR_READ,
 } apatch_return_code;
 
+/** \brief Codes for errors that may be encountered whilst merging.
+ */
+typedef enum {
+    AMERGE_OK = 0,
+    AMERGE_ERR_OPEN_BASE,
+    AMERGE_ERR_OPEN_OURS,
+    AMERGE_ERR_OPEN_THEIRS,
+    AMERGE_ERR_OPEN_OUTPUT,
+    /** The files' channels, sample rates or sample formats differ. */
+    AMERGE_ERR_FORMAT,
+} amerge_return_code;
+
 /** \brief Information about how two files differ (or why they couldn't be compared).
  */
 typedef struct {
@@ -38,6 +60,57 @@ typedef struct {
     hunk * hunks;
 } diff;
 
+/** \brief How each channel of two files differs (or why they couldn't be
+ * compared).
+ */
+typedef struct {
+    adiff_return_code code;
+    /** \brief Number of channels (and so of hunk lists). */
+    unsigned channels;
+    /** \brief A list of hunks (in frames) for each channel. */
+    hunk ** hunks;
+} channel_diff;
+
+/** \brief When to cache decoded audio whilst diffing.
+ *
+ * Narrowing seeks around the files a lot, which for compressed formats means
+ * decoding the same data over and over. With the cache, frames are decoded
+ * once (whilst chunking), spilled to a temporary file and read back from
+ * there.
+ */
+typedef enum {
+    /** \brief Cache compressed (FLAC and Ogg) files only. */
+    ADIFF_DECODE_CACHE_AUTO = 0,
+    /** \brief Cache every file. */
+    ADIFF_DECODE_CACHE_ALWAYS,
+    /** \brief Never cache, always seek in the file itself. */
+    ADIFF_DECODE_CACHE_NEVER,
+} adiff_decode_cache;
+
+/** \brief Tuning parameters for diffing and patching audio files.
+ */
+typedef struct {
+    /** \brief Parameters for the underlying binary diff.
+     * Fields left as zero are chosen automatically from the length of the
+     * files being compared. Stats are totalled over every channel (with
+     * adiff_channels()) or pair of files (with adiff_batch()). */
+    bdiff_options bdiff;
+    /** \brief Size (in bytes) of the buffer used to copy audio whilst
+     * patching (zero for the default). */
+    unsigned copy_buf_size;
+    /** \brief Maximum number of threads used to diff channels (or, with an
+     * adiff_context, pairs of files) in parallel (zero for one per
+     * processor). */
+    unsigned threads;
+    /** \brief When to cache decoded audio (see adiff_decode_cache). */
+    adiff_decode_cache decode_cache;
+    /** \brief A file to record every read and seek of the two files to
+     * whilst diffing (NULL, the default, for none), with file a as source 0
+     * and b as source 1. Only used by adiff_with_options() (and adiff()).
+     * \see trace_log */
+    char const * trace_path;
+} adiff_options;
+
 /** \brief Compare the files at the specified paths.
  * \param[in] a_path The original file for comparison.
  * \param[in] b_path The modified version of the file.
@@ -45,7 +118,103 @@ typedef struct {
  */
 diff adiff(char const * const a_path, char const * const b_path);
 
+/** \brief Compare the files at the specified paths using the given options.
+ * \param[in] opts Tuning parameters (NULL to choose them all automatically).
+ * \see adiff()
+ */
+diff adiff_with_options(
+    char const * const a_path, char const * const b_path,
+    adiff_options const * const opts);
+
+/** \brief How thoroughly adiff_summarise() compares two files.
+ */
+typedef enum {
+    /** \brief Only find whether the files are identical: their lengths are
+     * compared, then their frames a buffer at a time, stopping at the first
+     * difference. */
+    ADIFF_SUMMARY_IDENTITY = 0,
+    /** \brief Chunk and match the files, counting the rough hunks and the
+     * frames in them, without narrowing the hunks. */
+    ADIFF_SUMMARY_ROUGH,
+} adiff_summary_mode;
+
+/** \brief How much two files differ (or why they couldn't be compared).
+ */
+typedef struct {
+    adiff_return_code code;
+    /** \brief The summary, in frames (see bdiff_summary). */
+    bdiff_summary summary;
+} adiff_summary;
+
+/** \brief Summarise how the files at the specified paths differ, far more
+ * cheaply than finding the hunks with adiff().
+ *
+ * For checking many files for changes, or estimating how much changed.
+ * \param[in] mode How thoroughly to compare the files.
+ * \param[in] opts Tuning parameters (NULL to choose them all automatically).
+ * \see bdiff_identical() bdiff_summarise()
+ */
+adiff_summary adiff_summarise(
+    char const * const a_path, char const * const b_path,
+    adiff_summary_mode const mode, adiff_options const * const opts);
+
+/** \brief Compare each channel of the files at the specified paths
+ * separately.
+ *
+ * A change to one channel of a multichannel file only shows up in that
+ * channel's hunks, rather than marking every channel as changed. Each file
+ * is decoded once, in order, its channels split out into temporary files
+ * (so the decode cache isn't used), and the channels are then diffed in
+ * parallel from those. Once every thread has a channel, each takes up to
+ * four at a time, to be chunked together (see bdiff_pairs()).
+ * \param[in] opts Tuning parameters (NULL to choose them all automatically).
+ * \return The diffs of the channels, to be freed with channel_diff_free().
+ * \see adiff()
+ */
+channel_diff adiff_channels(
+    char const * const a_path, char const * const b_path,
+    adiff_options const * const opts);
+
+/** \brief Shared state for diffing many pairs of files.
+ *
+ * Holds the options, a pool of worker threads, which are started once and
+ * reused by every batch, and a bdiff_scratch for each worker, so that the
+ * buffers used whilst chunking and narrowing are allocated once rather than
+ * for every pair. A context may be used from several threads at once, but
+ * not from within its own workers.
+ */
+typedef struct adiff_context adiff_context;
+
+/** \brief Create a context for diffing with the given options.
+ * \param[in] opts Tuning parameters (copied, NULL to choose them all
+ * automatically). The threads field sets the size of the worker pool.
+ * \return The new context, to be freed with adiff_context_free().
+ */
+adiff_context * adiff_context_new(adiff_options const * const opts);
+
+/** \brief Free a context, waiting for any diffs in progress to finish.
+ */
+void adiff_context_free(adiff_context * const ctx);
+
+/** \brief Compare a list of pairs of files in parallel.
+ *
+ * Each pair is diffed on one of the context's workers, as by
+ * adiff_with_options(), and this returns once they are all done.
+ * \param[in] n_pairs The number of pairs of files.
+ * \param[in] a_paths The original file of each pair.
+ * \param[in] b_paths The modified version of each pair.
+ * \param[out] results Set to the diff of each pair (to be freed with
+ * diff_free()).
+ */
+void adiff_batch(
+    adiff_context * const ctx, unsigned const n_pairs,
+    char const * const * const a_paths, char const * const * const b_paths,
+    diff * const results);
+
 /** \brief Generate a patched file using the given patch and source data.
+ * Hunks copying data from elsewhere in A (see HUNK_SOURCE_A) read it from
+ * a_path, all others read from b_path. To read the patched frames without
+ * writing them out, see patched_source.
  * \param[in] hunks The diff data to use when generating the new file.
  * \param[in] a_path A path to the original source file A.
  * \param[in] b_path A path to the original source file B.
@@ -56,6 +225,97 @@ apatch_return_code apatch(
     hunk const * hunks, char const * const a_path, char const * const b_path,
     char const * const out_path);
 
+/** \brief Generate a patched file using the given options.
+ * \param[in] opts Tuning parameters (NULL for the defaults).
+ * \see apatch()
+ */
+apatch_return_code apatch_with_options(
+    hunk const * hunks, char const * const a_path, char const * const b_path,
+    char const * const out_path, adiff_options const * const opts);
+
+/** \brief Generate a patched file from per-channel hunks.
+ *
+ * Every channel must end up the same length once patched, otherwise
+ * APATCH_ERR_CHANNEL_LENGTHS is returned (and nothing written). Frames that
+ * several channels take from the same place are read once for all of them.
+ * \param[in] channel_hunks A list of hunks for each channel of a (as in
+ * channel_diff).
+ * \param[in] opts Tuning parameters (NULL for the defaults).
+ * \see apatch()
+ */
+apatch_return_code apatch_channels(
+    hunk * const * const channel_hunks, char const * const a_path,
+    char const * const b_path, char const * const out_path,
+    adiff_options const * const opts);
+
+/** \brief The outcome of a three way merge.
+ */
+typedef struct {
+    amerge_return_code code;
+    /** \brief Where ours and theirs both changed the base differently (in
+     * frames), keeping ours's changes. */
+    bdiff_conflict * conflicts;
+} amerge_result;
+
+/** \brief Merge the changes two files made to a common base file.
+ *
+ * The changes are found as bdiff_merge() finds them, then the merge is
+ * written in one pass over the three files, each read in order.
+ * \param[in] base_path A path to the file both were edited from.
+ * \param[in] ours_path A path to one edit (kept wherever they conflict).
+ * \param[in] theirs_path A path to the other edit.
+ * \param[in] out_path Where the merged file should be written.
+ * \param[in] opts Tuning parameters (NULL for the defaults).
+ * \return The merge's conflicts, or why it failed, to be freed with
+ * amerge_result_free().
+ */
+amerge_result amerge(
+    char const * const base_path, char const * const ours_path,
+    char const * const theirs_path, char const * const out_path,
+    adiff_options const * const opts);
+
+/** \brief Free the conflicts of a merge (as returned by amerge).
+ */
+void amerge_result_free(amerge_result * r);
+
+/** \brief Write a patch file holding the hunks and the frames of b they
+ * take, so that a can be patched without b.
+ *
+ * Integer frames are compressed losslessly, each block of up to 4096
+ * frames and each channel on its own, by a fixed linear predictor and
+ * Rice coding of what it fails to predict. Float and double frames are
+ * not compressed at all: they are stored uncompressed, in the file's own
+ * sample format, so a patch of floating point audio is as large as the
+ * frames it takes. Hunks copying from a (see HUNK_SOURCE_A) carry no
+ * frames.
+ * \param[in] hunks The diff data to write.
+ * \param[in] b_path A path to the file the hunks' b views are in.
+ * \param[in] patch_path Where the patch file should be written.
+ * \return A code describing the success or otherwise of the write.
+ */
+apatch_return_code apatch_write_file(
+    hunk const * const hunks, char const * const b_path,
+    char const * const patch_path);
+
+/** \brief Generate a patched file from a patch file written by
+ * apatch_write_file().
+ *
+ * The patch's frames are decoded a block at a time as they are written,
+ * reading the patch file once from start to end.
+ * \param[in] patch_path A path to the patch file.
+ * \param[in] a_path A path to the original source file A.
+ * \param[in] out_path Where the new file should be written.
+ * \param[in] opts Tuning parameters (NULL for the defaults).
+ * \return A code describing the success or otherwise of the patch.
+ */
+apatch_return_code apatch_file(
+    char const * const patch_path, char const * const a_path,
+    char const * const out_path, adiff_options const * const opts);
+
 /** \brief Free a diff (as returned by adiff).
  */
 void diff_free(diff * d);
+
+/** \brief Free a per-channel diff (as returned by adiff_channels).
+ */
+void channel_diff_free(channel_diff * d);
@@ -1,6 +1,196 @@
 #pragma once
 
 #include "diff_types.h"
+#include <stdint.h>
+
+/** \brief How the chunks of two sources are matched up into rough hunks.
+ */
+typedef enum {
+    /** \brief Match each chunk of a with the next chunk of b having the
+     * same hash. Fast, but can lock onto the wrong copy of repeated
+     * material. */
+    BDIFF_MATCHER_GREEDY = 0,
+    /** \brief Anchor on chunks that occur exactly once in each source
+     * (patience diff), filling the gaps between anchors with a longest
+     * common subsequence of chunks. Slower, but keeps repeated material
+     * (loops, silence, jingles) aligned. */
+    BDIFF_MATCHER_PATIENCE
+} bdiff_matcher;
+
+/** \brief A function the library user may supply to be told which parts of
+ * a source are about to be read, so that they can be fetched together.
+ *
+ * Called whilst narrowing with the ranges (in items) the next batch of
+ * hunks will probe. The ranges are only a hint: they may overlap, run past
+ * the end of the source, or not all be read.
+ */
+typedef void (*data_prefetcher)(
+    void * source, view const * ranges, unsigned n_ranges);
+
+/** \brief Number of bins in the chunk length histogram of bdiff_stats.
+ */
+#define BDIFF_CHUNK_HISTOGRAM_BINS 32
+
+/** \brief How a diff read one of its sources.
+ */
+typedef struct {
+    /** \brief Bytes returned by the data_fetcher. */
+    uint64_t bytes_fetched;
+    /** \brief Calls to the data_seeker. */
+    uint64_t seeks;
+    /** \brief Number of (coarsest level) chunks the source was split into.
+     */
+    uint64_t chunks;
+} bdiff_source_stats;
+
+/** \brief Where the work (and time) of a diff went.
+ *
+ * Diffs add to the counts, so one set of stats can total several diffs (see
+ * bdiff_stats_add()).
+ */
+typedef struct {
+    bdiff_source_stats a;
+    bdiff_source_stats b;
+    /** \brief Chunks of both sources with lengths (in samples) in
+     * [2**i, 2**(i + 1)) for each bin i. */
+    uint64_t chunk_lengths[BDIFF_CHUNK_HISTOGRAM_BINS];
+    /** \brief Hash table lookups, insertions and removals whilst matching
+     * chunks. */
+    uint64_t hash_probes;
+    /** \brief Hunks found by matching chunks, before narrowing. */
+    uint64_t rough_hunks;
+    /** \brief Hunks left after narrowing. */
+    uint64_t precise_hunks;
+    /** \brief Bytes of a compared with bytes of b whilst narrowing. */
+    uint64_t bytes_compared;
+    /** \brief Monotonic time (in microseconds) spent splitting the sources
+     * into chunks. */
+    int64_t chunking_us;
+    /** \brief Time spent matching (and refining) chunks. */
+    int64_t matching_us;
+    /** \brief Time spent narrowing rough hunks (and detecting moves). */
+    int64_t narrowing_us;
+} bdiff_stats;
+
+/** \brief Add the stats of one diff to a running total.
+ */
+void bdiff_stats_add(bdiff_stats * const total, bdiff_stats const * const s);
+
+/** \brief Buffers reused by one diff after another, so that each diff
+ * doesn't have to allocate (and fault in) its own.
+ *
+ * Holds the read, window and run buffers used whilst chunking, and the
+ * buffers used whilst narrowing and fine diffing, each kept at the largest
+ * size a diff has needed. Only one diff may use a scratch at a time.
+ */
+typedef struct bdiff_scratch bdiff_scratch;
+
+/** \brief Create an empty scratch (its buffers are allocated as diffs need
+ * them).
+ * \return The scratch, to be freed with bdiff_scratch_free().
+ */
+bdiff_scratch * bdiff_scratch_new();
+
+/** \brief Free a scratch and its buffers.
+ */
+void bdiff_scratch_free(bdiff_scratch * const scratch);
+
+/** \brief Largest number of chunking levels (see bdiff_options.levels).
+ */
+#define BDIFF_MAX_LEVELS 4
+
+/** \brief Largest usable bdiff_options.mask_bits (the rolling hash has 32
+ * bits).
+ */
+#define BDIFF_MAX_MASK_BITS 31
+
+/** \brief Tuning parameters for a binary diff.
+ *
+ * Smaller chunks give finer grained rough hunks (so less work whilst
+ * narrowing) at the cost of more bookkeeping whilst chunking and matching.
+ * Any field left as zero is filled in with its default value.
+ */
+typedef struct {
+    /** \brief Minimum number of samples in a content-defined chunk. */
+    unsigned min_chunk_size;
+    /** \brief Maximum number of samples in a chunk. */
+    unsigned max_chunk_size;
+    /** \brief Number of low bits of the rolling hash that must be zero for a
+     * chunk boundary (so the mean chunk length is around 2**mask_bits).
+     * Larger values than BDIFF_MAX_MASK_BITS are clamped to it. */
+    unsigned mask_bits;
+    /** \brief Number of samples in the rolling hash window. */
+    unsigned window_length;
+    /** \brief Minimum length (in samples, after the window_length it takes
+     * to spot one) of a run of identical samples to be split out as a
+     * single run chunk. Shorter runs are chunked like any other data. */
+    unsigned min_run_length;
+    /** \brief Size (in bytes) of the buffer used to read data for chunking. */
+    unsigned chunk_buf_size;
+    /** \brief Size (in bytes) of each of the two buffers used whilst
+     * narrowing. */
+    unsigned narrow_buf_size;
+    /** \brief Number of chunking levels (1 disables hierarchical diffing).
+     *
+     * Each extra level splits the chunks of the level above using
+     * level_shift fewer mask bits. Rough hunks spanning at least
+     * refine_min_chunks chunks are then re-diffed with the finer chunks
+     * beneath them, all boundaries coming from the same rolling hash pass.
+     *
+     * At most BDIFF_MAX_LEVELS levels are used, and only as many as leave
+     * the finest level at least one mask bit ((levels - 1) * level_shift <
+     * mask_bits); any more are dropped. */
+    unsigned levels;
+    /** \brief Number of mask bits dropped at each finer chunking level. */
+    unsigned level_shift;
+    /** \brief Minimum number of chunks a rough hunk must span (on its longer
+     * side) before it is re-diffed at the next level down. */
+    unsigned refine_min_chunks;
+    /** \brief Minimum number of consecutive chunks inserted in b that must
+     * be found together in a before they are copied from a (see
+     * HUNK_SOURCE_A) rather than taken from b. Zero (the default) disables
+     * move detection. */
+    unsigned move_min_chunks;
+    /** \brief Largest hunk (in samples, on each side) to re-diff sample by
+     * sample after narrowing, splitting it into smaller hunks around the
+     * samples it left unchanged when that makes the hunks' data smaller.
+     * Scattered corrections (such as declicking) then cost only the samples
+     * they changed. A hunk needing too many edits is left as it is. Zero
+     * (the default) disables the fine diff. */
+    unsigned fine_max_samples;
+    /** \brief Algorithm used to match chunks (greedy by default). */
+    bdiff_matcher matcher;
+    /** \brief Number of buffers (of chunk_buf_size bytes) to read ahead
+     * into on a separate thread whilst chunking, so that fetching the data
+     * overlaps with hashing it. Zero (the default) reads on the calling
+     * thread. */
+    unsigned read_ahead_buffers;
+    /** \brief Called with the ranges of each source narrowing is about to
+     * read (NULL, the default, for no prefetching).
+     * \see raw_source_prefetcher() */
+    data_prefetcher prefetcher;
+    /** \brief Where to add statistics about the diff (NULL, the default,
+     * to not collect any). Only one diff may use the stats at a time.
+     * \see bdiff_stats_add() */
+    bdiff_stats * stats;
+    /** \brief Buffers to reuse (NULL, the default, to allocate them for
+     * each diff). Only one diff may use the scratch at a time.
+     * \see bdiff_scratch_new() */
+    bdiff_scratch * scratch;
+} bdiff_options;
+
+/** \brief Get the default diff options.
+ */
+bdiff_options bdiff_options_default();
+
+/** \brief Pick diff options suited to sources of the given length.
+ *
+ * Longer sources get proportionally longer chunks (and larger buffers) so
+ * that the number of chunks, and hence the cost of matching them, grows
+ * more slowly than the length of the data.
+ * \param[in] source_length Number of samples in the (longest) source.
+ */
+bdiff_options bdiff_options_for_length(sample_pos const source_length);
 
 /** \brief A function to be supplied by the library user for getting the data to diff.
  */
@@ -11,15 +201,30 @@ hunk * const bdiff_rough(
     unsigned const sample_size, data_fetcher const df, void * const a,
     void * const b);
 
+/** \brief As bdiff_rough(), using the given options.
+ */
+hunk * const bdiff_rough_with_options(
+    unsigned const sample_size, data_fetcher const df, void * const a,
+    void * const b, bdiff_options const * const opts);
+
 /** \brief A function to be supplied by the library user for seeking to a point
  * in the data to diff.
  */
-typedef void (*data_seeker)(void * source, unsigned pos);
+typedef void (*data_seeker)(void * source, sample_pos pos);
 
 hunk * const bdiff_narrow(
     hunk * rough_hunks, unsigned const sample_size, data_seeker const ds,
     data_fetcher const df, void * const a, void * const b);
 
+/** \brief As bdiff_narrow(), using the given options.
+ *
+ * The options must match those used to produce the rough hunks.
+ */
+hunk * const bdiff_narrow_with_options(
+    hunk * rough_hunks, unsigned const sample_size, data_seeker const ds,
+    data_fetcher const df, void * const a, void * const b,
+    bdiff_options const * const opts);
+
 /** \brief Perform a binary diff.
  *
  * \param[in] sample_size The size (in bytes) of an item in the data type being
@@ -33,3 +238,127 @@ hunk * const bdiff_narrow(
 hunk * const bdiff(
     unsigned const sample_size, data_seeker const ds, data_fetcher const df,
     void * const a, void * const b);
+
+/** \brief Perform a binary diff using the given options.
+ *
+ * \param[in] opts Tuning parameters for the diff (NULL for the defaults).
+ * \see bdiff()
+ */
+hunk * const bdiff_with_options(
+    unsigned const sample_size, data_seeker const ds, data_fetcher const df,
+    void * const a, void * const b, bdiff_options const * const opts);
+
+/** \brief Diff several pairs of sources, as bdiff_with_options() would each
+ * pair.
+ *
+ * The sources of up to four pairs at a time are chunked together, their
+ * rolling hashes advanced in lockstep (see bdiff_options.scratch for reusing
+ * the buffers that takes), before each pair is matched and narrowed on its
+ * own. Diffing the channels of a file as pairs chunks them faster than one
+ * pair at a time can.
+ * \param[in] n_pairs The number of pairs.
+ * \param[in] a The a source of each pair.
+ * \param[in] b The b source of each pair.
+ * \param[out] hunks Set to the hunks of each pair's diff.
+ * \see bdiff_with_options()
+ */
+void bdiff_pairs(
+    unsigned const sample_size, data_seeker const ds, data_fetcher const df,
+    unsigned const n_pairs, void * const * const a, void * const * const b,
+    bdiff_options const * const opts, hunk ** const hunks);
+
+/** \brief How much two sources differ, without the hunks themselves.
+ */
+typedef struct {
+    /** \brief Whether the sources hold the same data. */
+    int identical;
+    /** \brief Number of rough hunks (zero if only checking identity). */
+    uint64_t hunks;
+    /** \brief Samples of a in rough hunks, an upper bound on how many were
+     * changed (zero if only checking identity). */
+    sample_pos a_changed;
+    /** \brief Samples of b in rough hunks. */
+    sample_pos b_changed;
+} bdiff_summary;
+
+/** \brief Check whether two sources hold the same data.
+ *
+ * The sources are read a buffer (of chunk_buf_size bytes) at a time and
+ * compared directly, stopping at the first buffer that differs, so nothing
+ * is chunked or hashed.
+ * \param[in] opts Options (NULL for the defaults), of which only
+ * chunk_buf_size and stats are used.
+ * \return Non-zero if the sources are identical.
+ */
+int bdiff_identical(
+    unsigned const sample_size, data_fetcher const df, void * const a,
+    void * const b, bdiff_options const * const opts);
+
+/** \brief Summarise how two sources differ from their rough hunks, without
+ * narrowing them (or keeping them).
+ *
+ * The sources count as identical when no rough hunks are found, so (unlike
+ * with bdiff_identical()) differences hidden by a hash collision go
+ * unnoticed.
+ * \param[in] opts Tuning parameters (NULL for the defaults).
+ * \see bdiff_rough()
+ */
+bdiff_summary bdiff_summarise(
+    unsigned const sample_size, data_fetcher const df, void * const a,
+    void * const b, bdiff_options const * const opts);
+
+/** \brief A range of a merge's base that ours and theirs both changed, but
+ * not in the same way.
+ */
+typedef struct bdiff_conflict {
+    struct bdiff_conflict * next;
+    /** \brief The range of the base that was changed. */
+    view base;
+    /** \brief What ours has in its place (which the merge keeps). */
+    view ours;
+    /** \brief What theirs has in its place (which the merge drops). */
+    view theirs;
+} bdiff_conflict;
+
+/** \brief The changes two sources made to a common base, merged.
+ *
+ * The hunks of both lists are against the base, in order and never
+ * overlapping one another, so together they patch the base into the merge:
+ * each hunk's b view is in ours or in theirs, depending on its list.
+ */
+typedef struct {
+    /** \brief Hunks taken from the diff of the base and ours. */
+    hunk * ours;
+    /** \brief Hunks taken from the diff of the base and theirs. */
+    hunk * theirs;
+    /** \brief Where both changed the base differently, in order. */
+    bdiff_conflict * conflicts;
+} bdiff_merge_result;
+
+/** \brief Merge the changes ours and theirs made to a common base.
+ *
+ * The base is chunked once (together with ours and theirs), and its chunks
+ * matched with both ours's and theirs's before each pair of diffs is narrowed.
+ * Hunks that don't overlap hunks of the other diff are merged as they are.
+ * Hunks that do (or that insert at the same place) make a conflict, unless
+ * both sides put the same data there; ours's hunks are kept for every
+ * conflict. Moves aren't detected (move_min_chunks is ignored), so the merge
+ * can be written reading each source once, in order. Hunks are fine diffed as
+ * bdiff_with_options() would before they are merged. Stats count the base's
+ * reads and chunks as a's, and both ours's and theirs's as b's.
+ * \param[in] ds Function to use to seek in the sources.
+ * \param[in] df Function to use to read from the sources.
+ * \param[in] base Given as the source parameter to ds and df for the base.
+ * \param[in] ours Given as the source parameter to ds and df for ours.
+ * \param[in] theirs Given as the source parameter to ds and df for theirs.
+ * \param[in] opts Tuning parameters for the diffs (NULL for the defaults).
+ * \return The merge, to be freed with bdiff_merge_free().
+ */
+bdiff_merge_result bdiff_merge(
+    unsigned const sample_size, data_seeker const ds, data_fetcher const df,
+    void * const base, void * const ours, void * const theirs,
+    bdiff_options const * const opts);
+
+/** \brief Free the hunks and conflicts of a merge.
+ */
+void bdiff_merge_free(bdiff_merge_result * const m);
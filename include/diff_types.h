@@ -1,24 +1,44 @@
 #pragma once
+#include <stdint.h>
+
+/** \brief A position (in samples) within a source.
+ * 64 bit, so that very long recordings and byte-level sources don't
+ * overflow.
+ */
+typedef uint64_t sample_pos;
 
 /** \brief Represents a slice of a larger piece of data.
  * The start index is inclusive, the end is exclusive (like a python list).
  * A view may be empty (contain no data), in this case start == end.
  */
 typedef struct {
-    unsigned start;
-    unsigned end;
+    sample_pos start;
+    sample_pos end;
 } view;
 
+/** \brief Identifies the data that a hunk's b view refers to.
+ */
+enum {
+    /** The modified data (the usual case). */
+    HUNK_SOURCE_B = 0,
+    /** The original data: the hunk copies a section of a that was moved or
+     * duplicated. */
+    HUNK_SOURCE_A = 1,
+};
+
 /** \brief Represents a changed section of the file.
  * Forms a linked list.
  * The view in a corresponds to the view in b.
  * Insertions are therefore represented as empty slices in a with filled slices in b.
  * Deletions are represented as filled slices in a replaced with empty slices in b.
+ * The b view is a slice of the data named by source, so a hunk with source
+ * HUNK_SOURCE_A replaces its a view with a copy of another part of a.
  */
 typedef struct hunk {
     struct hunk * next;
     view a;
     view b;
+    unsigned source;
 } hunk;
 
 /** \brief Create a new hunk as described and append it to the tail of the given hunk list (if any)
@@ -30,10 +50,73 @@ typedef struct hunk {
  * \param[in] b_end The end index of the new hunk's 'b' view
  */
 void append_hunk(
-        hunk ** const head, hunk ** const tail, unsigned const a_start,
-        unsigned const a_end, unsigned const b_start, unsigned const b_end);
+        hunk ** const head, hunk ** const tail, sample_pos const a_start,
+        sample_pos const a_end, sample_pos const b_start,
+        sample_pos const b_end);
+
+/** \brief Create a new hunk copying data from elsewhere in a and append it to
+ * the tail of the given hunk list (if any)
+ * \param[out] head The head of the linked list to which to append the new hunk
+ * \param[in] tail The tail of the linked list to which to append the new hunk
+ * \param[in] a_pos The (empty) position in a at which the copy is inserted
+ * \param[in] src_start The start index of the data to copy from a
+ * \param[in] src_end The end index of the data to copy from a
+ */
+void append_copy_hunk(
+        hunk ** const head, hunk ** const tail, sample_pos const a_pos,
+        sample_pos const src_start, sample_pos const src_end);
 
 /** \brief Free a linked list of hunks.
  * \param[inout] head the head of the list to free.
  */
 void hunk_free(hunk * head);
+
+/** \brief Combine the hunks taking a to b with those taking b to c.
+ *
+ * Works on the hunks alone: data in c that doesn't come from a is taken
+ * from c (as hunks don't carry data of their own, their b views are
+ * positions in the file they patch to). So the result patches a into c,
+ * reading c where a won't do, and no copy of b is needed.
+ * \param[in] first The hunks taking a to b.
+ * \param[in] second The hunks taking b to c.
+ * \return The hunks taking a to c (NULL if a and c are the same).
+ */
+hunk * hunks_compose(hunk const * const first, hunk const * const second);
+
+/** \brief Reverse the hunks taking a to b, to get those taking b to a.
+ *
+ * Each hunk's views swap over, so the result's b views are positions in a.
+ * Hunks copying from a (see HUNK_SOURCE_A) become deletions of the copies.
+ * \param[in] hunks The hunks taking a to b.
+ * \return The hunks taking b to a.
+ */
+hunk * hunks_invert(hunk const * hunks);
+
+/** \brief What applying a patch costs, in any one unit (such as
+ * microseconds on the storage the patch is applied from).
+ */
+typedef struct {
+    /** \brief Cost of each seek (each run of data copied from a or b). */
+    unsigned seek_cost;
+    /** \brief Cost of each byte a patch takes from b rather than a. */
+    unsigned byte_cost;
+    /** \brief Cost of each hunk in an encoded patch. */
+    unsigned hunk_cost;
+} hunk_costs;
+
+/** \brief Merge hunks separated by a few unchanged samples where that makes
+ * the patch cheaper to apply.
+ *
+ * Each hunk costs a seek in b, and each gap between hunks a seek in a, so
+ * merging two hunks saves two seeks and a hunk but takes the samples of
+ * the gap from b. Every gap is weighed on its own. Only hunks taking data
+ * from b (see HUNK_SOURCE_B) that hold the gap's samples where a does are
+ * merged.
+ * \param[in] hunks The hunks to merge (consumed).
+ * \param[in] sample_size The size (in bytes) of a sample.
+ * \param[in] costs The cost model.
+ * \return The merged hunks.
+ */
+hunk * hunks_coalesce(
+        hunk * hunks, unsigned const sample_size,
+        hunk_costs const * const costs);
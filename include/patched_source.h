@@ -0,0 +1,47 @@
+#pragma once
+
+#include "bdiff.h"
+
+/** \brief The result of patching a source, read without being written out.
+ *
+ * Built from a, b and the hunks taking a to b (as from bdiff(), including
+ * hunks copying from a, see HUNK_SOURCE_A). Any range of the patched data
+ * can be read: seeking finds the hunk holding a position by binary search,
+ * and reads are passed on to a or b as the hunks say, seeking them only
+ * when a read doesn't carry on from the last one.
+ */
+typedef struct patched_source patched_source;
+
+/** \brief Create a patched source.
+ * \param[in] hunks The hunks taking a to b (which are copied, so may be
+ * freed as soon as this returns).
+ * \param[in] a_length The number of items in a.
+ * \param[in] sample_size The size (in bytes) of an item.
+ * \param[in] ds Function to use to seek in a and b.
+ * \param[in] df Function to use to read from a and b.
+ * \param[in] a Given as the source parameter to ds and df for the a side.
+ * \param[in] b Given as the source parameter to ds and df for the b side.
+ * \return The source, to be read with patched_source_fetcher() and
+ * patched_source_seeker(), starting at its first item.
+ */
+patched_source * patched_source_new(
+    hunk const * const hunks, sample_pos const a_length,
+    unsigned const sample_size, data_seeker const ds, data_fetcher const df,
+    void * const a, void * const b);
+
+/** \brief Free a patched source (but not a or b).
+ */
+void patched_source_free(patched_source * const ps);
+
+/** \brief The number of items in the patched data.
+ */
+sample_pos patched_source_length(patched_source const * const ps);
+
+/** \brief A data_fetcher for patched_source.
+ */
+unsigned patched_source_fetcher(
+    void * source, char * buffer, unsigned n_items);
+
+/** \brief A data_seeker for patched_source.
+ */
+void patched_source_seeker(void * source, sample_pos pos);
@@ -18,10 +18,27 @@ hash_data hash_data_init(hash const irreducible_polynomial);
  */
 void hash_data_reset(hash_data * const hd);
 
+/** \brief Append a byte to a hash, given the table of a hash_data.
+ *
+ * For hot loops that keep hashes in local variables rather than in a
+ * hash_data.
+ * \return The new hash.
+ */
+static inline hash rabin_shift(
+        hash const * const table, hash const h, unsigned char const next) {
+    return ((h << 8) | next) ^ table[h >> (sizeof(hash) * 8 - 8)];
+}
+
 /** \brief Hash a byte of data.
+ *
+ * Inline, as it is called for every byte being chunked.
  * \return The new hash.
  */
-hash hash_data_update(hash_data * const hd, unsigned char const next);
+static inline hash hash_data_update(
+        hash_data * const hd, unsigned char const next) {
+    hd->h = rabin_shift(hd->table, hd->h, next);
+    return hd->h;
+}
 
 
 /** \brief Opaque structure holding state for windowed hashing.
@@ -55,4 +72,14 @@ void window_data_reset(window_data * const wd);
 /** \brief Hash a byte of data.
  * \return The hash of the new window.
  */
-hash window_data_update(window_data * const wd, unsigned char const next);
+static inline hash window_data_update(
+        window_data * const w, unsigned char const next) {
+    w->h ^= w->undo_table[w->undo_buf[w->buf_pos]];
+
+    w->undo_buf[w->buf_pos] = next;
+    if (++w->buf_pos == w->window_size) {
+        w->buf_pos = 0;
+    }
+
+    return hash_data_update(&w->hd, next);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "bdiff.h"
+
+/** \brief A source of raw (headerless, uncompressed) samples in a file.
+ *
+ * Reads use positional I/O, so seeking is free. Ranges given to
+ * raw_source_prefetcher() are read together (in one io_uring submission
+ * where available) and later reads inside them are served from memory.
+ */
+typedef struct raw_source raw_source;
+
+/** \brief Open a file of raw samples.
+ * \param[in] path The file to read.
+ * \param[in] sample_size The size (in bytes) of an item.
+ * \param[in] data_offset Number of bytes (of header) to skip before the
+ * first item.
+ * \return The source, or NULL if the file couldn't be opened.
+ */
+raw_source * raw_source_open(
+    char const * const path, unsigned const sample_size,
+    sample_pos const data_offset);
+
+/** \brief Read prefetched ranges with plain positional reads from now on.
+ *
+ * This happens anyway when io_uring isn't available, or after it fails
+ * (in which case the ranges it was reading are read again).
+ */
+void raw_source_disable_io_uring(raw_source * const rs);
+
+/** \brief Close a raw source, freeing it.
+ */
+void raw_source_close(raw_source * const rs);
+
+/** \brief A data_fetcher for raw_source.
+ */
+unsigned raw_source_fetcher(void * source, char * buffer, unsigned n_items);
+
+/** \brief A data_seeker for raw_source.
+ */
+void raw_source_seeker(void * source, sample_pos pos);
+
+/** \brief A data_prefetcher for raw_source.
+ *
+ * Replaces anything prefetched before with the given ranges.
+ */
+void raw_source_prefetcher(
+    void * source, view const * ranges, unsigned n_ranges);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "bdiff.h"
+#include <stdio.h>
+
+/** \brief A file recording how sources were read.
+ *
+ * Each line is one event, its fields separated by spaces:
+ *
+ *     source <id> <sample size>
+ *     fetch <id> <pos> <items wanted> <items read> <ns>
+ *     seek <id> <pos> <ns>
+ *     prefetch <id> <ranges> <ns>
+ *     range <id> <start> <end>
+ *
+ * where positions are in items, ns is the time the call took and the ranges
+ * of a prefetch follow it. Sources are numbered in the order they were
+ * created. Several sources (on several threads) may record to one log.
+ */
+typedef struct trace_log trace_log;
+
+/** \brief A source wrapped to record every read of it to a trace_log.
+ */
+typedef struct trace_source trace_source;
+
+/** \brief Create (or truncate) a trace file.
+ * \return The log, or NULL if the file couldn't be opened.
+ */
+trace_log * trace_log_open(char const * const path);
+
+/** \brief Close a trace file, freeing the log.
+ *
+ * Any sources recording to it must be freed first.
+ */
+void trace_log_close(trace_log * const log);
+
+/** \brief Wrap a source to record its reads.
+ * \param[in] ds The source's seeker (may be NULL if it isn't seekable).
+ * \param[in] df The source's fetcher.
+ * \param[in] dp The source's prefetcher (may be NULL).
+ * \param[in] source Given as the source parameter to ds, df and dp.
+ * \return The wrapped source, to be read with trace_source_fetcher(),
+ * trace_source_seeker() and trace_source_prefetcher().
+ */
+trace_source * trace_source_new(
+    trace_log * const log, unsigned const sample_size, data_seeker const ds,
+    data_fetcher const df, data_prefetcher const dp, void * const source);
+
+/** \brief Free a wrapped source (but not the source it wraps).
+ */
+void trace_source_free(trace_source * const ts);
+
+/** \brief A data_fetcher for trace_source.
+ */
+unsigned trace_source_fetcher(void * source, char * buffer, unsigned n_items);
+
+/** \brief A data_seeker for trace_source.
+ */
+void trace_source_seeker(void * source, sample_pos pos);
+
+/** \brief A data_prefetcher for trace_source.
+ */
+void trace_source_prefetcher(
+    void * source, view const * ranges, unsigned n_ranges);
+
+/** \brief Kinds of event in a trace (see trace_log).
+ */
+typedef enum {
+    TRACE_SOURCE,
+    TRACE_FETCH,
+    TRACE_SEEK,
+    TRACE_PREFETCH,
+    TRACE_RANGE,
+} trace_op;
+
+/** \brief One event read back from a trace.
+ */
+typedef struct {
+    trace_op op;
+    /** \brief The source the event is for. */
+    unsigned source;
+    /** \brief The items read (TRACE_FETCH), the position sought
+     * (TRACE_SEEK, as v.start) or the range (TRACE_RANGE). */
+    view v;
+    /** \brief The sample size (TRACE_SOURCE), number of items asked for
+     * (TRACE_FETCH) or number of ranges to follow (TRACE_PREFETCH). */
+    unsigned n;
+    /** \brief How long the call took, in nanoseconds. */
+    uint64_t ns;
+} trace_event;
+
+/** \brief Read the next event from a trace file.
+ * \return Zero at the end of the file (or at a line that isn't an event).
+ */
+int trace_read_event(FILE * const f, trace_event * const event);
@@ -1,6 +1,22 @@
 #include "../include/adiff.h"
 #include "../include/bdiff.h"
+#include "../include/trace_source.h"
+#include "bdiff_defs.h"
+#include "payload_codec.h"
+#include "probes.h"
 #include <sndfile.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+
+#define default_copy_buf_size 8192
+// As many pairs as bdiff_pairs() chunks together:
+#define max_grouped_channels (max_split_lanes / 2)
 
 typedef struct {
     SNDFILE * const file;
@@ -79,25 +95,238 @@ static fetcher_info get_fetcher(lsf_wrapped const f) {
     }
 }
 
-static void seeker(void * const source, unsigned const pos) {
+static void seeker(void * const source, sample_pos const pos) {
     // Should be error checked (-1 rval):
     sf_seek((SNDFILE * const) source, pos, SEEK_SET);
 }
 
-static diff cmp(const lsf_wrapped a, const lsf_wrapped b) {
+/*
+ * Fill in any diff options the caller left unset based on the length of the
+ * files being compared.
+ */
+static bdiff_options options_for_frames(
+        sf_count_t const frames, adiff_options const * const opts) {
+    bdiff_options const fallback = bdiff_options_for_length(frames);
+    return bdiff_options_complete(
+        (opts == NULL) ? NULL : &opts->bdiff, fallback);
+}
+
+static bdiff_options auto_options(
+        lsf_wrapped const a, lsf_wrapped const b,
+        adiff_options const * const opts) {
+    return options_for_frames(MAX(a.info.frames, b.info.frames), opts);
+}
+
+/*
+ * Whether to spill decoded frames to a cache, so that seeking whilst
+ * narrowing doesn't have to re-decode compressed data.
+ */
+static int wants_decode_cache(
+        lsf_wrapped const f, adiff_options const * const opts) {
+    adiff_decode_cache const mode = (opts == NULL) ?
+        ADIFF_DECODE_CACHE_AUTO : opts->decode_cache;
+    if (mode != ADIFF_DECODE_CACHE_AUTO) {
+        return mode == ADIFF_DECODE_CACHE_ALWAYS;
+    }
+    switch (f.info.format & SF_FORMAT_TYPEMASK) {
+        case SF_FORMAT_FLAC:
+        case SF_FORMAT_OGG:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Reads the frames of a file, optionally through a decode cache. With the
+ * cache the file is only ever read sequentially: everything decoded is
+ * written to a temporary file, and reads behind the decode position (after
+ * seeking back) are served from there.
+ */
+typedef struct {
+    SNDFILE * file;
+    data_fetcher fetcher;
+    size_t frame_size;
+    FILE * cache;
+    sample_pos decoded;
+    sample_pos pos;
+} frame_reader;
+
+static frame_reader frame_reader_open(
+        lsf_wrapped const f, adiff_options const * const opts) {
+    fetcher_info const fi = get_fetcher(f);
+    return (frame_reader) {
+        .file = f.file,
+        .fetcher = fi.fetcher,
+        .frame_size = fi.sample_size * f.info.channels,
+        .cache = wants_decode_cache(f, opts) ? tmpfile() : NULL};
+}
+
+static void frame_reader_close(frame_reader * const fr) {
+    if (fr->cache != NULL) {
+        fclose(fr->cache);
+    }
+}
+
+/*
+ * Write all of a buffer at offset, returning whether it was written.
+ */
+static int pwrite_all(
+        int const fd, char const * buffer, size_t n_bytes, off_t offset) {
+    while (n_bytes) {
+        ssize_t const written = pwrite(fd, buffer, n_bytes, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 0;
+        }
+        buffer += written;
+        n_bytes -= written;
+        offset += written;
+    }
+    return 1;
+}
+
+/*
+ * Decode frames, adding them to the cache. If the cache can't be written
+ * (the disk is full, say) it is dropped, leaving the reader to seek in the
+ * file itself.
+ */
+static unsigned decode_into_cache(
+        frame_reader * const fr, char * const buffer,
+        unsigned const n_items) {
+    unsigned const n_read = fr->fetcher(fr->file, buffer, n_items);
+    if (!pwrite_all(
+            fileno(fr->cache), buffer, n_read * fr->frame_size,
+            fr->decoded * fr->frame_size)) {
+        fclose(fr->cache);
+        fr->cache = NULL;
+    }
+    fr->decoded += n_read;
+    return n_read;
+}
+
+static unsigned cached_fetcher(
+        frame_reader * const fr, char * const buffer,
+        unsigned const n_items) {
+    unsigned total = 0;
+    while (total < n_items) {
+        char * const dst = buffer + total * fr->frame_size;
+        unsigned const wanted = n_items - total;
+        unsigned n;
+        if (fr->cache == NULL) {
+            // The cache was dropped, and the file was left where decoding
+            // stopped
+            if (fr->pos != fr->decoded) {
+                seeker(fr->file, fr->pos);
+            }
+            return total + fr->fetcher(fr->file, dst, wanted);
+        } else if (fr->pos < fr->decoded) {
+            sample_pos const available = fr->decoded - fr->pos;
+            n = (available < wanted) ? available : wanted;
+            ssize_t const n_bytes = pread(
+                fileno(fr->cache), dst, n * fr->frame_size,
+                fr->pos * fr->frame_size);
+            if (n_bytes <= 0) {
+                break;
+            }
+            n = n_bytes / fr->frame_size;
+        } else if (fr->pos > fr->decoded) {
+            // Skip ahead, still caching everything we pass over
+            sample_pos const gap = fr->pos - fr->decoded;
+            if (!decode_into_cache(fr, dst, (gap < wanted) ? gap : wanted)) {
+                break;
+            }
+            continue;
+        } else {
+            n = decode_into_cache(fr, dst, wanted);
+            if (n == 0) {
+                break;
+            }
+        }
+        total += n;
+        fr->pos += n;
+    }
+    return total;
+}
+
+static unsigned reader_fetcher(
+        void * const source, char * const buffer, unsigned const n_items) {
+    frame_reader * const fr = source;
+    if (fr->cache == NULL) {
+        return fr->fetcher(fr->file, buffer, n_items);
+    }
+    return cached_fetcher(fr, buffer, n_items);
+}
+
+static void reader_seeker(void * const source, sample_pos const pos) {
+    frame_reader * const fr = source;
+    if (fr->cache == NULL) {
+        seeker(fr->file, pos);
+    } else {
+        fr->pos = pos;
+    }
+}
+
+/*
+ * Diff the frame readers, recording how they were read to a trace file (or
+ * not at all if it can't be created).
+ */
+static hunk * traced_diff(
+        frame_reader * const a_fr, frame_reader * const b_fr,
+        bdiff_options const * const o, const_str trace_path) {
+    trace_log * const log = trace_log_open(trace_path);
+    if (log == NULL) {
+        return bdiff_with_options(
+            a_fr->frame_size, reader_seeker, reader_fetcher, a_fr, b_fr, o);
+    }
+    trace_source * const a = trace_source_new(
+        log, a_fr->frame_size, reader_seeker, reader_fetcher, o->prefetcher,
+        a_fr);
+    trace_source * const b = trace_source_new(
+        log, b_fr->frame_size, reader_seeker, reader_fetcher, o->prefetcher,
+        b_fr);
+    bdiff_options traced = *o;
+    if (o->prefetcher != NULL) {
+        traced.prefetcher = trace_source_prefetcher;
+    }
+    hunk * const hunks = bdiff_with_options(
+        a_fr->frame_size, trace_source_seeker, trace_source_fetcher, a, b,
+        &traced);
+    trace_source_free(a);
+    trace_source_free(b);
+    trace_log_close(log);
+    return hunks;
+}
+
+static diff cmp(
+        const lsf_wrapped a, const lsf_wrapped b,
+        adiff_options const * const opts) {
     adiff_return_code ret_code = info_cmp(a, b);
     if (ret_code == ADIFF_OK) {
-        fetcher_info const fi = get_fetcher(a);
-        return (diff) {
-            .code = ret_code,
-            .hunks = bdiff(
-                fi.sample_size * a.info.channels, seeker, fi.fetcher,
-                (void *) a.file, (void *) b.file)};
+        bdiff_options const o = auto_options(a, b, opts);
+        frame_reader a_fr = frame_reader_open(a, opts);
+        frame_reader b_fr = frame_reader_open(b, opts);
+        hunk * const hunks = (opts != NULL && opts->trace_path != NULL) ?
+            traced_diff(&a_fr, &b_fr, &o, opts->trace_path) :
+            bdiff_with_options(
+                a_fr.frame_size, reader_seeker, reader_fetcher, &a_fr, &b_fr,
+                &o);
+        frame_reader_close(&a_fr);
+        frame_reader_close(&b_fr);
+        return (diff) {.code = ret_code, .hunks = hunks};
     }
     return (diff) {.code = ret_code};
 }
 
 diff adiff(const_str path_a, const_str path_b) {
+    return adiff_with_options(path_a, path_b, NULL);
+}
+
+diff adiff_with_options(
+        const_str path_a, const_str path_b,
+        adiff_options const * const opts) {
     lsf_wrapped const a = sndfile_open(path_a);
     if (a.file == NULL) {
         return (diff) {.code = ADIFF_ERR_OPEN_A};
@@ -107,12 +336,431 @@ diff adiff(const_str path_a, const_str path_b) {
         sf_close(a.file);
         return (diff) {.code = ADIFF_ERR_OPEN_B};
     }
-    diff result = cmp(a, b);
+    diff result = cmp(a, b, opts);
+    sf_close(a.file);
+    sf_close(b.file);
+    return result;
+}
+
+static adiff_summary summarise(
+        const lsf_wrapped a, const lsf_wrapped b,
+        adiff_summary_mode const mode, adiff_options const * const opts) {
+    adiff_summary result = {.code = info_cmp(a, b)};
+    if (result.code != ADIFF_OK) {
+        return result;
+    }
+    bdiff_options const o = auto_options(a, b, opts);
+    fetcher_info const fi = get_fetcher(a);
+    unsigned const frame_size = fi.sample_size * a.info.channels;
+    if (mode == ADIFF_SUMMARY_ROUGH) {
+        result.summary = bdiff_summarise(
+            frame_size, fi.fetcher, a.file, b.file, &o);
+    } else {
+        // Files of different lengths can't be identical, so needn't be read
+        result.summary.identical =
+            a.info.frames == b.info.frames &&
+            bdiff_identical(frame_size, fi.fetcher, a.file, b.file, &o);
+    }
+    return result;
+}
+
+adiff_summary adiff_summarise(
+        const_str path_a, const_str path_b, adiff_summary_mode const mode,
+        adiff_options const * const opts) {
+    lsf_wrapped const a = sndfile_open(path_a);
+    if (a.file == NULL) {
+        return (adiff_summary) {.code = ADIFF_ERR_OPEN_A};
+    }
+    lsf_wrapped const b = sndfile_open(path_b);
+    if (b.file == NULL) {
+        sf_close(a.file);
+        return (adiff_summary) {.code = ADIFF_ERR_OPEN_B};
+    }
+    adiff_summary const result = summarise(a, b, mode, opts);
+    sf_close(a.file);
+    sf_close(b.file);
+    return result;
+}
+
+/*
+ * Copy n samples of one channel between (possibly) interleaved buffers, the
+ * strides being in samples. Written out per sample size so that the compiler
+ * can vectorise the strided copies.
+ */
+static void copy_channel(
+        char * const dst, unsigned const dst_stride, char const * const src,
+        unsigned const src_stride, unsigned const n,
+        size_t const sample_size) {
+    #define Copy(type) { \
+        type * const d = (type *) dst; \
+        type const * const s = (type const *) src; \
+        for (unsigned i = 0; i < n; i++) { \
+            d[i * dst_stride] = s[i * src_stride]; \
+        } \
+        return; }
+    switch (sample_size) {
+        case sizeof(uint16_t): Copy(uint16_t)
+        case sizeof(uint32_t): Copy(uint32_t)
+        case sizeof(uint64_t): Copy(uint64_t)
+    }
+    #undef Copy
+    for (unsigned i = 0; i < n; i++) {
+        memcpy(
+            dst + i * dst_stride * sample_size,
+            src + i * src_stride * sample_size, sample_size);
+    }
+}
+
+static unsigned copy_buf_frames(
+        lsf_wrapped const f, size_t const sample_size,
+        adiff_options const * const opts) {
+    unsigned const buf_size = (opts != NULL && opts->copy_buf_size) ?
+        opts->copy_buf_size : default_copy_buf_size;
+    unsigned const frames = buf_size / sample_size / f.info.channels;
+    return frames ? frames : 1;
+}
+
+/*
+ * One channel of a file, split out into a temporary file of its own.
+ */
+typedef struct {
+    FILE * file;
+    size_t sample_size;
+    sample_pos length;
+    sample_pos pos;
+} channel_source;
+
+static unsigned channel_fetcher(
+        void * const source, char * const buffer, unsigned const n_items) {
+    channel_source * const cs = source;
+    sample_pos const left = (cs->pos < cs->length) ? cs->length - cs->pos : 0;
+    size_t const wanted = MIN(left, n_items) * cs->sample_size;
+    size_t done = 0;
+    while (done < wanted) {
+        ssize_t const n_read = pread(
+            fileno(cs->file), buffer + done, wanted - done,
+            cs->pos * cs->sample_size + done);
+        if (n_read <= 0) {
+            break;
+        }
+        done += n_read;
+    }
+    unsigned const n = done / cs->sample_size;
+    cs->pos += n;
+    return n;
+}
+
+static void channel_seeker(void * const source, sample_pos const pos) {
+    ((channel_source *) source)->pos = pos;
+}
+
+static void close_channels(
+        channel_source * const cs, unsigned const channels) {
+    for (unsigned c = 0; c < channels; c++) {
+        if (cs[c].file != NULL) {
+            fclose(cs[c].file);
+        }
+    }
+}
+
+/*
+ * Decode a file once, in order, writing each block's samples out to a
+ * temporary file per channel. Returns zero (having closed any files it
+ * created) if the channels couldn't be written.
+ */
+static int split_channels(
+        lsf_wrapped const f, adiff_options const * const opts,
+        channel_source * const cs) {
+    unsigned const channels = f.info.channels;
+    fetcher_info const fi = get_fetcher(f);
+    unsigned const buf_frames = copy_buf_frames(f, fi.sample_size, opts);
+    char * const frames = malloc(buf_frames * fi.sample_size * channels);
+    char * const samples = malloc(buf_frames * fi.sample_size);
+    int ok = 1;
+    for (unsigned c = 0; c < channels; c++) {
+        cs[c] = (channel_source) {
+            .file = tmpfile(), .sample_size = fi.sample_size};
+        ok = ok && cs[c].file != NULL;
+    }
+    sample_pos length = 0;
+    unsigned n;
+    while (ok && (n = fi.fetcher(f.file, frames, buf_frames))) {
+        for (unsigned c = 0; ok && c < channels; c++) {
+            copy_channel(
+                samples, 1, frames + c * fi.sample_size, channels, n,
+                fi.sample_size);
+            ok = fwrite(samples, fi.sample_size, n, cs[c].file) == n;
+        }
+        length += n;
+    }
+    for (unsigned c = 0; ok && c < channels; c++) {
+        cs[c].length = length;
+        ok = fflush(cs[c].file) == 0;
+    }
+    if (!ok) {
+        close_channels(cs, channels);
+    }
+    free(frames);
+    free(samples);
+    return ok;
+}
+
+typedef struct {
+    channel_source const * a;
+    channel_source const * b;
+    bdiff_options const * opts;
+    unsigned channels;
+    // How many channels a worker takes at a time, to chunk together:
+    unsigned group;
+    gint next_channel;
+    hunk ** hunks;
+} channel_jobs;
+
+typedef struct {
+    channel_jobs * jobs;
+    // Our own stats, so that workers don't race to update the caller's:
+    bdiff_stats stats;
+} channel_worker;
+
+/*
+ * Diff groups of channels until there are none left, each group's channels
+ * being chunked together (see bdiff_pairs()). Each channel has files of its
+ * own, so workers never share a file position.
+ */
+static gpointer diff_channels_worker(gpointer const data) {
+    channel_worker * const w = data;
+    channel_jobs * const jobs = w->jobs;
+    bdiff_options o = *jobs->opts;
+    if (o.stats != NULL) {
+        o.stats = &w->stats;
+    }
+    // Reused for every channel we diff (the caller's may be in use on
+    // another worker):
+    o.scratch = bdiff_scratch_new();
+    channel_source * const a_cs = calloc(
+        jobs->group, sizeof(channel_source));
+    channel_source * const b_cs = calloc(
+        jobs->group, sizeof(channel_source));
+    void ** const a = calloc(jobs->group, sizeof(void *));
+    void ** const b = calloc(jobs->group, sizeof(void *));
+    unsigned first;
+    while (
+            (first = g_atomic_int_add(&jobs->next_channel, jobs->group)) <
+            jobs->channels) {
+        unsigned const n = MIN(jobs->group, jobs->channels - first);
+        for (unsigned i = 0; i < n; i++) {
+            a_cs[i] = jobs->a[first + i];
+            b_cs[i] = jobs->b[first + i];
+            a[i] = &a_cs[i];
+            b[i] = &b_cs[i];
+        }
+        bdiff_pairs(
+            a_cs[0].sample_size, channel_seeker, channel_fetcher, n, a, b,
+            &o, jobs->hunks + first);
+    }
+    free(a_cs);
+    free(b_cs);
+    free(a);
+    free(b);
+    bdiff_scratch_free(o.scratch);
+    return NULL;
+}
+
+static void diff_channels(
+        channel_jobs * const jobs, adiff_options const * const opts) {
+    unsigned n_threads = (opts != NULL && opts->threads) ?
+        opts->threads : g_get_num_processors();
+    // Chunking channels together only once every thread has some:
+    jobs->group = MAX(1, MIN(
+        (jobs->channels + n_threads - 1) / n_threads,
+        max_grouped_channels));
+    unsigned const n_groups =
+        (jobs->channels + jobs->group - 1) / jobs->group;
+    if (n_threads > n_groups) {
+        n_threads = n_groups;
+    }
+    channel_worker * const workers = calloc(
+        n_threads, sizeof(channel_worker));
+    GThread ** const threads = calloc(n_threads, sizeof(GThread *));
+    for (unsigned t = 0; t < n_threads; t++) {
+        workers[t].jobs = jobs;
+        if (t != 0) {
+            threads[t] = g_thread_new(
+                "adiff_channel", diff_channels_worker, &workers[t]);
+        }
+    }
+    // The calling thread does its share too:
+    diff_channels_worker(&workers[0]);
+    for (unsigned t = 0; t < n_threads; t++) {
+        if (t != 0) {
+            g_thread_join(threads[t]);
+        }
+        if (opts != NULL && opts->bdiff.stats != NULL) {
+            bdiff_stats_add(opts->bdiff.stats, &workers[t].stats);
+        }
+    }
+    free(workers);
+    free(threads);
+}
+
+static adiff_return_code split_and_diff_channels(
+        lsf_wrapped const a, lsf_wrapped const b,
+        adiff_options const * const opts, hunk ** const hunks) {
+    unsigned const channels = a.info.channels;
+    channel_source * const a_cs = calloc(channels, sizeof(channel_source));
+    channel_source * const b_cs = calloc(channels, sizeof(channel_source));
+    adiff_return_code code = ADIFF_ERR_READ;
+    if (split_channels(a, opts, a_cs)) {
+        if (split_channels(b, opts, b_cs)) {
+            bdiff_options const o = auto_options(a, b, opts);
+            channel_jobs jobs = {
+                .a = a_cs, .b = b_cs, .opts = &o, .channels = channels,
+                .hunks = hunks};
+            diff_channels(&jobs, opts);
+            code = ADIFF_OK;
+            close_channels(b_cs, channels);
+        }
+        close_channels(a_cs, channels);
+    }
+    free(a_cs);
+    free(b_cs);
+    return code;
+}
+
+channel_diff adiff_channels(
+        const_str path_a, const_str path_b,
+        adiff_options const * const opts) {
+    lsf_wrapped const a = sndfile_open(path_a);
+    if (a.file == NULL) {
+        return (channel_diff) {.code = ADIFF_ERR_OPEN_A};
+    }
+    lsf_wrapped const b = sndfile_open(path_b);
+    if (b.file == NULL) {
+        sf_close(a.file);
+        return (channel_diff) {.code = ADIFF_ERR_OPEN_B};
+    }
+    channel_diff result = {.code = info_cmp(a, b)};
+    if (result.code == ADIFF_OK) {
+        result.channels = a.info.channels;
+        result.hunks = calloc(result.channels, sizeof(hunk *));
+        result.code = split_and_diff_channels(a, b, opts, result.hunks);
+        if (result.code != ADIFF_OK) {
+            channel_diff_free(&result);
+        }
+    }
     sf_close(a.file);
     sf_close(b.file);
     return result;
 }
 
+struct adiff_context {
+    adiff_options opts;
+    GThreadPool * pool;
+    // Guards the caller's stats (if any), which every job adds to, and the
+    // scratches not in use:
+    GMutex lock;
+    // One for each worker, so there are always enough to go round:
+    bdiff_scratch ** scratches;
+    unsigned n_free_scratches;
+};
+
+/*
+ * Progress of a batch, the last job to finish waking the caller.
+ */
+typedef struct {
+    GMutex lock;
+    GCond done_cond;
+    unsigned remaining;
+} batch;
+
+typedef struct {
+    adiff_context * ctx;
+    batch * batch;
+    char const * a_path;
+    char const * b_path;
+    diff * result;
+} batch_job;
+
+static void batch_worker(gpointer const data, gpointer const user_data) {
+    batch_job * const job = data;
+    adiff_context * const ctx = job->ctx;
+    adiff_options opts = ctx->opts;
+    bdiff_stats stats = {};
+    if (opts.bdiff.stats != NULL) {
+        opts.bdiff.stats = &stats;
+    }
+    // Pairs diffed together would all write to the same trace:
+    opts.trace_path = NULL;
+    g_mutex_lock(&ctx->lock);
+    opts.bdiff.scratch = ctx->scratches[--ctx->n_free_scratches];
+    g_mutex_unlock(&ctx->lock);
+    *job->result = adiff_with_options(job->a_path, job->b_path, &opts);
+    g_mutex_lock(&ctx->lock);
+    ctx->scratches[ctx->n_free_scratches++] = opts.bdiff.scratch;
+    if (ctx->opts.bdiff.stats != NULL) {
+        bdiff_stats_add(ctx->opts.bdiff.stats, &stats);
+    }
+    g_mutex_unlock(&ctx->lock);
+    g_mutex_lock(&job->batch->lock);
+    if (--job->batch->remaining == 0) {
+        g_cond_signal(&job->batch->done_cond);
+    }
+    g_mutex_unlock(&job->batch->lock);
+}
+
+adiff_context * adiff_context_new(adiff_options const * const opts) {
+    adiff_context * const ctx = malloc(sizeof(adiff_context));
+    *ctx = (adiff_context) {.opts = (opts == NULL) ?
+        (adiff_options) {} : *opts};
+    unsigned const n_threads = ctx->opts.threads ?
+        ctx->opts.threads : g_get_num_processors();
+    g_mutex_init(&ctx->lock);
+    ctx->scratches = malloc(n_threads * sizeof(bdiff_scratch *));
+    for (unsigned i = 0; i < n_threads; i++) {
+        ctx->scratches[i] = bdiff_scratch_new();
+    }
+    ctx->n_free_scratches = n_threads;
+    ctx->pool = g_thread_pool_new(batch_worker, NULL, n_threads, TRUE, NULL);
+    return ctx;
+}
+
+void adiff_context_free(adiff_context * const ctx) {
+    g_thread_pool_free(ctx->pool, FALSE, TRUE);
+    for (unsigned i = 0; i < ctx->n_free_scratches; i++) {
+        bdiff_scratch_free(ctx->scratches[i]);
+    }
+    free(ctx->scratches);
+    g_mutex_clear(&ctx->lock);
+    free(ctx);
+}
+
+void adiff_batch(
+        adiff_context * const ctx, unsigned const n_pairs,
+        const_str * const a_paths, const_str * const b_paths,
+        diff * const results) {
+    if (n_pairs == 0) {
+        return;
+    }
+    batch b = {.remaining = n_pairs};
+    g_mutex_init(&b.lock);
+    g_cond_init(&b.done_cond);
+    batch_job * const jobs = malloc(n_pairs * sizeof(batch_job));
+    for (unsigned i = 0; i < n_pairs; i++) {
+        jobs[i] = (batch_job) {
+            .ctx = ctx, .batch = &b, .a_path = a_paths[i],
+            .b_path = b_paths[i], .result = &results[i]};
+        g_thread_pool_push(ctx->pool, &jobs[i], NULL);
+    }
+    g_mutex_lock(&b.lock);
+    while (b.remaining) {
+        g_cond_wait(&b.done_cond, &b.lock);
+    }
+    g_mutex_unlock(&b.lock);
+    free(jobs);
+    g_cond_clear(&b.done_cond);
+    g_mutex_clear(&b.lock);
+}
+
 typedef unsigned (*data_writer)(
     SNDFILE * const, char const * buffer, unsigned const n_items);
 
@@ -146,22 +794,26 @@ static writer_info get_writer(lsf_wrapped const f) {
     }
 }
 
+/*
+ * Copy the frames [start, end) of in to the end of out.
+ */
 static void copy_data(
-        lsf_wrapped const in, lsf_wrapped const out, unsigned start,
-        unsigned end) {
-    if (end == 0) {
+        lsf_wrapped const in, lsf_wrapped const out, char * const buffer,
+        unsigned const buf_size, sample_pos start, sample_pos const end) {
+    if (start >= end) {
         return;
     }
-    end--;
     sf_seek(in.file, start, SEEK_SET);  // Should be error checked (-1 rval)
     fetcher_info const fi = get_fetcher(in);
     writer_info const ei = get_writer(in);
-    char buffer[8192];
-    unsigned n_items = 8192 / ei.sample_size / in.info.channels;
+    unsigned const max_items = buf_size / ei.sample_size / in.info.channels;
     while (start < end) {
-        if ((end - start) < n_items)
-            n_items = (end - start) + 1;
+        unsigned const n_items =
+            ((end - start) < max_items) ? (end - start) : max_items;
         const unsigned n_read = fi.fetcher(in.file, buffer, n_items);
+        if (n_read == 0) {
+            break;
+        }
         ei.writer(out.file, buffer, n_read);  // Possible write failure
         start += n_read;
     }
@@ -169,20 +821,35 @@ static void copy_data(
 
 static apatch_return_code apply_patch(
         hunk const * h, lsf_wrapped const a, lsf_wrapped const b,
-        lsf_wrapped const o) {
-    unsigned prev_hunk_end = 0;
+        lsf_wrapped const o, unsigned const buf_size) {
+    Probe(patch__start, h);
+    char * const buffer = malloc(buf_size);
+    lsf_wrapped const sources[] = {[HUNK_SOURCE_B] = b, [HUNK_SOURCE_A] = a};
+    sample_pos prev_hunk_end = 0;
     for (; h != NULL; h = h->next) {
-        copy_data(a, o, prev_hunk_end, h->a.start);
-        copy_data(b, o, h->b.start, h->b.end);
+        assert(h->source < sizeof(sources) / sizeof(sources[0]));
+        copy_data(a, o, buffer, buf_size, prev_hunk_end, h->a.start);
+        copy_data(
+            sources[h->source], o, buffer, buf_size, h->b.start, h->b.end);
         prev_hunk_end = h->a.end;
     }
-    copy_data(a, o, prev_hunk_end, a.info.frames + 1);
+    copy_data(a, o, buffer, buf_size, prev_hunk_end, a.info.frames);
+    free(buffer);
+    Probe(patch__done);
     return APATCH_OK;
 }
 
 apatch_return_code apatch(
         hunk const * hunks, const_str path_a, const_str path_b,
         const_str out_path) {
+    return apatch_with_options(hunks, path_a, path_b, out_path, NULL);
+}
+
+apatch_return_code apatch_with_options(
+        hunk const * hunks, const_str path_a, const_str path_b,
+        const_str out_path, adiff_options const * const opts) {
+    unsigned const buf_size = (opts != NULL && opts->copy_buf_size) ?
+        opts->copy_buf_size : default_copy_buf_size;
     apatch_return_code retcode;
     lsf_wrapped const a = sndfile_open(path_a);
     if (a.file != NULL) {
@@ -190,7 +857,7 @@ apatch_return_code apatch(
         if (b.file != NULL) {
             lsf_wrapped const o = sndfile_new(out_path, a.info);
             if (o.file != NULL) {
-                retcode = apply_patch(hunks, a, b, o);
+                retcode = apply_patch(hunks, a, b, o, buf_size);
                 sf_close(o.file);
             } else {
                 retcode = APATCH_ERR_OPEN_OUTPUT;
@@ -206,6 +873,586 @@ apatch_return_code apatch(
     return retcode;
 }
 
+/*
+ * Write the base with the hunks of both sides of a merge applied, in order.
+ */
+static void write_merge(
+        bdiff_merge_result const * const m, lsf_wrapped const base,
+        lsf_wrapped const ours, lsf_wrapped const theirs,
+        lsf_wrapped const out, unsigned const buf_size) {
+    char * const buffer = malloc(buf_size);
+    hunk const * o = m->ours, * t = m->theirs;
+    sample_pos base_pos = 0;
+    while (o != NULL || t != NULL) {
+        int const from_ours =
+            t == NULL || (o != NULL && o->a.start <= t->a.start);
+        hunk const * const h = from_ours ? o : t;
+        copy_data(base, out, buffer, buf_size, base_pos, h->a.start);
+        copy_data(
+            from_ours ? ours : theirs, out, buffer, buf_size, h->b.start,
+            h->b.end);
+        base_pos = h->a.end;
+        if (from_ours) {
+            o = o->next;
+        } else {
+            t = t->next;
+        }
+    }
+    copy_data(base, out, buffer, buf_size, base_pos, base.info.frames);
+    free(buffer);
+}
+
+static amerge_result merge(
+        lsf_wrapped const base, lsf_wrapped const ours,
+        lsf_wrapped const theirs, const_str out_path,
+        adiff_options const * const opts) {
+    if (
+            info_cmp(base, ours) != ADIFF_OK ||
+            info_cmp(base, theirs) != ADIFF_OK) {
+        return (amerge_result) {.code = AMERGE_ERR_FORMAT};
+    }
+    lsf_wrapped const out = sndfile_new(out_path, base.info);
+    if (out.file == NULL) {
+        return (amerge_result) {.code = AMERGE_ERR_OPEN_OUTPUT};
+    }
+    bdiff_options const o = options_for_frames(
+        MAX(base.info.frames, MAX(ours.info.frames, theirs.info.frames)),
+        opts);
+    frame_reader base_fr = frame_reader_open(base, opts);
+    frame_reader ours_fr = frame_reader_open(ours, opts);
+    frame_reader theirs_fr = frame_reader_open(theirs, opts);
+    bdiff_merge_result m = bdiff_merge(
+        base_fr.frame_size, reader_seeker, reader_fetcher, &base_fr, &ours_fr,
+        &theirs_fr, &o);
+    frame_reader_close(&base_fr);
+    frame_reader_close(&ours_fr);
+    frame_reader_close(&theirs_fr);
+    unsigned const buf_size = (opts != NULL && opts->copy_buf_size) ?
+        opts->copy_buf_size : default_copy_buf_size;
+    write_merge(&m, base, ours, theirs, out, buf_size);
+    sf_close(out.file);
+    amerge_result const result = {
+        .code = AMERGE_OK, .conflicts = m.conflicts};
+    m.conflicts = NULL;
+    bdiff_merge_free(&m);
+    return result;
+}
+
+amerge_result amerge(
+        const_str base_path, const_str ours_path, const_str theirs_path,
+        const_str out_path, adiff_options const * const opts) {
+    lsf_wrapped const base = sndfile_open(base_path);
+    if (base.file == NULL) {
+        return (amerge_result) {.code = AMERGE_ERR_OPEN_BASE};
+    }
+    lsf_wrapped const ours = sndfile_open(ours_path);
+    if (ours.file == NULL) {
+        sf_close(base.file);
+        return (amerge_result) {.code = AMERGE_ERR_OPEN_OURS};
+    }
+    lsf_wrapped const theirs = sndfile_open(theirs_path);
+    if (theirs.file == NULL) {
+        sf_close(base.file);
+        sf_close(ours.file);
+        return (amerge_result) {.code = AMERGE_ERR_OPEN_THEIRS};
+    }
+    amerge_result const result = merge(base, ours, theirs, out_path, opts);
+    sf_close(base.file);
+    sf_close(ours.file);
+    sf_close(theirs.file);
+    return result;
+}
+
+/*
+ * Position within the patched stream of one channel. Runs of frames come
+ * alternately from the gaps in a between hunks and from the hunks' sources.
+ */
+typedef struct {
+    hunk const * h;
+    sample_pos a_pos;
+    int in_gap;
+    lsf_wrapped const * file;
+    sample_pos pos;
+    sample_pos end;
+} channel_cursor;
+
+static int next_run(
+        channel_cursor * const cc, lsf_wrapped const * const sources,
+        lsf_wrapped const * const a) {
+    while (cc->pos == cc->end) {
+        if (!cc->in_gap) {
+            assert(cc->h == NULL || cc->h->a.start >= cc->a_pos);
+            cc->in_gap = 1;
+            cc->file = a;
+            cc->pos = cc->a_pos;
+            cc->end = (cc->h == NULL) ? a->info.frames : cc->h->a.start;
+        } else if (cc->h != NULL) {
+            assert(cc->h->source <= HUNK_SOURCE_A);
+            cc->in_gap = 0;
+            cc->file = &sources[cc->h->source];
+            cc->pos = cc->h->b.start;
+            cc->end = cc->h->b.end;
+            cc->a_pos = cc->h->a.end;
+            cc->h = cc->h->next;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static sf_count_t patched_length(
+        hunk const * h, sf_count_t const a_frames) {
+    sf_count_t length = a_frames;
+    for (; h != NULL; h = h->next) {
+        length += (sf_count_t) (h->b.end - h->b.start) -
+            (sf_count_t) (h->a.end - h->a.start);
+    }
+    return length;
+}
+
+/*
+ * Frames one channel takes from a source for a block of output.
+ */
+typedef struct {
+    lsf_wrapped const * file;
+    sample_pos pos;
+    unsigned n;
+    unsigned channel;
+    // Where in the block they go:
+    unsigned filled;
+} channel_run;
+
+static int run_cmp(void const * const a, void const * const b) {
+    channel_run const * const ra = a, * const rb = b;
+    uintptr_t const fa = (uintptr_t) ra->file->file;
+    uintptr_t const fb = (uintptr_t) rb->file->file;
+    if (fa != fb) {
+        return (fa > fb) - (fa < fb);
+    }
+    return (ra->pos > rb->pos) - (ra->pos < rb->pos);
+}
+
+/*
+ * Write the patched channels a block at a time. The runs of frames every
+ * channel takes for a block are sorted by where they come from, and those
+ * overlapping or touching are read together, so frames the channels share
+ * (as they do in the gaps between hunks) are decoded once.
+ */
+static apatch_return_code apply_channel_patches(
+        hunk * const * const channel_hunks, lsf_wrapped const a,
+        lsf_wrapped const b, lsf_wrapped const o,
+        adiff_options const * const opts) {
+    Probe(patch__start, channel_hunks);
+    unsigned const channels = a.info.channels;
+    fetcher_info const fi = get_fetcher(a);
+    writer_info const ei = get_writer(a);
+    sf_count_t const length = patched_length(channel_hunks[0], a.info.frames);
+    lsf_wrapped const sources[] = {[HUNK_SOURCE_B] = b, [HUNK_SOURCE_A] = a};
+    channel_cursor * const cursors = calloc(channels, sizeof(channel_cursor));
+    for (unsigned c = 0; c < channels; c++) {
+        cursors[c].h = channel_hunks[c];
+    }
+    unsigned const buf_frames = copy_buf_frames(a, fi.sample_size, opts);
+    size_t const frame_size = fi.sample_size * channels;
+    // Runs read together never span more than the frames of all the runs
+    char * const in = malloc(buf_frames * channels * frame_size);
+    char * const out = calloc(buf_frames, frame_size);
+    unsigned max_runs = channels;
+    channel_run * runs = malloc(max_runs * sizeof(channel_run));
+    apatch_return_code retcode = APATCH_OK;
+    for (sf_count_t done = 0; done < length;) {
+        unsigned const n = ((length - done) < buf_frames) ?
+            (length - done) : buf_frames;
+        unsigned n_runs = 0;
+        for (unsigned c = 0; c < channels; c++) {
+            channel_cursor * const cc = &cursors[c];
+            unsigned filled = 0;
+            while (filled < n && next_run(cc, sources, &a)) {
+                unsigned const wanted = ((cc->end - cc->pos) < (n - filled)) ?
+                    (cc->end - cc->pos) : (n - filled);
+                if (n_runs == max_runs) {
+                    max_runs *= 2;
+                    runs = realloc(runs, max_runs * sizeof(channel_run));
+                }
+                runs[n_runs++] = (channel_run) {
+                    .file = cc->file, .pos = cc->pos, .n = wanted,
+                    .channel = c, .filled = filled};
+                filled += wanted;
+                cc->pos += wanted;
+            }
+        }
+        qsort(runs, n_runs, sizeof(channel_run), run_cmp);
+        for (unsigned r = 0; r < n_runs;) {
+            SNDFILE * const file = runs[r].file->file;
+            sample_pos const start = runs[r].pos;
+            sample_pos end = start + runs[r].n;
+            unsigned last = r + 1;
+            for (
+                    ; last < n_runs && runs[last].file->file == file &&
+                    runs[last].pos <= end; last++) {
+                end = MAX(end, runs[last].pos + runs[last].n);
+            }
+            seeker(file, start);
+            if (fi.fetcher(file, in, end - start) != end - start) {
+                retcode = APATCH_ERR_READ;
+                goto done;
+            }
+            for (; r < last; r++) {
+                channel_run const * const cr = &runs[r];
+                copy_channel(
+                    out + (cr->filled * channels + cr->channel) *
+                        fi.sample_size, channels,
+                    in + ((cr->pos - start) * channels + cr->channel) *
+                        fi.sample_size, channels, cr->n, fi.sample_size);
+            }
+        }
+        ei.writer(o.file, out, n);  // Possible write failure
+        done += n;
+    }
+done:
+    free(in);
+    free(out);
+    free(runs);
+    free(cursors);
+    Probe(patch__done);
+    return retcode;
+}
+
+apatch_return_code apatch_channels(
+        hunk * const * const channel_hunks, const_str path_a,
+        const_str path_b, const_str out_path,
+        adiff_options const * const opts) {
+    apatch_return_code retcode;
+    lsf_wrapped const a = sndfile_open(path_a);
+    if (a.file == NULL) {
+        return APATCH_ERR_OPEN_A;
+    }
+    lsf_wrapped const b = sndfile_open(path_b);
+    if (b.file == NULL) {
+        sf_close(a.file);
+        return APATCH_ERR_OPEN_B;
+    }
+    sf_count_t const length = patched_length(channel_hunks[0], a.info.frames);
+    if (b.info.channels != a.info.channels) {
+        retcode = APATCH_ERR_CHANNELS;
+    } else {
+        retcode = APATCH_OK;
+        for (int c = 1; c < a.info.channels; c++) {
+            if (patched_length(channel_hunks[c], a.info.frames) != length) {
+                retcode = APATCH_ERR_CHANNEL_LENGTHS;
+            }
+        }
+    }
+    if (retcode == APATCH_OK) {
+        lsf_wrapped const o = sndfile_new(out_path, a.info);
+        if (o.file != NULL) {
+            retcode = apply_channel_patches(channel_hunks, a, b, o, opts);
+            sf_close(o.file);
+        } else {
+            retcode = APATCH_ERR_OPEN_OUTPUT;
+        }
+    }
+    sf_close(b.file);
+    sf_close(a.file);
+    return retcode;
+}
+
+/*
+ * Patch files hold, in order (all integers little endian):
+ *
+ *     "APF1"
+ *     u32 channels, u32 encoding, u32 frame size (in bytes)
+ *     u64 number of hunks, then each hunk's u64 a.start, a.end, b.start,
+ *         b.end and u32 source
+ *     the frames of each hunk taking data from b, in blocks of up to
+ *         payload_block_frames frames, each a u32 size then its bytes
+ *
+ * Blocks of PATCH_RICE frames are encoded with payload_encode(), blocks of
+ * PATCH_RAW frames are the frames as read.
+ */
+#define patch_magic "APF1"
+
+enum {
+    PATCH_RICE = 0,
+    PATCH_RAW = 1,
+};
+
+static void write_le(FILE * const f, uint64_t const value, unsigned const n) {
+    unsigned char bytes[8];
+    for (unsigned i = 0; i < n; i++) {
+        bytes[i] = value >> (8 * i);
+    }
+    fwrite(bytes, 1, n, f);  // Possible write failure
+}
+
+static int read_le(FILE * const f, uint64_t * const value, unsigned const n) {
+    unsigned char bytes[8];
+    if (fread(bytes, 1, n, f) != n) {
+        return 0;
+    }
+    *value = 0;
+    for (unsigned i = n; i-- > 0;) {
+        *value = (*value << 8) | bytes[i];
+    }
+    return 1;
+}
+
+/*
+ * Whether a file's samples are integers (and so can be Rice coded as 32 bit
+ * integers without loss).
+ */
+static int integer_samples(lsf_wrapped const f) {
+    switch (f.info.format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_FLOAT:
+        case SF_FORMAT_DOUBLE:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static unsigned patch_frame_size(lsf_wrapped const f, unsigned const encoding) {
+    size_t const sample_size = (encoding == PATCH_RICE) ?
+        sizeof(int32_t) : get_fetcher(f).sample_size;
+    return sample_size * f.info.channels;
+}
+
+static apatch_return_code write_patch(
+        hunk const * const hunks, lsf_wrapped const b, FILE * const pf) {
+    unsigned const encoding = integer_samples(b) ? PATCH_RICE : PATCH_RAW;
+    unsigned const channels = b.info.channels;
+    unsigned const frame_size = patch_frame_size(b, encoding);
+    fwrite(patch_magic, 1, 4, pf);
+    write_le(pf, channels, 4);
+    write_le(pf, encoding, 4);
+    write_le(pf, frame_size, 4);
+    uint64_t n_hunks = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        n_hunks++;
+    }
+    write_le(pf, n_hunks, 8);
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        write_le(pf, h->a.start, 8);
+        write_le(pf, h->a.end, 8);
+        write_le(pf, h->b.start, 8);
+        write_le(pf, h->b.end, 8);
+        write_le(pf, h->source, 4);
+    }
+    fetcher_info const fi = get_fetcher(b);
+    char * const frames = malloc((size_t) payload_block_frames * frame_size);
+    unsigned char * const encoded = malloc(
+        payload_max_bytes(payload_block_frames, channels));
+    apatch_return_code retcode = APATCH_OK;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        if (h->source != HUNK_SOURCE_B) {
+            continue;
+        }
+        seeker(b.file, h->b.start);
+        for (sample_pos pos = h->b.start; pos < h->b.end;) {
+            unsigned const n = MIN(h->b.end - pos, payload_block_frames);
+            unsigned const n_read = (encoding == PATCH_RICE) ?
+                int_fetcher(b.file, frames, n) :
+                fi.fetcher(b.file, frames, n);
+            if (n_read != n) {
+                retcode = APATCH_ERR_BAD_PATCH;
+                goto done;
+            }
+            if (encoding == PATCH_RICE) {
+                size_t const n_bytes = payload_encode(
+                    (int32_t const *) frames, n, channels, encoded);
+                write_le(pf, n_bytes, 4);
+                fwrite(encoded, 1, n_bytes, pf);
+            } else {
+                write_le(pf, (uint64_t) n * frame_size, 4);
+                fwrite(frames, frame_size, n, pf);
+            }
+            pos += n;
+        }
+    }
+done:
+    free(frames);
+    free(encoded);
+    return retcode;
+}
+
+apatch_return_code apatch_write_file(
+        hunk const * const hunks, const_str b_path, const_str patch_path) {
+    lsf_wrapped const b = sndfile_open(b_path);
+    if (b.file == NULL) {
+        return APATCH_ERR_OPEN_B;
+    }
+    FILE * const pf = fopen(patch_path, "wb");
+    if (pf == NULL) {
+        sf_close(b.file);
+        return APATCH_ERR_OPEN_PATCH;
+    }
+    apatch_return_code const retcode = write_patch(hunks, b, pf);
+    fclose(pf);
+    sf_close(b.file);
+    return retcode;
+}
+
+/*
+ * Read the hunks of a patch file (after checking its header suits a),
+ * returning NULL with an error code if it doesn't.
+ */
+static apatch_return_code read_patch_hunks(
+        FILE * const pf, lsf_wrapped const a, unsigned * const encoding,
+        hunk ** const hunks) {
+    char magic[4];
+    uint64_t channels, enc, frame_size, n_hunks;
+    *hunks = NULL;
+    if (
+            fread(magic, 1, 4, pf) != 4 || memcmp(magic, patch_magic, 4) ||
+            !read_le(pf, &channels, 4) || !read_le(pf, &enc, 4) ||
+            !read_le(pf, &frame_size, 4) || !read_le(pf, &n_hunks, 8) ||
+            enc > PATCH_RAW) {
+        return APATCH_ERR_BAD_PATCH;
+    }
+    if (channels != (uint64_t) a.info.channels) {
+        return APATCH_ERR_CHANNELS;
+    }
+    *encoding = enc;
+    if (frame_size != patch_frame_size(a, enc)) {
+        return APATCH_ERR_BAD_PATCH;
+    }
+    hunk * tail = NULL;
+    sample_pos a_pos = 0;
+    for (uint64_t i = 0; i < n_hunks; i++) {
+        uint64_t a_start, a_end, b_start, b_end, source;
+        if (
+                !read_le(pf, &a_start, 8) || !read_le(pf, &a_end, 8) ||
+                !read_le(pf, &b_start, 8) || !read_le(pf, &b_end, 8) ||
+                !read_le(pf, &source, 4) || source > HUNK_SOURCE_A ||
+                a_start < a_pos || a_end < a_start || b_end < b_start) {
+            hunk_free(*hunks);
+            *hunks = NULL;
+            return APATCH_ERR_BAD_PATCH;
+        }
+        append_hunk(hunks, &tail, a_start, a_end, b_start, b_end);
+        tail->source = source;
+        a_pos = a_end;
+    }
+    return APATCH_OK;
+}
+
+/*
+ * Decode the frames of a hunk from a patch file, writing them to out.
+ */
+static apatch_return_code write_patch_frames(
+        FILE * const pf, unsigned const encoding, sample_pos frames,
+        lsf_wrapped const out, char * const decoded,
+        unsigned char * const encoded) {
+    unsigned const channels = out.info.channels;
+    size_t const max_bytes = payload_max_bytes(payload_block_frames, channels);
+    unsigned const frame_size = patch_frame_size(out, encoding);
+    writer_info const ei = get_writer(out);
+    while (frames) {
+        unsigned const n = MIN(frames, payload_block_frames);
+        uint64_t n_bytes;
+        if (
+                !read_le(pf, &n_bytes, 4) || n_bytes > max_bytes ||
+                fread(encoded, 1, n_bytes, pf) != n_bytes) {
+            return APATCH_ERR_BAD_PATCH;
+        }
+        if (encoding == PATCH_RICE) {
+            if (!payload_decode(
+                    encoded, n_bytes, n, channels, (int32_t *) decoded)) {
+                return APATCH_ERR_BAD_PATCH;
+            }
+            sf_writef_int(out.file, (int const *) decoded, n);
+        } else {
+            if (n_bytes != (uint64_t) n * frame_size) {
+                return APATCH_ERR_BAD_PATCH;
+            }
+            ei.writer(out.file, (char const *) encoded, n);
+        }
+        frames -= n;
+    }
+    return APATCH_OK;
+}
+
+static apatch_return_code apply_patch_file(
+        FILE * const pf, lsf_wrapped const a, lsf_wrapped const o,
+        unsigned const buf_size) {
+    unsigned encoding;
+    hunk * hunks;
+    apatch_return_code retcode = read_patch_hunks(pf, a, &encoding, &hunks);
+    if (retcode != APATCH_OK) {
+        return retcode;
+    }
+    char * const buffer = malloc(buf_size);
+    char * const decoded = malloc(
+        (size_t) payload_block_frames * patch_frame_size(a, encoding));
+    unsigned char * const encoded = malloc(
+        payload_max_bytes(payload_block_frames, a.info.channels));
+    sample_pos prev_hunk_end = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        copy_data(a, o, buffer, buf_size, prev_hunk_end, h->a.start);
+        if (h->source == HUNK_SOURCE_A) {
+            copy_data(a, o, buffer, buf_size, h->b.start, h->b.end);
+        } else {
+            retcode = write_patch_frames(
+                pf, encoding, h->b.end - h->b.start, o, decoded, encoded);
+            if (retcode != APATCH_OK) {
+                break;
+            }
+        }
+        prev_hunk_end = h->a.end;
+    }
+    if (retcode == APATCH_OK) {
+        copy_data(a, o, buffer, buf_size, prev_hunk_end, a.info.frames);
+    }
+    free(buffer);
+    free(decoded);
+    free(encoded);
+    hunk_free(hunks);
+    return retcode;
+}
+
+apatch_return_code apatch_file(
+        const_str patch_path, const_str a_path, const_str out_path,
+        adiff_options const * const opts) {
+    unsigned const buf_size = (opts != NULL && opts->copy_buf_size) ?
+        opts->copy_buf_size : default_copy_buf_size;
+    FILE * const pf = fopen(patch_path, "rb");
+    if (pf == NULL) {
+        return APATCH_ERR_OPEN_PATCH;
+    }
+    apatch_return_code retcode;
+    lsf_wrapped const a = sndfile_open(a_path);
+    if (a.file != NULL) {
+        lsf_wrapped const o = sndfile_new(out_path, a.info);
+        if (o.file != NULL) {
+            retcode = apply_patch_file(pf, a, o, buf_size);
+            sf_close(o.file);
+        } else {
+            retcode = APATCH_ERR_OPEN_OUTPUT;
+        }
+        sf_close(a.file);
+    } else {
+        retcode = APATCH_ERR_OPEN_A;
+    }
+    fclose(pf);
+    return retcode;
+}
+
 void diff_free(diff * d) {
     hunk_free(d->hunks);
 }
+
+void amerge_result_free(amerge_result * r) {
+    bdiff_merge_result m = {.conflicts = r->conflicts};
+    bdiff_merge_free(&m);
+    r->conflicts = NULL;
+}
+
+void channel_diff_free(channel_diff * d) {
+    for (unsigned c = 0; c < d->channels; c++) {
+        hunk_free(d->hunks[c]);
+    }
+    free(d->hunks);
+    d->hunks = NULL;
+    d->channels = 0;
+}
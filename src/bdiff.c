@@ -2,34 +2,687 @@
 #include "bdiff_defs.h"
 #include "chunk.h"
 #include "hunk.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#define max_auto_mask_bits 16
+#define max_auto_buf_scale 2
+
+bdiff_options bdiff_options_default() {
+    return (bdiff_options) {
+        .min_chunk_size = default_min_chunk_size,
+        .max_chunk_size = default_max_chunk_size,
+        .mask_bits = default_mask_bits,
+        .window_length = default_window_length,
+        .min_run_length = default_min_run_length,
+        .chunk_buf_size = default_chunk_buf_size,
+        .narrow_buf_size = default_narrow_buf_size,
+        .levels = default_levels,
+        .level_shift = default_level_shift,
+        .refine_min_chunks = default_refine_min_chunks};
+}
+
+/*
+ * Aim for around sqrt(source_length) chunks, scaling the chunk length bounds
+ * along with the mean, but never go finer than the defaults.
+ */
+bdiff_options bdiff_options_for_length(sample_pos const source_length) {
+    bdiff_options opts = bdiff_options_default();
+    unsigned length_bits = 0;
+    while (length_bits < 64 && (source_length >> length_bits)) {
+        length_bits++;
+    }
+    unsigned mask_bits = length_bits / 2;
+    if (mask_bits <= default_mask_bits) {
+        return opts;
+    }
+    if (mask_bits > max_auto_mask_bits) {
+        mask_bits = max_auto_mask_bits;
+    }
+    unsigned const scale = mask_bits - default_mask_bits;
+    unsigned const buf_scale =
+        (scale < max_auto_buf_scale) ? scale : max_auto_buf_scale;
+    opts.mask_bits = mask_bits;
+    opts.min_chunk_size <<= scale;
+    opts.max_chunk_size <<= scale;
+    opts.chunk_buf_size <<= buf_scale;
+    opts.narrow_buf_size <<= buf_scale;
+    return opts;
+}
+
+/*
+ * Bring the chunking parameters within what split_data() can handle:
+ * masks must fit in a hash, and every level must keep at least one bit.
+ */
+static bdiff_options clamp_levels(bdiff_options o) {
+    o.mask_bits = MIN(o.mask_bits, BDIFF_MAX_MASK_BITS);
+    o.levels = MIN(o.levels, BDIFF_MAX_LEVELS);
+    while (o.levels > 1 && (o.levels - 1) * o.level_shift >= o.mask_bits) {
+        o.levels--;
+    }
+    return o;
+}
+
+bdiff_options bdiff_options_complete(
+        bdiff_options const * const opts, bdiff_options const fallback) {
+    if (opts == NULL) {
+        return clamp_levels(fallback);
+    }
+    #define Complete(field) .field = opts->field ? opts->field : fallback.field
+    return clamp_levels((bdiff_options) {
+        Complete(min_chunk_size),
+        Complete(max_chunk_size),
+        Complete(mask_bits),
+        Complete(window_length),
+        Complete(min_run_length),
+        Complete(chunk_buf_size),
+        Complete(narrow_buf_size),
+        Complete(levels),
+        Complete(level_shift),
+        Complete(refine_min_chunks),
+        Complete(move_min_chunks),
+        Complete(fine_max_samples),
+        Complete(matcher),
+        Complete(read_ahead_buffers),
+        Complete(prefetcher),
+        Complete(stats),
+        Complete(scratch)});
+    #undef Complete
+}
+
+void bdiff_stats_add(bdiff_stats * const total, bdiff_stats const * const s) {
+    bdiff_source_stats * const totals[] = {&total->a, &total->b};
+    bdiff_source_stats const * const sources[] = {&s->a, &s->b};
+    for (unsigned i = 0; i < 2; i++) {
+        totals[i]->bytes_fetched += sources[i]->bytes_fetched;
+        totals[i]->seeks += sources[i]->seeks;
+        totals[i]->chunks += sources[i]->chunks;
+    }
+    for (unsigned i = 0; i < BDIFF_CHUNK_HISTOGRAM_BINS; i++) {
+        total->chunk_lengths[i] += s->chunk_lengths[i];
+    }
+    total->hash_probes += s->hash_probes;
+    total->rough_hunks += s->rough_hunks;
+    total->precise_hunks += s->precise_hunks;
+    total->bytes_compared += s->bytes_compared;
+    total->chunking_us += s->chunking_us;
+    total->matching_us += s->matching_us;
+    total->narrowing_us += s->narrowing_us;
+}
+
+/*
+ * A source wrapped to count the reads and seeks made of it.
+ */
+typedef struct {
+    data_fetcher df;
+    data_seeker ds;
+    data_prefetcher dp;
+    void * source;
+    unsigned sample_size;
+    bdiff_source_stats * stats;
+} counted_source;
+
+static unsigned counting_fetcher(
+        void * const source, char * const buffer, unsigned const n_items) {
+    counted_source * const cs = source;
+    unsigned const n_read = cs->df(cs->source, buffer, n_items);
+    cs->stats->bytes_fetched += (uint64_t) n_read * cs->sample_size;
+    return n_read;
+}
+
+static void counting_seeker(void * const source, sample_pos const pos) {
+    counted_source * const cs = source;
+    cs->stats->seeks++;
+    cs->ds(cs->source, pos);
+}
+
+static void counting_prefetcher(
+        void * const source, view const * const ranges,
+        unsigned const n_ranges) {
+    counted_source * const cs = source;
+    cs->dp(cs->source, ranges, n_ranges);
+}
+
+static counted_source count_source(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const source,
+        bdiff_options const * const o, bdiff_source_stats * const stats) {
+    return (counted_source) {
+        .df = df, .ds = ds, .dp = o->prefetcher, .source = source,
+        .sample_size = sample_size, .stats = stats};
+}
+
+static void count_chunks(
+        bdiff_stats * const stats, bdiff_source_stats * const source,
+        chunk const * c) {
+    for (; c != NULL; c = c->next) {
+        sample_pos const length = c->end - c->start;
+        unsigned bin = 0;
+        while (bin + 1 < BDIFF_CHUNK_HISTOGRAM_BINS && (length >> (bin + 1))) {
+            bin++;
+        }
+        stats->chunk_lengths[bin]++;
+        source->chunks++;
+    }
+}
+
+static uint64_t count_hunks(hunk const * h) {
+    uint64_t n = 0;
+    for (; h != NULL; h = h->next) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * The time at the end of a phase, if collecting stats.
+ */
+static inline int64_t stats_clock(bdiff_stats const * const stats) {
+    return (stats == NULL) ? 0 : g_get_monotonic_time();
+}
 
 /*
  * Perform a chunk based diff of two binary streams.
  * This method has algorithmic complexity
  * O(length_stream_a + length_stream_b).
  */
+static hunk * rough_hunks_from_chunks(
+        chunks const a_chunks, chunks const b_chunks,
+        bdiff_options const * const o) {
+    hunk * h = match_chunks(a_chunks, b_chunks, o->matcher, o->stats);
+    if (o->levels > 1) {
+        h = refine_hunks(
+            h, a_chunks, b_chunks, o->refine_min_chunks, o->matcher,
+            o->stats);
+    }
+    return h;
+}
+
+/*
+ * Chunk the sources together (see split_data_many()).
+ */
+static void split_sources(
+        unsigned const sample_size, data_fetcher const df,
+        void * const * const sources, unsigned const n_sources,
+        bdiff_options const * const o, chunks * const out) {
+    int64_t const start = stats_clock(o->stats);
+    split_data_many(sample_size, df, sources, n_sources, o, out);
+    if (o->stats != NULL) {
+        o->stats->chunking_us += stats_clock(o->stats) - start;
+    }
+}
+
+/*
+ * Match a pair's chunks, returning the rough hunks and leaving the chunks
+ * for the caller to free.
+ */
+static hunk * rough_diff_chunks(
+        chunks const a_chunks, chunks const b_chunks,
+        bdiff_options const * const o) {
+    bdiff_stats * const stats = o->stats;
+    int64_t const start = stats_clock(stats);
+    hunk * const h = rough_hunks_from_chunks(a_chunks, b_chunks, o);
+    if (stats != NULL) {
+        stats->matching_us += stats_clock(stats) - start;
+        count_chunks(stats, &stats->a, a_chunks);
+        count_chunks(stats, &stats->b, b_chunks);
+        stats->rough_hunks += count_hunks(h);
+    }
+    return h;
+}
+
+/*
+ * Chunk and match the sources, returning the rough hunks and leaving the
+ * chunks for the caller to free.
+ */
+static hunk * rough_diff(
+        unsigned const sample_size, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const o,
+        chunks * const a_chunks, chunks * const b_chunks) {
+    void * const sources[] = {a, b};
+    chunks out[2];
+    split_sources(sample_size, df, sources, 2, o, out);
+    *a_chunks = out[0];
+    *b_chunks = out[1];
+    return rough_diff_chunks(*a_chunks, *b_chunks, o);
+}
+
+static hunk * rough_diff_sources(
+        unsigned const sample_size, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const o) {
+    chunks a_chunks, b_chunks;
+    hunk * const h = rough_diff(
+        sample_size, df, a, b, o, &a_chunks, &b_chunks);
+    chunk_free(a_chunks);
+    chunk_free(b_chunks);
+    return h;
+}
+
+hunk * const bdiff_rough_with_options(
+        unsigned const sample_size, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const opts) {
+    bdiff_options const o = bdiff_options_complete(
+        opts, bdiff_options_default());
+    if (o.stats == NULL) {
+        return rough_diff_sources(sample_size, df, a, b, &o);
+    }
+    counted_source ca = count_source(
+        sample_size, NULL, df, a, &o, &o.stats->a);
+    counted_source cb = count_source(
+        sample_size, NULL, df, b, &o, &o.stats->b);
+    return rough_diff_sources(sample_size, counting_fetcher, &ca, &cb, &o);
+}
+
 hunk * const bdiff_rough(
         unsigned const sample_size, data_fetcher const df, void * const a,
         void * const b) {
-    chunks a_chunks = split_data(
-        sample_size, df, a, min_chunk_size, max_chunk_size);
-    chunks b_chunks = split_data(
-        sample_size, df, b, min_chunk_size, max_chunk_size);
-    hunk * const h = diff_chunks(a_chunks, b_chunks);
+    return bdiff_rough_with_options(sample_size, df, a, b, NULL);
+}
+
+/*
+ * Narrow (and fine diff) rough hunks, consuming them.
+ */
+static hunk * precise_hunks_from_rough(
+        hunk * const rough_hunks, unsigned const sample_size,
+        data_seeker const ds, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const o) {
+    hunk * precise_hunks = bdiff_narrow_with_options(
+        rough_hunks, sample_size, ds, df, a, b, o);
+    hunk_free(rough_hunks);
+    if (o->stats != NULL) {
+        o->stats->precise_hunks += count_hunks(precise_hunks);
+    }
+    if (o->fine_max_samples) {
+        precise_hunks = fine_diff_hunks(
+            precise_hunks, sample_size, ds, df, a, b, o);
+    }
+    return precise_hunks;
+}
+
+/*
+ * Match, narrow (and look for moves in) a pair's chunks, consuming them.
+ */
+static hunk * diff_chunked(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, void * const b,
+        bdiff_options const * const o, chunks const a_chunks,
+        chunks const b_chunks) {
+    hunk * const rough_hunks = rough_diff_chunks(a_chunks, b_chunks, o);
+    int64_t const matched = stats_clock(o->stats);
+    hunk * precise_hunks = precise_hunks_from_rough(
+        rough_hunks, sample_size, ds, df, a, b, o);
+    if (o->move_min_chunks) {
+        precise_hunks = detect_moves(
+            precise_hunks, a_chunks, b_chunks, o->move_min_chunks);
+    }
+    if (o->stats != NULL) {
+        o->stats->narrowing_us += stats_clock(o->stats) - matched;
+    }
     chunk_free(a_chunks);
     chunk_free(b_chunks);
-    return h;
+    return precise_hunks;
+}
+
+static hunk * diff_sources(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, void * const b,
+        bdiff_options const * const o) {
+    void * const sources[] = {a, b};
+    chunks out[2];
+    split_sources(sample_size, df, sources, 2, o, out);
+    return diff_chunked(sample_size, ds, df, a, b, o, out[0], out[1]);
 }
 
 /*
  * Find a semantically correct binary diff of two streams.
  */
+hunk * const bdiff_with_options(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, void * const b,
+        bdiff_options const * const opts) {
+    bdiff_options o = bdiff_options_complete(opts, bdiff_options_default());
+    if (o.stats == NULL) {
+        return diff_sources(sample_size, ds, df, a, b, &o);
+    }
+    counted_source ca = count_source(
+        sample_size, ds, df, a, &o, &o.stats->a);
+    counted_source cb = count_source(
+        sample_size, ds, df, b, &o, &o.stats->b);
+    if (o.prefetcher != NULL) {
+        o.prefetcher = counting_prefetcher;
+    }
+    return diff_sources(
+        sample_size, counting_seeker, counting_fetcher, &ca, &cb, &o);
+}
+
 hunk * const bdiff(
         unsigned const sample_size, data_seeker const ds,
         data_fetcher const df, void * const a, void * const b) {
-    hunk * const rough_hunks = bdiff_rough(sample_size, df, a, b);
-    hunk * const precise_hunks = bdiff_narrow(
-        rough_hunks, sample_size, ds, df, a, b);
-    hunk_free(rough_hunks);
-    return precise_hunks;
+    return bdiff_with_options(sample_size, ds, df, a, b, NULL);
+}
+
+/*
+ * Chunk as many pairs together as the wide splitters have lanes for, then
+ * diff each pair of chunks.
+ */
+static void diff_pairs(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, unsigned const n_pairs,
+        void * const * const a, void * const * const b,
+        bdiff_options const * const o, hunk ** const hunks) {
+    unsigned const max_pairs = max_split_lanes / 2;
+    for (unsigned first = 0; first < n_pairs; first += max_pairs) {
+        unsigned const n = MIN(n_pairs - first, max_pairs);
+        void * sources[max_split_lanes];
+        chunks out[max_split_lanes];
+        for (unsigned i = 0; i < n; i++) {
+            sources[2 * i] = a[first + i];
+            sources[2 * i + 1] = b[first + i];
+        }
+        split_sources(sample_size, df, sources, 2 * n, o, out);
+        for (unsigned i = 0; i < n; i++) {
+            hunks[first + i] = diff_chunked(
+                sample_size, ds, df, a[first + i], b[first + i], o,
+                out[2 * i], out[2 * i + 1]);
+        }
+    }
+}
+
+void bdiff_pairs(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, unsigned const n_pairs,
+        void * const * const a, void * const * const b,
+        bdiff_options const * const opts, hunk ** const hunks) {
+    bdiff_options o = bdiff_options_complete(opts, bdiff_options_default());
+    if (o.stats == NULL) {
+        diff_pairs(sample_size, ds, df, n_pairs, a, b, &o, hunks);
+        return;
+    }
+    counted_source * const counted = malloc(
+        2 * n_pairs * sizeof(counted_source));
+    void ** const sources = malloc(2 * n_pairs * sizeof(void *));
+    for (unsigned i = 0; i < n_pairs; i++) {
+        counted[i] = count_source(
+            sample_size, ds, df, a[i], &o, &o.stats->a);
+        counted[n_pairs + i] = count_source(
+            sample_size, ds, df, b[i], &o, &o.stats->b);
+        sources[i] = &counted[i];
+        sources[n_pairs + i] = &counted[n_pairs + i];
+    }
+    if (o.prefetcher != NULL) {
+        o.prefetcher = counting_prefetcher;
+    }
+    diff_pairs(
+        sample_size, counting_seeker, counting_fetcher, n_pairs, sources,
+        sources + n_pairs, &o, hunks);
+    free(counted);
+    free(sources);
+}
+
+/*
+ * Fetch until the buffer is full or the source runs out.
+ */
+static unsigned fetch_all(
+        data_fetcher const df, void * const source, char * const buffer,
+        unsigned const n_items, unsigned const sample_size) {
+    unsigned total = 0;
+    while (total < n_items) {
+        unsigned const n = df(
+            source, buffer + (size_t) total * sample_size, n_items - total);
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+static int identical_sources(
+        unsigned const sample_size, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const o) {
+    unsigned const buf_items = MAX(o->chunk_buf_size / sample_size, 1);
+    size_t const buf_size = (size_t) buf_items * sample_size;
+    char * const a_buf = g_malloc(2 * buf_size);
+    char * const b_buf = a_buf + buf_size;
+    int identical;
+    for (;;) {
+        unsigned const n_a = fetch_all(df, a, a_buf, buf_items, sample_size);
+        unsigned const n_b = fetch_all(df, b, b_buf, buf_items, sample_size);
+        identical = (n_a == n_b) && !memcmp(a_buf, b_buf, n_a * sample_size);
+        if (!identical || n_a < buf_items) {
+            break;
+        }
+    }
+    g_free(a_buf);
+    return identical;
+}
+
+int bdiff_identical(
+        unsigned const sample_size, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const opts) {
+    bdiff_options const o = bdiff_options_complete(
+        opts, bdiff_options_default());
+    if (o.stats == NULL) {
+        return identical_sources(sample_size, df, a, b, &o);
+    }
+    counted_source ca = count_source(
+        sample_size, NULL, df, a, &o, &o.stats->a);
+    counted_source cb = count_source(
+        sample_size, NULL, df, b, &o, &o.stats->b);
+    return identical_sources(sample_size, counting_fetcher, &ca, &cb, &o);
+}
+
+bdiff_summary bdiff_summarise(
+        unsigned const sample_size, data_fetcher const df, void * const a,
+        void * const b, bdiff_options const * const opts) {
+    hunk * const hunks = bdiff_rough_with_options(
+        sample_size, df, a, b, opts);
+    bdiff_summary summary = {.identical = (hunks == NULL)};
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        summary.hunks++;
+        summary.a_changed += h->a.end - h->a.start;
+        summary.b_changed += h->b.end - h->b.start;
+    }
+    hunk_free(hunks);
+    return summary;
+}
+
+static void move_hunk(
+        hunk ** const from, hunk ** const head, hunk ** const tail) {
+    hunk * const h = *from;
+    *from = h->next;
+    h->next = NULL;
+    if (*tail != NULL) {
+        (*tail)->next = h;
+    } else {
+        *head = h;
+    }
+    *tail = h;
+}
+
+static void drop_hunk(hunk ** const from) {
+    hunk * const h = *from;
+    *from = h->next;
+    free(h);
+}
+
+/*
+ * Whether a hunk overlaps the range [start, end) of the base, or inserts at
+ * its start.
+ */
+static int overlaps(
+        hunk const * const h, sample_pos const start, sample_pos const end) {
+    return h != NULL && (h->a.start < end || h->a.start == start);
+}
+
+/*
+ * Merge the hunks of two diffs against the same base (consuming them),
+ * keeping ours wherever they overlap. Positions in ours and theirs are
+ * found from the hunks, whose b views are offset from their a views by
+ * everything inserted before them.
+ */
+static bdiff_merge_result merge_hunks(hunk * ours, hunk * theirs) {
+    bdiff_merge_result m = {};
+    hunk * ours_tail = NULL, * theirs_tail = NULL;
+    bdiff_conflict * conflicts_tail = NULL;
+    while (ours != NULL || theirs != NULL) {
+        int const ours_first = theirs == NULL ||
+            (ours != NULL && ours->a.start <= theirs->a.start);
+        hunk const * const first = ours_first ? ours : theirs;
+        hunk const * const other = ours_first ? theirs : ours;
+        if (!overlaps(other, first->a.start, first->a.end)) {
+            if (ours_first) {
+                move_hunk(&ours, &m.ours, &ours_tail);
+            } else {
+                move_hunk(&theirs, &m.theirs, &theirs_tail);
+            }
+            continue;
+        }
+        bdiff_conflict * const c = malloc(sizeof(bdiff_conflict));
+        sample_pos const start = first->a.start;
+        sample_pos end = first->a.end;
+        c->next = NULL;
+        c->ours.start = ours->b.start - (ours->a.start - start);
+        c->theirs.start = theirs->b.start - (theirs->a.start - start);
+        // Both overlap the conflict, so each is replaced at least once
+        hunk last_ours = *ours, last_theirs = *theirs;
+        for (;;) {
+            if (overlaps(ours, start, end)) {
+                end = MAX(end, ours->a.end);
+                last_ours = *ours;
+                move_hunk(&ours, &m.ours, &ours_tail);
+            } else if (overlaps(theirs, start, end)) {
+                end = MAX(end, theirs->a.end);
+                last_theirs = *theirs;
+                drop_hunk(&theirs);
+            } else {
+                break;
+            }
+        }
+        c->base = (view) {.start = start, .end = end};
+        c->ours.end = last_ours.b.end + (end - last_ours.a.end);
+        c->theirs.end = last_theirs.b.end + (end - last_theirs.a.end);
+        if (conflicts_tail != NULL) {
+            conflicts_tail->next = c;
+        } else {
+            m.conflicts = c;
+        }
+        conflicts_tail = c;
+    }
+    return m;
+}
+
+/*
+ * Whether a and b hold the same data in the given (equally long) ranges.
+ */
+static int same_data(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, view const a_range,
+        void * const b, view const b_range, bdiff_options const * const o) {
+    sample_pos left = a_range.end - a_range.start;
+    if (left != b_range.end - b_range.start) {
+        return 0;
+    }
+    unsigned const buf_items = MAX(o->chunk_buf_size / sample_size, 1);
+    size_t const buf_size = (size_t) buf_items * sample_size;
+    char * const a_buf = g_malloc(2 * buf_size);
+    char * const b_buf = a_buf + buf_size;
+    ds(a, a_range.start);
+    ds(b, b_range.start);
+    int same = 1;
+    while (same && left) {
+        unsigned const n = MIN(left, buf_items);
+        same = fetch_all(df, a, a_buf, n, sample_size) == n &&
+            fetch_all(df, b, b_buf, n, sample_size) == n &&
+            !memcmp(a_buf, b_buf, (size_t) n * sample_size);
+        left -= n;
+    }
+    g_free(a_buf);
+    return same;
+}
+
+static bdiff_merge_result merge_sources(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const base, void * const ours,
+        void * const theirs, bdiff_options const * const o) {
+    bdiff_stats * const stats = o->stats;
+    void * const sources[] = {base, ours, theirs};
+    chunks out[3];
+    split_sources(sample_size, df, sources, 3, o, out);
+    chunks const base_chunks = out[0];
+    chunks const ours_chunks = out[1];
+    chunks const theirs_chunks = out[2];
+    int64_t const chunked = stats_clock(stats);
+    hunk * const ours_rough = rough_hunks_from_chunks(
+        base_chunks, ours_chunks, o);
+    hunk * const theirs_rough = rough_hunks_from_chunks(
+        base_chunks, theirs_chunks, o);
+    int64_t const matched = stats_clock(stats);
+    if (stats != NULL) {
+        stats->matching_us += matched - chunked;
+        count_chunks(stats, &stats->a, base_chunks);
+        count_chunks(stats, &stats->b, ours_chunks);
+        count_chunks(stats, &stats->b, theirs_chunks);
+        stats->rough_hunks += count_hunks(ours_rough);
+        stats->rough_hunks += count_hunks(theirs_rough);
+    }
+    chunk_free(base_chunks);
+    chunk_free(ours_chunks);
+    chunk_free(theirs_chunks);
+    hunk * const ours_hunks = precise_hunks_from_rough(
+        ours_rough, sample_size, ds, df, base, ours, o);
+    hunk * const theirs_hunks = precise_hunks_from_rough(
+        theirs_rough, sample_size, ds, df, base, theirs, o);
+    bdiff_merge_result m = merge_hunks(ours_hunks, theirs_hunks);
+    // Both sides making the same change isn't a conflict
+    for (bdiff_conflict ** c = &m.conflicts; *c != NULL;) {
+        if (same_data(
+                sample_size, ds, df, ours, (*c)->ours, theirs, (*c)->theirs,
+                o)) {
+            bdiff_conflict * const same = *c;
+            *c = same->next;
+            free(same);
+        } else {
+            c = &(*c)->next;
+        }
+    }
+    if (stats != NULL) {
+        stats->narrowing_us += stats_clock(stats) - matched;
+    }
+    return m;
+}
+
+bdiff_merge_result bdiff_merge(
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const base, void * const ours,
+        void * const theirs, bdiff_options const * const opts) {
+    bdiff_options o = bdiff_options_complete(opts, bdiff_options_default());
+    if (o.stats == NULL) {
+        return merge_sources(sample_size, ds, df, base, ours, theirs, &o);
+    }
+    counted_source cbase = count_source(
+        sample_size, ds, df, base, &o, &o.stats->a);
+    counted_source cours = count_source(
+        sample_size, ds, df, ours, &o, &o.stats->b);
+    counted_source ctheirs = count_source(
+        sample_size, ds, df, theirs, &o, &o.stats->b);
+    if (o.prefetcher != NULL) {
+        o.prefetcher = counting_prefetcher;
+    }
+    return merge_sources(
+        sample_size, counting_seeker, counting_fetcher, &cbase, &cours,
+        &ctheirs, &o);
+}
+
+void bdiff_merge_free(bdiff_merge_result * const m) {
+    hunk_free(m->ours);
+    hunk_free(m->theirs);
+    while (m->conflicts != NULL) {
+        bdiff_conflict * const c = m->conflicts;
+        m->conflicts = c->next;
+        free(c);
+    }
+    *m = (bdiff_merge_result) {};
 }
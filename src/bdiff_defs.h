@@ -1,5 +1,42 @@
 #pragma once
+#include "../include/bdiff.h"
 
-#define buf_size 8192
-#define min_chunk_size 10
-#define max_chunk_size 10000
+#define default_min_chunk_size 10
+#define default_max_chunk_size 10000
+#define default_mask_bits 8
+#define default_window_length 16
+#define default_min_run_length 256
+#define default_chunk_buf_size 16384
+#define default_narrow_buf_size 8192
+#define default_levels 1
+#define default_level_shift 3
+#define default_refine_min_chunks 4
+#define max_chunk_levels BDIFF_MAX_LEVELS
+#define max_split_lanes 8
+#define prefetch_batch_hunks 64
+#define max_fine_edits 1024
+
+/** \brief Fill in any zero fields of the given options from the fallback.
+ *
+ * Out of range chunking parameters are clamped (see bdiff_options.levels).
+ * \param[in] opts User supplied options (may be NULL).
+ * \param[in] fallback Values to use for fields left as zero.
+ * \return A complete set of options.
+ */
+bdiff_options bdiff_options_complete(
+    bdiff_options const * const opts, bdiff_options const fallback);
+
+/** \brief Re-diff small hunks sample by sample (see fine_max_samples).
+ *
+ * A bounded Myers diff of each hunk no longer than opts->fine_max_samples
+ * on either side finds the samples it left unchanged, giving up after
+ * max_fine_edits edits (or half the hunk's samples). The hunk is replaced
+ * by the hunks between those samples if their data and views take fewer
+ * bytes than its own.
+ * \param[in] hunks Narrowed hunks taking a to b (consumed).
+ * \return The hunks, with those worth splitting split.
+ */
+hunk * fine_diff_hunks(
+    hunk * hunks, unsigned const sample_size, data_seeker const ds,
+    data_fetcher const df, void * const a, void * const b,
+    bdiff_options const * const opts);
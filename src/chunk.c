@@ -1,10 +1,25 @@
 #include "chunk.h"
 #include "../include/rabin.h"
+#include "bdiff_defs.h"
+#include "read_ahead.h"
+#include "probes.h"
+#include "scratch.h"
+#include <glib.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define have_avx2_splitters 1
+#include <immintrin.h>
+#else
+#define have_avx2_splitters 0
+#endif
 
 chunk * chunk_new(
-        chunk * const prev, unsigned const start, unsigned const end,
+        chunk * const prev, sample_pos const start, sample_pos const end,
         hash const h) {
     chunk *new_chunk = malloc(sizeof(chunk));
     *new_chunk = (chunk) {.start = start, .end = end, .hash = h};
@@ -14,19 +29,940 @@ chunk * chunk_new(
     return new_chunk;
 }
 
-static const unsigned buf_size = 16384;
-
 // 2**32 (truncated) + 2**7 + 2**3 + 2**2 + 2**0
 static hash const irreducible_polynomial = 141;
 
-static inline hash hash_sample(
-        hash_data * const hd, window_data * const wd,
-        unsigned const sample_size, char const * const buf) {
-    for (unsigned short b = 0; b < sample_size; b++) {
-        hash_data_update(hd, buf[b]);
-        window_data_update(wd, buf[b]);
+/*
+ * The hash tables depend only on the polynomial, so are built once and
+ * shared by every split (on any thread).
+ */
+static hash_data const * shared_hash_data() {
+    static hash_data hd;
+    static gsize initialised = 0;
+    if (g_once_init_enter(&initialised)) {
+        hd = hash_data_init(irreducible_polynomial);
+        g_once_init_leave(&initialised, 1);
+    }
+    return &hd;
+}
+
+/*
+ * Chunking state for one level of a (possibly) hierarchical split.
+ * Level 0 is the coarsest, each level below splits its chunks further.
+ */
+typedef struct {
+    hash_data hd;
+    hash mask;
+    unsigned min_length;
+    unsigned max_length;
+    sample_pos start_pos;
+    chunk * head;
+    chunk * tail;
+    // First chunk of the level below since our last boundary:
+    chunk * first_sub;
+} chunk_level;
+
+static inline int is_boundary(
+        chunk_level const * const level, hash const h, sample_pos const pos) {
+    sample_pos const length = pos - level->start_pos;
+    return
+        (length >= level->min_length && !(h & level->mask)) ||
+        length == level->max_length + 1;
+}
+
+static void end_chunk(
+        chunk_level * const levels, unsigned const l, unsigned const n_levels,
+        sample_pos const pos) {
+    chunk_level * const level = &levels[l];
+    level->tail = chunk_new(level->tail, level->start_pos, pos, level->hd.h);
+    if (level->head == NULL) {
+        level->head = level->tail;
+    }
+    if (l + 1 < n_levels) {
+        level->tail->sub = level->first_sub;
+        level->first_sub = NULL;
+    }
+    if (l > 0 && levels[l - 1].first_sub == NULL) {
+        levels[l - 1].first_sub = level->tail;
+    }
+    level->start_pos = pos;
+    hash_data_reset(&level->hd);
+}
+
+static inline unsigned max_u(unsigned const a, unsigned const b) {
+    return (a > b) ? a : b;
+}
+
+/*
+ * State of a split in progress, carried from one buffer to the next.
+ */
+typedef struct {
+    chunk_level levels[max_chunk_levels];
+    unsigned n_levels;
+    window_data wd;
+    unsigned sample_size;
+    sample_pos pos;
+    // Input, with data pointing at the next of the available samples:
+    data_fetcher df;
+    void * source;
+    read_ahead * ra;
+    char * buf;
+    unsigned buf_items;
+    char const * data;
+    unsigned available;
+    int at_end;
+    // Runs of identical samples (see split_run()):
+    unsigned min_run_length;
+    int detect_runs;
+    int run_candidate;
+    char * run_sample;
+    char * run_buf;
+    unsigned run_buf_items;
+    // Where the buffers come from, and which of the pair being split this is:
+    bdiff_scratch * scratch;
+    unsigned lane;
+} split_state;
+
+/*
+ * The hashing state of a split held in locals whilst a buffer is hashed.
+ */
+typedef struct {
+    hash window;
+    unsigned buf_pos;
+    unsigned char * undo_buf;
+    unsigned char const * bytes;
+    hash content[max_chunk_levels];
+} split_lane;
+
+static inline __attribute__((always_inline)) void lane_load(
+        split_lane * const lane, split_state const * const s,
+        unsigned const n_levels) {
+    lane->window = s->wd.h;
+    lane->buf_pos = s->wd.buf_pos;
+    lane->undo_buf = s->wd.undo_buf;
+    lane->bytes = (unsigned char const *) s->data;
+    for (unsigned l = 0; l < n_levels; l++) {
+        lane->content[l] = s->levels[l].hd.h;
+    }
+}
+
+static inline __attribute__((always_inline)) void lane_store(
+        split_lane const * const lane, split_state * const s,
+        unsigned const n_levels) {
+    s->wd.h = lane->window;
+    s->wd.buf_pos = lane->buf_pos;
+    for (unsigned l = 0; l < n_levels; l++) {
+        s->levels[l].hd.h = lane->content[l];
+    }
+}
+
+static inline __attribute__((always_inline)) void lane_hash_byte(
+        split_lane * const lane, window_data const * const wd,
+        unsigned const n_levels) {
+    unsigned char const next = *lane->bytes++;
+    for (unsigned l = 0; l < n_levels; l++) {
+        lane->content[l] = rabin_shift(wd->table, lane->content[l], next);
+    }
+    lane->window ^= wd->undo_table[lane->undo_buf[lane->buf_pos]];
+    lane->undo_buf[lane->buf_pos] = next;
+    if (++lane->buf_pos == wd->window_size) {
+        lane->buf_pos = 0;
+    }
+    lane->window = rabin_shift(wd->table, lane->window, next);
+}
+
+/*
+ * Whether the sample just hashed is a copy of the one before it (which the
+ * window still holds, however the samples were fetched).
+ */
+static inline __attribute__((always_inline)) int lane_repeats(
+        split_lane const * const lane, window_data const * const wd,
+        unsigned const sample_size) {
+    unsigned const window_size = wd->window_size;
+    unsigned const prev =
+        (lane->buf_pos + 2 * window_size - 2 * sample_size) % window_size;
+    return !memcmp(
+        lane->bytes - sample_size, lane->undo_buf + prev, sample_size);
+}
+
+/*
+ * Whether the window holds nothing but copies of one sample.
+ */
+static int window_is_run(
+        unsigned char const * const undo_buf, unsigned const window_size,
+        unsigned const sample_size) {
+    for (unsigned i = sample_size; i < window_size; i++) {
+        if (undo_buf[i] != undo_buf[i - sample_size]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * End chunks at the sample at pos, if it is a boundary. Returns whether the
+ * window was reset when it held nothing but copies of one sample (as it is
+ * at every minimum length chunk of a run whose window hash is a boundary).
+ */
+static inline __attribute__((always_inline)) int lane_split(
+        split_lane * const lane, split_state * const s, sample_pos const pos,
+        unsigned const n_levels) {
+    chunk_level * const levels = s->levels;
+    unsigned split_level = 0;
+    while (
+            split_level < n_levels &&
+            !is_boundary(&levels[split_level], lane->window, pos)) {
+        split_level++;
+    }
+    if (split_level == n_levels) {
+        return 0;
+    }
+    unsigned char const * const bytes = lane->bytes;
+    lane_store(lane, s, n_levels);
+    for (unsigned l = n_levels; l-- > split_level;) {
+        end_chunk(levels, l, n_levels, pos);
+    }
+    int run = 0;
+    if (split_level == 0) {
+        run = s->detect_runs && window_is_run(
+            s->wd.undo_buf, s->wd.window_size, s->sample_size);
+        window_data_reset(&s->wd);
+    }
+    lane_load(lane, s, n_levels);
+    lane->bytes = bytes;
+    return run;
+}
+
+/*
+ * Chunk up to n_samples of each of n_lanes (one or two) independent splits
+ * in lockstep. The hashing of each lane is a serial dependency chain, so
+ * interleaving two lanes lets their table lookups overlap. Two lanes are
+ * all a single pair of sources has; more (the channels of a file, say) are
+ * hashed by the wide splitters (see split_wide_lanes()).
+ *
+ * A window hash left unchanged by a sample that repeats the one before it
+ * means the window may hold nothing but copies of that sample, so a run may
+ * be starting (as it may when lane_split() says so). We then stop early,
+ * flagging the lane(s) for split_run(), and return the number of samples
+ * done. The hash alone isn't enough: it can be unchanged (by a collision)
+ * when the samples differ, and stopping on every sample of such data would
+ * stall both lanes in split_run() for nothing.
+ *
+ * This is always inlined into the splitters below, so that a constant
+ * sample_size fully unrolls the hashing of each sample, and a constant
+ * single level reduces the boundary test to one comparison. The hashes live
+ * in locals (so in registers) between boundaries, the structures only being
+ * updated when a chunk ends.
+ */
+static inline __attribute__((always_inline)) unsigned split_lanes(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned const sample_size,
+        unsigned const n_levels) {
+    // Every lane shares a polynomial and window length, so tables:
+    window_data const * const wd = &s[0]->wd;
+    int const detect_runs = s[0]->detect_runs;
+    split_lane first, second;
+    lane_load(&first, s[0], n_levels);
+    if (n_lanes > 1) {
+        lane_load(&second, s[1], n_levels);
+    }
+    unsigned sample = 0;
+    while (sample < n_samples) {
+        hash const first_window = first.window;
+        hash const second_window = (n_lanes > 1) ? second.window : 0;
+        for (unsigned b = 0; b < sample_size; b++) {
+            lane_hash_byte(&first, wd, n_levels);
+            if (n_lanes > 1) {
+                lane_hash_byte(&second, wd, n_levels);
+            }
+        }
+        int first_run =
+            first.window == first_window &&
+            lane_repeats(&first, wd, sample_size);
+        int second_run =
+            n_lanes > 1 && second.window == second_window &&
+            lane_repeats(&second, wd, sample_size);
+        first_run |= lane_split(&first, s[0], s[0]->pos + sample, n_levels);
+        if (n_lanes > 1) {
+            second_run |=
+                lane_split(&second, s[1], s[1]->pos + sample, n_levels);
+        }
+        sample++;
+        if (detect_runs && (first_run || second_run)) {
+            s[0]->run_candidate = first_run;
+            if (n_lanes > 1) {
+                s[1]->run_candidate = second_run;
+            }
+            break;
+        }
+    }
+    for (unsigned i = 0; i < n_lanes; i++) {
+        lane_store((i == 0) ? &first : &second, s[i], n_levels);
+        s[i]->pos += sample;
+        s[i]->data += sample * sample_size;
+        s[i]->available -= sample;
+    }
+    return sample;
+}
+
+/*
+ * Chunk up to n_samples of each of the given splits, returning how many
+ * were done.
+ */
+typedef unsigned (*lanes_splitter)(
+    split_state * const * const s, unsigned const n_samples);
+
+#define Define_generic_splitters(lanes) \
+    static unsigned split_generic_single_##lanes( \
+            split_state * const * const s, unsigned const n_samples) { \
+        return split_lanes(s, lanes, n_samples, s[0]->sample_size, 1); \
+    } \
+    static unsigned split_generic_multi_##lanes( \
+            split_state * const * const s, unsigned const n_samples) { \
+        return split_lanes( \
+            s, lanes, n_samples, s[0]->sample_size, s[0]->n_levels); \
+    }
+Define_generic_splitters(1)
+Define_generic_splitters(2)
+#undef Define_generic_splitters
+
+// Frame sizes (sample size times channels) given their own splitters:
+#define Specialised_frame_sizes(X) \
+    X(2) X(4) X(6) X(8) X(12) X(16) X(24) X(32) X(48) X(64)
+
+#define Define_splitters(size, lanes) \
+    static unsigned split_##size##_single_##lanes( \
+            split_state * const * const s, unsigned const n_samples) { \
+        return split_lanes(s, lanes, n_samples, size, 1); \
+    } \
+    static unsigned split_##size##_multi_##lanes( \
+            split_state * const * const s, unsigned const n_samples) { \
+        return split_lanes(s, lanes, n_samples, size, s[0]->n_levels); \
     }
-    return wd->h;
+#define Define_splitters_1(size) Define_splitters(size, 1)
+#define Define_splitters_2(size) Define_splitters(size, 2)
+Specialised_frame_sizes(Define_splitters_1)
+Specialised_frame_sizes(Define_splitters_2)
+#undef Define_splitters_2
+#undef Define_splitters_1
+#undef Define_splitters
+
+#define Choose_splitter(lanes) \
+    static lanes_splitter choose_splitter_##lanes( \
+            unsigned const sample_size, unsigned const n_levels) { \
+        switch (sample_size) { \
+            Specialised_frame_sizes(Choose_case_##lanes) \
+        } \
+        return (n_levels == 1) ? \
+            split_generic_single_##lanes : split_generic_multi_##lanes; \
+    }
+#define Choose_case(size, lanes) \
+    case size: \
+        return (n_levels == 1) ? \
+            split_##size##_single_##lanes : split_##size##_multi_##lanes;
+#define Choose_case_1(size) Choose_case(size, 1)
+#define Choose_case_2(size) Choose_case(size, 2)
+Choose_splitter(1)
+Choose_splitter(2)
+#undef Choose_case_2
+#undef Choose_case_1
+#undef Choose_case
+#undef Choose_splitter
+
+/*
+ * The wide splitters hash three to max_split_lanes splits in lockstep.
+ *
+ * Each lane's samples are first copied in after the window it starts with,
+ * so the byte leaving a lane's window is always window_size bytes before the
+ * byte entering it, and no lane needs a ring buffer of its own. A lane
+ * restarting its window overwrites the bytes that are yet to leave it as
+ * window_data_reset() would clear them, and the window is copied back to the
+ * window_data when we're done (see wide_store()).
+ *
+ * Boundaries, chunks reaching their maximum length and unchanged windows are
+ * rare, so are tested for all lanes at once, and only then dealt with lane
+ * by lane (see wide_lane_split()).
+ */
+typedef unsigned (*wide_splitter)(
+    split_state * const * const s, unsigned const n_lanes,
+    unsigned const n_samples, unsigned char * const * const bytes);
+
+// Tiles of 8 bytes may read up to 7 bytes past the samples of a lane:
+#define wide_padding 8
+#define min_avx2_lanes 6
+
+/*
+ * The number of samples from the one at pos to the first that ends a chunk
+ * for reaching its level's maximum length (so zero if that one does).
+ */
+static unsigned samples_to_max_length(
+        split_state const * const s, sample_pos const pos) {
+    sample_pos least = UINT_MAX;
+    for (unsigned l = 0; l < s->n_levels; l++) {
+        chunk_level const * const level = &s->levels[l];
+        sample_pos const end = level->start_pos + level->max_length + 1;
+        if (end - pos < least) {
+            least = end - pos;
+        }
+    }
+    return least;
+}
+
+static void wide_load(
+        split_state const * const s, unsigned char * const bytes,
+        unsigned const n_samples, unsigned const n_levels,
+        hash * const window, hash * const content,
+        unsigned * const countdown) {
+    window_data const * const wd = &s->wd;
+    unsigned const oldest = wd->window_size - wd->buf_pos;
+    memcpy(bytes, wd->undo_buf + wd->buf_pos, oldest);
+    memcpy(bytes + oldest, wd->undo_buf, wd->buf_pos);
+    memcpy(
+        bytes + wd->window_size, s->data,
+        (size_t) n_samples * s->sample_size);
+    *window = wd->h;
+    for (unsigned l = 0; l < n_levels; l++) {
+        content[l] = s->levels[l].hd.h;
+    }
+    *countdown = samples_to_max_length(s, s->pos);
+}
+
+static void wide_store(
+        split_state * const s, unsigned char const * const bytes,
+        unsigned const done, unsigned const n_levels, hash const window,
+        hash const * const content) {
+    size_t const done_bytes = (size_t) done * s->sample_size;
+    s->wd.h = window;
+    s->wd.buf_pos = 0;
+    memcpy(s->wd.undo_buf, bytes + done_bytes, s->wd.window_size);
+    for (unsigned l = 0; l < n_levels; l++) {
+        s->levels[l].hd.h = content[l];
+    }
+    s->pos += done;
+    s->data += done_bytes;
+    s->available -= done;
+}
+
+/*
+ * Having hashed the given sample of a lane, end chunks there if it is a
+ * boundary (as lane_split() would), and reset the countdown to the next
+ * chunk reaching its maximum length. Returns whether a run may be starting
+ * (as split_lanes() would flag it).
+ */
+static int wide_lane_split(
+        split_state * const s, unsigned char * const bytes,
+        unsigned const sample, hash * const window, hash const prev_window,
+        hash * const content, unsigned * const countdown) {
+    unsigned const sample_size = s->sample_size;
+    unsigned const window_size = s->wd.window_size;
+    unsigned const n_levels = s->n_levels;
+    chunk_level * const levels = s->levels;
+    unsigned char * const hashed =
+        bytes + window_size + (size_t) sample * sample_size;
+    int run =
+        s->detect_runs && *window == prev_window &&
+        !memcmp(hashed, hashed - sample_size, sample_size);
+    sample_pos const pos = s->pos + sample;
+    unsigned split_level = 0;
+    while (
+            split_level < n_levels &&
+            !is_boundary(&levels[split_level], *window, pos)) {
+        split_level++;
+    }
+    if (split_level < n_levels) {
+        for (unsigned l = 0; l < n_levels; l++) {
+            levels[l].hd.h = content[l];
+        }
+        for (unsigned l = n_levels; l-- > split_level;) {
+            end_chunk(levels, l, n_levels, pos);
+        }
+        if (split_level == 0) {
+            // The bytes in the window, which are the next to leave it
+            unsigned char * const in_window =
+                hashed + sample_size - window_size;
+            run |= s->detect_runs && window_is_run(
+                in_window, window_size, sample_size);
+            window_data_reset(&s->wd);
+            memcpy(in_window, s->wd.undo_buf, window_size);
+            *window = s->wd.h;
+        }
+        for (unsigned l = 0; l < n_levels; l++) {
+            content[l] = levels[l].hd.h;
+        }
+    }
+    *countdown = samples_to_max_length(s, pos + 1);
+    return run;
+}
+
+/*
+ * Chunk up to n_samples of each of n_lanes splits in lockstep, with the
+ * lanes' samples in bytes (laid out by wide_load()), stopping early if a run
+ * may be starting in any of them. Returns the number of samples done.
+ *
+ * This is the portable wide splitter, each lane's hashes in locals as in
+ * split_lanes(), but with more lanes' table lookups in flight at once.
+ */
+static inline __attribute__((always_inline)) unsigned split_wide_lanes(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned char * const * const bytes,
+        unsigned const n_levels) {
+    window_data const * const wd = &s[0]->wd;
+    unsigned const window_size = wd->window_size;
+    unsigned const sample_size = s[0]->sample_size;
+    hash const mask = s[0]->levels[n_levels - 1].mask;
+    int const detect_runs = s[0]->detect_runs;
+    hash window[max_split_lanes];
+    hash content[max_split_lanes][max_chunk_levels];
+    unsigned countdown[max_split_lanes];
+    for (unsigned j = 0; j < n_lanes; j++) {
+        wide_load(
+            s[j], bytes[j], n_samples, n_levels, &window[j], content[j],
+            &countdown[j]);
+    }
+    unsigned sample = 0;
+    int run = 0;
+    while (!run && sample < n_samples) {
+        hash prev[max_split_lanes];
+        memcpy(prev, window, sizeof(prev));
+        size_t const first = (size_t) sample * sample_size;
+        for (size_t k = first; k < first + sample_size; k++) {
+            for (unsigned j = 0; j < n_lanes; j++) {
+                unsigned char const next = bytes[j][window_size + k];
+                for (unsigned l = 0; l < n_levels; l++) {
+                    content[j][l] = rabin_shift(
+                        wd->table, content[j][l], next);
+                }
+                window[j] = rabin_shift(
+                    wd->table, window[j] ^ wd->undo_table[bytes[j][k]], next);
+            }
+        }
+        for (unsigned j = 0; j < n_lanes; j++) {
+            if (
+                    !(window[j] & mask) || !countdown[j] ||
+                    (detect_runs && window[j] == prev[j])) {
+                int const lane_run = wide_lane_split(
+                    s[j], bytes[j], sample, &window[j], prev[j], content[j],
+                    &countdown[j]);
+                s[j]->run_candidate |= lane_run;
+                run |= lane_run;
+            } else {
+                countdown[j]--;
+            }
+        }
+        sample++;
+    }
+    for (unsigned j = 0; j < n_lanes; j++) {
+        wide_store(s[j], bytes[j], sample, n_levels, window[j], content[j]);
+    }
+    return sample;
+}
+
+static unsigned split_wide_single(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned char * const * const bytes) {
+    return split_wide_lanes(s, n_lanes, n_samples, bytes, 1);
+}
+
+static unsigned split_wide_multi(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned char * const * const bytes) {
+    return split_wide_lanes(s, n_lanes, n_samples, bytes, s[0]->n_levels);
+}
+
+#if have_avx2_splitters
+#define Avx2 __attribute__((target("avx2")))
+
+_Static_assert(sizeof(hash) == 4, "The AVX2 splitters hash 32 bit lanes");
+
+static inline __attribute__((always_inline)) Avx2 __m256i avx2_shift(
+        int const * const table, __m256i const h, __m256i const next) {
+    __m256i const top = _mm256_srli_epi32(h, sizeof(hash) * 8 - 8);
+    return _mm256_xor_si256(
+        _mm256_or_si256(_mm256_slli_epi32(h, 8), next),
+        _mm256_i32gather_epi32(table, top, sizeof(hash)));
+}
+
+/*
+ * Transpose 8 bytes from each of 8 lanes, from byte k on, into tile (8
+ * bytes from each lane for each byte).
+ */
+static inline __attribute__((always_inline)) Avx2 void avx2_tile(
+        unsigned char const * const * const lanes, size_t const k,
+        unsigned char * const tile) {
+    __m128i r[8];
+    for (unsigned j = 0; j < 8; j++) {
+        r[j] = _mm_loadl_epi64((__m128i const *) (lanes[j] + k));
+    }
+    __m128i const a0 = _mm_unpacklo_epi8(r[0], r[1]);
+    __m128i const a1 = _mm_unpacklo_epi8(r[2], r[3]);
+    __m128i const a2 = _mm_unpacklo_epi8(r[4], r[5]);
+    __m128i const a3 = _mm_unpacklo_epi8(r[6], r[7]);
+    __m128i const b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i const b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i const b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i const b3 = _mm_unpackhi_epi16(a2, a3);
+    _mm_storeu_si128((__m128i *) tile, _mm_unpacklo_epi32(b0, b2));
+    _mm_storeu_si128((__m128i *) (tile + 16), _mm_unpackhi_epi32(b0, b2));
+    _mm_storeu_si128((__m128i *) (tile + 32), _mm_unpacklo_epi32(b1, b3));
+    _mm_storeu_si128((__m128i *) (tile + 48), _mm_unpackhi_epi32(b1, b3));
+}
+
+/*
+ * As split_wide_lanes(), but with a lane in each 32 bit element of AVX2
+ * vectors, the table lookups of all the lanes being a single gather. The
+ * bytes entering and leaving the windows are transposed 8 at a time into
+ * tiles, lanes beyond n_lanes repeating the first (and being ignored).
+ */
+static inline __attribute__((always_inline)) Avx2 unsigned
+split_wide_avx2_lanes(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned char * const * const bytes,
+        unsigned const n_levels) {
+    window_data const * const wd = &s[0]->wd;
+    unsigned const window_size = wd->window_size;
+    unsigned const sample_size = s[0]->sample_size;
+    int const * const table = (int const *) wd->table;
+    int const * const undo_table = (int const *) wd->undo_table;
+    int const detect_runs = s[0]->detect_runs;
+    unsigned const lanes_mask = (1u << n_lanes) - 1;
+    unsigned char const * entering[8], * leaving[8];
+    hash window[8], prev_window[8], content[max_chunk_levels][8];
+    unsigned countdown[8];
+    for (unsigned j = 0; j < 8; j++) {
+        unsigned const lane = (j < n_lanes) ? j : 0;
+        hash lane_content[max_chunk_levels];
+        if (j == lane) {
+            wide_load(
+                s[j], bytes[j], n_samples, n_levels, &window[j],
+                lane_content, &countdown[j]);
+        } else {
+            window[j] = window[0];
+            countdown[j] = countdown[0];
+            for (unsigned l = 0; l < n_levels; l++) {
+                lane_content[l] = content[l][0];
+            }
+        }
+        for (unsigned l = 0; l < n_levels; l++) {
+            content[l][j] = lane_content[l];
+        }
+        leaving[j] = bytes[lane];
+        entering[j] = bytes[lane] + window_size;
+    }
+    __m256i const mask = _mm256_set1_epi32(
+        s[0]->levels[n_levels - 1].mask);
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const one = _mm256_set1_epi32(1);
+    __m256i w = _mm256_loadu_si256((__m256i const *) window);
+    __m256i left = _mm256_loadu_si256((__m256i const *) countdown);
+    __m256i c[max_chunk_levels];
+    for (unsigned l = 0; l < n_levels; l++) {
+        c[l] = _mm256_loadu_si256((__m256i const *) content[l]);
+    }
+    unsigned char entering_tile[64], leaving_tile[64];
+    size_t tile_start = 0;
+    unsigned tile_left = 0;
+    size_t k = 0;
+    unsigned sample = 0;
+    int run = 0;
+    while (!run && sample < n_samples) {
+        __m256i const prev = w;
+        for (unsigned b = 0; b < sample_size; b++, k++) {
+            if (!tile_left) {
+                avx2_tile(entering, k, entering_tile);
+                avx2_tile(leaving, k, leaving_tile);
+                tile_start = k;
+                tile_left = 8;
+            }
+            tile_left--;
+            size_t const t = 8 * (k - tile_start);
+            __m256i const next = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((__m128i const *) (entering_tile + t)));
+            __m256i const old = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((__m128i const *) (leaving_tile + t)));
+            for (unsigned l = 0; l < n_levels; l++) {
+                c[l] = avx2_shift(table, c[l], next);
+            }
+            w = avx2_shift(
+                table,
+                _mm256_xor_si256(
+                    w, _mm256_i32gather_epi32(undo_table, old, sizeof(hash))),
+                next);
+        }
+        __m256i candidates = _mm256_or_si256(
+            _mm256_cmpeq_epi32(_mm256_and_si256(w, mask), zero),
+            _mm256_cmpeq_epi32(left, zero));
+        if (detect_runs) {
+            candidates = _mm256_or_si256(
+                candidates, _mm256_cmpeq_epi32(w, prev));
+        }
+        left = _mm256_sub_epi32(left, one);
+        unsigned hits = lanes_mask & (unsigned) _mm256_movemask_ps(
+            _mm256_castsi256_ps(candidates));
+        if (hits) {
+            _mm256_storeu_si256((__m256i *) window, w);
+            _mm256_storeu_si256((__m256i *) prev_window, prev);
+            _mm256_storeu_si256((__m256i *) countdown, left);
+            for (unsigned l = 0; l < n_levels; l++) {
+                _mm256_storeu_si256((__m256i *) content[l], c[l]);
+            }
+            for (; hits; hits &= hits - 1) {
+                unsigned const j = __builtin_ctz(hits);
+                hash lane_content[max_chunk_levels];
+                for (unsigned l = 0; l < n_levels; l++) {
+                    lane_content[l] = content[l][j];
+                }
+                int const lane_run = wide_lane_split(
+                    s[j], bytes[j], sample, &window[j], prev_window[j],
+                    lane_content, &countdown[j]);
+                for (unsigned l = 0; l < n_levels; l++) {
+                    content[l][j] = lane_content[l];
+                }
+                s[j]->run_candidate |= lane_run;
+                run |= lane_run;
+            }
+            w = _mm256_loadu_si256((__m256i const *) window);
+            left = _mm256_loadu_si256((__m256i const *) countdown);
+            for (unsigned l = 0; l < n_levels; l++) {
+                c[l] = _mm256_loadu_si256((__m256i const *) content[l]);
+            }
+            // A restarted window rewrites bytes that may be in the tiles
+            tile_left = 0;
+        }
+        sample++;
+    }
+    _mm256_storeu_si256((__m256i *) window, w);
+    for (unsigned l = 0; l < n_levels; l++) {
+        _mm256_storeu_si256((__m256i *) content[l], c[l]);
+    }
+    for (unsigned j = 0; j < n_lanes; j++) {
+        hash lane_content[max_chunk_levels];
+        for (unsigned l = 0; l < n_levels; l++) {
+            lane_content[l] = content[l][j];
+        }
+        wide_store(
+            s[j], bytes[j], sample, n_levels, window[j], lane_content);
+    }
+    return sample;
+}
+
+static Avx2 unsigned split_wide_avx2_single(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned char * const * const bytes) {
+    return split_wide_avx2_lanes(s, n_lanes, n_samples, bytes, 1);
+}
+
+static Avx2 unsigned split_wide_avx2_multi(
+        split_state * const * const s, unsigned const n_lanes,
+        unsigned const n_samples, unsigned char * const * const bytes) {
+    return split_wide_avx2_lanes(
+        s, n_lanes, n_samples, bytes, s[0]->n_levels);
+}
+
+#undef Avx2
+#endif
+
+/*
+ * The AVX2 splitters where the CPU has AVX2 (unless generic ones are asked
+ * for) and there are lanes enough to fill most of a vector, the portable
+ * ones otherwise. A gather costs much the same however few of its lanes are
+ * wanted, so half empty vectors are slower than the portable splitters.
+ */
+static wide_splitter choose_wide_splitter(
+        unsigned const n_lanes, unsigned const n_levels, int const generic) {
+#if have_avx2_splitters
+    if (
+            !generic && n_lanes >= min_avx2_lanes &&
+            __builtin_cpu_supports("avx2")) {
+        return (n_levels == 1) ?
+            split_wide_avx2_single : split_wide_avx2_multi;
+    }
+#endif
+    return (n_levels == 1) ? split_wide_single : split_wide_multi;
+}
+
+static void split_init(
+        split_state * const s, unsigned const lane, unsigned const sample_size,
+        data_fetcher const df, void * const source,
+        bdiff_options const * const opts, hash_data const * const hd) {
+    unsigned const n_levels = opts->levels ? opts->levels : 1;
+    unsigned const buf_items = opts->chunk_buf_size / sample_size;
+    assert(buf_items != 0);
+    assert(opts->mask_bits < sizeof(hash) * 8);
+    assert(n_levels <= max_chunk_levels);
+    assert(opts->mask_bits > (n_levels - 1) * opts->level_shift);
+    Probe(split__start, source);
+    *s = (split_state) {
+        .n_levels = n_levels, .sample_size = sample_size, .df = df,
+        .source = source, .buf_items = buf_items,
+        .min_run_length = opts->min_run_length, .detect_runs = 1,
+        .run_sample = malloc(sample_size), .scratch = opts->scratch,
+        .lane = lane};
+    for (unsigned l = 0; l < n_levels; l++) {
+        unsigned const shift = l * opts->level_shift;
+        unsigned const min_length = l ?
+            max_u(opts->min_chunk_size >> shift, 1) : opts->min_chunk_size;
+        s->levels[l] = (chunk_level) {
+            .hd = *hd,
+            .mask = (((hash) 1) << (opts->mask_bits - shift)) - 1,
+            .min_length = min_length,
+            .max_length = l ?
+                max_u(opts->max_chunk_size >> shift, min_length) :
+                opts->max_chunk_size};
+    }
+    s->ra = opts->read_ahead_buffers ?
+        read_ahead_start(
+            sample_size, df, source, opts->read_ahead_buffers, buf_items) :
+        NULL;
+    s->buf = (s->ra == NULL) ?
+        scratch_get(
+            s->scratch, SCRATCH_SPLIT_READ + lane,
+            (size_t) buf_items * sample_size) :
+        NULL;
+    unsigned const window_buffer_size = sample_size * opts->window_length;
+    s->wd = window_data_init(
+        hd,
+        scratch_get(
+            s->scratch, SCRATCH_SPLIT_WINDOW + lane, window_buffer_size),
+        window_buffer_size);
+}
+
+/*
+ * Make sure some samples are available, unless the source is exhausted.
+ * \return The number of samples available (0 at the end of the source).
+ */
+static unsigned split_fill(split_state * const s) {
+    if (s->available || s->at_end) {
+        return s->available;
+    }
+    if (s->ra == NULL) {
+        s->available = s->df(s->source, s->buf, s->buf_items);
+        s->data = s->buf;
+    } else {
+        s->available = read_ahead_next(s->ra, &s->data);
+    }
+    Probe(fetch, s->source, s->available);
+    s->at_end = (s->available == 0);
+    return s->available;
+}
+
+/*
+ * End the chunks in progress at start, and add a run chunk at every level
+ * from there to the current position. The window is restarted after the run,
+ * so what follows is chunked as it would be after any other boundary.
+ */
+static void add_run_chunk(split_state * const s, sample_pos const start) {
+    chunk_level * const levels = s->levels;
+    unsigned const n_levels = s->n_levels;
+    for (unsigned l = n_levels; l-- > 0;) {
+        if (start > levels[l].start_pos) {
+            end_chunk(levels, l, n_levels, start);
+        }
+    }
+    hash_data hd = levels[0].hd;
+    for (unsigned b = 0; b < s->sample_size; b++) {
+        hash_data_update(&hd, s->run_sample[b]);
+    }
+    hash const h = run_hash(hd.h, s->pos - start);
+    for (unsigned l = n_levels; l-- > 0;) {
+        levels[l].hd.h = h;
+        end_chunk(levels, l, n_levels, s->pos);
+        levels[l].tail->is_run = 1;
+        // Start what follows as though it held the last of the run, so it
+        // only matches the same data after the same sample
+        levels[l].hd.h = hd.h;
+    }
+    window_data_reset(&s->wd);
+    Probe(run, s->source, start, s->pos);
+}
+
+/*
+ * Hash length copies of the run sample, from start, as if they had been
+ * read from the source.
+ */
+static void replay_run(
+        split_state * const s, sample_pos const start, sample_pos length,
+        lanes_splitter const split) {
+    unsigned const sample_size = s->sample_size;
+    if (length == 0) {
+        return;
+    }
+    if (s->run_buf == NULL) {
+        s->run_buf_items = (s->min_run_length < s->buf_items) ?
+            s->min_run_length : s->buf_items;
+        s->run_buf = scratch_get(
+            s->scratch, SCRATCH_SPLIT_RUN + s->lane,
+            (size_t) s->run_buf_items * sample_size);
+    }
+    for (unsigned i = 0; i < s->run_buf_items; i++) {
+        memcpy(
+            s->run_buf + (size_t) i * sample_size, s->run_sample,
+            sample_size);
+    }
+    char const * const data = s->data;
+    unsigned const available = s->available;
+    s->pos = start;
+    s->detect_runs = 0;
+    split_state * const lanes[] = {s};
+    while (length) {
+        s->data = s->run_buf;
+        s->available = (length < s->run_buf_items) ?
+            length : s->run_buf_items;
+        length -= split(lanes, s->available);
+    }
+    s->detect_runs = 1;
+    s->data = data;
+    s->available = available;
+}
+
+/*
+ * Having hashed a sample that may start a run, take the copies of it that
+ * follow (across as many fetches as it takes). At least min_run_length of
+ * them make a run chunk, fewer are hashed as usual.
+ */
+static void split_run(split_state * const s, lanes_splitter const split) {
+    unsigned const sample_size = s->sample_size;
+    s->run_candidate = 0;
+    memcpy(s->run_sample, s->data - sample_size, sample_size);
+    sample_pos const start = s->pos;
+    while (split_fill(s)) {
+        unsigned n = 0;
+        while (
+                n < s->available &&
+                !memcmp(s->data, s->run_sample, sample_size)) {
+            s->data += sample_size;
+            n++;
+        }
+        s->pos += n;
+        s->available -= n;
+        if (s->available) {
+            break;
+        }
+    }
+    // The run takes in the sample that was hashed (like the last sample of
+    // any chunk, that sample's hash went to the chunk before)
+    sample_pos const length = s->pos - start;
+    if (length + 1 >= s->min_run_length) {
+        add_run_chunk(s, start - 1);
+    } else {
+        replay_run(s, start, length, split);
+    }
+}
+
+static chunks split_finish(split_state * const s) {
+    if (s->ra != NULL) {
+        read_ahead_finish(s->ra);
+    }
+    scratch_put(s->scratch, s->buf);
+    scratch_put(s->scratch, s->wd.undo_buf);
+    free(s->run_sample);
+    scratch_put(s->scratch, s->run_buf);
+    for (unsigned l = s->n_levels; l-- > 0;) {
+        if (s->pos > s->levels[l].start_pos) {
+            end_chunk(s->levels, l, s->n_levels, s->pos);
+        }
+    }
+    Probe(split__done, s->source, s->pos);
+    return s->levels[0].head;
 }
 
 /*! Breaks data into chunks by splitting based on content.
@@ -36,53 +972,158 @@ static inline hash hash_sample(
  * lower n bits of the hash is zero). That means that our splitting is
  * resistant to shifts in the data from insertions and deletions, which is very
  * useful for comparison with other data.
+ *
+ * When more than one level is requested the same windowed hash is tested
+ * against progressively shorter masks, so every boundary of a level is also a
+ * boundary of all the levels below it. Each chunk then points (via sub) at the
+ * first of the finer chunks that make it up. Only boundaries of the coarsest
+ * level reset the window, which keeps that level identical to a single level
+ * split.
+ *
+ * Runs of identical samples (silence, DC) would otherwise be cut into many
+ * chunks with the same hash, so each run of at least min_run_length samples
+ * is made a single run chunk instead (see split_run()), and skipped over
+ * without hashing it.
+ *
+ * The hashing loop is specialised for common frame sizes (see
+ * Specialised_frame_sizes), the specialisation being chosen once per call.
+ *
+ * With read_ahead_buffers set, the data is fetched on another thread (see
+ * read_ahead_start()) whilst we hash the buffer fetched before it.
  */
+static chunks split_data_with(
+        unsigned const sample_size, data_fetcher const df,
+        void * const source, bdiff_options const * const opts,
+        int const generic) {
+    split_state state;
+    split_init(&state, 0, sample_size, df, source, opts, shared_hash_data());
+    split_state * const lanes[] = {&state};
+    lanes_splitter const split = generic ?
+        ((state.n_levels == 1) ?
+            split_generic_single_1 : split_generic_multi_1) :
+        choose_splitter_1(sample_size, state.n_levels);
+    while (split_fill(&state)) {
+        split(lanes, state.available);
+        if (state.run_candidate) {
+            split_run(&state, split);
+        }
+    }
+    return split_finish(&state);
+}
+
 chunks const split_data(
         unsigned const sample_size, data_fetcher const df,
-        void * const source, unsigned const min_length,
-        unsigned const max_length) {
-    char buf[buf_size];
-    chunks head = NULL, tail = NULL;
-    unsigned samples_read, start_pos = 0, total_samples_read = 0;
-    hash_data hd = hash_data_init(irreducible_polynomial);
-    unsigned const window_buffer_size = sample_size * 16;
-    unsigned char window_buffer[window_buffer_size];
-    window_data wd = window_data_init(&hd, window_buffer, window_buffer_size);
-    do {
-        samples_read = df(source, buf, buf_size / sample_size);
-        for (unsigned sample = 0; sample < samples_read; sample++) {
-            hash const h = hash_sample(
-                &hd, &wd, sample_size, buf + (sample * sample_size));
-            if (
-                    (
-                        (total_samples_read - start_pos) >= min_length &&
-                        !(h & 0xFF)) ||
-                    (total_samples_read - start_pos) == max_length + 1) {
-                tail = chunk_new(
-                    tail, start_pos, total_samples_read, hd.h);
-                start_pos = total_samples_read;
-                if (head == NULL) {
-                    head = tail;
+        void * const source, bdiff_options const * const opts) {
+    return split_data_with(sample_size, df, source, opts, 0);
+}
+
+chunks const split_data_generic(
+        unsigned const sample_size, data_fetcher const df,
+        void * const source, bdiff_options const * const opts) {
+    return split_data_with(sample_size, df, source, opts, 1);
+}
+
+/*
+ * The sources are hashed in lockstep whilst they have data: three or more of
+ * them by a wide splitter, two as a pair, and the last on its own.
+ */
+static void split_many(
+        unsigned const sample_size, data_fetcher const df,
+        void * const * const sources, unsigned const n_sources,
+        bdiff_options const * const opts, chunks * const out,
+        int const generic) {
+    assert(n_sources <= max_split_lanes);
+    hash_data const * const hd = shared_hash_data();
+    split_state states[max_split_lanes];
+    for (unsigned i = 0; i < n_sources; i++) {
+        split_init(&states[i], i, sample_size, df, sources[i], opts, hd);
+    }
+    unsigned const n_levels = states[0].n_levels;
+    lanes_splitter const split_two = generic ?
+        ((n_levels == 1) ? split_generic_single_2 : split_generic_multi_2) :
+        choose_splitter_2(sample_size, n_levels);
+    lanes_splitter const split_one = generic ?
+        ((n_levels == 1) ? split_generic_single_1 : split_generic_multi_1) :
+        choose_splitter_1(sample_size, n_levels);
+    // Room for each lane's window and a buffer of its samples:
+    size_t const wide_stride =
+        states[0].wd.window_size +
+        (size_t) states[0].buf_items * sample_size + wide_padding;
+    unsigned char * const wide = (n_sources > 2) ?
+        scratch_get(
+            opts->scratch, SCRATCH_SPLIT_WIDE, n_sources * wide_stride) :
+        NULL;
+    for (;;) {
+        split_state * active[max_split_lanes];
+        unsigned char * bytes[max_split_lanes];
+        unsigned n_active = 0, least = 0;
+        for (unsigned i = 0; i < n_sources; i++) {
+            unsigned const available = split_fill(&states[i]);
+            if (available) {
+                if (n_active == 0 || available < least) {
+                    least = available;
                 }
-                hash_data_reset(&hd);
-                window_data_reset(&wd);
+                bytes[n_active] = (wide != NULL) ?
+                    wide + i * wide_stride : NULL;
+                active[n_active++] = &states[i];
             }
-            total_samples_read++;
         }
-    } while (samples_read);
-    if (total_samples_read > start_pos) {
-        tail = chunk_new(tail, start_pos, total_samples_read, hd.h);
-        if (head == NULL) {
-            head = tail;
+        if (n_active > 2) {
+            wide_splitter const split_wide = choose_wide_splitter(
+                n_active, n_levels, generic);
+            split_wide(active, n_active, least, bytes);
+        } else if (n_active == 2) {
+            split_two(active, least);
+        } else if (n_active == 1) {
+            split_one(active, least);
+        } else {
+            break;
+        }
+        for (unsigned i = 0; i < n_sources; i++) {
+            if (states[i].run_candidate) {
+                split_run(&states[i], split_one);
+            }
         }
     }
-    return head;
+    scratch_put(opts->scratch, wide);
+    for (unsigned i = 0; i < n_sources; i++) {
+        out[i] = split_finish(&states[i]);
+    }
+}
+
+void split_data_pair(
+        unsigned const sample_size, data_fetcher const df,
+        void * const a, void * const b, bdiff_options const * const opts,
+        chunks * const a_chunks, chunks * const b_chunks) {
+    void * const sources[] = {a, b};
+    chunks out[2];
+    split_many(sample_size, df, sources, 2, opts, out, 0);
+    *a_chunks = out[0];
+    *b_chunks = out[1];
+}
+
+void split_data_many(
+        unsigned const sample_size, data_fetcher const df,
+        void * const * const sources, unsigned const n_sources,
+        bdiff_options const * const opts, chunks * const out) {
+    split_many(sample_size, df, sources, n_sources, opts, out, 0);
+}
+
+void split_data_many_generic(
+        unsigned const sample_size, data_fetcher const df,
+        void * const * const sources, unsigned const n_sources,
+        bdiff_options const * const opts, chunks * const out) {
+    split_many(sample_size, df, sources, n_sources, opts, out, 1);
 }
 
 void chunk_free(chunk * head) {
+    chunk * const sub = (head != NULL) ? head->sub : NULL;
     while (head != NULL) {
         chunk * prev = head;
         head = head->next;
         free(prev);
     }
+    if (sub != NULL) {
+        chunk_free(sub);
+    }
 }
@@ -4,7 +4,14 @@
 
 /** \brief Shift resistant block.
  *
- * Linked list of views with hashes.
+ * Linked list of views with hashes. When chunking at several levels, sub
+ * points to the first of the finer chunks covering this one; the finer
+ * chunks of a level form one list spanning the whole source.
+ *
+ * A run chunk covers a stretch of identical samples (silence, say), and has
+ * the same extent at every level. Its hash combines the hash of the repeated
+ * sample with the run's length (see run_hash()), so that only runs of the
+ * same length have the same hash.
  */
 typedef struct chunk {
     union {
@@ -12,11 +19,25 @@ typedef struct chunk {
         view v;
     };
     hash hash;
+    int is_run;
     struct chunk * next;
+    struct chunk * sub;
 } chunk;
 
 typedef chunk * chunks;
 
+/** \brief The hash of a run of length samples, each hashing to value.
+ */
+static inline hash run_hash(hash const value, sample_pos const length) {
+    return value ^ (hash) (length * 2654435761u);
+}
+
+/** \brief The hash of the repeated sample of a run chunk.
+ */
+static inline hash run_value(chunk const * const c) {
+    return run_hash(c->hash, c->end - c->start);
+}
+
 /** \brief Create a new chunk on the heap.
  *
  * \param[out] prev pointer to the chunk to append the new one to.
@@ -26,7 +47,7 @@ typedef chunk * chunks;
  * \return a pointer to the new chunk.
  */
 chunk * chunk_new(
-        chunk * const prev, unsigned const start, unsigned const end,
+        chunk * const prev, sample_pos const start, sample_pos const end,
         hash const h);
 
 /** \brief Split the data given by the data_fetcher into shift resistant blocks.
@@ -34,13 +55,64 @@ chunk * chunk_new(
  * \param[in] sample_size the size of a sample returned by the data fetcher.
  * \param[in] df a data_fetcher function.
  * \param[in] source pointer to the data to give to the specified data_fetcher.
+ * \param[in] opts chunk length bounds, boundary mask, window and buffer sizes
+ * and minimum run length (all fields must be set).
  * \return the head of a linked list of chunks.
  */
 chunks const split_data(
     unsigned const sample_size, data_fetcher const df, void * const source,
-    unsigned const min_length, unsigned const max_length);
+    bdiff_options const * const opts);
+
+/** \brief Split the data as split_data() does, but always through the
+ * generic hashing loop rather than one specialised for the sample size.
+ *
+ * For checking the specialised loops against.
+ */
+chunks const split_data_generic(
+    unsigned const sample_size, data_fetcher const df, void * const source,
+    bdiff_options const * const opts);
+
+/** \brief Split two sources, as split_data() would, hashing them together.
+ *
+ * The rolling hashes of the two sources are advanced in lockstep, so that
+ * the table lookups of one overlap with those of the other rather than each
+ * source waiting on its own chain of lookups.
+ *
+ * \param[out] a_chunks Set to the chunks of a.
+ * \param[out] b_chunks Set to the chunks of b.
+ */
+void split_data_pair(
+    unsigned const sample_size, data_fetcher const df, void * const a,
+    void * const b, bdiff_options const * const opts,
+    chunks * const a_chunks, chunks * const b_chunks);
+
+/** \brief Split several sources, as split_data() would, hashing them
+ * together.
+ *
+ * Whilst three or more have data, their rolling hashes are advanced in
+ * lockstep by a wide splitter, so that the table lookups of them all
+ * overlap (as AVX2 gathers, where the CPU has them and six or more have
+ * data). Two are hashed as split_data_pair() would.
+ *
+ * \param[in] sources The sources (at most max_split_lanes), each given as
+ * the source parameter to df.
+ * \param[in] n_sources The number of sources.
+ * \param[out] out Set to the chunks of each source.
+ */
+void split_data_many(
+    unsigned const sample_size, data_fetcher const df,
+    void * const * const sources, unsigned const n_sources,
+    bdiff_options const * const opts, chunks * const out);
+
+/** \brief As split_data_many(), but always through the portable hashing
+ * loops, for checking the specialised and AVX2 ones against.
+ */
+void split_data_many_generic(
+    unsigned const sample_size, data_fetcher const df,
+    void * const * const sources, unsigned const n_sources,
+    bdiff_options const * const opts, chunks * const out);
 
-/** \brief Free a linked list of chunks.
+/** \brief Free a linked list of chunks (and any finer levels beneath it).
  *
  * \param[out] head pointer to the start of the list.
  */
@@ -1,10 +1,15 @@
 #include "hunk.h"
 #include <stdlib.h>
 #include "hash_counting_table.h"
+#include "probes.h"
 
-static inline hash_counting_table create_hash_counting_table(chunks c) {
+// Largest gap (in a chunks times b chunks) matched with a full LCS table:
+#define max_lcs_cells (1u << 20)
+
+static inline hash_counting_table create_hash_counting_table(
+        chunks c, chunk const * const stop) {
     hash_counting_table c_hashes = hash_counting_table_new();
-    while (c != NULL) {
+    while (c != stop) {
         hash_counting_table_inc(
             c_hashes, c->hash);
         c = c->next;
@@ -12,13 +17,11 @@ static inline hash_counting_table create_hash_counting_table(chunks c) {
     return c_hashes;
 }
 
-void append_hunk(
-        hunk ** const head, hunk ** const tail, unsigned const a_start,
-        unsigned const a_end, unsigned const b_start, unsigned const b_end) {
+static void append_new_hunk(
+        hunk ** const head, hunk ** const tail, hunk const h) {
     hunk * new_hunk = malloc(sizeof(hunk));
-    *new_hunk = (hunk) {
-        .a = {.start = a_start, .end = a_end},
-        .b = {.start = b_start, .end = b_end}};
+    *new_hunk = h;
+    new_hunk->next = NULL;
     if (*tail != NULL) {
         (*tail)->next = new_hunk;
     }
@@ -28,52 +31,571 @@ void append_hunk(
     }
 }
 
+void append_hunk(
+        hunk ** const head, hunk ** const tail, sample_pos const a_start,
+        sample_pos const a_end, sample_pos const b_start,
+        sample_pos const b_end) {
+    append_new_hunk(head, tail, (hunk) {
+        .a = {.start = a_start, .end = a_end},
+        .b = {.start = b_start, .end = b_end},
+        .source = HUNK_SOURCE_B});
+}
+
+void append_copy_hunk(
+        hunk ** const head, hunk ** const tail, sample_pos const a_pos,
+        sample_pos const src_start, sample_pos const src_end) {
+    append_new_hunk(head, tail, (hunk) {
+        .a = {.start = a_pos, .end = a_pos},
+        .b = {.start = src_start, .end = src_end},
+        .source = HUNK_SOURCE_A});
+}
+
 static inline void possibly_append_hunk(
-        hunk ** const head, hunk ** const tail, unsigned const a_start,
-        unsigned const a_end, unsigned const b_start, unsigned const b_end) {
+        hunk ** const head, hunk ** const tail, sample_pos const a_start,
+        sample_pos const a_end, sample_pos const b_start,
+        sample_pos const b_end) {
     if ((a_start != a_end) || (b_start != b_end)) {
         // There's a gap, we skipped over some unique chunks
         append_hunk(head, tail, a_start, a_end, b_start, b_end);
     }
 }
 
-hunk * diff_chunks(chunks a, chunks b) {
-    hash_counting_table b_hashes = create_hash_counting_table(b);
+/*
+ * Whether two chunks hold the same data, or are runs of the same sample (of
+ * any lengths).
+ */
+static inline int chunks_match(chunk const * const a, chunk const * const b) {
+    return
+        a->hash == b->hash ||
+        (a->is_run && b->is_run && run_value(a) == run_value(b));
+}
+
+/*
+ * Where the hunk after two matching chunks starts: after both, unless they're
+ * runs of different lengths, when the rest of the longer is left to the hunk.
+ */
+static inline void end_match(
+        chunk const * const a, chunk const * const b,
+        sample_pos * const hunk_start_a, sample_pos * const hunk_start_b) {
+    *hunk_start_a = a->end;
+    *hunk_start_b = b->end;
+    if (a->is_run && b->is_run) {
+        sample_pos const a_length = a->end - a->start;
+        sample_pos const b_length = b->end - b->start;
+        sample_pos const common = (a_length < b_length) ? a_length : b_length;
+        *hunk_start_a = a->start + common;
+        *hunk_start_b = b->start + common;
+    }
+}
+
+/*
+ * Diff the chunks from a up to (but excluding) a_stop against those from b up
+ * to b_stop. The starts give the positions the spans begin at, so that empty
+ * spans still produce correctly placed hunks.
+ */
+static hunk * diff_chunk_spans(
+        chunks a, chunk const * const a_stop, sample_pos const a_start,
+        chunks b, chunk const * const b_stop, sample_pos const b_start,
+        bdiff_stats * const stats) {
+    Probe(match__start, a_start, b_start);
+    hash_counting_table b_hashes = create_hash_counting_table(b, b_stop);
+    // One insertion per b chunk, then one lookup per a chunk and one removal
+    // per b chunk passed:
+    uint64_t probes = 0;
 
     hunk * head = NULL, * tail = NULL;
-    unsigned hunk_start_a = 0, hunk_start_b = 0;
+    sample_pos hunk_start_a = a_start, hunk_start_b = b_start;
     // Initial zero-length chunks to avoid nasty first iteration logic:
-    chunk zero_a = {.start = 0, .end = 0, .next = a};
-    chunk zero_b = {.start = 0, .end = 0, .next = b};
+    chunk zero_a = {.start = a_start, .end = a_start, .next = a};
+    chunk zero_b = {.start = b_start, .end = b_start, .next = b};
     a = &zero_a;
     b = &zero_b;
-    for (; a->next != NULL; a = a->next) {
-        if (hash_counting_table_get(b_hashes, a->next->hash)) {
+    for (; a->next != a_stop; a = a->next) {
+        probes++;
+        // Runs of the same sample side by side match whatever their lengths:
+        int const runs =
+            b->next != b_stop && a->next->is_run && b->next->is_run &&
+            chunks_match(a->next, b->next);
+        if (runs || hash_counting_table_get(b_hashes, a->next->hash)) {
             // We're processing a chunk common to a and b
-            while (b->next->hash != a->next->hash) {
+            while (!runs && b->next->hash != a->next->hash) {
                 b = b->next;
                 hash_counting_table_dec(b_hashes, b->hash);
+                probes++;
             }
 
             possibly_append_hunk(
                 &head, &tail, hunk_start_a, a->next->start,
                 hunk_start_b, b->next->start);
 
-            hunk_start_a = a->next->end;
-            hunk_start_b = b->next->end;
+            end_match(a->next, b->next, &hunk_start_a, &hunk_start_b);
 
             hash_counting_table_dec(b_hashes, b->next->hash);
+            probes++;
             b = b->next;
         }
     }
-    while (b->next != NULL) {
+    while (b->next != b_stop) {
         b = b->next;
     }
+    if (stats != NULL) {
+        for (chunk const * c = zero_b.next; c != b_stop; c = c->next) {
+            probes++;
+        }
+        stats->hash_probes += probes;
+    }
 
     possibly_append_hunk(
         &head, &tail, hunk_start_a, a->end, hunk_start_b, b->end);
 
     hash_counting_table_destroy(b_hashes);
+    Probe(match__done, a_start, b_start);
+    return head;
+}
+
+hunk * diff_chunks(chunks a, chunks b) {
+    return diff_chunk_spans(a, NULL, 0, b, NULL, 0, NULL);
+}
+
+/*
+ * Chunk matching for the patience matcher works on arrays of the chunks in
+ * each span, building up the (in order) list of matched index pairs.
+ */
+typedef struct {
+    unsigned a;
+    unsigned b;
+} chunk_match;
+
+typedef struct {
+    chunk ** a;
+    chunk ** b;
+    chunk_match * matches;
+    unsigned n_matches;
+    uint64_t probes;
+} patience_state;
+
+static chunk ** chunk_array(
+        chunks c, chunk const * const stop, unsigned * const n_chunks) {
+    unsigned n = 0;
+    for (chunk const * i = c; i != stop; i = i->next) {
+        n++;
+    }
+    chunk ** const array = malloc((n ? n : 1) * sizeof(chunk *));
+    for (unsigned i = 0; i < n; i++, c = c->next) {
+        array[i] = c;
+    }
+    *n_chunks = n;
+    return array;
+}
+
+static inline void add_match(
+        patience_state * const ps, unsigned const a, unsigned const b) {
+    ps->matches[ps->n_matches++] = (chunk_match) {.a = a, .b = b};
+}
+
+static void match_range(
+    patience_state * const ps, unsigned a_lo, unsigned a_hi, unsigned b_lo,
+    unsigned b_hi);
+
+typedef struct {
+    unsigned n_a;
+    unsigned a;
+    unsigned n_b;
+    unsigned b;
+} hash_occurrences;
+
+/*
+ * Find the chunks whose hash occurs once in each range, keep the longest
+ * sequence of them in order in both (patience sorting on their b indices)
+ * and match the ranges between them. Returns 0 if there are no such chunks.
+ */
+static int match_unique(
+        patience_state * const ps, unsigned const a_lo, unsigned const a_hi,
+        unsigned const b_lo, unsigned const b_hi) {
+    hash_occurrences * const occurrences = calloc(
+        a_hi - a_lo, sizeof(hash_occurrences));
+    GHashTable * const index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (unsigned i = a_lo; i < a_hi; i++) {
+        gpointer const key = GUINT_TO_POINTER(ps->a[i]->hash);
+        hash_occurrences * o = g_hash_table_lookup(index, key);
+        ps->probes++;
+        if (o == NULL) {
+            o = &occurrences[i - a_lo];
+            g_hash_table_insert(index, key, o);
+            ps->probes++;
+        }
+        o->n_a++;
+        o->a = i;
+    }
+    for (unsigned j = b_lo; j < b_hi; j++) {
+        hash_occurrences * const o = g_hash_table_lookup(
+            index, GUINT_TO_POINTER(ps->b[j]->hash));
+        if (o != NULL) {
+            o->n_b++;
+            o->b = j;
+        }
+    }
+    ps->probes += b_hi - b_lo;
+    g_hash_table_destroy(index);
+
+    // Candidates (in a order) and, for each, its predecessor in the longest
+    // increasing run of b indices ending with it:
+    unsigned n_candidates = 0;
+    chunk_match * const candidates = malloc(
+        (a_hi - a_lo) * sizeof(chunk_match));
+    unsigned * const prev = malloc((a_hi - a_lo) * sizeof(unsigned));
+    unsigned * const pile_tops = malloc((a_hi - a_lo) * sizeof(unsigned));
+    unsigned n_piles = 0;
+    for (unsigned i = 0; i < a_hi - a_lo; i++) {
+        hash_occurrences const * const o = &occurrences[i];
+        if (o->n_a != 1 || o->n_b != 1) {
+            continue;
+        }
+        unsigned const c = n_candidates++;
+        candidates[c] = (chunk_match) {.a = o->a, .b = o->b};
+        unsigned lo = 0, hi = n_piles;
+        while (lo < hi) {
+            unsigned const mid = (lo + hi) / 2;
+            if (candidates[pile_tops[mid]].b < o->b) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        prev[c] = lo ? pile_tops[lo - 1] : c;
+        pile_tops[lo] = c;
+        if (lo == n_piles) {
+            n_piles++;
+        }
+    }
+    free(occurrences);
+
+    if (n_piles != 0) {
+        // Unwind the longest run (from its end) into the start of pile_tops:
+        unsigned c = pile_tops[n_piles - 1];
+        for (unsigned p = n_piles; p-- > 0; c = prev[c]) {
+            pile_tops[p] = c;
+        }
+        unsigned a_start = a_lo, b_start = b_lo;
+        for (unsigned p = 0; p < n_piles; p++) {
+            chunk_match const anchor = candidates[pile_tops[p]];
+            match_range(ps, a_start, anchor.a, b_start, anchor.b);
+            add_match(ps, anchor.a, anchor.b);
+            a_start = anchor.a + 1;
+            b_start = anchor.b + 1;
+        }
+        match_range(ps, a_start, a_hi, b_start, b_hi);
+    }
+    free(candidates);
+    free(prev);
+    free(pile_tops);
+    return n_piles != 0;
+}
+
+/*
+ * Match the longest common subsequence of hashes in the ranges.
+ */
+static void match_lcs(
+        patience_state * const ps, unsigned const a_lo, unsigned const a_hi,
+        unsigned const b_lo, unsigned const b_hi) {
+    unsigned const n = a_hi - a_lo, m = b_hi - b_lo;
+    // lengths[i * (m + 1) + j] is the LCS length of a[i:] and b[j:]
+    unsigned * const lengths = calloc((n + 1) * (m + 1), sizeof(unsigned));
+    #define Length(i, j) lengths[(i) * (m + 1) + (j)]
+    for (unsigned i = n; i-- > 0;) {
+        for (unsigned j = m; j-- > 0;) {
+            if (chunks_match(ps->a[a_lo + i], ps->b[b_lo + j])) {
+                Length(i, j) = Length(i + 1, j + 1) + 1;
+            } else if (Length(i + 1, j) >= Length(i, j + 1)) {
+                Length(i, j) = Length(i + 1, j);
+            } else {
+                Length(i, j) = Length(i, j + 1);
+            }
+        }
+    }
+    unsigned i = 0, j = 0;
+    while (i < n && j < m) {
+        if (chunks_match(ps->a[a_lo + i], ps->b[b_lo + j])) {
+            add_match(ps, a_lo + i++, b_lo + j++);
+        } else if (Length(i + 1, j) >= Length(i, j + 1)) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    #undef Length
+    free(lengths);
+}
+
+/*
+ * Match the ranges as diff_chunk_spans() would, for gaps too large for
+ * match_lcs().
+ */
+static void match_greedy(
+        patience_state * const ps, unsigned const a_lo, unsigned const a_hi,
+        unsigned const b_lo, unsigned const b_hi) {
+    hash_counting_table b_hashes = hash_counting_table_new();
+    for (unsigned j = b_lo; j < b_hi; j++) {
+        hash_counting_table_inc(b_hashes, ps->b[j]->hash);
+    }
+    ps->probes += (b_hi - b_lo) + (a_hi - a_lo);
+    unsigned j = b_lo;
+    for (unsigned i = a_lo; i < a_hi; i++) {
+        hash const h = ps->a[i]->hash;
+        if (hash_counting_table_get(b_hashes, h)) {
+            unsigned const j_start = j;
+            while (ps->b[j]->hash != h) {
+                hash_counting_table_dec(b_hashes, ps->b[j++]->hash);
+            }
+            hash_counting_table_dec(b_hashes, h);
+            add_match(ps, i, j++);
+            ps->probes += j - j_start;
+        }
+    }
+    hash_counting_table_destroy(b_hashes);
+}
+
+static void match_range(
+        patience_state * const ps, unsigned a_lo, unsigned a_hi,
+        unsigned b_lo, unsigned b_hi) {
+    while (
+            a_lo < a_hi && b_lo < b_hi &&
+            chunks_match(ps->a[a_lo], ps->b[b_lo])) {
+        add_match(ps, a_lo++, b_lo++);
+    }
+    unsigned n_suffix = 0;
+    while (
+            a_lo < a_hi && b_lo < b_hi &&
+            chunks_match(ps->a[a_hi - 1], ps->b[b_hi - 1])) {
+        a_hi--;
+        b_hi--;
+        n_suffix++;
+    }
+    if (
+            a_lo < a_hi && b_lo < b_hi &&
+            !match_unique(ps, a_lo, a_hi, b_lo, b_hi)) {
+        if ((a_hi - a_lo) <= max_lcs_cells / (b_hi - b_lo)) {
+            match_lcs(ps, a_lo, a_hi, b_lo, b_hi);
+        } else {
+            match_greedy(ps, a_lo, a_hi, b_lo, b_hi);
+        }
+    }
+    for (unsigned k = 0; k < n_suffix; k++) {
+        add_match(ps, a_hi + k, b_hi + k);
+    }
+}
+
+/*
+ * As diff_chunk_spans(), but using the patience matcher.
+ */
+static hunk * patience_chunk_spans(
+        chunks a, chunk const * const a_stop, sample_pos const a_start,
+        chunks b, chunk const * const b_stop, sample_pos const b_start,
+        bdiff_stats * const stats) {
+    Probe(match__start, a_start, b_start);
+    unsigned n_a, n_b;
+    patience_state ps = {
+        .a = chunk_array(a, a_stop, &n_a),
+        .b = chunk_array(b, b_stop, &n_b)};
+    ps.matches = malloc(((n_a < n_b ? n_a : n_b) + 1) * sizeof(chunk_match));
+    match_range(&ps, 0, n_a, 0, n_b);
+
+    hunk * head = NULL, * tail = NULL;
+    sample_pos hunk_start_a = a_start, hunk_start_b = b_start;
+    for (unsigned m = 0; m < ps.n_matches; m++) {
+        chunk const * const a_chunk = ps.a[ps.matches[m].a];
+        chunk const * const b_chunk = ps.b[ps.matches[m].b];
+        possibly_append_hunk(
+            &head, &tail, hunk_start_a, a_chunk->start,
+            hunk_start_b, b_chunk->start);
+        end_match(a_chunk, b_chunk, &hunk_start_a, &hunk_start_b);
+    }
+    possibly_append_hunk(
+        &head, &tail, hunk_start_a, n_a ? ps.a[n_a - 1]->end : a_start,
+        hunk_start_b, n_b ? ps.b[n_b - 1]->end : b_start);
+
+    free(ps.a);
+    free(ps.b);
+    free(ps.matches);
+    if (stats != NULL) {
+        stats->hash_probes += ps.probes;
+    }
+    Probe(match__done, a_start, b_start);
+    return head;
+}
+
+hunk * diff_chunks_patience(chunks a, chunks b) {
+    return patience_chunk_spans(a, NULL, 0, b, NULL, 0, NULL);
+}
+
+hunk * match_chunks(
+        chunks a, chunks b, bdiff_matcher const matcher,
+        bdiff_stats * const stats) {
+    return (matcher == BDIFF_MATCHER_PATIENCE) ?
+        patience_chunk_spans(a, NULL, 0, b, NULL, 0, stats) :
+        diff_chunk_spans(a, NULL, 0, b, NULL, 0, stats);
+}
+
+/*
+ * Find the chunks covering [start, end), given a cursor at or before them.
+ * Returns the number of chunks spanned, leaving the cursor on the first of
+ * them and setting after to the chunk following the span (or NULL).
+ */
+static unsigned find_span(
+        chunk ** const cursor, chunk ** const after, sample_pos const start,
+        sample_pos const end) {
+    while (*cursor != NULL && (*cursor)->start < start) {
+        *cursor = (*cursor)->next;
+    }
+    unsigned n_chunks = 0;
+    chunk * c = *cursor;
+    for (; c != NULL && c->start < end; c = c->next) {
+        n_chunks++;
+    }
+    *after = c;
+    return n_chunks;
+}
+
+static inline chunk * sub_or_null(chunk const * const c) {
+    return (c == NULL) ? NULL : c->sub;
+}
+
+typedef hunk * (*chunk_span_matcher)(
+    chunks a, chunk const * a_stop, sample_pos a_start,
+    chunks b, chunk const * b_stop, sample_pos b_start,
+    bdiff_stats * stats);
+
+/*
+ * Replace the rough hunks that span many chunks with a diff of the finer
+ * chunks beneath them, recursing down through the levels.
+ */
+static hunk * refine_spans(
+        hunk * rough, chunk * a, chunk * b, unsigned const min_chunks,
+        chunk_span_matcher const matcher, bdiff_stats * const stats) {
+    hunk * head = NULL, * tail = NULL;
+    while (rough != NULL) {
+        hunk * const next = rough->next;
+        rough->next = NULL;
+        chunk * a_after, * b_after;
+        unsigned const n_a = find_span(
+            &a, &a_after, rough->a.start, rough->a.end);
+        unsigned const n_b = find_span(
+            &b, &b_after, rough->b.start, rough->b.end);
+        hunk * refined = rough;
+        if (
+                n_a && n_b && ((n_a > n_b) ? n_a : n_b) >= min_chunks &&
+                a->sub != NULL && b->sub != NULL) {
+            chunk * const a_sub = a->sub, * const b_sub = b->sub;
+            refined = matcher(
+                a_sub, sub_or_null(a_after), rough->a.start,
+                b_sub, sub_or_null(b_after), rough->b.start, stats);
+            refined = refine_spans(
+                refined, a_sub, b_sub, min_chunks, matcher, stats);
+            hunk_free(rough);
+        }
+        if (refined != NULL) {
+            if (tail == NULL) {
+                head = refined;
+            } else {
+                tail->next = refined;
+            }
+            tail = refined;
+            while (tail->next != NULL) {
+                tail = tail->next;
+            }
+        }
+        rough = next;
+    }
+    return head;
+}
+
+hunk * refine_hunks(
+        hunk * rough_hunks, chunks a, chunks b, unsigned const min_chunks,
+        bdiff_matcher const matcher, bdiff_stats * const stats) {
+    return refine_spans(
+        rough_hunks, a, b, min_chunks,
+        (matcher == BDIFF_MATCHER_PATIENCE) ?
+            patience_chunk_spans : diff_chunk_spans,
+        stats);
+}
+
+static inline unsigned chunk_length(chunk const * const c) {
+    return c->end - c->start;
+}
+
+/*
+ * Index the first chunk of a with each hash, so that chunks of b can be found
+ * anywhere in a.
+ */
+static GHashTable * index_chunks(chunks c) {
+    GHashTable * const index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (; c != NULL; c = c->next) {
+        gpointer const key = GUINT_TO_POINTER(c->hash);
+        if (!g_hash_table_contains(index, key)) {
+            g_hash_table_insert(index, key, c);
+        }
+    }
+    return index;
+}
+
+/*
+ * Split a hunk around runs of at least min_run of its b chunks that also
+ * appear, in order, somewhere in a. The a view of the hunk stays with the
+ * first piece, the rest are inserted where it ends.
+ */
+static void split_moves(
+        hunk const * const h, chunk ** const b_cursor,
+        GHashTable * const a_index, unsigned const min_run,
+        hunk ** const head, hunk ** const tail) {
+    sample_pos piece_a_start = h->a.start, piece_b_start = h->b.start;
+    chunk * c = *b_cursor;
+    while (c != NULL && c->start < h->b.start) {
+        c = c->next;
+    }
+    while (c != NULL && c->end <= h->b.end) {
+        chunk const * const match = g_hash_table_lookup(
+            a_index, GUINT_TO_POINTER(c->hash));
+        chunk const * a_run = match, * a_last = NULL;
+        chunk * b_run = c;
+        unsigned run = 0;
+        while (
+                a_run != NULL && b_run != NULL && b_run->end <= h->b.end &&
+                a_run->hash == b_run->hash &&
+                chunk_length(a_run) == chunk_length(b_run)) {
+            run++;
+            a_last = a_run;
+            a_run = a_run->next;
+            b_run = b_run->next;
+        }
+        if (run < min_run || run == 0) {
+            c = c->next;
+            continue;
+        }
+        possibly_append_hunk(
+            head, tail, piece_a_start, h->a.end, piece_b_start, c->start);
+        append_copy_hunk(head, tail, h->a.end, match->start, a_last->end);
+        piece_a_start = h->a.end;
+        piece_b_start = (b_run == NULL) ? h->b.end : b_run->start;
+        c = b_run;
+    }
+    possibly_append_hunk(
+        head, tail, piece_a_start, h->a.end, piece_b_start, h->b.end);
+    *b_cursor = c;
+}
+
+hunk * detect_moves(
+        hunk * hunks, chunks a, chunks b, unsigned const min_run) {
+    GHashTable * const a_index = index_chunks(a);
+    hunk * head = NULL, * tail = NULL;
+    for (hunk * h = hunks; h != NULL; h = h->next) {
+        if (h->source == HUNK_SOURCE_B && h->b.start != h->b.end) {
+            split_moves(h, &b, a_index, min_run, &head, &tail);
+        } else {
+            append_new_hunk(&head, &tail, *h);
+        }
+    }
+    g_hash_table_destroy(a_index);
+    hunk_free(hunks);
     return head;
 }
 
@@ -84,3 +606,222 @@ void hunk_free(hunk * head) {
         free(prev);
     }
 }
+
+// The end of the last piece of a patched file, which runs to the end of a:
+#define unbounded UINT64_MAX
+
+/*
+ * A stretch of patched data: either a range of a (from a_start), or data
+ * that is only in the patch's target, found there at the same position.
+ */
+typedef struct {
+    sample_pos start;
+    sample_pos end;
+    int from_a;
+    sample_pos a_start;
+} piece;
+
+/*
+ * Split the data a hunk list patches a into into pieces, in order. The last
+ * piece is the unchanged end of a, which is unbounded as a's length isn't
+ * known.
+ */
+static piece * patch_pieces(
+        hunk const * const hunks, unsigned * const n_pieces) {
+    unsigned n_hunks = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        n_hunks++;
+    }
+    piece * const pieces = malloc((2 * n_hunks + 1) * sizeof(piece));
+    unsigned n = 0;
+    sample_pos a_pos = 0, pos = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        if (h->a.start > a_pos) {
+            pieces[n++] = (piece) {
+                .start = pos, .end = pos + h->a.start - a_pos, .from_a = 1,
+                .a_start = a_pos};
+            pos = pieces[n - 1].end;
+        }
+        if (h->b.end > h->b.start) {
+            pieces[n++] = (piece) {
+                .start = pos, .end = pos + h->b.end - h->b.start,
+                .from_a = (h->source == HUNK_SOURCE_A),
+                .a_start = h->b.start};
+            pos = pieces[n - 1].end;
+        }
+        a_pos = h->a.end;
+    }
+    pieces[n++] = (piece) {
+        .start = pos, .end = unbounded, .from_a = 1, .a_start = a_pos};
+    *n_pieces = n;
+    return pieces;
+}
+
+/*
+ * Hunks being built from the pieces of a patched file, in order.
+ */
+typedef struct {
+    hunk * head;
+    hunk * tail;
+    // Hunks from here on are at a_pos, and may still grow.
+    hunk * open;
+    sample_pos a_pos;
+    sample_pos pos;
+} hunk_builder;
+
+static void build_from_target(hunk_builder * const hb, sample_pos const n) {
+    hunk * const t = hb->tail;
+    if (
+            hb->open != NULL && t->source == HUNK_SOURCE_B &&
+            t->b.end == hb->pos) {
+        t->b.end += n;
+    } else {
+        append_hunk(
+            &hb->head, &hb->tail, hb->a_pos, hb->a_pos, hb->pos,
+            hb->pos + n);
+        hb->open = (hb->open != NULL) ? hb->open : hb->tail;
+    }
+    hb->pos += n;
+}
+
+static void build_from_a(
+        hunk_builder * const hb, sample_pos const start,
+        sample_pos const n) {
+    if (start >= hb->a_pos) {
+        // Carries on through a, deleting anything skipped
+        if (start > hb->a_pos) {
+            if (hb->open != NULL) {
+                hb->tail->a.end = start;
+            } else {
+                append_hunk(
+                    &hb->head, &hb->tail, hb->a_pos, start, hb->pos,
+                    hb->pos);
+            }
+        }
+        hb->open = NULL;
+        hb->a_pos = (n == unbounded) ? unbounded : start + n;
+        hb->pos = (n == unbounded) ? unbounded : hb->pos + n;
+        return;
+    }
+    // Goes back in a, so must be a copy
+    sample_pos const copied = (n == unbounded) ? hb->a_pos - start : n;
+    hunk * const t = hb->tail;
+    if (
+            hb->open != NULL && t->source == HUNK_SOURCE_A &&
+            t->b.end == start) {
+        t->b.end += copied;
+    } else {
+        append_copy_hunk(
+            &hb->head, &hb->tail, hb->a_pos, start, start + copied);
+        hb->open = (hb->open != NULL) ? hb->open : hb->tail;
+    }
+    hb->pos += copied;
+    if (n == unbounded) {
+        build_from_a(hb, hb->a_pos, unbounded);
+    }
+}
+
+/*
+ * The first of the pieces that ends after pos.
+ */
+static unsigned find_piece(
+        piece const * const pieces, unsigned const n_pieces,
+        sample_pos const pos) {
+    unsigned lo = 0, hi = n_pieces - 1;
+    while (lo < hi) {
+        unsigned const mid = lo + (hi - lo) / 2;
+        if (pieces[mid].end <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Add the range [start, end) of the data first patches a into, which may be
+ * unbounded.
+ */
+static void build_from_first(
+        hunk_builder * const hb, piece const * const pieces,
+        unsigned const n_pieces, sample_pos const start,
+        sample_pos const end) {
+    for (
+            unsigned p = find_piece(pieces, n_pieces, start);
+            p < n_pieces && pieces[p].start < end; p++) {
+        sample_pos const s = MAX(start, pieces[p].start);
+        sample_pos const e = MIN(end, pieces[p].end);
+        sample_pos const n = (e == unbounded) ? unbounded : e - s;
+        if (pieces[p].from_a) {
+            build_from_a(hb, pieces[p].a_start + (s - pieces[p].start), n);
+        } else {
+            build_from_target(hb, n);
+        }
+    }
+}
+
+hunk * hunks_compose(hunk const * const first, hunk const * const second) {
+    unsigned n_pieces;
+    piece * const pieces = patch_pieces(first, &n_pieces);
+    hunk_builder hb = {};
+    sample_pos b_pos = 0;
+    for (hunk const * h = second; h != NULL; h = h->next) {
+        if (h->a.start > b_pos) {
+            build_from_first(&hb, pieces, n_pieces, b_pos, h->a.start);
+        }
+        if (h->source == HUNK_SOURCE_A) {
+            build_from_first(&hb, pieces, n_pieces, h->b.start, h->b.end);
+        } else if (h->b.end > h->b.start) {
+            build_from_target(&hb, h->b.end - h->b.start);
+        }
+        b_pos = h->a.end;
+    }
+    build_from_first(&hb, pieces, n_pieces, b_pos, unbounded);
+    free(pieces);
+    return hb.head;
+}
+
+hunk * hunks_invert(hunk const * h) {
+    hunk * head = NULL, * tail = NULL;
+    sample_pos a_pos = 0, pos = 0;
+    for (; h != NULL; h = h->next) {
+        sample_pos const start = pos + (h->a.start - a_pos);
+        sample_pos const end = start + (h->b.end - h->b.start);
+        if (
+                tail != NULL && tail->a.end == start &&
+                tail->b.end == h->a.start) {
+            tail->a.end = end;
+            tail->b.end = h->a.end;
+        } else {
+            append_hunk(&head, &tail, start, end, h->a.start, h->a.end);
+        }
+        a_pos = h->a.end;
+        pos = end;
+    }
+    return head;
+}
+
+hunk * hunks_coalesce(
+        hunk * const hunks, unsigned const sample_size,
+        hunk_costs const * const costs) {
+    uint64_t const saved = 2 * (uint64_t) costs->seek_cost + costs->hunk_cost;
+    hunk * h = hunks;
+    while (h != NULL && h->next != NULL) {
+        hunk * const next = h->next;
+        sample_pos const gap = next->a.start - h->a.end;
+        if (
+                h->source == HUNK_SOURCE_B &&
+                next->source == HUNK_SOURCE_B &&
+                next->b.start - h->b.end == gap &&
+                gap * sample_size * costs->byte_cost <= saved) {
+            h->a.end = next->a.end;
+            h->b.end = next->b.end;
+            h->next = next->next;
+            free(next);
+        } else {
+            h = next;
+        }
+    }
+    return hunks;
+}
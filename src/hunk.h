@@ -6,6 +6,50 @@
  */
 hunk * diff_chunks(restrict chunks ours, restrict chunks theirs);
 
+/** \brief As diff_chunks(), but matching chunks with a patience diff.
+ *
+ * Chunks whose hash occurs exactly once in each list are used as anchors
+ * (keeping the longest run of them that is in order in both), and the
+ * gaps between anchors are matched recursively, falling back to a longest
+ * common subsequence of hashes where there are no unique chunks left.
+ * \see BDIFF_MATCHER_PATIENCE
+ */
+hunk * diff_chunks_patience(chunks ours, chunks theirs);
+
+/** \brief Match chunks with the given matcher.
+ * \param[out] stats Where to count hash table probes (may be NULL).
+ * \see diff_chunks() diff_chunks_patience()
+ */
+hunk * match_chunks(
+    chunks a, chunks b, bdiff_matcher const matcher,
+    bdiff_stats * const stats);
+
+/** \brief Re-diff large rough hunks using finer chunks.
+ *
+ * Any hunk spanning at least min_chunks chunks (on its longer side) is
+ * replaced by a diff of the chunks of the next level down (see
+ * split_data()), recursively, so that matching material inside it is no
+ * longer reported as changed.
+ * \param[in] rough_hunks Hunks from diff_chunks() of a and b (consumed).
+ * \param[in] matcher How to match up the finer chunks.
+ * \param[out] stats Where to count hash table probes (may be NULL).
+ * \return The refined hunks.
+ */
+hunk * refine_hunks(
+    hunk * rough_hunks, chunks a, chunks b, unsigned const min_chunks,
+    bdiff_matcher const matcher, bdiff_stats * const stats);
+
+/** \brief Find data inserted by hunks that was moved or copied from a.
+ *
+ * Runs of at least min_run consecutive b chunks inside a hunk that also
+ * appear consecutively in a are split out into hunks copying from a (see
+ * HUNK_SOURCE_A), so only genuinely new data is left to come from b.
+ * \param[in] hunks Precise hunks for the diff of a and b (consumed).
+ * \return The hunks with moved data split out.
+ */
+hunk * detect_moves(
+    hunk * hunks, chunks a, chunks b, unsigned const min_run);
+
 /** \brief Free a linked list of hunks.
  */
 void hunk_free(hunk * head);
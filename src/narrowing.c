@@ -1,13 +1,24 @@
 #include "../include/bdiff.h"
 #include "hunk.h"
 #include "bdiff_defs.h"
+#include "probes.h"
+#include "scratch.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 static inline unsigned min(unsigned const a, unsigned const b) {
     return (a < b) ? a : b;
 }
 
+/*
+ * The minimum of a (possibly long) length and a bound that fits in unsigned.
+ */
+static inline unsigned min_pos(sample_pos const a, unsigned const b) {
+    return (a < b) ? a : b;
+}
+
 static inline unsigned min3(
         unsigned const a, unsigned const b, unsigned const c) {
     return min(min(a, b), c);
@@ -21,37 +32,62 @@ typedef struct {
     data_fetcher const df;
     data_seeker const ds;
     unsigned const sample_size;
+    unsigned const buf_items;
     char * const buf_a;
     char * const buf_b;
+    bdiff_stats * const stats;
 } read_seek_data;
 
+static inline unsigned fetch(
+        read_seek_data const rsd, void * const source, char * const buffer,
+        unsigned const n_items) {
+    unsigned const n_read = rsd.df(source, buffer, n_items);
+    Probe(fetch, source, n_read);
+    return n_read;
+}
+
+static inline void seek(
+        read_seek_data const rsd, void * const source, sample_pos const pos) {
+    Probe(seek, source, pos);
+    rsd.ds(source, pos);
+}
+
+static inline void count_compared(
+        read_seek_data const rsd, unsigned const n_bytes) {
+    if (rsd.stats != NULL) {
+        rsd.stats->bytes_compared += n_bytes;
+    }
+}
+
 /*
  * Search through two file sections from an aligned point returning the first
  * differing sample relative to the start of the sections.
  */
 static unsigned find_start_delta(
         read_seek_data rsd, void * const a, void * const b,
-        unsigned const a_start, unsigned const b_start,
+        sample_pos const a_start, sample_pos const b_start,
         unsigned const max_length) {
     unsigned delta_offset = 0;
-    rsd.ds(a, a_start);
-    rsd.ds(b, b_start);
+    seek(rsd, a, a_start);
+    seek(rsd, b, b_start);
     while (delta_offset < max_length) {
-        unsigned const n_read_a = rsd.df(
-            a, rsd.buf_a,
-            min(buf_size/rsd.sample_size, max_length - delta_offset));
-        unsigned const n_read_b = rsd.df(
-            b, rsd.buf_b,
-            min(buf_size/rsd.sample_size, max_length - delta_offset));
+        unsigned const n_read_a = fetch(
+            rsd, a, rsd.buf_a,
+            min(rsd.buf_items, max_length - delta_offset));
+        unsigned const n_read_b = fetch(
+            rsd, b, rsd.buf_b,
+            min(rsd.buf_items, max_length - delta_offset));
         unsigned const min_read = min(n_read_a, n_read_b);
         for (
                 unsigned byte_idx = 0;
                 byte_idx < (rsd.sample_size * min_read);
                 byte_idx++) {
             if (rsd.buf_a[byte_idx] != rsd.buf_b[byte_idx]) {
+                count_compared(rsd, byte_idx + 1);
                 return (byte_idx / rsd.sample_size) + delta_offset;
             }
         }
+        count_compared(rsd, rsd.sample_size * min_read);
         if (n_read_a != n_read_b) {
             return min_read + delta_offset;
         } else {
@@ -71,15 +107,15 @@ static unsigned find_start_delta(
  */
 static unsigned find_end_delta(
         read_seek_data rsd, unsigned end_delta, void * const a,
-        unsigned const a_end, void * const b, unsigned const b_end) {
-    rsd.ds(a, a_end - end_delta);
-    rsd.ds(b, b_end - end_delta);
+        sample_pos const a_end, void * const b, sample_pos const b_end) {
+    seek(rsd, a, a_end - end_delta);
+    seek(rsd, b, b_end - end_delta);
     unsigned loop_start_delta = end_delta;
     while (loop_start_delta) {
-        unsigned const n_read = rsd.df(
-            a, rsd.buf_a, min(buf_size/rsd.sample_size, loop_start_delta));
+        unsigned const n_read = fetch(
+            rsd, a, rsd.buf_a, min(rsd.buf_items, loop_start_delta));
         assert(n_read != 0);
-        assert(rsd.df(b, rsd.buf_b, n_read) == n_read);
+        assert(fetch(rsd, b, rsd.buf_b, n_read) == n_read);
         for (
                 unsigned byte_idx = 0; byte_idx < (rsd.sample_size * n_read);
                 byte_idx++) {
@@ -88,6 +124,7 @@ static unsigned find_end_delta(
                     loop_start_delta - (byte_idx / rsd.sample_size) - 1;
             }
         }
+        count_compared(rsd, rsd.sample_size * n_read);
         loop_start_delta -= n_read;
     }
     return end_delta;
@@ -99,19 +136,21 @@ static unsigned find_end_delta(
  */
 static unsigned slidey_aligner(
         read_seek_data rsd, void * const fixed, void * const sliding,
-        unsigned const fixed_start, unsigned const sliding_end,
+        sample_pos const fixed_start, sample_pos const sliding_end,
         unsigned slide_distance) {
+    Probe(slide__start, fixed_start, sliding_end, slide_distance);
     for (; slide_distance; slide_distance--) {
-        rsd.ds(sliding, sliding_end - slide_distance);
-        rsd.ds(fixed, fixed_start);
-        assert(rsd.df(fixed, rsd.buf_a, 1) == 1);
-        assert(rsd.df(sliding, rsd.buf_b, 1) == 1);
+        seek(rsd, sliding, sliding_end - slide_distance);
+        seek(rsd, fixed, fixed_start);
+        assert(fetch(rsd, fixed, rsd.buf_a, 1) == 1);
+        assert(fetch(rsd, sliding, rsd.buf_b, 1) == 1);
         unsigned i = 0;
         for (; i < rsd.sample_size; i++) {
             if (rsd.buf_a[i] != rsd.buf_b[i]) {
                 break;
             }
         }
+        count_compared(rsd, (i < rsd.sample_size) ? i + 1 : i);
         if (i != rsd.sample_size) {
             continue;
         }
@@ -122,45 +161,103 @@ static unsigned slidey_aligner(
             break;
         }
     }
+    Probe(slide__done, slide_distance);
     return slide_distance;
 }
 
 /*
- * Subtract 2 unsigned numbers returning 0 when we would otherwise underflow.
+ * Subtract 2 positions returning 0 when we would otherwise underflow.
  */
-static inline unsigned clamped_subtract(unsigned const a, unsigned const b) {
+static inline sample_pos clamped_subtract(
+        sample_pos const a, sample_pos const b) {
     return (a > b) ? a - b : 0;
 }
 
+static inline view probe_start(view const v, unsigned const length) {
+    return (view) {.start = v.start, .end = v.start + length};
+}
+
+static inline view probe_end(view const v, unsigned const length) {
+    return (view) {
+        .start = v.end - min_pos(v.end - v.start, length), .end = v.end};
+}
+
+/*
+ * Tell the prefetcher which parts of a and b narrowing the next batch of
+ * hunks will read, returning the first hunk after the batch.
+ */
+static hunk const * prefetch_hunks(
+        hunk const * h, data_prefetcher const dp, void * const a,
+        void * const b, unsigned const probe_length) {
+    view a_ranges[2 * prefetch_batch_hunks];
+    view b_ranges[2 * prefetch_batch_hunks];
+    unsigned n_ranges = 0;
+    for (; h != NULL && n_ranges < 2 * prefetch_batch_hunks; h = h->next) {
+        a_ranges[n_ranges] = probe_start(h->a, probe_length);
+        b_ranges[n_ranges++] = probe_start(h->b, probe_length);
+        a_ranges[n_ranges] = probe_end(h->a, probe_length);
+        b_ranges[n_ranges++] = probe_end(h->b, probe_length);
+    }
+    dp(a, a_ranges, n_ranges);
+    dp(b, b_ranges, n_ranges);
+    return h;
+}
+
 /*
  * Takes a set of "rough" hunks (start and end points aligned to chunk
  * boundaries) and reads the data around the start and end points to narrow
  * down exactly when the differing region starts and ends.
  */
-hunk * const bdiff_narrow(
+hunk * const bdiff_narrow_with_options(
         hunk * rough_hunks, unsigned const sample_size, data_seeker const ds,
-        data_fetcher const df, void * const a, void * const b) {
+        data_fetcher const df, void * const a, void * const b,
+        bdiff_options const * const opts) {
+    Probe(narrow__start, rough_hunks);
+    bdiff_options const o = bdiff_options_complete(
+        opts, bdiff_options_default());
+    unsigned const max_chunk_size = o.max_chunk_size;
+    unsigned const buf_items = o.narrow_buf_size / sample_size;
+    assert(buf_items != 0);
     hunk * precise_hunks_head = NULL, * precise_hunks_tail = NULL;
     unsigned end_shove_a = 0, end_shove_b = 0;
-    char buf_a[buf_size], buf_b[buf_size];
+    char * const buf_a = scratch_get(
+        o.scratch, SCRATCH_NARROW_A, (size_t) buf_items * sample_size);
+    char * const buf_b = scratch_get(
+        o.scratch, SCRATCH_NARROW_B, (size_t) buf_items * sample_size);
     read_seek_data rsd = (read_seek_data) {
-        .df = df, .ds = ds, .sample_size = sample_size, .buf_a = buf_a,
-        .buf_b = buf_b};
+        .df = df, .ds = ds, .sample_size = sample_size,
+        .buf_items = buf_items, .buf_a = buf_a, .buf_b = buf_b,
+        .stats = o.stats};
+    hunk const * next_prefetch = rough_hunks;
     for (; rough_hunks != NULL; rough_hunks = rough_hunks->next) {
+        if (o.prefetcher != NULL && rough_hunks == next_prefetch) {
+            next_prefetch = prefetch_hunks(
+                rough_hunks, o.prefetcher, a, b, buf_items);
+        }
         if (end_shove_a) {
             end_shove_a = slidey_aligner(
                 rsd, a, b, rough_hunks->a.start, precise_hunks_tail->b.end,
                 min3(
-                    precise_hunks_tail->b.end - precise_hunks_tail->b.start,
-                    rough_hunks->a.end - rough_hunks->a.start,
+                    min_pos(
+                        precise_hunks_tail->b.end -
+                            precise_hunks_tail->b.start,
+                        max_chunk_size),
+                    min_pos(
+                        rough_hunks->a.end - rough_hunks->a.start,
+                        max_chunk_size),
                     max_chunk_size));
             precise_hunks_tail->b.end -= end_shove_a;
         } else if (end_shove_b) {
             end_shove_b = slidey_aligner(
                 rsd, b, a, rough_hunks->b.start, precise_hunks_tail->a.end,
                 min3(
-                    precise_hunks_tail->a.end - precise_hunks_tail->a.start,
-                    rough_hunks->b.end - rough_hunks->b.start,
+                    min_pos(
+                        precise_hunks_tail->a.end -
+                            precise_hunks_tail->a.start,
+                        max_chunk_size),
+                    min_pos(
+                        rough_hunks->b.end - rough_hunks->b.start,
+                        max_chunk_size),
                     max_chunk_size));
             precise_hunks_tail->a.end -= end_shove_b;
         }
@@ -193,8 +290,12 @@ hunk * const bdiff_narrow(
         precise_hunks_tail->a.end += max(end_shove_a, end_shove_b);
         precise_hunks_tail->b.end += max(end_shove_a, end_shove_b);
         unsigned end_delta = min3(
-            precise_hunks_tail->a.end - precise_hunks_tail->a.start,
-            precise_hunks_tail->b.end - precise_hunks_tail->b.start,
+            min_pos(
+                precise_hunks_tail->a.end - precise_hunks_tail->a.start,
+                max_chunk_size),
+            min_pos(
+                precise_hunks_tail->b.end - precise_hunks_tail->b.start,
+                max_chunk_size),
             max_chunk_size);
         if (end_delta) {
             end_delta = find_end_delta(
@@ -204,5 +305,241 @@ hunk * const bdiff_narrow(
         precise_hunks_tail->a.end -= end_delta;
         precise_hunks_tail->b.end -= end_delta;
     }
+    scratch_put(o.scratch, buf_a);
+    scratch_put(o.scratch, buf_b);
+    Probe(narrow__done, precise_hunks_head);
     return precise_hunks_head;
 }
+
+hunk * const bdiff_narrow(
+        hunk * rough_hunks, unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, void * const b) {
+    return bdiff_narrow_with_options(
+        rough_hunks, sample_size, ds, df, a, b, NULL);
+}
+
+// Bytes a hunk takes beyond its data (its two views):
+#define hunk_view_bytes (4 * sizeof(sample_pos))
+
+/*
+ * A run of samples a[a_start, a_start + length) equal to b[b_start, ...).
+ */
+typedef struct {
+    unsigned a_start;
+    unsigned b_start;
+    unsigned length;
+} diagonal;
+
+typedef struct {
+    read_seek_data rsd;
+    unsigned max_samples;
+    // Furthest x reached on each diagonal k after d edits, for every d
+    // (row d holding -d <= k <= d), -1 where k can't be reached
+    int * trace;
+    diagonal * diagonals;
+} fine_diff_state;
+
+static unsigned read_range(
+        read_seek_data const rsd, void * const source, char * const buffer,
+        sample_pos const pos, unsigned const n) {
+    seek(rsd, source, pos);
+    unsigned total = 0;
+    while (total < n) {
+        unsigned const n_read = fetch(
+            rsd, source, buffer + (size_t) total * rsd.sample_size,
+            n - total);
+        if (n_read == 0) {
+            break;
+        }
+        total += n_read;
+    }
+    return total;
+}
+
+static inline int * trace_row(int * const trace, int const d) {
+    return trace + d * d + d;
+}
+
+/*
+ * The x a Myers diff reaches on diagonal k before following its snake,
+ * by an insertion from diagonal k + 1 or a deletion from k - 1 (-1 if
+ * neither reaches it).
+ */
+static inline int snake_start(
+        int const * const prev, int const d, int const k, int * const from) {
+    int const down = (k + 1 <= d - 1) ? prev[k + 1] : -1;
+    int const right = (k - 1 >= 1 - d && prev[k - 1] >= 0) ?
+        prev[k - 1] + 1 : -1;
+    *from = (down >= right) ? k + 1 : k - 1;
+    return (down >= right) ? down : right;
+}
+
+/*
+ * Find the samples left unchanged by a shortest edit script taking a[0, n)
+ * to b[0, m), following Myers' O(ND) algorithm. Returns the number of runs
+ * of them put in fs->diagonals, in order, or -1 if more than max_d edits
+ * are needed.
+ */
+static int myers_diagonals(
+        fine_diff_state * const fs, unsigned const n, unsigned const m,
+        int const max_d) {
+    unsigned const sample_size = fs->rsd.sample_size;
+    char const * const a = fs->rsd.buf_a, * const b = fs->rsd.buf_b;
+    for (int d = 0; d <= max_d; d++) {
+        int * const v = trace_row(fs->trace, d);
+        int const * const prev = trace_row(fs->trace, d - 1);
+        for (int k = -d; k <= d; k += 2) {
+            int from = k;
+            int x = (d == 0) ? 0 : snake_start(prev, d, k, &from);
+            if (x < 0 || x > (int) n || x - k < 0 || x - k > (int) m) {
+                v[k] = -1;
+                continue;
+            }
+            while (
+                    x < (int) n && x - k < (int) m &&
+                    !memcmp(
+                        a + (size_t) x * sample_size,
+                        b + (size_t) (x - k) * sample_size, sample_size)) {
+                x++;
+            }
+            v[k] = x;
+            if (x < (int) n || x - k < (int) m) {
+                continue;
+            }
+            // Walk back through the edits, collecting the snakes between
+            // them (last first)
+            int n_diagonals = 0;
+            for (int e = d;; e--) {
+                // The first snake starts at the origin, with no edit before
+                // it to follow back
+                int const start = (e == 0) ?
+                    0 : snake_start(trace_row(fs->trace, e - 1), e, k, &from);
+                fs->diagonals[n_diagonals++] = (diagonal) {
+                    .a_start = start, .b_start = start - k,
+                    .length = trace_row(fs->trace, e)[k] - start};
+                if (e == 0) {
+                    break;
+                }
+                k = from;
+            }
+            for (int i = 0; i < n_diagonals / 2; i++) {
+                diagonal const t = fs->diagonals[i];
+                fs->diagonals[i] = fs->diagonals[n_diagonals - 1 - i];
+                fs->diagonals[n_diagonals - 1 - i] = t;
+            }
+            return n_diagonals;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Replace h with the hunks between the samples a fine diff left unchanged,
+ * if that saves bytes, returning whether it did.
+ */
+static int fine_diff_hunk(
+        fine_diff_state * const fs, hunk const * const h, void * const a,
+        void * const b, hunk ** const head, hunk ** const tail) {
+    sample_pos const a_length = h->a.end - h->a.start;
+    sample_pos const b_length = h->b.end - h->b.start;
+    if (
+            h->source != HUNK_SOURCE_B || !a_length || !b_length ||
+            a_length > fs->max_samples || b_length > fs->max_samples) {
+        return 0;
+    }
+    unsigned const n = a_length, m = b_length;
+    if (
+            read_range(fs->rsd, a, fs->rsd.buf_a, h->a.start, n) != n ||
+            read_range(fs->rsd, b, fs->rsd.buf_b, h->b.start, m) != m) {
+        return 0;
+    }
+    int const n_diagonals = myers_diagonals(
+        fs, n, m, min(max_fine_edits, (n + m) / 2));
+    if (n_diagonals < 0) {
+        return 0;
+    }
+    // Count the hunks between the diagonals and the samples they take
+    unsigned n_hunks = 0, inserted = 0, x = 0, y = 0;
+    for (int i = 0; i <= n_diagonals; i++) {
+        diagonal const next = (i < n_diagonals) ?
+            fs->diagonals[i] : (diagonal) {.a_start = n, .b_start = m};
+        if (i < n_diagonals && next.length == 0) {
+            continue;
+        }
+        if (next.a_start > x || next.b_start > y) {
+            n_hunks++;
+            inserted += next.b_start - y;
+        }
+        x = next.a_start + next.length;
+        y = next.b_start + next.length;
+    }
+    unsigned const sample_size = fs->rsd.sample_size;
+    if (
+            (size_t) inserted * sample_size + n_hunks * hunk_view_bytes >=
+            (size_t) m * sample_size + hunk_view_bytes) {
+        return 0;
+    }
+    x = y = 0;
+    for (int i = 0; i <= n_diagonals; i++) {
+        diagonal const next = (i < n_diagonals) ?
+            fs->diagonals[i] : (diagonal) {.a_start = n, .b_start = m};
+        if (i < n_diagonals && next.length == 0) {
+            continue;
+        }
+        if (next.a_start > x || next.b_start > y) {
+            append_hunk(
+                head, tail, h->a.start + x, h->a.start + next.a_start,
+                h->b.start + y, h->b.start + next.b_start);
+        }
+        x = next.a_start + next.length;
+        y = next.b_start + next.length;
+    }
+    return 1;
+}
+
+hunk * fine_diff_hunks(
+        hunk * hunks, unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, void * const b,
+        bdiff_options const * const opts) {
+    unsigned const max_samples = opts->fine_max_samples;
+    unsigned const max_d = min(max_fine_edits, max_samples);
+    fine_diff_state fs = {
+        .rsd = {
+            .df = df, .ds = ds, .sample_size = sample_size,
+            .buf_items = max_samples,
+            .buf_a = scratch_get(
+                opts->scratch, SCRATCH_NARROW_A,
+                (size_t) max_samples * sample_size),
+            .buf_b = scratch_get(
+                opts->scratch, SCRATCH_NARROW_B,
+                (size_t) max_samples * sample_size),
+            .stats = opts->stats},
+        .max_samples = max_samples,
+        .trace = scratch_get(
+            opts->scratch, SCRATCH_FINE_TRACE,
+            (size_t) (max_d + 1) * (max_d + 1) * sizeof(int)),
+        .diagonals = scratch_get(
+            opts->scratch, SCRATCH_FINE_DIAGONALS,
+            (max_d + 1) * sizeof(diagonal))};
+    hunk * head = NULL, * tail = NULL;
+    while (hunks != NULL) {
+        hunk * const h = hunks;
+        hunks = h->next;
+        if (fine_diff_hunk(&fs, h, a, b, &head, &tail)) {
+            free(h);
+            continue;
+        }
+        h->next = NULL;
+        if (tail != NULL) {
+            tail->next = h;
+        } else {
+            head = h;
+        }
+        tail = h;
+    }
+    scratch_put(opts->scratch, fs.rsd.buf_a);
+    scratch_put(opts->scratch, fs.rsd.buf_b);
+    scratch_put(opts->scratch, fs.trace);
+    scratch_put(opts->scratch, fs.diagonals);
+    return head;
+}
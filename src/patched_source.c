@@ -0,0 +1,128 @@
+#include "../include/patched_source.h"
+#include <stdlib.h>
+
+/*
+ * A stretch of the patched data, taken from one place in a or b.
+ */
+typedef struct {
+    sample_pos start;
+    sample_pos length;
+    unsigned source;
+    sample_pos source_start;
+} segment;
+
+/*
+ * One of the sources being patched, and where it was last left.
+ */
+typedef struct {
+    void * source;
+    sample_pos pos;
+} side;
+
+struct patched_source {
+    segment * segments;
+    unsigned n_segments;
+    sample_pos length;
+    unsigned sample_size;
+    data_seeker ds;
+    data_fetcher df;
+    side sides[2];
+    // The segment holding pos (n_segments at the end):
+    unsigned segment;
+    sample_pos pos;
+};
+
+static void add_segment(
+        patched_source * const ps, unsigned const source,
+        sample_pos const start, sample_pos const end) {
+    if (start < end) {
+        ps->segments[ps->n_segments++] = (segment) {
+            .start = ps->length, .length = end - start, .source = source,
+            .source_start = start};
+        ps->length += end - start;
+    }
+}
+
+patched_source * patched_source_new(
+        hunk const * const hunks, sample_pos const a_length,
+        unsigned const sample_size, data_seeker const ds,
+        data_fetcher const df, void * const a, void * const b) {
+    unsigned n_hunks = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        n_hunks++;
+    }
+    patched_source * const ps = malloc(sizeof(patched_source));
+    // The source's position is unknown until it is first sought:
+    *ps = (patched_source) {
+        .segments = malloc((2 * n_hunks + 1) * sizeof(segment)),
+        .sample_size = sample_size, .ds = ds, .df = df,
+        .sides = {
+            [HUNK_SOURCE_B] = {.source = b, .pos = UINT64_MAX},
+            [HUNK_SOURCE_A] = {.source = a, .pos = UINT64_MAX}}};
+    sample_pos a_pos = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        add_segment(ps, HUNK_SOURCE_A, a_pos, h->a.start);
+        add_segment(ps, h->source, h->b.start, h->b.end);
+        a_pos = h->a.end;
+    }
+    add_segment(ps, HUNK_SOURCE_A, a_pos, a_length);
+    return ps;
+}
+
+void patched_source_free(patched_source * const ps) {
+    free(ps->segments);
+    free(ps);
+}
+
+sample_pos patched_source_length(patched_source const * const ps) {
+    return ps->length;
+}
+
+unsigned patched_source_fetcher(
+        void * source, char * buffer, unsigned n_items) {
+    patched_source * const ps = source;
+    unsigned total = 0;
+    while (total < n_items && ps->segment < ps->n_segments) {
+        segment const * const seg = &ps->segments[ps->segment];
+        sample_pos const offset = ps->pos - seg->start;
+        if (offset == seg->length) {
+            ps->segment++;
+            continue;
+        }
+        side * const s = &ps->sides[seg->source];
+        sample_pos const pos = seg->source_start + offset;
+        if (s->pos != pos) {
+            ps->ds(s->source, pos);
+            s->pos = pos;
+        }
+        sample_pos const left = seg->length - offset;
+        unsigned const wanted = (left < n_items - total) ?
+            left : n_items - total;
+        unsigned const n_read = ps->df(
+            s->source, buffer + (size_t) total * ps->sample_size, wanted);
+        if (n_read == 0) {
+            // The source is shorter than the hunks say
+            break;
+        }
+        s->pos += n_read;
+        ps->pos += n_read;
+        total += n_read;
+    }
+    return total;
+}
+
+void patched_source_seeker(void * source, sample_pos pos) {
+    patched_source * const ps = source;
+    // Find the last segment starting at or before pos:
+    unsigned lo = 0, hi = ps->n_segments;
+    while (lo < hi) {
+        unsigned const mid = lo + (hi - lo) / 2;
+        if (ps->segments[mid].start <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    ps->segment = lo ? lo - 1 : 0;
+    ps->pos = (pos < ps->length) ? pos : ps->length;
+}
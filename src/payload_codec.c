@@ -0,0 +1,213 @@
+#include "payload_codec.h"
+
+#define max_order 4
+#define max_rice_param 40
+// Quotients this large are written as the raw value instead:
+#define rice_escape 32
+
+typedef struct {
+    unsigned char * out;
+    size_t pos;
+    uint64_t acc;
+    unsigned n_bits;
+} bit_writer;
+
+typedef struct {
+    unsigned char const * in;
+    size_t n_bytes;
+    size_t pos;
+    uint64_t acc;
+    unsigned n_bits;
+} bit_reader;
+
+static inline uint64_t low_bits(uint64_t const value, unsigned const n) {
+    return value & ((((uint64_t) 1) << n) - 1);
+}
+
+/*
+ * Write the low n (at most 56) bits of value, most significant first.
+ */
+static void put_bits(
+        bit_writer * const w, uint64_t const value, unsigned const n) {
+    w->acc = (w->acc << n) | low_bits(value, n);
+    w->n_bits += n;
+    while (w->n_bits >= 8) {
+        w->n_bits -= 8;
+        w->out[w->pos++] = w->acc >> w->n_bits;
+    }
+    w->acc = low_bits(w->acc, w->n_bits);
+}
+
+static uint64_t get_bits(bit_reader * const r, unsigned const n) {
+    while (r->n_bits < n) {
+        // Reading past the end gives zeros, caught by the caller
+        r->acc = (r->acc << 8) | ((r->pos < r->n_bytes) ? r->in[r->pos] : 0);
+        r->pos++;
+        r->n_bits += 8;
+    }
+    r->n_bits -= n;
+    uint64_t const value = r->acc >> r->n_bits;
+    r->acc = low_bits(r->acc, r->n_bits);
+    return value;
+}
+
+static inline uint64_t zigzag(int64_t const v) {
+    return (v < 0) ? ((uint64_t) -(v + 1) << 1) | 1 : (uint64_t) v << 1;
+}
+
+static inline int64_t unzigzag(uint64_t const u) {
+    return (u & 1) ? -(int64_t) (u >> 1) - 1 : (int64_t) (u >> 1);
+}
+
+/*
+ * The fixed polynomial prediction of x[i], falling back to lower orders for
+ * the first samples.
+ */
+static inline int64_t predict(
+        int64_t const * const x, unsigned const i, unsigned const order) {
+    switch ((i < order) ? i : order) {
+        case 0:
+            return 0;
+        case 1:
+            return x[i - 1];
+        case 2:
+            return 2 * x[i - 1] - x[i - 2];
+        case 3:
+            return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+        default:
+            return 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+    }
+}
+
+static uint64_t rice_bits(
+        uint64_t const * const u, unsigned const n, unsigned const k) {
+    uint64_t bits = 0;
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t const q = u[i] >> k;
+        bits += (q < rice_escape) ? q + 1 + k : rice_escape + 64;
+    }
+    return bits;
+}
+
+static void encode_channel(
+        bit_writer * const w, int32_t const * const samples,
+        unsigned const n, unsigned const stride) {
+    uint32_t set = 0;
+    for (unsigned i = 0; i < n; i++) {
+        set |= (uint32_t) samples[i * stride];
+    }
+    unsigned wasted = 0;
+    while (set && !((set >> wasted) & 1)) {
+        wasted++;
+    }
+    int64_t x[payload_block_frames];
+    for (unsigned i = 0; i < n; i++) {
+        x[i] = samples[i * stride] >> wasted;
+    }
+    unsigned order = 0;
+    uint64_t best_total = UINT64_MAX;
+    for (unsigned o = 0; o <= max_order; o++) {
+        uint64_t total = 0;
+        for (unsigned i = 0; i < n; i++) {
+            int64_t const r = x[i] - predict(x, i, o);
+            total += (r < 0) ? -(uint64_t) r : (uint64_t) r;
+        }
+        if (total < best_total) {
+            best_total = total;
+            order = o;
+        }
+    }
+    uint64_t u[payload_block_frames];
+    for (unsigned i = 0; i < n; i++) {
+        u[i] = zigzag(x[i] - predict(x, i, order));
+    }
+    unsigned k = 0;
+    uint64_t best_bits = UINT64_MAX;
+    for (unsigned p = 0; p <= max_rice_param; p++) {
+        uint64_t const bits = rice_bits(u, n, p);
+        if (bits < best_bits) {
+            best_bits = bits;
+            k = p;
+        }
+    }
+    put_bits(w, wasted, 5);
+    put_bits(w, order, 3);
+    put_bits(w, k, 6);
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t const q = u[i] >> k;
+        if (q < rice_escape) {
+            put_bits(w, 0, q);
+            put_bits(w, 1, 1);
+            put_bits(w, u[i], k);
+        } else {
+            put_bits(w, 0, rice_escape);
+            put_bits(w, u[i] >> 32, 32);
+            put_bits(w, u[i], 32);
+        }
+    }
+}
+
+static int decode_channel(
+        bit_reader * const r, int32_t * const samples, unsigned const n,
+        unsigned const stride) {
+    unsigned const wasted = get_bits(r, 5);
+    unsigned const order = get_bits(r, 3);
+    unsigned const k = get_bits(r, 6);
+    if (order > max_order || k > max_rice_param) {
+        return 0;
+    }
+    int64_t x[payload_block_frames];
+    for (unsigned i = 0; i < n; i++) {
+        unsigned q = 0;
+        while (q < rice_escape && !get_bits(r, 1)) {
+            q++;
+            if (r->pos > r->n_bytes) {
+                return 0;
+            }
+        }
+        uint64_t u;
+        if (q < rice_escape) {
+            u = ((uint64_t) q << k) | get_bits(r, k);
+        } else {
+            u = get_bits(r, 32) << 32;
+            u |= get_bits(r, 32);
+        }
+        x[i] = unzigzag(u) + predict(x, i, order);
+        samples[i * stride] = (int32_t) ((uint32_t) x[i] << wasted);
+    }
+    return 1;
+}
+
+size_t payload_max_bytes(unsigned const n_frames, unsigned const channels) {
+    // Every residual escaped, plus each channel's header
+    return (size_t) channels * (n_frames * (rice_escape + 64) / 8 + 3);
+}
+
+size_t payload_encode(
+        int32_t const * const samples, unsigned const n_frames,
+        unsigned const channels, unsigned char * const out) {
+    bit_writer w = {.out = out};
+    for (unsigned c = 0; c < channels; c++) {
+        encode_channel(&w, samples + c, n_frames, channels);
+    }
+    if (w.n_bits) {
+        put_bits(&w, 0, 8 - w.n_bits);
+    }
+    return w.pos;
+}
+
+int payload_decode(
+        unsigned char const * const in, size_t const n_bytes,
+        unsigned const n_frames, unsigned const channels,
+        int32_t * const samples) {
+    if (n_frames > payload_block_frames) {
+        return 0;
+    }
+    bit_reader r = {.in = in, .n_bytes = n_bytes};
+    for (unsigned c = 0; c < channels; c++) {
+        if (!decode_channel(&r, samples + c, n_frames, channels)) {
+            return 0;
+        }
+    }
+    return r.pos == n_bytes;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/** \brief Largest number of frames encoded as one block. */
+#define payload_block_frames 4096
+
+/** \brief Largest number of bytes a block of frames may encode to.
+ */
+size_t payload_max_bytes(unsigned const n_frames, unsigned const channels);
+
+/** \brief Losslessly encode a block of interleaved integer samples.
+ *
+ * Each channel is coded on its own: low bits that are zero in every sample
+ * (as in 16 bit audio read as 32 bit) are dropped, the best of the fixed
+ * polynomial predictors of orders 0 to 4 is chosen, and what it fails to
+ * predict is Rice coded with the best parameter for the block.
+ *
+ * The fixed predictors (as FLAC's) are used rather than LPC with quantised
+ * coefficients stored per block, which would decode just as independently
+ * and often predict better, for simplicity: there are no coefficients to
+ * search for, quantise or store, and no dependency on an encoder library.
+ * \param[in] samples n_frames * channels samples.
+ * \param[in] n_frames The number of frames (at most payload_block_frames).
+ * \param[out] out At least payload_max_bytes() bytes to encode into.
+ * \return The number of bytes of out used.
+ */
+size_t payload_encode(
+    int32_t const * const samples, unsigned const n_frames,
+    unsigned const channels, unsigned char * const out);
+
+/** \brief Decode a block encoded with payload_encode().
+ * \param[in] in The encoded block.
+ * \param[in] n_bytes The number of bytes in the encoded block.
+ * \param[out] samples Where to write the n_frames * channels samples.
+ * \return Zero if the block is corrupt (not exactly n_bytes long).
+ */
+int payload_decode(
+    unsigned char const * const in, size_t const n_bytes,
+    unsigned const n_frames, unsigned const channels,
+    int32_t * const samples);
@@ -0,0 +1,19 @@
+#pragma once
+
+/** \brief Static tracepoints (USDT) for tools such as perf and bpftrace.
+ *
+ * Probes are in the libadiff provider, so can be listed with e.g.
+ * `perf list sdt_libadiff:*` or `bpftrace -l 'usdt:libadiff.so:*'`. A
+ * probe site is a single nop until a tracer attaches to it, and without
+ * sys/sdt.h (or with the probes meson option disabled) probes compile to
+ * nothing, their arguments not even being evaluated.
+ *
+ * Names use a double underscore for the dash tracers show, so
+ * Probe(split__start, source) appears as split-start.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define Probe(name, ...) STAP_PROBEV(libadiff, name, ##__VA_ARGS__)
+#else
+#define Probe(name, ...) ((void) 0)
+#endif
@@ -50,14 +50,6 @@ void hash_data_reset(hash_data * const hd) {
     hd->h = 1;
 }
 
-hash hash_data_update(hash_data * const hd, unsigned char const next) {
-    hash const overflow = hd->table[hd->h >> (hash_len - 8)];
-    hd->h <<= 8;
-    hd->h |= next;
-    hd->h ^= overflow;
-    return hd->h;
-}
-
 void window_data_reset(window_data * const wd) {
     hash_data_reset(&wd->hd);
     for (unsigned i = 0; i < wd->window_size - 1; i++) {
@@ -78,13 +70,3 @@ window_data window_data_init(
     return wd;
 }
 
-hash window_data_update(window_data * const w, unsigned char const next) {
-    w->h ^= w->undo_table[w->undo_buf[w->buf_pos]];
-
-    w->undo_buf[w->buf_pos] = next;
-    if (++w->buf_pos == w->window_size) {
-        w->buf_pos = 0;
-    }
-
-    return hash_data_update(&w->hd, next);
-}
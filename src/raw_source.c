@@ -0,0 +1,301 @@
+#include "../include/raw_source.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define raw_uring_depth 64
+
+/*
+ * A range of the file read into memory by the prefetcher.
+ */
+typedef struct {
+    view v;
+    char * data;
+} extent;
+
+struct raw_source {
+    int fd;
+    unsigned sample_size;
+    sample_pos data_offset;
+    sample_pos pos;
+    // Sorted, non-overlapping:
+    extent * extents;
+    unsigned n_extents;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    int ring_ready;
+#endif
+};
+
+raw_source * raw_source_open(
+        char const * const path, unsigned const sample_size,
+        sample_pos const data_offset) {
+    int const fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    raw_source * const rs = calloc(1, sizeof(raw_source));
+    rs->fd = fd;
+    rs->sample_size = sample_size;
+    rs->data_offset = data_offset;
+#ifdef HAVE_LIBURING
+    rs->ring_ready = !io_uring_queue_init(raw_uring_depth, &rs->ring, 0);
+#endif
+    return rs;
+}
+
+static void free_extents(raw_source * const rs) {
+    for (unsigned e = 0; e < rs->n_extents; e++) {
+        free(rs->extents[e].data);
+    }
+    free(rs->extents);
+    rs->extents = NULL;
+    rs->n_extents = 0;
+}
+
+void raw_source_disable_io_uring(raw_source * const rs) {
+#ifdef HAVE_LIBURING
+    if (rs->ring_ready) {
+        // Drops any reads queued but not submitted
+        io_uring_queue_exit(&rs->ring);
+        rs->ring_ready = 0;
+    }
+#endif
+}
+
+void raw_source_close(raw_source * const rs) {
+    free_extents(rs);
+    raw_source_disable_io_uring(rs);
+    close(rs->fd);
+    free(rs);
+}
+
+static inline off_t file_offset(
+        raw_source const * const rs, sample_pos const pos) {
+    return rs->data_offset + pos * rs->sample_size;
+}
+
+/*
+ * Read whole items at pos, returning how many were read.
+ */
+static unsigned read_items(
+        raw_source const * const rs, char * const buffer,
+        sample_pos const pos, unsigned const n_items) {
+    size_t const wanted = (size_t) n_items * rs->sample_size;
+    size_t done = 0;
+    while (done < wanted) {
+        ssize_t const n_read = pread(
+            rs->fd, buffer + done, wanted - done,
+            file_offset(rs, pos) + done);
+        if (n_read <= 0) {
+            break;
+        }
+        done += n_read;
+    }
+    return done / rs->sample_size;
+}
+
+/*
+ * The first extent ending after pos (or n_extents if there are none).
+ */
+static unsigned find_extent(
+        raw_source const * const rs, sample_pos const pos) {
+    unsigned lo = 0, hi = rs->n_extents;
+    while (lo < hi) {
+        unsigned const mid = (lo + hi) / 2;
+        if (rs->extents[mid].v.end <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+unsigned raw_source_fetcher(void * source, char * buffer, unsigned n_items) {
+    raw_source * const rs = source;
+    unsigned total = 0;
+    unsigned e = find_extent(rs, rs->pos);
+    while (total < n_items) {
+        // Skip extents behind us (or left empty by a failed prefetch):
+        while (e < rs->n_extents && rs->extents[e].v.end <= rs->pos) {
+            e++;
+        }
+        char * const dst = buffer + (size_t) total * rs->sample_size;
+        unsigned wanted = n_items - total;
+        unsigned n;
+        if (e < rs->n_extents && rs->extents[e].v.start <= rs->pos) {
+            extent const * const x = &rs->extents[e];
+            if (x->v.end - rs->pos < wanted) {
+                wanted = x->v.end - rs->pos;
+            }
+            memcpy(
+                dst, x->data + (rs->pos - x->v.start) * rs->sample_size,
+                (size_t) wanted * rs->sample_size);
+            n = wanted;
+        } else {
+            if (
+                    e < rs->n_extents &&
+                    rs->extents[e].v.start - rs->pos < wanted) {
+                wanted = rs->extents[e].v.start - rs->pos;
+            }
+            n = read_items(rs, dst, rs->pos, wanted);
+        }
+        total += n;
+        rs->pos += n;
+        if (n < wanted) {
+            break;
+        }
+    }
+    return total;
+}
+
+void raw_source_seeker(void * source, sample_pos pos) {
+    ((raw_source *) source)->pos = pos;
+}
+
+static int view_cmp(void const * const a, void const * const b) {
+    view const * const va = a, * const vb = b;
+    return (va->start > vb->start) - (va->start < vb->start);
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * Wait for n reads to complete, noting how many items each extent got in
+ * lengths, and returning how many completions were reaped.
+ */
+static unsigned uring_reap(
+        raw_source * const rs, unsigned const n, sample_pos * const lengths) {
+    unsigned reaped = 0;
+    while (reaped < n) {
+        struct io_uring_cqe * cqe;
+        int const err = io_uring_wait_cqe(&rs->ring, &cqe);
+        if (err == -EINTR) {
+            continue;
+        }
+        if (err < 0) {
+            break;
+        }
+        extent const * const x = io_uring_cqe_get_data(cqe);
+        // Keep only what was read (none on error):
+        lengths[x - rs->extents] =
+            (cqe->res > 0) ? cqe->res / rs->sample_size : 0;
+        io_uring_cqe_seen(&rs->ring, cqe);
+        reaped++;
+    }
+    return reaped;
+}
+
+/*
+ * Read the extents in batches of reads submitted together, returning zero if
+ * the ring couldn't be used (so they must be read some other way). The
+ * extents are only cut short to what was read once every read is done, and
+ * a ring that fails is shut down rather than used again.
+ */
+static int uring_read_extents(raw_source * const rs) {
+    if (!rs->ring_ready) {
+        return 0;
+    }
+    sample_pos * const lengths = malloc(rs->n_extents * sizeof(sample_pos));
+    int ok = 1;
+    for (unsigned first = 0; ok && first < rs->n_extents;) {
+        unsigned n = 0;
+        for (; n < raw_uring_depth && first + n < rs->n_extents; n++) {
+            extent const * const x = &rs->extents[first + n];
+            struct io_uring_sqe * const sqe = io_uring_get_sqe(&rs->ring);
+            io_uring_prep_read(
+                sqe, rs->fd, x->data,
+                (x->v.end - x->v.start) * rs->sample_size,
+                file_offset(rs, x->v.start));
+            io_uring_sqe_set_data(sqe, &rs->extents[first + n]);
+        }
+        int const submitted = io_uring_submit(&rs->ring);
+        unsigned const in_flight = (submitted > 0) ? submitted : 0;
+        unsigned const reaped = uring_reap(rs, in_flight, lengths);
+        if (reaped < in_flight) {
+            // Reads still in flight may land in the buffers at any time, so
+            // leave those to the kernel and read into new ones
+            for (unsigned e = 0; e < rs->n_extents; e++) {
+                extent * const x = &rs->extents[e];
+                x->data = malloc((x->v.end - x->v.start) * rs->sample_size);
+            }
+        }
+        ok = (unsigned) submitted == n && reaped == n;
+        first += n;
+    }
+    if (ok) {
+        for (unsigned e = 0; e < rs->n_extents; e++) {
+            extent * const x = &rs->extents[e];
+            x->v.end = x->v.start + lengths[e];
+        }
+    } else {
+        raw_source_disable_io_uring(rs);
+    }
+    free(lengths);
+    return ok;
+}
+#endif
+
+/*
+ * Read the extents by telling the kernel about all of them first, so the
+ * reads can be issued together, before reading each in turn.
+ */
+static void pread_extents(raw_source * const rs) {
+#ifdef POSIX_FADV_WILLNEED
+    for (unsigned e = 0; e < rs->n_extents; e++) {
+        view const v = rs->extents[e].v;
+        posix_fadvise(
+            rs->fd, file_offset(rs, v.start),
+            (v.end - v.start) * rs->sample_size, POSIX_FADV_WILLNEED);
+    }
+#endif
+    for (unsigned e = 0; e < rs->n_extents; e++) {
+        extent * const x = &rs->extents[e];
+        x->v.end = x->v.start + read_items(
+            rs, x->data, x->v.start, x->v.end - x->v.start);
+    }
+}
+
+void raw_source_prefetcher(
+        void * source, view const * ranges, unsigned n_ranges) {
+    raw_source * const rs = source;
+    free_extents(rs);
+    if (n_ranges == 0) {
+        return;
+    }
+    view * const sorted = malloc(n_ranges * sizeof(view));
+    memcpy(sorted, ranges, n_ranges * sizeof(view));
+    qsort(sorted, n_ranges, sizeof(view), view_cmp);
+    // Merge overlapping and touching ranges into extents:
+    rs->extents = malloc(n_ranges * sizeof(extent));
+    for (unsigned r = 0; r < n_ranges; r++) {
+        if (sorted[r].start >= sorted[r].end) {
+            continue;
+        }
+        extent * const last = rs->n_extents ?
+            &rs->extents[rs->n_extents - 1] : NULL;
+        if (last != NULL && sorted[r].start <= last->v.end) {
+            if (sorted[r].end > last->v.end) {
+                last->v.end = sorted[r].end;
+            }
+        } else {
+            rs->extents[rs->n_extents++] = (extent) {.v = sorted[r]};
+        }
+    }
+    free(sorted);
+    for (unsigned e = 0; e < rs->n_extents; e++) {
+        extent * const x = &rs->extents[e];
+        x->data = malloc((x->v.end - x->v.start) * rs->sample_size);
+    }
+#ifdef HAVE_LIBURING
+    if (uring_read_extents(rs)) {
+        return;
+    }
+#endif
+    pread_extents(rs);
+}
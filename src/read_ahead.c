@@ -0,0 +1,113 @@
+#include "read_ahead.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <assert.h>
+
+struct read_ahead {
+    data_fetcher df;
+    void * source;
+    unsigned n_buffers;
+    unsigned buf_items;
+    size_t buf_bytes;
+    char * buffers;
+    unsigned * items;
+    GMutex lock;
+    // Signalled when a buffer is filled:
+    GCond filled_cond;
+    // Signalled when a buffer is handed back (or we're stopping):
+    GCond free_cond;
+    // Buffers filled but not yet handed back by the consumer:
+    unsigned n_filled;
+    unsigned produced;
+    unsigned consumed;
+    int holding;
+    // Set once the consumer has been given the end of the source:
+    int at_end;
+    int stop;
+    GThread * producer;
+};
+
+static gpointer produce(gpointer const data) {
+    read_ahead * const ra = data;
+    for (;;) {
+        g_mutex_lock(&ra->lock);
+        while (ra->n_filled == ra->n_buffers && !ra->stop) {
+            g_cond_wait(&ra->free_cond, &ra->lock);
+        }
+        int const stop = ra->stop;
+        g_mutex_unlock(&ra->lock);
+        if (stop) {
+            break;
+        }
+        unsigned const slot = ra->produced % ra->n_buffers;
+        unsigned const n_read = ra->df(
+            ra->source, ra->buffers + slot * ra->buf_bytes, ra->buf_items);
+        g_mutex_lock(&ra->lock);
+        ra->items[slot] = n_read;
+        ra->n_filled++;
+        ra->produced++;
+        g_cond_signal(&ra->filled_cond);
+        g_mutex_unlock(&ra->lock);
+        if (n_read == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+read_ahead * read_ahead_start(
+        unsigned const sample_size, data_fetcher const df, void * const source,
+        unsigned const n_buffers, unsigned const buf_items) {
+    assert(n_buffers != 0);
+    assert(buf_items != 0);
+    read_ahead * const ra = malloc(sizeof(read_ahead));
+    *ra = (read_ahead) {
+        .df = df, .source = source, .n_buffers = n_buffers,
+        .buf_items = buf_items, .buf_bytes = (size_t) buf_items * sample_size};
+    ra->buffers = malloc(ra->buf_bytes * n_buffers);
+    ra->items = malloc(n_buffers * sizeof(unsigned));
+    g_mutex_init(&ra->lock);
+    g_cond_init(&ra->filled_cond);
+    g_cond_init(&ra->free_cond);
+    ra->producer = g_thread_new("read_ahead", produce, ra);
+    return ra;
+}
+
+unsigned read_ahead_next(read_ahead * const ra, char const ** const buffer) {
+    g_mutex_lock(&ra->lock);
+    if (ra->holding) {
+        ra->n_filled--;
+        ra->holding = 0;
+        g_cond_signal(&ra->free_cond);
+    }
+    if (ra->at_end) {
+        g_mutex_unlock(&ra->lock);
+        *buffer = NULL;
+        return 0;
+    }
+    while (ra->n_filled == 0) {
+        g_cond_wait(&ra->filled_cond, &ra->lock);
+    }
+    unsigned const slot = ra->consumed % ra->n_buffers;
+    unsigned const n_items = ra->items[slot];
+    ra->consumed++;
+    ra->holding = 1;
+    ra->at_end = (n_items == 0);
+    g_mutex_unlock(&ra->lock);
+    *buffer = ra->buffers + slot * ra->buf_bytes;
+    return n_items;
+}
+
+void read_ahead_finish(read_ahead * const ra) {
+    g_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    g_cond_signal(&ra->free_cond);
+    g_mutex_unlock(&ra->lock);
+    g_thread_join(ra->producer);
+    g_cond_clear(&ra->filled_cond);
+    g_cond_clear(&ra->free_cond);
+    g_mutex_clear(&ra->lock);
+    free(ra->buffers);
+    free(ra->items);
+    free(ra);
+}
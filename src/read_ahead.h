@@ -0,0 +1,38 @@
+#pragma once
+#include "../include/bdiff.h"
+
+/** \brief Reads a source sequentially on a separate thread.
+ *
+ * A producer thread fills a ring of buffers using a data_fetcher whilst the
+ * consumer works through the buffers filled before, so that the cost of
+ * fetching (decoding, disk or network I/O) overlaps with processing.
+ */
+typedef struct read_ahead read_ahead;
+
+/** \brief Start reading ahead from the given source.
+ *
+ * Nothing else may use the source until read_ahead_finish() is called.
+ * \param[in] sample_size The size (in bytes) of an item from df.
+ * \param[in] df Function used (on the producer thread) to read the source.
+ * \param[in] source Given as the source parameter to df.
+ * \param[in] n_buffers Number of buffers in the ring (at least 2 to overlap
+ * reading with processing).
+ * \param[in] buf_items Number of items in each buffer.
+ */
+read_ahead * read_ahead_start(
+    unsigned const sample_size, data_fetcher const df, void * const source,
+    unsigned const n_buffers, unsigned const buf_items);
+
+/** \brief Get the next buffer of data.
+ *
+ * The previously returned buffer is handed back to the producer, so is no
+ * longer valid.
+ * \param[out] buffer Set to the data read.
+ * \return The number of items in the buffer (0 once the source is
+ * exhausted).
+ */
+unsigned read_ahead_next(read_ahead * const ra, char const ** const buffer);
+
+/** \brief Stop reading ahead, and free the read_ahead.
+ */
+void read_ahead_finish(read_ahead * const ra);
@@ -0,0 +1,42 @@
+#include "scratch.h"
+#include <stdlib.h>
+
+struct bdiff_scratch {
+    void * bufs[SCRATCH_SLOTS];
+    size_t sizes[SCRATCH_SLOTS];
+};
+
+bdiff_scratch * bdiff_scratch_new() {
+    return calloc(1, sizeof(bdiff_scratch));
+}
+
+void bdiff_scratch_free(bdiff_scratch * const scratch) {
+    if (scratch == NULL) {
+        return;
+    }
+    for (unsigned i = 0; i < SCRATCH_SLOTS; i++) {
+        free(scratch->bufs[i]);
+    }
+    free(scratch);
+}
+
+void * scratch_get(
+        bdiff_scratch * const scratch, unsigned const slot,
+        size_t const size) {
+    if (scratch == NULL) {
+        return malloc(size);
+    }
+    if (scratch->sizes[slot] < size) {
+        // Nothing in the old buffer is wanted, so don't copy it
+        free(scratch->bufs[slot]);
+        scratch->bufs[slot] = malloc(size);
+        scratch->sizes[slot] = size;
+    }
+    return scratch->bufs[slot];
+}
+
+void scratch_put(bdiff_scratch * const scratch, void * const buf) {
+    if (scratch == NULL) {
+        free(buf);
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "../include/bdiff.h"
+#include "bdiff_defs.h"
+#include <stddef.h>
+
+/** \brief The buffers a bdiff_scratch holds, one of each in use at a time.
+ *
+ * There is one of each split buffer for each of the sources split together
+ * (see split_data_many()), and one holding the samples of all of them for
+ * the wide splitters. Narrowing's buffers are reused by the fine diff, which
+ * only starts once narrowing is done.
+ */
+enum {
+    SCRATCH_SPLIT_READ,
+    SCRATCH_SPLIT_WINDOW = SCRATCH_SPLIT_READ + max_split_lanes,
+    SCRATCH_SPLIT_RUN = SCRATCH_SPLIT_WINDOW + max_split_lanes,
+    SCRATCH_SPLIT_WIDE = SCRATCH_SPLIT_RUN + max_split_lanes,
+    SCRATCH_NARROW_A,
+    SCRATCH_NARROW_B,
+    SCRATCH_FINE_TRACE,
+    SCRATCH_FINE_DIAGONALS,
+    SCRATCH_SLOTS
+};
+
+/** \brief Get a buffer of at least size bytes for the given slot.
+ *
+ * The buffer is kept in the scratch (grown if it is too small) for the next
+ * diff to reuse. Its contents are undefined.
+ * \param[in] scratch The scratch to take it from (NULL to malloc() it).
+ * \return The buffer, to be handed back with scratch_put().
+ */
+void * scratch_get(
+    bdiff_scratch * const scratch, unsigned const slot, size_t const size);
+
+/** \brief Hand back a buffer from scratch_get() (freeing it if it didn't
+ * come from a scratch).
+ */
+void scratch_put(bdiff_scratch * const scratch, void * const buf);
@@ -0,0 +1,147 @@
+#include "../include/trace_source.h"
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct trace_log {
+    FILE * f;
+    GMutex lock;
+    unsigned n_sources;
+};
+
+struct trace_source {
+    trace_log * log;
+    unsigned id;
+    data_seeker ds;
+    data_fetcher df;
+    data_prefetcher dp;
+    void * source;
+    sample_pos pos;
+};
+
+trace_log * trace_log_open(char const * const path) {
+    FILE * const f = fopen(path, "w");
+    if (f == NULL) {
+        return NULL;
+    }
+    trace_log * const log = calloc(1, sizeof(trace_log));
+    log->f = f;
+    g_mutex_init(&log->lock);
+    return log;
+}
+
+void trace_log_close(trace_log * const log) {
+    fclose(log->f);
+    g_mutex_clear(&log->lock);
+    free(log);
+}
+
+static uint64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+trace_source * trace_source_new(
+        trace_log * const log, unsigned const sample_size,
+        data_seeker const ds, data_fetcher const df,
+        data_prefetcher const dp, void * const source) {
+    trace_source * const ts = malloc(sizeof(trace_source));
+    *ts = (trace_source) {
+        .log = log, .ds = ds, .df = df, .dp = dp, .source = source};
+    g_mutex_lock(&log->lock);
+    ts->id = log->n_sources++;
+    fprintf(log->f, "source %u %u\n", ts->id, sample_size);
+    g_mutex_unlock(&log->lock);
+    return ts;
+}
+
+void trace_source_free(trace_source * const ts) {
+    free(ts);
+}
+
+unsigned trace_source_fetcher(void * source, char * buffer, unsigned n_items) {
+    trace_source * const ts = source;
+    uint64_t const start = now_ns();
+    unsigned const n_read = ts->df(ts->source, buffer, n_items);
+    uint64_t const ns = now_ns() - start;
+    g_mutex_lock(&ts->log->lock);
+    fprintf(
+        ts->log->f, "fetch %u %" PRIu64 " %u %u %" PRIu64 "\n", ts->id,
+        ts->pos, n_items, n_read, ns);
+    g_mutex_unlock(&ts->log->lock);
+    ts->pos += n_read;
+    return n_read;
+}
+
+void trace_source_seeker(void * source, sample_pos pos) {
+    trace_source * const ts = source;
+    uint64_t const start = now_ns();
+    ts->ds(ts->source, pos);
+    uint64_t const ns = now_ns() - start;
+    g_mutex_lock(&ts->log->lock);
+    fprintf(
+        ts->log->f, "seek %u %" PRIu64 " %" PRIu64 "\n", ts->id, pos, ns);
+    g_mutex_unlock(&ts->log->lock);
+    ts->pos = pos;
+}
+
+void trace_source_prefetcher(
+        void * source, view const * ranges, unsigned n_ranges) {
+    trace_source * const ts = source;
+    uint64_t const start = now_ns();
+    if (ts->dp != NULL) {
+        ts->dp(ts->source, ranges, n_ranges);
+    }
+    uint64_t const ns = now_ns() - start;
+    g_mutex_lock(&ts->log->lock);
+    fprintf(
+        ts->log->f, "prefetch %u %u %" PRIu64 "\n", ts->id, n_ranges, ns);
+    for (unsigned r = 0; r < n_ranges; r++) {
+        fprintf(
+            ts->log->f, "range %u %" PRIu64 " %" PRIu64 "\n", ts->id,
+            ranges[r].start, ranges[r].end);
+    }
+    g_mutex_unlock(&ts->log->lock);
+}
+
+int trace_read_event(FILE * const f, trace_event * const event) {
+    char line[256];
+    char op[16];
+    if (
+            fgets(line, sizeof(line), f) == NULL ||
+            sscanf(line, "%15s", op) != 1) {
+        return 0;
+    }
+    *event = (trace_event) {};
+    if (!strcmp(op, "source")) {
+        event->op = TRACE_SOURCE;
+        return sscanf(line, "%*s %u %u", &event->source, &event->n) == 2;
+    } else if (!strcmp(op, "fetch")) {
+        unsigned n_read = 0;
+        event->op = TRACE_FETCH;
+        int const ok = sscanf(
+            line, "%*s %u %" SCNu64 " %u %u %" SCNu64, &event->source,
+            &event->v.start, &event->n, &n_read, &event->ns) == 5;
+        event->v.end = event->v.start + n_read;
+        return ok;
+    } else if (!strcmp(op, "seek")) {
+        event->op = TRACE_SEEK;
+        return sscanf(
+            line, "%*s %u %" SCNu64 " %" SCNu64, &event->source,
+            &event->v.start, &event->ns) == 3;
+    } else if (!strcmp(op, "prefetch")) {
+        event->op = TRACE_PREFETCH;
+        return sscanf(
+            line, "%*s %u %u %" SCNu64, &event->source, &event->n,
+            &event->ns) == 3;
+    } else if (!strcmp(op, "range")) {
+        event->op = TRACE_RANGE;
+        return sscanf(
+            line, "%*s %u %" SCNu64 " %" SCNu64, &event->source,
+            &event->v.start, &event->v.end) == 3;
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "fake_fetcher.h"
+#include <string.h>
 
 unsigned fake_fetcher(void * source, char * buffer, unsigned n_items) {
     fake_fetcher_data * const ffd = source;
@@ -23,3 +24,17 @@ unsigned fake_fetcher(void * source, char * buffer, unsigned n_items) {
     }
     return ffd->pos - initial_pos;
 }
+
+unsigned memory_fetcher(void * source, char * buffer, unsigned n_items) {
+    memory_source * const ms = source;
+    unsigned const n = MIN(n_items, ms->length - ms->pos);
+    memcpy(buffer, ms->data + ms->pos, n * sizeof(guint32));
+    ms->pos += n;
+    return n;
+}
+
+void memory_seeker(void * source, sample_pos pos) {
+    memory_source * const ms = source;
+    g_assert_cmpuint(pos, <=, ms->length);
+    ms->pos = pos;
+}
@@ -1,4 +1,5 @@
 #include <glib.h>
+#include "../include/diff_types.h"
 
 typedef struct {
     GRand * g_rand;
@@ -8,3 +9,15 @@ typedef struct {
 } fake_fetcher_data;
 
 unsigned fake_fetcher(void * source, char * buffer, unsigned n_items);
+
+/** \brief An in-memory source of 32 bit samples.
+ */
+typedef struct {
+    guint32 const * data;
+    unsigned length;
+    unsigned pos;
+} memory_source;
+
+unsigned memory_fetcher(void * source, char * buffer, unsigned n_items);
+
+void memory_seeker(void * source, sample_pos pos);
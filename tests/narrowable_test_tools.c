@@ -22,7 +22,7 @@ unsigned narrowable_fetcher(
     return n_output;
 }
 
-void narrowable_seeker(void * source, unsigned pos) {
+void narrowable_seeker(void * source, sample_pos pos) {
     narrowable_data * nd = source;
     g_assert_cmpuint(pos, <=, nd->from[nd->n_values - 1] + 1);
     nd->pos = pos;
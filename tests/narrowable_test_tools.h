@@ -11,7 +11,7 @@ typedef struct {
 unsigned narrowable_fetcher(
         void * source, char * buffer, unsigned n_items);
 
-void narrowable_seeker(void * source, unsigned pos);
+void narrowable_seeker(void * source, sample_pos pos);
 
 void assert_hunk_eq(
         hunk const * const h, unsigned const a_start, unsigned const a_end,
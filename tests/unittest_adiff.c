@@ -1,10 +1,13 @@
 #include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <stdint.h>
 #include <string.h>
 #include <glib.h>
 #include <sndfile.h>
 #include "../include/adiff.h"
 #include "../include/bdiff.h"  // data_fetcher
+#include "../include/trace_source.h"
 #include "fake_fetcher.h"
 
 typedef struct {
@@ -30,6 +33,9 @@ typedef struct {
     char * const float1;
     char * const double0;
     char * const double1;
+    char * const moved0;
+    char * const quad0;
+    char * const quad1;
 } adiff_fixture;
 
 static void create_sndfile(
@@ -50,6 +56,57 @@ static void create_sndfile(
     sf_close(f);
 }
 
+/*
+ * Write a copy of the file at in_path with the frames from split onwards moved
+ * to the start.
+ */
+static void create_rotated_sndfile(
+        char const * const in_path, char const * const out_path,
+        unsigned const split) {
+    SF_INFO info = {};
+    SNDFILE * const in = sf_open(in_path, SFM_READ, &info);
+    g_assert_nonnull(in);
+    SNDFILE * const out = sf_open(out_path, SFM_WRITE, &info);
+    g_assert_nonnull(out);
+    int * const buffer = g_new(int, info.frames * info.channels);
+    g_assert_cmpint(sf_readf_int(in, buffer, info.frames), ==, info.frames);
+    sf_writef_int(
+        out, buffer + split * info.channels, info.frames - split);
+    sf_writef_int(out, buffer, split);
+    g_free(buffer);
+    sf_close(in);
+    sf_close(out);
+}
+
+/*
+ * Write a file of random frames, with the samples of edit_channel between
+ * edit_start and edit_end replaced by those from another seed.
+ */
+static void create_multichannel_sndfile(
+        char const * const path, SF_INFO info, unsigned const frames,
+        unsigned const edit_channel, unsigned const edit_start,
+        unsigned const edit_end) {
+    SNDFILE * const f = sf_open(path, SFM_WRITE, &info);
+    g_assert_nonnull(f);
+    int * const buffer = g_new(int, frames * info.channels);
+    GRand * const g_rand = g_rand_new_with_seed(1234);
+    GRand * const edit_rand = g_rand_new_with_seed(4321);
+    for (unsigned i = 0; i < frames * info.channels; i++) {
+        buffer[i] = g_rand_int(g_rand);
+        unsigned const frame = i / info.channels;
+        if (
+                i % info.channels == edit_channel &&
+                frame >= edit_start && frame < edit_end) {
+            buffer[i] = g_rand_int(edit_rand);
+        }
+    }
+    sf_writef_int(f, buffer, frames);
+    g_rand_free(g_rand);
+    g_rand_free(edit_rand);
+    g_free(buffer);
+    sf_close(f);
+}
+
 static adiff_fixture create_fixture() {
     GError * err = NULL;
     char * temp_dir = g_dir_make_tmp("test_adiff_XXXXXX", &err);
@@ -70,6 +127,9 @@ static adiff_fixture create_fixture() {
         .float1 = g_build_filename(temp_dir, "float1", NULL),
         .double0 = g_build_filename(temp_dir, "double0", NULL),
         .double1 = g_build_filename(temp_dir, "double1", NULL),
+        .moved0 = g_build_filename(temp_dir, "moved0", NULL),
+        .quad0 = g_build_filename(temp_dir, "quad0", NULL),
+        .quad1 = g_build_filename(temp_dir, "quad1", NULL),
         };
     create_sndfile(
         fixture.alt_sample_rate,
@@ -131,6 +191,13 @@ static adiff_fixture create_fixture() {
             .channels = 1, .samplerate = 44100,
             .format = SF_FORMAT_WAV | SF_FORMAT_DOUBLE},
         &fixture.fcd1);
+    create_rotated_sndfile(fixture.short0, fixture.moved0, 12000);
+    SF_INFO const quad_info = {
+        .channels = 4, .samplerate = 44100,
+        .format = SF_FORMAT_WAV | SF_FORMAT_PCM_16};
+    create_multichannel_sndfile(fixture.quad0, quad_info, 20000, 0, 0, 0);
+    create_multichannel_sndfile(
+        fixture.quad1, quad_info, 20000, 2, 5000, 5100);
     return fixture;
 }
 
@@ -148,6 +215,9 @@ static void cleanup_fixture(adiff_fixture f) {
     rm_free(float1)
     rm_free(double0)
     rm_free(double1)
+    rm_free(moved0)
+    rm_free(quad0)
+    rm_free(quad1)
     rm_free(temp_dir)
     #undef rm_free
     g_free(f.missing);
@@ -331,6 +401,282 @@ pos_test(double)
 
 #undef pos_test
 
+static void test_moved(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    adiff_options const opts = {.bdiff = {.move_min_chunks = 4}};
+    diff d = adiff_with_options(f->short0, f->moved0, &opts);
+    g_assert_cmpint(d.code, ==, ADIFF_OK);
+    unsigned from_a = 0, from_b = 0;
+    for (hunk const * h = d.hunks; h != NULL; h = h->next) {
+        if (h->source == HUNK_SOURCE_A) {
+            from_a += h->b.end - h->b.start;
+        } else {
+            from_b += h->b.end - h->b.start;
+        }
+    }
+    g_assert_cmpuint(from_a, >, from_b);
+    test_patch(d.hunks, f->temp_dir, f->short0, f->moved0);
+    diff_free(&d);
+}
+
+static void test_decode_cache(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    adiff_options opts = {.decode_cache = ADIFF_DECODE_CACHE_NEVER};
+    diff uncached = adiff_with_options(f->short0, f->short1, &opts);
+    opts.decode_cache = ADIFF_DECODE_CACHE_ALWAYS;
+    diff cached = adiff_with_options(f->short0, f->short1, &opts);
+    g_assert_cmpint(cached.code, ==, ADIFF_OK);
+    hunk const * c = cached.hunks, * u = uncached.hunks;
+    for (; c != NULL && u != NULL; c = c->next, u = u->next) {
+        g_assert_cmpuint(c->a.start, ==, u->a.start);
+        g_assert_cmpuint(c->a.end, ==, u->a.end);
+        g_assert_cmpuint(c->b.start, ==, u->b.start);
+        g_assert_cmpuint(c->b.end, ==, u->b.end);
+    }
+    g_assert_null(c);
+    g_assert_null(u);
+    diff_assertions(&cached, &f->fcd0, &f->fcd1);
+    diff_free(&cached);
+    diff_free(&uncached);
+
+    channel_diff d = adiff_channels(f->quad0, f->quad1, &opts);
+    g_assert_cmpint(d.code, ==, ADIFF_OK);
+    g_assert_null(d.hunks[0]);
+    g_assert_nonnull(d.hunks[2]);
+    channel_diff_free(&d);
+}
+
+/*
+ * A cache that can't be written (here because the file size limit is
+ * reached) is dropped, the diff reading the files directly instead.
+ */
+static void test_decode_cache_full(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    adiff_options const opts = {.decode_cache = ADIFF_DECODE_CACHE_ALWAYS};
+    struct rlimit old_limit;
+    g_assert_cmpint(getrlimit(RLIMIT_FSIZE, &old_limit), ==, 0);
+    struct rlimit const limit = {
+        .rlim_cur = 1000, .rlim_max = old_limit.rlim_max};
+    void (* const old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    g_assert_cmpint(setrlimit(RLIMIT_FSIZE, &limit), ==, 0);
+    diff d = adiff_with_options(f->short0, f->short1, &opts);
+    g_assert_cmpint(setrlimit(RLIMIT_FSIZE, &old_limit), ==, 0);
+    signal(SIGXFSZ, old_handler);
+    diff_assertions(&d, &f->fcd0, &f->fcd1);
+    diff_free(&d);
+}
+
+static void test_trace(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    char * const trace_path = g_build_filename(f->temp_dir, "trace", NULL);
+    adiff_options const opts = {.trace_path = trace_path};
+    diff d = adiff_with_options(f->short0, f->short1, &opts);
+    diff_assertions(&d, &f->fcd0, &f->fcd1);
+    diff_free(&d);
+    FILE * const trace = fopen(trace_path, "r");
+    g_assert_nonnull(trace);
+    trace_event e;
+    unsigned fetches[2] = {};
+    while (trace_read_event(trace, &e)) {
+        g_assert_cmpuint(e.source, <, 2);
+        if (e.op == TRACE_SOURCE) {
+            g_assert_cmpuint(e.n, ==, sizeof(short));
+        }
+        fetches[e.source] += (e.op == TRACE_FETCH);
+    }
+    g_assert_cmpuint(fetches[0], >, 0);
+    g_assert_cmpuint(fetches[1], >, 0);
+    fclose(trace);
+    g_assert_cmpint(remove(trace_path), ==, 0);
+    g_free(trace_path);
+}
+
+static void test_summary(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    adiff_summary s = adiff_summarise(
+        f->short0, f->short0, ADIFF_SUMMARY_IDENTITY, NULL);
+    g_assert_cmpint(s.code, ==, ADIFF_OK);
+    g_assert_true(s.summary.identical);
+    s = adiff_summarise(f->short0, f->short1, ADIFF_SUMMARY_IDENTITY, NULL);
+    g_assert_cmpint(s.code, ==, ADIFF_OK);
+    g_assert_false(s.summary.identical);
+    g_assert_cmpuint(s.summary.hunks, ==, 0);
+    s = adiff_summarise(f->short0, f->short1, ADIFF_SUMMARY_ROUGH, NULL);
+    g_assert_cmpint(s.code, ==, ADIFF_OK);
+    g_assert_false(s.summary.identical);
+    g_assert_cmpuint(s.summary.hunks, >=, 2);
+    g_assert_cmpuint(s.summary.a_changed, >=, f->fcd0.first_length);
+    g_assert_cmpuint(s.summary.b_changed, >=, f->fcd1.first_length);
+    s = adiff_summarise(f->quad0, f->quad0, ADIFF_SUMMARY_ROUGH, NULL);
+    g_assert_true(s.summary.identical);
+    s = adiff_summarise(f->missing, f->short0, ADIFF_SUMMARY_ROUGH, NULL);
+    g_assert_cmpint(s.code, ==, ADIFF_ERR_OPEN_A);
+    s = adiff_summarise(
+        f->short_stereo0, f->short0, ADIFF_SUMMARY_IDENTITY, NULL);
+    g_assert_cmpint(s.code, ==, ADIFF_ERR_CHANNELS);
+}
+
+static void test_channels(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    adiff_options const opts = {.threads = 2};
+    channel_diff d = adiff_channels(f->quad0, f->quad1, &opts);
+    g_assert_cmpint(d.code, ==, ADIFF_OK);
+    g_assert_cmpuint(d.channels, ==, 4);
+    for (unsigned c = 0; c < d.channels; c++) {
+        if (c != 2) {
+            g_assert_null(d.hunks[c]);
+        }
+    }
+    hunk const * const h = d.hunks[2];
+    g_assert_nonnull(h);
+    g_assert_null(h->next);
+    g_assert_cmpuint(h->a.start, <=, 5000);
+    g_assert_cmpuint(h->a.end, >=, 5100);
+    g_assert_cmpuint(h->a.end - h->a.start, <, 1000);
+
+    char * patch_outfile = g_build_filename(f->temp_dir, "patch_result", NULL);
+    g_assert_cmpint(
+        APATCH_OK, ==,
+        apatch_channels(d.hunks, f->quad0, f->quad1, patch_outfile, NULL));
+    files_identical(f->quad1, patch_outfile);
+    remove(patch_outfile);
+    g_free(patch_outfile);
+    channel_diff_free(&d);
+
+    d = adiff_channels(f->short_stereo0, f->short0, NULL);
+    g_assert_cmpint(d.code, ==, ADIFF_ERR_CHANNELS);
+    g_assert_null(d.hunks);
+}
+
+/*
+ * Channels taking frames from different files (and so read separately)
+ * patch as well as those sharing them, and hunks reaching past the end of
+ * a file are an error.
+ */
+static void test_channel_patch_reads(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    // Only channel 2 differs, so taking any channels whole from quad1 and
+    // the rest from quad0 gives quad1
+    hunk whole = {.a = {0, 20000}, .b = {0, 20000}};
+    hunk * const hunks[] = {&whole, NULL, &whole, NULL};
+    char * const out = g_build_filename(f->temp_dir, "patch_result", NULL);
+    adiff_options const opts = {.copy_buf_size = 1000};
+    g_assert_cmpint(
+        apatch_channels(hunks, f->quad0, f->quad1, out, &opts), ==,
+        APATCH_OK);
+    files_identical(f->quad1, out);
+    hunk past_end = {.a = {19000, 20000}, .b = {19500, 20500}};
+    hunk * const short_hunks[] = {&past_end, &past_end, &past_end, &past_end};
+    g_assert_cmpint(
+        apatch_channels(short_hunks, f->quad0, f->quad1, out, NULL), ==,
+        APATCH_ERR_READ);
+    remove(out);
+    g_free(out);
+}
+
+static void assert_patch_file_gives(
+        hunk const * const h, char const * const temp_dir,
+        char const * const a, char const * const b) {
+    char * const patch = g_build_filename(temp_dir, "patch_file", NULL);
+    char * const out = g_build_filename(temp_dir, "patch_result", NULL);
+    g_assert_cmpint(apatch_write_file(h, b, patch), ==, APATCH_OK);
+    g_assert_cmpint(apatch_file(patch, a, out, NULL), ==, APATCH_OK);
+    files_identical(b, out);
+    remove(out);
+    remove(patch);
+    g_free(out);
+    g_free(patch);
+}
+
+static void test_patch_file(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    char const * const a_paths[] = {f->short0, f->float0, f->short0};
+    char const * const b_paths[] = {f->short1, f->float1, f->moved0};
+    adiff_options const opts = {.bdiff = {.move_min_chunks = 4}};
+    for (unsigned i = 0; i < 3; i++) {
+        diff d = adiff_with_options(a_paths[i], b_paths[i], &opts);
+        g_assert_cmpint(d.code, ==, ADIFF_OK);
+        assert_patch_file_gives(d.hunks, f->temp_dir, a_paths[i], b_paths[i]);
+        diff_free(&d);
+    }
+
+    char * const out = g_build_filename(f->temp_dir, "patch_result", NULL);
+    g_assert_cmpint(
+        apatch_file(f->missing, f->short0, out, NULL), ==,
+        APATCH_ERR_OPEN_PATCH);
+    g_assert_cmpint(
+        apatch_file(f->short1, f->short0, out, NULL), ==,
+        APATCH_ERR_BAD_PATCH);
+    g_assert_cmpint(
+        apatch_write_file(NULL, f->missing, out), ==, APATCH_ERR_OPEN_B);
+    // A patch for mono files doesn't fit stereo ones
+    char * const patch = g_build_filename(f->temp_dir, "patch_file", NULL);
+    g_assert_cmpint(apatch_write_file(NULL, f->short1, patch), ==, APATCH_OK);
+    g_assert_cmpint(
+        apatch_file(patch, f->short_stereo0, out, NULL), ==,
+        APATCH_ERR_CHANNELS);
+    remove(patch);
+    remove(out);
+    g_free(patch);
+    g_free(out);
+}
+
+static void test_merge(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    char * const out = g_build_filename(f->temp_dir, "merge_result", NULL);
+    // Only one side changed
+    amerge_result r = amerge(f->short0, f->short1, f->short0, out, NULL);
+    g_assert_cmpint(r.code, ==, AMERGE_OK);
+    g_assert_null(r.conflicts);
+    files_identical(f->short1, out);
+    r = amerge(f->short0, f->short0, f->short1, out, NULL);
+    g_assert_cmpint(r.code, ==, AMERGE_OK);
+    g_assert_null(r.conflicts);
+    files_identical(f->short1, out);
+    // Both made the same change
+    r = amerge(f->short0, f->short1, f->short1, out, NULL);
+    g_assert_cmpint(r.code, ==, AMERGE_OK);
+    g_assert_null(r.conflicts);
+    files_identical(f->short1, out);
+    remove(out);
+    g_free(out);
+
+    r = amerge(f->missing, f->short0, f->short1, f->missing, NULL);
+    g_assert_cmpint(r.code, ==, AMERGE_ERR_OPEN_BASE);
+    r = amerge(f->short0, f->short0, f->missing, f->missing, NULL);
+    g_assert_cmpint(r.code, ==, AMERGE_ERR_OPEN_THEIRS);
+    r = amerge(f->short0, f->short_stereo0, f->short1, f->missing, NULL);
+    g_assert_cmpint(r.code, ==, AMERGE_ERR_FORMAT);
+    amerge_result_free(&r);
+}
+
+static void test_batch(gconstpointer ud) {
+    adiff_fixture const * const f = ud;
+    bdiff_stats stats = {};
+    adiff_options const opts = {.threads = 2, .bdiff = {.stats = &stats}};
+    adiff_context * const ctx = adiff_context_new(&opts);
+    char const * const a_paths[] = {
+        f->short0, f->int0, f->float0, f->double0, f->missing, f->float0};
+    char const * const b_paths[] = {
+        f->short1, f->int1, f->float1, f->double1, f->short0, f->short0};
+    unsigned const n_pairs = sizeof(a_paths) / sizeof(a_paths[0]);
+    diff results[n_pairs];
+    for (unsigned round = 0; round < 2; round++) {
+        adiff_batch(ctx, n_pairs, a_paths, b_paths, results);
+        for (unsigned i = 0; i < 4; i++) {
+            diff_assertions(&results[i], &f->fcd0, &f->fcd1);
+            diff_free(&results[i]);
+        }
+        g_assert_cmpint(results[4].code, ==, ADIFF_ERR_OPEN_A);
+        g_assert_cmpint(results[5].code, ==, ADIFF_ERR_SAMPLE_FORMAT);
+    }
+    adiff_batch(ctx, 0, NULL, NULL, NULL);
+    adiff_context_free(ctx);
+    // Two rounds of four successful diffs, each with two hunks:
+    g_assert_cmpuint(stats.precise_hunks, ==, 2 * 4 * 2);
+    g_assert_cmpuint(stats.a.chunks, >, 0);
+}
+
 int main(int argc, char **argv) {
     g_test_init(&argc, &argv, NULL);
     adiff_fixture fixture = create_fixture();
@@ -351,8 +697,27 @@ int main(int argc, char **argv) {
         "/adiff/float", &fixture, test_float);
     g_test_add_data_func(
         "/adiff/double", &fixture, test_double);
+    g_test_add_data_func(
+        "/adiff/moved", &fixture, test_moved);
+    g_test_add_data_func(
+        "/adiff/channels", &fixture, test_channels);
+    g_test_add_data_func(
+        "/apatch/channel_reads", &fixture, test_channel_patch_reads);
+    g_test_add_data_func(
+        "/adiff/decode_cache", &fixture, test_decode_cache);
+    g_test_add_data_func(
+        "/adiff/decode_cache_full", &fixture, test_decode_cache_full);
+    g_test_add_data_func(
+        "/adiff/batch", &fixture, test_batch);
+    g_test_add_data_func(
+        "/adiff/trace", &fixture, test_trace);
+    g_test_add_data_func(
+        "/adiff/summary", &fixture, test_summary);
     g_test_add_data_func(
         "/apatch/open_errors", &fixture, test_apatch_file_open_errors);
+    g_test_add_data_func(
+        "/apatch/patch_file", &fixture, test_patch_file);
+    g_test_add_data_func("/amerge/merge", &fixture, test_merge);
     int const run_result = g_test_run();
     cleanup_fixture(fixture);
     return run_result;
@@ -3,9 +3,16 @@
 #include "unittest_hunk.h"
 #include "unittest_chunk.h"
 #include "unittest_narrowing.h"
+#include "unittest_read_ahead.h"
+#include "unittest_raw_source.h"
+#include "unittest_trace_source.h"
+#include "unittest_patched_source.h"
+#include "unittest_payload_codec.h"
 #include "fake_fetcher.h"
 #include "../include/bdiff.h"
+#include "../src/bdiff_defs.h"
 #include "narrowable_test_tools.h"
+#include <string.h>
 
 static void bdiff_rough_test() {
     fake_fetcher_data dfa = {
@@ -68,9 +75,755 @@ static void bdiff_combined_insertion_same_either_side() {
     hunk_free(hunks);
 }
 
+static void bdiff_small_buffers() {
+    Build_narrowable_data(nda, 3, Arr(150, 650, 700), Arr(0, 1, 0));
+    Build_narrowable_data(ndb, 3, Arr(150, 650, 700), Arr(0, 2, 0));
+    bdiff_options const opts = {
+        .chunk_buf_size = 7 * sizeof(unsigned),
+        .narrow_buf_size = 3 * sizeof(unsigned)};
+    hunk * hunks = bdiff_with_options(
+        sizeof(unsigned), narrowable_seeker, narrowable_fetcher, &nda, &ndb,
+        &opts);
+    assert_hunk_eq(hunks, 151, 651, 151, 651);
+    g_assert_null(hunks->next);
+    hunk_free(hunks);
+}
+
+static void bdiff_options_scale_with_length() {
+    bdiff_options const def = bdiff_options_default();
+    bdiff_options const small = bdiff_options_for_length(20000);
+    g_assert_cmpuint(small.mask_bits, ==, def.mask_bits);
+    g_assert_cmpuint(small.min_chunk_size, ==, def.min_chunk_size);
+    g_assert_cmpuint(small.max_chunk_size, ==, def.max_chunk_size);
+    bdiff_options const hour = bdiff_options_for_length(44100 * 3600);
+    g_assert_cmpuint(hour.mask_bits, >, def.mask_bits);
+    g_assert_cmpuint(hour.min_chunk_size, >, def.min_chunk_size);
+    g_assert_cmpuint(hour.max_chunk_size, >, def.max_chunk_size);
+    g_assert_cmpuint(hour.window_length, ==, def.window_length);
+    bdiff_options const huge = bdiff_options_for_length(0xFFFFFFFF);
+    g_assert_cmpuint(huge.mask_bits, >=, hour.mask_bits);
+    g_assert_cmpuint(huge.max_chunk_size, >, huge.min_chunk_size);
+    // A week at 192kHz:
+    bdiff_options const week = bdiff_options_for_length(
+        (sample_pos) 192000 * 3600 * 24 * 7);
+    g_assert_cmpuint(week.mask_bits, >=, huge.mask_bits);
+    g_assert_cmpuint(week.max_chunk_size, >=, huge.max_chunk_size);
+}
+
+/*
+ * Levels that would leave the finest level without any mask bits (or
+ * overflow the per-level state) are dropped rather than used.
+ */
+static void bdiff_options_clamp_levels() {
+    bdiff_options const def = bdiff_options_default();
+    bdiff_options opts = {.levels = 4};
+    bdiff_options o = bdiff_options_complete(&opts, def);
+    g_assert_cmpuint(o.levels, ==, 3);
+    g_assert_cmpuint(o.level_shift, ==, def.level_shift);
+    opts = (bdiff_options) {.levels = 4, .level_shift = 2};
+    o = bdiff_options_complete(&opts, def);
+    g_assert_cmpuint(o.levels, ==, 4);
+    opts = (bdiff_options) {.levels = 100, .mask_bits = 100};
+    o = bdiff_options_complete(&opts, def);
+    g_assert_cmpuint(o.levels, ==, BDIFF_MAX_LEVELS);
+    g_assert_cmpuint(o.mask_bits, ==, BDIFF_MAX_MASK_BITS);
+    opts = (bdiff_options) {.levels = 9, .level_shift = 20};
+    o = bdiff_options_complete(&opts, def);
+    g_assert_cmpuint(o.levels, ==, 1);
+
+    // Diffing with the clamped options works as usual
+    fake_fetcher_data dfa = {
+        .g_rand = g_rand_new_with_seed(212), .first_length = 600,
+        .second_length = 10000};
+    fake_fetcher_data dfb = {
+        .g_rand = g_rand_new_with_seed(121), .first_length = 400,
+        .second_length = 9000};
+    opts = (bdiff_options) {.levels = 4};
+    hunk * const h = bdiff_rough_with_options(
+        sizeof(guint32), fake_fetcher, &dfa, &dfb, &opts);
+    g_assert_nonnull(h);
+    g_assert_cmpuint(h->a.start, ==, 0);
+    g_assert_cmpuint(h->b.start, ==, 0);
+    hunk_free(h);
+    g_rand_free(dfa.g_rand);
+    g_rand_free(dfb.g_rand);
+}
+
+/*
+ * Apply hunks to in memory data, checking the result matches the expected b.
+ */
+static void assert_patch_gives(
+        hunk const * h, guint32 const * const a, unsigned const a_length,
+        guint32 const * const b, unsigned const b_length) {
+    guint32 const * const sources[] = {[HUNK_SOURCE_B] = b, [HUNK_SOURCE_A] = a};
+    unsigned a_pos = 0, out_pos = 0;
+    for (; h != NULL; h = h->next) {
+        g_assert_cmpuint(h->a.start, >=, a_pos);
+        g_assert_cmpuint(out_pos + h->a.start - a_pos, <=, b_length);
+        g_assert_cmpmem(
+            a + a_pos, (h->a.start - a_pos) * sizeof(guint32),
+            b + out_pos, (h->a.start - a_pos) * sizeof(guint32));
+        out_pos += h->a.start - a_pos;
+        unsigned const length = h->b.end - h->b.start;
+        g_assert_cmpuint(out_pos + length, <=, b_length);
+        g_assert_cmpmem(
+            sources[h->source] + h->b.start, length * sizeof(guint32),
+            b + out_pos, length * sizeof(guint32));
+        out_pos += length;
+        a_pos = h->a.end;
+    }
+    g_assert_cmpuint(out_pos + a_length - a_pos, ==, b_length);
+    g_assert_cmpmem(
+        a + a_pos, (a_length - a_pos) * sizeof(guint32),
+        b + out_pos, (a_length - a_pos) * sizeof(guint32));
+}
+
+static guint32 * random_data(unsigned const length, guint32 const seed) {
+    guint32 * const data = g_new(guint32, length);
+    GRand * const g_rand = g_rand_new_with_seed(seed);
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = g_rand_int(g_rand);
+    }
+    g_rand_free(g_rand);
+    return data;
+}
+
+/*
+ * A section moved from the end to the start should be copied rather than
+ * deleted and reinserted.
+ */
+static void bdiff_moves() {
+    unsigned const length = 30000, moved = 10000;
+    guint32 * const a_data = random_data(length, 77);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data + length - moved, moved * sizeof(guint32));
+    memcpy(
+        b_data + moved, a_data, (length - moved) * sizeof(guint32));
+    memory_source a = {.data = a_data, .length = length};
+    memory_source b = {.data = b_data, .length = length};
+    bdiff_options const opts = {.move_min_chunks = 4};
+    hunk * const hunks = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    unsigned from_b = 0, from_a = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        unsigned const length = h->b.end - h->b.start;
+        if (h->source == HUNK_SOURCE_A) {
+            from_a += length;
+        } else {
+            from_b += length;
+        }
+    }
+    g_assert_cmpuint(from_a, >, moved / 2);
+    g_assert_cmpuint(from_b, <, moved / 5);
+    assert_patch_gives(hunks, a_data, length, b_data, length);
+    hunk_free(hunks);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+static unsigned rough_volume(
+        guint32 const * const a_data, unsigned const a_length,
+        guint32 const * const b_data, unsigned const b_length,
+        bdiff_options const * const opts) {
+    memory_source a = {.data = a_data, .length = a_length};
+    memory_source b = {.data = b_data, .length = b_length};
+    hunk * const hunks = bdiff_rough_with_options(
+        sizeof(guint32), memory_fetcher, &a, &b, opts);
+    unsigned volume = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        volume += (h->a.end - h->a.start) + (h->b.end - h->b.start);
+    }
+    hunk_free(hunks);
+    return volume;
+}
+
+/*
+ * A short jingle moved from the start to the end should not stop the
+ * patience matcher from matching everything else.
+ */
+static void bdiff_patience() {
+    unsigned const length = 22000, jingle = 2000;
+    guint32 * const a_data = random_data(length, 99);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data + jingle, (length - jingle) * sizeof(guint32));
+    memcpy(b_data + length - jingle, a_data, jingle * sizeof(guint32));
+    bdiff_options opts = {.matcher = BDIFF_MATCHER_GREEDY};
+    g_assert_cmpuint(
+        rough_volume(a_data, length, b_data, length, &opts), >,
+        length - jingle);
+    opts.matcher = BDIFF_MATCHER_PATIENCE;
+    g_assert_cmpuint(
+        rough_volume(a_data, length, b_data, length, &opts), <, 4 * jingle);
+    memory_source a = {.data = a_data, .length = length};
+    memory_source b = {.data = b_data, .length = length};
+    hunk * const hunks = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    assert_patch_gives(hunks, a_data, length, b_data, length);
+    hunk_free(hunks);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * Scattered single sample edits inside what the coarse chunking sees as one
+ * large changed region should each come out as their own hunk.
+ */
+static void bdiff_levels() {
+    unsigned const length = 40000;
+    guint32 * const a_data = random_data(length, 4321);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data, length * sizeof(guint32));
+    for (unsigned i = 10000; i < 16000; i += 1000) {
+        b_data[i] ^= 0xFFFF;
+    }
+    bdiff_options opts = {
+        .mask_bits = 12, .min_chunk_size = 100, .max_chunk_size = 40000};
+    memory_source a = {.data = a_data, .length = length};
+    memory_source b = {.data = b_data, .length = length};
+    hunk * hunks = bdiff_rough_with_options(
+        sizeof(guint32), memory_fetcher, &a, &b, &opts);
+    unsigned rough_length = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        rough_length += h->a.end - h->a.start;
+    }
+    g_assert_cmpuint(rough_length, >, 5000);
+    hunk_free(hunks);
+    opts.levels = 2;
+    opts.level_shift = 5;
+    opts.refine_min_chunks = 2;
+    a.pos = b.pos = 0;
+    hunks = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    hunk const * h = hunks;
+    for (unsigned i = 10000; i < 16000; i += 1000) {
+        assert_hunk_eq(h, i, i + 1, i, i + 1);
+        h = h->next;
+    }
+    g_assert_null(h);
+    assert_patch_gives(hunks, a_data, length, b_data, length);
+    hunk_free(hunks);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * Silences of different lengths match over their common length, leaving
+ * only the extra silence as a hunk.
+ */
+static void bdiff_silence() {
+    unsigned const sound = 5000, a_silence = 3000, b_silence = 5000;
+    unsigned const a_length = 2 * sound + a_silence;
+    unsigned const b_length = 2 * sound + b_silence;
+    guint32 * const a_data = random_data(a_length, 31);
+    guint32 * const b_data = g_new(guint32, b_length);
+    memset(a_data + sound, 0, a_silence * sizeof(guint32));
+    memcpy(b_data, a_data, (sound + a_silence) * sizeof(guint32));
+    memset(
+        b_data + sound + a_silence, 0,
+        (b_silence - a_silence) * sizeof(guint32));
+    memcpy(
+        b_data + sound + b_silence, a_data + sound + a_silence,
+        sound * sizeof(guint32));
+    bdiff_options const opts = {};
+    g_assert_cmpuint(
+        rough_volume(a_data, a_length, b_data, b_length, &opts), <,
+        2 * (b_silence - a_silence));
+    memory_source a = {.data = a_data, .length = a_length};
+    memory_source b = {.data = b_data, .length = b_length};
+    hunk * const hunks = bdiff(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b);
+    g_assert_nonnull(hunks);
+    g_assert_null(hunks->next);
+    g_assert_cmpuint(hunks->a.start, ==, hunks->a.end);
+    g_assert_cmpuint(
+        hunks->b.end - hunks->b.start, ==, b_silence - a_silence);
+    assert_patch_gives(hunks, a_data, a_length, b_data, b_length);
+    hunk_free(hunks);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * An identity check should stop reading at the first buffer that differs,
+ * and a summary count the rough hunks without narrowing them.
+ */
+static void bdiff_summaries() {
+    unsigned const length = 30000, changed = 1000;
+    guint32 * const a_data = random_data(length, 8);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data, length * sizeof(guint32));
+    memory_source a = {.data = a_data, .length = length};
+    memory_source b = {.data = b_data, .length = length};
+    g_assert_true(bdiff_identical(
+        sizeof(guint32), memory_fetcher, &a, &b, NULL));
+    a.pos = b.pos = 0;
+    bdiff_summary summary = bdiff_summarise(
+        sizeof(guint32), memory_fetcher, &a, &b, NULL);
+    g_assert_true(summary.identical);
+    g_assert_cmpuint(summary.hunks, ==, 0);
+
+    b_data[changed]++;
+    bdiff_stats stats = {};
+    bdiff_options const opts = {
+        .chunk_buf_size = 100 * sizeof(guint32), .stats = &stats};
+    a.pos = b.pos = 0;
+    g_assert_false(bdiff_identical(
+        sizeof(guint32), memory_fetcher, &a, &b, &opts));
+    g_assert_cmpuint(
+        stats.a.bytes_fetched, <=, (changed + 100) * sizeof(guint32));
+    g_assert_cmpuint(stats.b.bytes_fetched, ==, stats.a.bytes_fetched);
+    a.pos = b.pos = 0;
+    summary = bdiff_summarise(sizeof(guint32), memory_fetcher, &a, &b, NULL);
+    g_assert_false(summary.identical);
+    g_assert_cmpuint(summary.hunks, ==, 1);
+    g_assert_cmpuint(summary.a_changed, >=, 1);
+    g_assert_cmpuint(summary.a_changed, <, 2000);
+    g_assert_cmpuint(summary.b_changed, ==, summary.a_changed);
+
+    b_data[changed]--;
+    b.length--;
+    a.pos = b.pos = 0;
+    g_assert_false(bdiff_identical(
+        sizeof(guint32), memory_fetcher, &a, &b, NULL));
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * Stats should account for everything read, chunked and found.
+ */
+static void bdiff_stats_collected() {
+    unsigned const length = 30000;
+    guint32 * const a_data = random_data(length, 5);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data, length * sizeof(guint32));
+    for (unsigned i = 1000; i < length; i += 7000) {
+        b_data[i]++;
+    }
+    memory_source a = {.data = a_data, .length = length};
+    memory_source b = {.data = b_data, .length = length};
+    bdiff_stats stats = {};
+    bdiff_options const opts = {.stats = &stats};
+    hunk * const hunks = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    unsigned n_hunks = 0;
+    for (hunk const * h = hunks; h != NULL; h = h->next) {
+        n_hunks++;
+    }
+    g_assert_cmpuint(n_hunks, ==, 5);
+    g_assert_cmpuint(stats.precise_hunks, ==, n_hunks);
+    g_assert_cmpuint(stats.rough_hunks, ==, n_hunks);
+    g_assert_cmpuint(stats.a.bytes_fetched, >, length * sizeof(guint32));
+    g_assert_cmpuint(stats.b.bytes_fetched, >, length * sizeof(guint32));
+    g_assert_cmpuint(stats.a.seeks, >=, 2 * n_hunks);
+    g_assert_cmpuint(stats.a.seeks, ==, stats.b.seeks);
+    uint64_t histogram_total = 0;
+    for (unsigned i = 0; i < BDIFF_CHUNK_HISTOGRAM_BINS; i++) {
+        histogram_total += stats.chunk_lengths[i];
+    }
+    g_assert_cmpuint(stats.a.chunks, >, 1);
+    g_assert_cmpuint(histogram_total, ==, stats.a.chunks + stats.b.chunks);
+    g_assert_cmpuint(stats.hash_probes, >=, stats.a.chunks + stats.b.chunks);
+    g_assert_cmpuint(stats.bytes_compared, >, 0);
+
+    bdiff_stats total = {};
+    bdiff_stats_add(&total, &stats);
+    bdiff_stats_add(&total, &stats);
+    g_assert_cmpuint(total.a.bytes_fetched, ==, 2 * stats.a.bytes_fetched);
+    g_assert_cmpuint(total.chunk_lengths[8], ==, 2 * stats.chunk_lengths[8]);
+    g_assert_cmpint(total.narrowing_us, ==, 2 * stats.narrowing_us);
+    hunk_free(hunks);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * Diffing pairs together (five, so one is left over after those chunked
+ * four at a time) gives each the hunks of diffing it on its own, and stats
+ * that add up to theirs.
+ */
+static void bdiff_pairs_together() {
+    enum {n_pairs = 5};
+    unsigned const length = 20000;
+    guint32 * a_data[n_pairs], * b_data[n_pairs];
+    memory_source a[n_pairs], b[n_pairs];
+    void * a_ptrs[n_pairs], * b_ptrs[n_pairs];
+    for (unsigned p = 0; p < n_pairs; p++) {
+        a_data[p] = random_data(length, 40 + p);
+        b_data[p] = g_new(guint32, length);
+        memcpy(b_data[p], a_data[p], length * sizeof(guint32));
+        for (unsigned i = 500 * (p + 1); i < length; i += 4000) {
+            b_data[p][i]++;
+        }
+        memset(b_data[p] + 15000, 0, 1000 * sizeof(guint32));
+        a[p] = (memory_source) {.data = a_data[p], .length = length};
+        b[p] = (memory_source) {
+            .data = b_data[p], .length = length - 300 * p};
+        a_ptrs[p] = &a[p];
+        b_ptrs[p] = &b[p];
+    }
+    bdiff_stats together_stats = {}, alone_stats = {};
+    bdiff_options opts = {.levels = 2, .stats = &together_stats};
+    opts.scratch = bdiff_scratch_new();
+    hunk * together[n_pairs];
+    bdiff_pairs(
+        sizeof(guint32), memory_seeker, memory_fetcher, n_pairs, a_ptrs,
+        b_ptrs, &opts, together);
+    bdiff_scratch_free(opts.scratch);
+    opts = (bdiff_options) {.levels = 2, .stats = &alone_stats};
+    for (unsigned p = 0; p < n_pairs; p++) {
+        a[p].pos = b[p].pos = 0;
+        hunk * const alone = bdiff_with_options(
+            sizeof(guint32), memory_seeker, memory_fetcher, &a[p], &b[p],
+            &opts);
+        hunk const * x = alone, * y = together[p];
+        for (; x != NULL && y != NULL; x = x->next, y = y->next) {
+            g_assert_cmpuint(x->a.start, ==, y->a.start);
+            g_assert_cmpuint(x->a.end, ==, y->a.end);
+            g_assert_cmpuint(x->b.start, ==, y->b.start);
+            g_assert_cmpuint(x->b.end, ==, y->b.end);
+        }
+        g_assert_null(x);
+        g_assert_null(y);
+        assert_patch_gives(
+            together[p], a_data[p], length, b_data[p], b[p].length);
+        hunk_free(alone);
+        hunk_free(together[p]);
+        g_free(a_data[p]);
+        g_free(b_data[p]);
+    }
+    g_assert_cmpuint(
+        together_stats.a.bytes_fetched, ==, alone_stats.a.bytes_fetched);
+    g_assert_cmpuint(
+        together_stats.b.bytes_fetched, ==, alone_stats.b.bytes_fetched);
+    g_assert_cmpuint(together_stats.a.chunks, ==, alone_stats.a.chunks);
+    g_assert_cmpuint(
+        together_stats.rough_hunks, ==, alone_stats.rough_hunks);
+}
+
+/*
+ * Diffs sharing one scratch, with buffers of different sizes and with and
+ * without the fine diff and finer levels, give the hunks they give alone.
+ */
+static void bdiff_scratch_reuse() {
+    unsigned const length = 30000;
+    guint32 * const a_data = random_data(length, 37);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data, length * sizeof(guint32));
+    for (unsigned i = 1000; i < length; i += 3000) {
+        b_data[i]++;
+        b_data[i + 40]++;
+    }
+    memset(b_data + 20000, 0, 1000 * sizeof(guint32));
+    bdiff_options const configs[] = {
+        {.chunk_buf_size = 64, .narrow_buf_size = 64},
+        {.fine_max_samples = 100},
+        {.levels = 2, .chunk_buf_size = 1 << 16},
+        {.min_run_length = 16, .narrow_buf_size = 16},
+        {}};
+    bdiff_scratch * const scratch = bdiff_scratch_new();
+    for (unsigned c = 0; c < G_N_ELEMENTS(configs); c++) {
+        memory_source a = {.data = a_data, .length = length};
+        memory_source b = {.data = b_data, .length = length};
+        hunk * const alone = bdiff_with_options(
+            sizeof(guint32), memory_seeker, memory_fetcher, &a, &b,
+            &configs[c]);
+        bdiff_options opts = configs[c];
+        opts.scratch = scratch;
+        a.pos = b.pos = 0;
+        hunk * const shared = bdiff_with_options(
+            sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+        hunk const * x = alone, * y = shared;
+        for (; x != NULL && y != NULL; x = x->next, y = y->next) {
+            g_assert_cmpuint(x->a.start, ==, y->a.start);
+            g_assert_cmpuint(x->a.end, ==, y->a.end);
+            g_assert_cmpuint(x->b.start, ==, y->b.start);
+            g_assert_cmpuint(x->b.end, ==, y->b.end);
+        }
+        g_assert_null(x);
+        g_assert_null(y);
+        g_assert_nonnull(shared);
+        assert_patch_gives(shared, a_data, length, b_data, length);
+        hunk_free(alone);
+        hunk_free(shared);
+    }
+    bdiff_scratch_free(scratch);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * Scattered corrections inside one hunk should be split out by a fine diff,
+ * but only in hunks small enough for it, and merged back when seeks cost
+ * more than the samples between them.
+ */
+static void bdiff_fine_diff() {
+    unsigned const a_length = 30000, b_length = a_length + 1;
+    guint32 * const a_data = random_data(a_length, 48);
+    guint32 * const b_data = g_new(guint32, b_length);
+    // Three samples changed, one deleted and two inserted
+    memcpy(b_data, a_data, 5120 * sizeof(guint32));
+    b_data[5000]++;
+    b_data[5040]++;
+    b_data[5090]++;
+    memcpy(
+        b_data + 5120, a_data + 5121, (5150 - 5121) * sizeof(guint32));
+    b_data[5149] = 1;
+    b_data[5150] = 2;
+    memcpy(
+        b_data + 5151, a_data + 5150, (a_length - 5150) * sizeof(guint32));
+    unsigned const thresholds[] = {0, 100, 1000};
+    unsigned n_hunks[3];
+    unsigned b_samples[3];
+    for (unsigned t = 0; t < 3; t++) {
+        memory_source a = {.data = a_data, .length = a_length};
+        memory_source b = {.data = b_data, .length = b_length};
+        bdiff_options const opts = {.fine_max_samples = thresholds[t]};
+        hunk * hunks = bdiff_with_options(
+            sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+        n_hunks[t] = b_samples[t] = 0;
+        for (hunk const * h = hunks; h != NULL; h = h->next) {
+            n_hunks[t]++;
+            b_samples[t] += h->b.end - h->b.start;
+        }
+        assert_patch_gives(hunks, a_data, a_length, b_data, b_length);
+        // Seeking so slowly the fine hunks are better merged back up
+        hunk_costs const costs = {.seek_cost = 1000, .byte_cost = 1};
+        hunks = hunks_coalesce(hunks, sizeof(guint32), &costs);
+        g_assert_null(hunks->next);
+        assert_patch_gives(hunks, a_data, a_length, b_data, b_length);
+        hunk_free(hunks);
+    }
+    g_assert_cmpuint(n_hunks[0], ==, 1);
+    g_assert_cmpuint(b_samples[0], >=, 150);
+    // The hunk is too long to be re-diffed
+    g_assert_cmpuint(n_hunks[1], ==, n_hunks[0]);
+    g_assert_cmpuint(b_samples[1], ==, b_samples[0]);
+    g_assert_cmpuint(n_hunks[2], ==, 5);
+    g_assert_cmpuint(b_samples[2], ==, 5);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * Hunks fine diffed directly may start and end with unchanged samples (the
+ * first snake of the edit script, with no edit before it), or hold none
+ * that changed at all.
+ */
+static void bdiff_fine_diff_unchanged_ends() {
+    unsigned const length = 40;
+    guint32 * const a_data = random_data(length, 49);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data, length * sizeof(guint32));
+    b_data[20]++;
+    memory_source a = {.data = a_data, .length = length};
+    memory_source b = {.data = b_data, .length = length};
+    bdiff_options const opts = {.fine_max_samples = 100};
+    hunk * const h = malloc(sizeof(hunk));
+    *h = (hunk) {.a = {10, 30}, .b = {10, 30}};
+    hunk * hunks = fine_diff_hunks(
+        h, sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    assert_hunk_eq(hunks, 20, 21, 20, 21);
+    g_assert_null(hunks->next);
+    assert_patch_gives(hunks, a_data, length, b_data, length);
+    hunk_free(hunks);
+
+    // An edit script of no edits
+    hunk * const same = malloc(sizeof(hunk));
+    *same = (hunk) {.a = {0, 20}, .b = {0, 20}};
+    hunks = fine_diff_hunks(
+        same, sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    g_assert_null(hunks);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*
+ * A copy of data with [start, end) replaced by n new samples.
+ */
+static guint32 * replaced(
+        guint32 const * const data, unsigned const length,
+        unsigned const start, unsigned const end, unsigned const n,
+        guint32 const seed, unsigned * const new_length) {
+    guint32 * const new_samples = random_data(n, seed);
+    *new_length = length - (end - start) + n;
+    guint32 * const r = g_new(guint32, *new_length);
+    memcpy(r, data, start * sizeof(guint32));
+    memcpy(r + start, new_samples, n * sizeof(guint32));
+    memcpy(r + start + n, data + end, (length - end) * sizeof(guint32));
+    g_free(new_samples);
+    return r;
+}
+
+/*
+ * Merge ours and theirs against base, checking the merge (as written from
+ * its hunks) matches expected, and returning the number of conflicts.
+ */
+static unsigned assert_merge_gives(
+        guint32 const * const base_data, unsigned const base_length,
+        guint32 const * const ours_data, unsigned const ours_length,
+        guint32 const * const theirs_data, unsigned const theirs_length,
+        guint32 const * const expected, unsigned const expected_length,
+        bdiff_options const * const opts) {
+    memory_source base = {.data = base_data, .length = base_length};
+    memory_source ours = {.data = ours_data, .length = ours_length};
+    memory_source theirs = {.data = theirs_data, .length = theirs_length};
+    bdiff_merge_result m = bdiff_merge(
+        sizeof(guint32), memory_seeker, memory_fetcher, &base, &ours,
+        &theirs, opts);
+    guint32 * const merged = g_new(guint32, expected_length);
+    unsigned base_pos = 0, out_pos = 0;
+    hunk const * o = m.ours, * t = m.theirs;
+    while (o != NULL || t != NULL) {
+        int const from_ours =
+            t == NULL || (o != NULL && o->a.start <= t->a.start);
+        hunk const * const h = from_ours ? o : t;
+        guint32 const * const source = from_ours ? ours_data : theirs_data;
+        unsigned const length = h->b.end - h->b.start;
+        g_assert_cmpuint(h->a.start, >=, base_pos);
+        g_assert_cmpuint(
+            out_pos + (h->a.start - base_pos) + length, <=, expected_length);
+        memcpy(
+            merged + out_pos, base_data + base_pos,
+            (h->a.start - base_pos) * sizeof(guint32));
+        out_pos += h->a.start - base_pos;
+        memcpy(
+            merged + out_pos, source + h->b.start, length * sizeof(guint32));
+        out_pos += length;
+        base_pos = h->a.end;
+        if (from_ours) {
+            o = o->next;
+        } else {
+            t = t->next;
+        }
+    }
+    g_assert_cmpuint(out_pos + base_length - base_pos, ==, expected_length);
+    memcpy(
+        merged + out_pos, base_data + base_pos,
+        (base_length - base_pos) * sizeof(guint32));
+    g_assert_cmpmem(
+        merged, expected_length * sizeof(guint32), expected,
+        expected_length * sizeof(guint32));
+    unsigned n_conflicts = 0;
+    for (bdiff_conflict const * c = m.conflicts; c != NULL; c = c->next) {
+        n_conflicts++;
+    }
+    g_free(merged);
+    bdiff_merge_free(&m);
+    return n_conflicts;
+}
+
+/*
+ * Changes to different parts of the base merge cleanly, changes to the
+ * same part conflict (keeping ours), and the same change made by both
+ * sides doesn't conflict.
+ */
+static void bdiff_merges() {
+    unsigned const base_length = 20000;
+    guint32 * const base_data = random_data(base_length, 47);
+    unsigned ours_length, theirs_length, both_length, overlap_length;
+    guint32 * const ours_data = replaced(
+        base_data, base_length, 2000, 2100, 200, 1, &ours_length);
+    guint32 * const changed = replaced(
+        base_data, base_length, 10000, 10050, 50, 2, &theirs_length);
+    guint32 * const theirs_data = replaced(
+        changed, theirs_length, 15000, 15000, 100, 3, &theirs_length);
+    // Both changes, ours shifting theirs along by 100
+    guint32 * const both_data = replaced(
+        theirs_data, theirs_length, 2000, 2100, 200, 1, &both_length);
+    g_assert_cmpuint(
+        assert_merge_gives(
+            base_data, base_length, ours_data, ours_length, theirs_data,
+            theirs_length, both_data, both_length, NULL), ==, 0);
+    g_assert_cmpuint(
+        assert_merge_gives(
+            base_data, base_length, theirs_data, theirs_length, ours_data,
+            ours_length, both_data, both_length, NULL), ==, 0);
+
+    guint32 * const overlap_data = replaced(
+        base_data, base_length, 2050, 2150, 80, 4, &overlap_length);
+    g_assert_cmpuint(
+        assert_merge_gives(
+            base_data, base_length, ours_data, ours_length, overlap_data,
+            overlap_length, ours_data, ours_length, NULL), ==, 1);
+    g_assert_cmpuint(
+        assert_merge_gives(
+            base_data, base_length, ours_data, ours_length, ours_data,
+            ours_length, ours_data, ours_length, NULL), ==, 0);
+
+    memory_source base = {.data = base_data, .length = base_length};
+    memory_source ours = {.data = ours_data, .length = ours_length};
+    memory_source theirs = {.data = overlap_data, .length = overlap_length};
+    bdiff_merge_result m = bdiff_merge(
+        sizeof(guint32), memory_seeker, memory_fetcher, &base, &ours,
+        &theirs, NULL);
+    bdiff_conflict const * const c = m.conflicts;
+    g_assert_nonnull(c);
+    g_assert_cmpuint(c->base.start, <=, 2050);
+    g_assert_cmpuint(c->base.end, >=, 2150);
+    g_assert_cmpuint(c->ours.start, ==, c->base.start);
+    g_assert_cmpuint(c->ours.end, ==, c->base.end + 100);
+    g_assert_cmpuint(c->theirs.start, ==, c->base.start);
+    g_assert_cmpuint(c->theirs.end, ==, c->base.end - 20);
+    g_assert_null(m.theirs);
+    bdiff_merge_free(&m);
+    g_assert_null(m.conflicts);
+    g_free(base_data);
+    g_free(ours_data);
+    g_free(changed);
+    g_free(theirs_data);
+    g_free(both_data);
+    g_free(overlap_data);
+}
+
+/*
+ * Fine diffing separates changes narrowing alone would merge into one
+ * conflicting hunk, and the merge's reads and chunks are counted.
+ */
+static void bdiff_merge_options() {
+    unsigned const length = 20000;
+    guint32 * const base_data = random_data(length, 50);
+    guint32 * const ours_data = g_new(guint32, length);
+    guint32 * const theirs_data = g_new(guint32, length);
+    guint32 * const both_data = g_new(guint32, length);
+    memcpy(ours_data, base_data, length * sizeof(guint32));
+    ours_data[5000]++;
+    ours_data[5040]++;
+    memcpy(theirs_data, base_data, length * sizeof(guint32));
+    theirs_data[5020]++;
+    memcpy(both_data, ours_data, length * sizeof(guint32));
+    both_data[5020]++;
+    g_assert_cmpuint(
+        assert_merge_gives(
+            base_data, length, ours_data, length, theirs_data, length,
+            ours_data, length, NULL), ==, 1);
+    bdiff_stats stats = {};
+    bdiff_options const opts = {.fine_max_samples = 100, .stats = &stats};
+    g_assert_cmpuint(
+        assert_merge_gives(
+            base_data, length, ours_data, length, theirs_data, length,
+            both_data, length, &opts), ==, 0);
+    g_assert_cmpuint(stats.a.bytes_fetched, >=, length * sizeof(guint32));
+    g_assert_cmpuint(
+        stats.b.bytes_fetched, >=, 2 * length * sizeof(guint32));
+    g_assert_cmpuint(stats.a.chunks, >, 0);
+    g_assert_cmpuint(stats.b.chunks, >=, 2 * stats.a.chunks - 2);
+    g_assert_cmpuint(stats.rough_hunks, ==, 2);
+    g_assert_cmpuint(stats.precise_hunks, ==, 2);
+    g_free(base_data);
+    g_free(ours_data);
+    g_free(theirs_data);
+    g_free(both_data);
+}
+
 int main(int argc, char **argv) {
     g_test_init(&argc, &argv, NULL);
     add_chunk_tests();
+    add_read_ahead_tests();
+    add_raw_source_tests();
+    add_trace_source_tests();
+    add_patched_source_tests();
+    add_payload_codec_tests();
     add_hash_counting_table_tests();
     add_hunk_tests();
     g_test_add_func("/bdiff/rough", bdiff_rough_test);
@@ -80,5 +833,22 @@ int main(int argc, char **argv) {
     g_test_add_func(
         "/bdiff/combined_highly_repetitive",
         bdiff_combined_insertion_same_either_side);
+    g_test_add_func("/bdiff/small_buffers", bdiff_small_buffers);
+    g_test_add_func(
+        "/bdiff/options_for_length", bdiff_options_scale_with_length);
+    g_test_add_func("/bdiff/clamp_levels", bdiff_options_clamp_levels);
+    g_test_add_func("/bdiff/levels", bdiff_levels);
+    g_test_add_func("/bdiff/moves", bdiff_moves);
+    g_test_add_func("/bdiff/patience", bdiff_patience);
+    g_test_add_func("/bdiff/silence", bdiff_silence);
+    g_test_add_func("/bdiff/summaries", bdiff_summaries);
+    g_test_add_func("/bdiff/stats", bdiff_stats_collected);
+    g_test_add_func("/bdiff/scratch", bdiff_scratch_reuse);
+    g_test_add_func("/bdiff/pairs", bdiff_pairs_together);
+    g_test_add_func("/bdiff/merges", bdiff_merges);
+    g_test_add_func("/bdiff/merge_options", bdiff_merge_options);
+    g_test_add_func("/bdiff/fine_diff", bdiff_fine_diff);
+    g_test_add_func(
+        "/bdiff/fine_diff_unchanged_ends", bdiff_fine_diff_unchanged_ends);
     return g_test_run();
 }
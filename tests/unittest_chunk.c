@@ -1,7 +1,17 @@
 #include "unittest_chunk.h"
 #include "chunk.h"
+#include "bdiff_defs.h"
 #include "fake_fetcher.h"
 #include <glib.h>
+#include <string.h>
+
+static bdiff_options length_opts(
+        unsigned const min_length, unsigned const max_length) {
+    bdiff_options opts = bdiff_options_default();
+    opts.min_chunk_size = min_length;
+    opts.max_chunk_size = max_length;
+    return opts;
+}
 
 /*! Tests our chunking of two streams of data that start differently but end
  * with the same content. We assert that the last content-defined chunk of each
@@ -13,11 +23,12 @@ static void test_with_random_data() {
     fake_fetcher_data df = {
         .g_rand = g_rand_new_with_seed(121), .first_length = 400,
         .second_length = 10000};
-    chunks a = split_data(sizeof(guint32), fake_fetcher, &df, 1, 20000);
+    bdiff_options const opts = length_opts(1, 20000);
+    chunks a = split_data(sizeof(guint32), fake_fetcher, &df, &opts);
     g_rand_set_seed(df.g_rand, 212);
     df.first_length = 600;
     df.pos = 0;
-    chunks b = split_data(sizeof(guint32), fake_fetcher, &df, 1, 20000);
+    chunks b = split_data(sizeof(guint32), fake_fetcher, &df, &opts);
     g_assert_cmphex(a->hash, !=, b->hash);
     g_assert_cmpuint(a->start, ==, 0);
     g_assert_cmpuint(b->start, ==, 0);
@@ -48,26 +59,485 @@ static unsigned immediate_split_fetcher(
 
 static void test_minimum_chunk_length() {
     unsigned total_length = 2;
-    chunks c = split_data(1, immediate_split_fetcher, &total_length, 1, 50);
+    bdiff_options opts = length_opts(1, 50);
+    chunks c = split_data(1, immediate_split_fetcher, &total_length, &opts);
     g_assert_nonnull(c->next);
     g_assert_cmpuint(c->end, ==, 1);
     chunk_free(c);
     total_length = 2;
-    c = split_data(1, immediate_split_fetcher, &total_length, 2, 50);
+    opts = length_opts(2, 50);
+    c = split_data(1, immediate_split_fetcher, &total_length, &opts);
     g_assert_null(c->next);
     chunk_free(c);
 }
 
 static void test_maximum_chunk_length() {
     unsigned total_length = 6;
-    chunks c = split_data(1, immediate_split_fetcher, &total_length, total_length, 3);
+    bdiff_options const opts = length_opts(total_length, 3);
+    chunks c = split_data(1, immediate_split_fetcher, &total_length, &opts);
     g_assert_nonnull(c->next);
     g_assert_cmpuint(c->end, ==, 4);
     chunk_free(c);
 }
 
+static unsigned count_chunks(chunk const * c) {
+    unsigned n = 0;
+    for (; c != NULL; c = c->next) {
+        n++;
+    }
+    return n;
+}
+
+static chunks split_random(bdiff_options const * const opts) {
+    fake_fetcher_data df = {
+        .g_rand = g_rand_new_with_seed(121), .first_length = 400,
+        .second_length = 10000};
+    chunks const c = split_data(sizeof(guint32), fake_fetcher, &df, opts);
+    g_rand_free(df.g_rand);
+    return c;
+}
+
+/*! The buffer size only affects how the data is read, not where it is split.
+ */
+static void test_buffer_size_independent() {
+    bdiff_options opts = length_opts(1, 20000);
+    chunks a = split_random(&opts);
+    opts.chunk_buf_size = 3 * sizeof(guint32);
+    chunks b = split_random(&opts);
+    chunks ca = a, cb = b;
+    for (; ca != NULL && cb != NULL; ca = ca->next, cb = cb->next) {
+        g_assert_cmpuint(ca->start, ==, cb->start);
+        g_assert_cmpuint(ca->end, ==, cb->end);
+        g_assert_cmphex(ca->hash, ==, cb->hash);
+    }
+    g_assert_null(ca);
+    g_assert_null(cb);
+    chunk_free(a);
+    chunk_free(b);
+}
+
+/*! Reading ahead on another thread doesn't change where the data is split.
+ */
+static void test_read_ahead() {
+    bdiff_options opts = length_opts(1, 20000);
+    opts.chunk_buf_size = 64 * sizeof(guint32);
+    chunks a = split_random(&opts);
+    opts.read_ahead_buffers = 3;
+    chunks b = split_random(&opts);
+    chunks ca = a, cb = b;
+    for (; ca != NULL && cb != NULL; ca = ca->next, cb = cb->next) {
+        g_assert_cmpuint(ca->start, ==, cb->start);
+        g_assert_cmpuint(ca->end, ==, cb->end);
+        g_assert_cmphex(ca->hash, ==, cb->hash);
+    }
+    g_assert_null(ca);
+    g_assert_null(cb);
+    chunk_free(a);
+    chunk_free(b);
+}
+
+/*! Requiring more zero bits for a boundary should give fewer, longer chunks.
+ */
+static void test_mask_bits() {
+    bdiff_options opts = length_opts(1, 20000);
+    chunks fine = split_random(&opts);
+    opts.mask_bits = 10;
+    chunks coarse = split_random(&opts);
+    g_assert_cmpuint(count_chunks(coarse), <, count_chunks(fine));
+    g_assert_cmpuint(count_chunks(coarse), >, 1);
+    chunk_free(fine);
+    chunk_free(coarse);
+}
+
+/*! Chunking at several levels should leave the coarsest level unchanged and
+ * nest the finer levels within it.
+ */
+static void test_levels() {
+    bdiff_options opts = length_opts(1, 20000);
+    chunks single = split_random(&opts);
+    opts.levels = 3;
+    opts.level_shift = 2;
+    chunks multi = split_random(&opts);
+    chunks cs = single, cm = multi;
+    for (; cs != NULL && cm != NULL; cs = cs->next, cm = cm->next) {
+        g_assert_cmpuint(cs->start, ==, cm->start);
+        g_assert_cmpuint(cs->end, ==, cm->end);
+        g_assert_cmphex(cs->hash, ==, cm->hash);
+    }
+    g_assert_null(cs);
+    g_assert_null(cm);
+    for (chunk const * level = multi; level->sub != NULL; level = level->sub) {
+        chunk const * fine = level->sub;
+        for (chunk const * c = level; c != NULL; c = c->next) {
+            g_assert(c->sub == fine);
+            g_assert_cmpuint(fine->start, ==, c->start);
+            while (fine->end < c->end) {
+                g_assert_cmpuint(fine->next->start, ==, fine->end);
+                fine = fine->next;
+            }
+            g_assert_cmpuint(fine->end, ==, c->end);
+            fine = fine->next;
+        }
+        g_assert_null(fine);
+        g_assert_cmpuint(count_chunks(level->sub), >, count_chunks(level));
+    }
+    g_assert_nonnull(multi->sub);
+    g_assert_nonnull(multi->sub->sub);
+    chunk_free(single);
+    chunk_free(multi);
+}
+
+static void assert_same_chunks(chunk const * a, chunk const * b) {
+    for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+        g_assert_cmpuint(a->start, ==, b->start);
+        g_assert_cmpuint(a->end, ==, b->end);
+        g_assert_cmphex(a->hash, ==, b->hash);
+    }
+    g_assert_null(a);
+    g_assert_null(b);
+}
+
+/*! Splitting two sources together gives the same chunks as splitting each
+ * on its own, whichever is the longer and however many levels there are.
+ */
+static void test_pair() {
+    bdiff_options opts = length_opts(1, 20000);
+    opts.chunk_buf_size = 100 * sizeof(guint32);
+    for (unsigned levels = 1; levels <= 2; levels++) {
+        opts.levels = levels;
+        fake_fetcher_data short_df = {
+            .g_rand = g_rand_new_with_seed(121), .first_length = 400,
+            .second_length = 3000};
+        fake_fetcher_data long_df = {
+            .g_rand = g_rand_new_with_seed(212), .first_length = 600,
+            .second_length = 10000};
+        chunks a, b;
+        split_data_pair(
+            sizeof(guint32), fake_fetcher, &short_df, &long_df, &opts, &a,
+            &b);
+        g_rand_set_seed(short_df.g_rand, 121);
+        short_df.pos = 0;
+        chunks const a_alone = split_data(
+            sizeof(guint32), fake_fetcher, &short_df, &opts);
+        g_rand_set_seed(long_df.g_rand, 212);
+        long_df.pos = 0;
+        chunks const b_alone = split_data(
+            sizeof(guint32), fake_fetcher, &long_df, &opts);
+        assert_same_chunks(a, a_alone);
+        assert_same_chunks(b, b_alone);
+        if (levels > 1) {
+            assert_same_chunks(a->sub, a_alone->sub);
+            assert_same_chunks(b->sub, b_alone->sub);
+        }
+        chunk_free(a);
+        chunk_free(b);
+        chunk_free(a_alone);
+        chunk_free(b_alone);
+        g_rand_free(short_df.g_rand);
+        g_rand_free(long_df.g_rand);
+    }
+}
+
+/*
+ * Random samples, but for a stretch of silence and a stretch of one other
+ * repeated sample, each run_length long.
+ */
+static guint32 * data_with_runs(
+        unsigned const length, unsigned const run_length) {
+    GRand * const g_rand = g_rand_new_with_seed(33);
+    guint32 * const data = g_new(guint32, length);
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = g_rand_int(g_rand);
+    }
+    for (unsigned i = 0; i < run_length; i++) {
+        data[length / 4 + i] = 0;
+        data[length / 2 + i] = 0x12345678;
+    }
+    g_rand_free(g_rand);
+    return data;
+}
+
+static chunks split_memory(
+        guint32 const * const data, unsigned const length,
+        bdiff_options const * const opts) {
+    memory_source ms = {.data = data, .length = length};
+    return split_data(sizeof(guint32), memory_fetcher, &ms, opts);
+}
+
+/*! A long run of one sample, silent or not, becomes a single run chunk
+ * however the data is read, at every level.
+ */
+static void test_runs() {
+    unsigned const length = 20000, run_length = 1000;
+    guint32 * const data = data_with_runs(length, run_length);
+    bdiff_options opts = bdiff_options_default();
+    chunks const c = split_memory(data, length, &opts);
+    unsigned n_runs = 0;
+    for (chunk const * r = c; r != NULL; r = r->next) {
+        if (r->is_run) {
+            sample_pos const run_start = n_runs++ ? length / 2 : length / 4;
+            g_assert_cmpuint(r->start, >=, run_start);
+            g_assert_cmpuint(r->start, <, run_start + 2 * 16);
+            g_assert_cmpuint(r->end, ==, run_start + run_length);
+        }
+    }
+    g_assert_cmpuint(n_runs, ==, 2);
+    opts.chunk_buf_size = 3 * sizeof(guint32);
+    chunks const small_buffers = split_memory(data, length, &opts);
+    assert_same_chunks(c, small_buffers);
+    opts.levels = 2;
+    chunks const levels = split_memory(data, length, &opts);
+    assert_same_chunks(c, levels);
+    n_runs = 0;
+    for (chunk const * r = levels->sub; r != NULL; r = r->next) {
+        n_runs += r->is_run;
+    }
+    g_assert_cmpuint(n_runs, ==, 2);
+    chunk_free(c);
+    chunk_free(small_buffers);
+    chunk_free(levels);
+    g_free(data);
+}
+
+/*! Runs shorter than the minimum are chunked as any other data, however the
+ * data is read.
+ */
+static void test_short_runs() {
+    unsigned const length = 20000, run_length = 200;
+    guint32 * const data = data_with_runs(length, run_length);
+    bdiff_options opts = bdiff_options_default();
+    chunks const c = split_memory(data, length, &opts);
+    for (chunk const * r = c; r != NULL; r = r->next) {
+        g_assert_false(r->is_run);
+    }
+    opts.chunk_buf_size = 3 * sizeof(guint32);
+    chunks const small_buffers = split_memory(data, length, &opts);
+    assert_same_chunks(c, small_buffers);
+    opts.min_run_length = run_length / 2;
+    chunks const runs = split_memory(data, length, &opts);
+    g_assert_cmpuint(count_chunks(runs), <, count_chunks(c));
+    chunk_free(c);
+    chunk_free(small_buffers);
+    chunk_free(runs);
+    g_free(data);
+}
+
+/*! A signal that repeats every few samples, but never repeats one sample,
+ * has no runs, and is chunked the same however it is read, alone or paired.
+ */
+static void test_periodic() {
+    unsigned const length = 20000, period = 4;
+    guint32 * const data = g_new(guint32, length);
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = 0x01000000 * (i % period + 1);
+    }
+    bdiff_options opts = length_opts(1, 1000);
+    chunks const c = split_memory(data, length, &opts);
+    for (chunk const * r = c; r != NULL; r = r->next) {
+        g_assert_false(r->is_run);
+    }
+    g_assert_cmpuint(count_chunks(c), >, 1);
+    opts.chunk_buf_size = 3 * sizeof(guint32);
+    chunks const small_buffers = split_memory(data, length, &opts);
+    assert_same_chunks(c, small_buffers);
+    memory_source a = {.data = data, .length = length};
+    memory_source b = {.data = data, .length = length};
+    chunks pa, pb;
+    split_data_pair(
+        sizeof(guint32), memory_fetcher, &a, &b, &opts, &pa, &pb);
+    assert_same_chunks(c, pa);
+    assert_same_chunks(c, pb);
+    chunk_free(c);
+    chunk_free(small_buffers);
+    chunk_free(pa);
+    chunk_free(pb);
+    g_free(data);
+}
+
+/*
+ * An in-memory source of samples of any size.
+ */
+typedef struct {
+    unsigned char const * data;
+    unsigned sample_size;
+    unsigned length;
+    unsigned pos;
+} bytes_source;
+
+static unsigned bytes_fetcher(
+        void * const source, char * const buffer, unsigned const n_items) {
+    bytes_source * const bs = source;
+    unsigned const n = (bs->length - bs->pos < n_items) ?
+        bs->length - bs->pos : n_items;
+    memcpy(
+        buffer, bs->data + (size_t) bs->pos * bs->sample_size,
+        (size_t) n * bs->sample_size);
+    bs->pos += n;
+    return n;
+}
+
+/*! The splitters specialised for common frame sizes, alone or paired and
+ * at one level or several, give the same chunks as the generic one.
+ */
+static void test_specialised_sizes() {
+    unsigned const n_bytes = 1 << 19;
+    unsigned char * const data = g_malloc(n_bytes);
+    GRand * const g_rand = g_rand_new_with_seed(35);
+    for (unsigned i = 0; i < n_bytes; i++) {
+        data[i] = g_rand_int(g_rand);
+    }
+    g_rand_free(g_rand);
+    // A run long enough to be split out whatever the sample size:
+    memset(data + n_bytes / 4, 0, 300 * 64);
+    unsigned const sizes[] = {2, 4, 6, 8, 12, 16, 24, 32, 48, 64};
+    for (unsigned levels = 1; levels <= 2; levels++) {
+        bdiff_options opts = length_opts(1, 2000);
+        opts.levels = levels;
+        for (unsigned i = 0; i < G_N_ELEMENTS(sizes); i++) {
+            unsigned const size = sizes[i];
+            bytes_source bs = {
+                .data = data, .sample_size = size,
+                .length = n_bytes / size};
+            chunks const generic = split_data_generic(
+                size, bytes_fetcher, &bs, &opts);
+            bs.pos = 0;
+            chunks const specialised = split_data(
+                size, bytes_fetcher, &bs, &opts);
+            bytes_source a = bs, b = bs;
+            a.pos = b.pos = 0;
+            b.length -= 1000;
+            chunks pa, pb;
+            split_data_pair(
+                size, bytes_fetcher, &a, &b, &opts, &pa, &pb);
+            assert_same_chunks(generic, specialised);
+            assert_same_chunks(generic, pa);
+            g_assert_cmpuint(count_chunks(generic), >, 1);
+            unsigned n_runs = 0;
+            for (chunk const * r = generic; r != NULL; r = r->next) {
+                n_runs += r->is_run;
+            }
+            g_assert_cmpuint(n_runs, ==, 1);
+            if (levels > 1) {
+                assert_same_chunks(generic->sub, specialised->sub);
+                assert_same_chunks(generic->sub, pa->sub);
+            }
+            bs.pos = 0;
+            bs.length = b.length;
+            chunks const shorter = split_data_generic(
+                size, bytes_fetcher, &bs, &opts);
+            assert_same_chunks(shorter, pb);
+            chunk_free(generic);
+            chunk_free(specialised);
+            chunk_free(pa);
+            chunk_free(pb);
+            chunk_free(shorter);
+        }
+    }
+    g_free(data);
+}
+
+/*
+ * Split the first n of data together, by split_data_many() and
+ * split_data_many_generic(), and check each gives the same chunks as
+ * splitting each on its own. The sources' lengths all differ.
+ */
+static void check_many(
+        unsigned char * const * const data, unsigned const n_bytes,
+        unsigned const size, unsigned const n,
+        bdiff_options const * const opts) {
+    bytes_source sources[max_split_lanes];
+    bytes_source generic_sources[max_split_lanes];
+    void * ptrs[max_split_lanes];
+    void * generic_ptrs[max_split_lanes];
+    for (unsigned j = 0; j < n; j++) {
+        sources[j] = (bytes_source) {
+            .data = data[j], .sample_size = size,
+            .length = n_bytes / size - 700 * j};
+        generic_sources[j] = sources[j];
+        ptrs[j] = &sources[j];
+        generic_ptrs[j] = &generic_sources[j];
+    }
+    chunks many[max_split_lanes];
+    chunks generic[max_split_lanes];
+    split_data_many(size, bytes_fetcher, ptrs, n, opts, many);
+    split_data_many_generic(
+        size, bytes_fetcher, generic_ptrs, n, opts, generic);
+    unsigned n_runs = 0;
+    for (unsigned j = 0; j < n; j++) {
+        sources[j].pos = 0;
+        chunks const alone = split_data_generic(
+            size, bytes_fetcher, &sources[j], opts);
+        for (chunk const * r = alone; r != NULL; r = r->next) {
+            n_runs += r->is_run;
+        }
+        chunk const * x = alone, * y = many[j], * z = generic[j];
+        for (unsigned l = 0; l < opts->levels; l++) {
+            assert_same_chunks(x, y);
+            assert_same_chunks(x, z);
+            x = x->sub;
+            y = y->sub;
+            z = z->sub;
+        }
+        chunk_free(alone);
+        chunk_free(many[j]);
+        chunk_free(generic[j]);
+    }
+    g_assert_cmpuint(n_runs, >, 0);
+}
+
+/*! Splitting three or more sources together, by the AVX2 or the portable
+ * wide splitters, gives the same chunks as splitting each on its own, at
+ * any sample size, number of levels or buffer size.
+ */
+static void test_many() {
+    unsigned const n_bytes = 1 << 16;
+    unsigned char * data[max_split_lanes];
+    GRand * const g_rand = g_rand_new_with_seed(36);
+    for (unsigned j = 0; j < max_split_lanes; j++) {
+        data[j] = g_malloc(n_bytes);
+        for (unsigned i = 0; i < n_bytes; i++) {
+            data[j][i] = g_rand_int(g_rand);
+        }
+        memset(data[j] + n_bytes / (j + 2), 0, 300 * 64);
+    }
+    g_rand_free(g_rand);
+    // Identical sources keep their lanes in step throughout:
+    memcpy(data[5], data[1], n_bytes);
+    unsigned const sizes[] = {1, 2, 4, 6};
+    // The AVX2 splitters are only used with six or more lanes to fill
+    unsigned const counts[] = {3, 7, max_split_lanes};
+    for (unsigned short_chunks = 0; short_chunks < 2; short_chunks++) {
+        bdiff_options opts = short_chunks ?
+            length_opts(4, 60) : length_opts(1, 2000);
+        if (short_chunks) {
+            // Leaving the sources with differing amounts buffered
+            opts.chunk_buf_size = 1000;
+        }
+        for (opts.levels = 1; opts.levels <= 3; opts.levels++) {
+            for (unsigned i = 0; i < G_N_ELEMENTS(sizes); i++) {
+                for (unsigned c = 0; c < G_N_ELEMENTS(counts); c++) {
+                    check_many(data, n_bytes, sizes[i], counts[c], &opts);
+                }
+            }
+        }
+    }
+    for (unsigned j = 0; j < max_split_lanes; j++) {
+        g_free(data[j]);
+    }
+}
+
 void add_chunk_tests() {
     g_test_add_func("/chunk/random", test_with_random_data);
     g_test_add_func("/chunk/min_length", test_minimum_chunk_length);
     g_test_add_func("/chunk/max_length", test_maximum_chunk_length);
+    g_test_add_func("/chunk/buffer_size", test_buffer_size_independent);
+    g_test_add_func("/chunk/read_ahead", test_read_ahead);
+    g_test_add_func("/chunk/mask_bits", test_mask_bits);
+    g_test_add_func("/chunk/levels", test_levels);
+    g_test_add_func("/chunk/pair", test_pair);
+    g_test_add_func("/chunk/runs", test_runs);
+    g_test_add_func("/chunk/short_runs", test_short_runs);
+    g_test_add_func("/chunk/periodic", test_periodic);
+    g_test_add_func("/chunk/specialised_sizes", test_specialised_sizes);
+    g_test_add_func("/chunk/many", test_many);
 }
@@ -1,5 +1,8 @@
 #include "unittest_hunk.h"
 #include <glib.h>
+#include <string.h>
+#include "../include/patched_source.h"
+#include "fake_fetcher.h"
 #include "hunk.h"
 
 static chunk c2 = {.start = 2, .end = 3, .hash = 3};
@@ -15,8 +18,9 @@ static void test_identical_files() {
 }
 
 static void assertion_helper(
-        hunk const * const h, unsigned const a_start, unsigned const a_end,
-        unsigned const b_start, unsigned const b_end) {
+        hunk const * const h, sample_pos const a_start,
+        sample_pos const a_end, sample_pos const b_start,
+        sample_pos const b_end) {
     g_assert_nonnull(h);
     g_assert_cmpuint(h->a.start, ==, a_start);
     g_assert_cmpuint(h->a.end, ==, a_end);
@@ -175,6 +179,314 @@ static void test_consecutive_duplicate_anchors() {
     hunk_free(h);
 }
 
+/*! A rough hunk spanning a changed coarse chunk is cut down to the changed
+ * fine chunk beneath it:
+ * A [  1  ][ 20 | 21 ][  3  ]
+ * B [  1  ][ 20 | 22 ][  3  ]
+ */
+static void test_refine() {
+    chunk fa3 = {.start = 8, .end = 12, .hash = 30};
+    chunk fa2 = {.start = 6, .end = 8, .hash = 21, .next = &fa3};
+    chunk fa1 = {.start = 4, .end = 6, .hash = 20, .next = &fa2};
+    chunk fa0 = {.start = 0, .end = 4, .hash = 10, .next = &fa1};
+    chunk a2 = {.start = 8, .end = 12, .hash = 3, .sub = &fa3};
+    chunk a1 = {.start = 4, .end = 8, .hash = 2, .next = &a2, .sub = &fa1};
+    chunk a0 = {.start = 0, .end = 4, .hash = 1, .next = &a1, .sub = &fa0};
+
+    chunk fb3 = {.start = 8, .end = 12, .hash = 30};
+    chunk fb2 = {.start = 6, .end = 8, .hash = 22, .next = &fb3};
+    chunk fb1 = {.start = 4, .end = 6, .hash = 20, .next = &fb2};
+    chunk fb0 = {.start = 0, .end = 4, .hash = 10, .next = &fb1};
+    chunk b2 = {.start = 8, .end = 12, .hash = 3, .sub = &fb3};
+    chunk b1 = {.start = 4, .end = 8, .hash = 9, .next = &b2, .sub = &fb1};
+    chunk b0 = {.start = 0, .end = 4, .hash = 1, .next = &b1, .sub = &fb0};
+
+    hunk * h = diff_chunks(&a0, &b0);
+    assertion_helper(h, 4, 8, 4, 8);
+    g_assert_null(h->next);
+    hunk * const not_refined = refine_hunks(
+        h, &a0, &b0, 2, BDIFF_MATCHER_GREEDY, NULL);
+    assertion_helper(not_refined, 4, 8, 4, 8);
+    g_assert_null(not_refined->next);
+    h = refine_hunks(
+        not_refined, &a0, &b0, 1, BDIFF_MATCHER_GREEDY, NULL);
+    assertion_helper(h, 6, 8, 6, 8);
+    g_assert_null(h->next);
+    hunk_free(h);
+}
+
+/*! A chunk moved from the end of a to the start of b is copied from a:
+ * A [1][2][3][4]
+ * B [4][1][2][3]
+ */
+static void test_detect_moves() {
+    chunk a3 = {.start = 3, .end = 4, .hash = 4};
+    chunk a2 = {.start = 2, .end = 3, .hash = 3, .next = &a3};
+    chunk a1 = {.start = 1, .end = 2, .hash = 2, .next = &a2};
+    chunk a0 = {.start = 0, .end = 1, .hash = 1, .next = &a1};
+    chunk b3 = {.start = 3, .end = 4, .hash = 3};
+    chunk b2 = {.start = 2, .end = 3, .hash = 2, .next = &b3};
+    chunk b1 = {.start = 1, .end = 2, .hash = 1, .next = &b2};
+    chunk b0 = {.start = 0, .end = 1, .hash = 4, .next = &b1};
+    hunk * h = diff_chunks(&a0, &b0);
+    assertion_helper(h, 0, 0, 0, 1);
+    assertion_helper(h->next, 3, 4, 4, 4);
+    g_assert_null(h->next->next);
+    h = detect_moves(h, &a0, &b0, 2);
+    assertion_helper(h, 0, 0, 0, 1);
+    g_assert_cmpuint(h->source, ==, HUNK_SOURCE_B);
+    h = detect_moves(h, &a0, &b0, 1);
+    assertion_helper(h, 0, 0, 3, 4);
+    g_assert_cmpuint(h->source, ==, HUNK_SOURCE_A);
+    assertion_helper(h->next, 3, 4, 4, 4);
+    g_assert_cmpuint(h->next->source, ==, HUNK_SOURCE_B);
+    g_assert_null(h->next->next);
+    hunk_free(h);
+}
+
+static void test_patience_both_null() {
+    g_assert_null(diff_chunks_patience(NULL, NULL));
+    g_assert_null(diff_chunks_patience(&c0, &c0));
+}
+
+/*! A chunk moved from the start of a to the end of b. Greedy matching locks
+ * onto it and loses the rest, anchoring on unique chunks keeps the rest:
+ * A [9][1][2][3]
+ * B [1][2][3][9]
+ */
+static void test_patience_moved_chunk() {
+    chunk a3 = {.start = 3, .end = 4, .hash = 3};
+    chunk a2 = {.start = 2, .end = 3, .hash = 2, .next = &a3};
+    chunk a1 = {.start = 1, .end = 2, .hash = 1, .next = &a2};
+    chunk a0 = {.start = 0, .end = 1, .hash = 9, .next = &a1};
+    chunk b3 = {.start = 3, .end = 4, .hash = 9};
+    chunk b2 = {.start = 2, .end = 3, .hash = 3, .next = &b3};
+    chunk b1 = {.start = 1, .end = 2, .hash = 2, .next = &b2};
+    chunk b0 = {.start = 0, .end = 1, .hash = 1, .next = &b1};
+    hunk * h = diff_chunks(&a0, &b0);
+    assertion_helper(h, 0, 0, 0, 3);
+    assertion_helper(h->next, 1, 4, 4, 4);
+    g_assert_null(h->next->next);
+    hunk_free(h);
+    h = diff_chunks_patience(&a0, &b0);
+    assertion_helper(h, 0, 1, 0, 0);
+    assertion_helper(h->next, 4, 4, 3, 4);
+    g_assert_null(h->next->next);
+    hunk_free(h);
+}
+
+/*! With no unique chunks the gap is filled with a longest common
+ * subsequence:
+ * A [1][2][1][2]
+ * B [2][1][2][1]
+ */
+static void test_patience_lcs() {
+    chunk a3 = {.start = 3, .end = 4, .hash = 2};
+    chunk a2 = {.start = 2, .end = 3, .hash = 1, .next = &a3};
+    chunk a1 = {.start = 1, .end = 2, .hash = 2, .next = &a2};
+    chunk a0 = {.start = 0, .end = 1, .hash = 1, .next = &a1};
+    chunk b3 = {.start = 3, .end = 4, .hash = 1};
+    chunk b2 = {.start = 2, .end = 3, .hash = 2, .next = &b3};
+    chunk b1 = {.start = 1, .end = 2, .hash = 1, .next = &b2};
+    chunk b0 = {.start = 0, .end = 1, .hash = 2, .next = &b1};
+    hunk * h = diff_chunks_patience(&a0, &b0);
+    assertion_helper(h, 0, 1, 0, 0);
+    assertion_helper(h->next, 4, 4, 3, 4);
+    g_assert_null(h->next->next);
+    hunk_free(h);
+}
+
+/*! Anchors on the unique chunks around the changes, matching the repeated
+ * chunks between them:
+ * A [1][5][2][2][1][6]
+ * B [1][5][2][7][1][6]
+ */
+static void test_patience_repeats_between_anchors() {
+    chunk a5 = {.start = 5, .end = 6, .hash = 6};
+    chunk a4 = {.start = 4, .end = 5, .hash = 1, .next = &a5};
+    chunk a3 = {.start = 3, .end = 4, .hash = 2, .next = &a4};
+    chunk a2 = {.start = 2, .end = 3, .hash = 2, .next = &a3};
+    chunk a1 = {.start = 1, .end = 2, .hash = 5, .next = &a2};
+    chunk a0 = {.start = 0, .end = 1, .hash = 1, .next = &a1};
+    chunk b5 = {.start = 5, .end = 6, .hash = 6};
+    chunk b4 = {.start = 4, .end = 5, .hash = 1, .next = &b5};
+    chunk b3 = {.start = 3, .end = 4, .hash = 7, .next = &b4};
+    chunk b2 = {.start = 2, .end = 3, .hash = 2, .next = &b3};
+    chunk b1 = {.start = 1, .end = 2, .hash = 5, .next = &b2};
+    chunk b0 = {.start = 0, .end = 1, .hash = 1, .next = &b1};
+    hunk * h = diff_chunks_patience(&a0, &b0);
+    assertion_helper(h, 3, 4, 3, 4);
+    g_assert_null(h->next);
+    hunk_free(h);
+}
+
+/*! Positions beyond 2**32 survive matching:
+ * A [1][2][3]
+ * B [1][4][3]
+ */
+static void test_long_positions() {
+    sample_pos const base = ((sample_pos) 1) << 33;
+    chunk a2 = {.start = base + 20, .end = base + 30, .hash = 3};
+    chunk a1 = {.start = base + 10, .end = base + 20, .hash = 2, .next = &a2};
+    chunk a0 = {.start = 0, .end = base + 10, .hash = 1, .next = &a1};
+    chunk b2 = {.start = base + 25, .end = base + 35, .hash = 3};
+    chunk b1 = {.start = base + 10, .end = base + 25, .hash = 4, .next = &b2};
+    chunk b0 = {.start = 0, .end = base + 10, .hash = 1, .next = &b1};
+    hunk * h = diff_chunks(&a0, &b0);
+    assertion_helper(h, base + 10, base + 20, base + 10, base + 25);
+    g_assert_null(h->next);
+    hunk_free(h);
+    h = diff_chunks_patience(&a0, &b0);
+    assertion_helper(h, base + 10, base + 20, base + 10, base + 25);
+    g_assert_null(h->next);
+    hunk_free(h);
+}
+
+/*! Composing follows a's data through both patches, taking the rest from
+ * the final target:
+ * A [0, 100)
+ * B A[0, 10) X A[20, 100)                where X is 5 new samples
+ * C B[0, 5) X B[0, 5) B[15, 95) Y        where Y is 5 new samples
+ */
+static void test_compose() {
+    hunk * first = NULL, * first_tail = NULL;
+    append_hunk(&first, &first_tail, 10, 20, 10, 15);
+    hunk * second = NULL, * second_tail = NULL;
+    append_hunk(&second, &second_tail, 5, 10, 5, 5);
+    append_copy_hunk(&second, &second_tail, 15, 0, 5);
+    append_hunk(&second, &second_tail, 95, 95, 95, 100);
+    hunk * const h = hunks_compose(first, second);
+    assertion_helper(h, 5, 5, 5, 10);
+    g_assert_cmpuint(h->source, ==, HUNK_SOURCE_B);
+    assertion_helper(h->next, 5, 20, 0, 5);
+    g_assert_cmpuint(h->next->source, ==, HUNK_SOURCE_A);
+    assertion_helper(h->next->next, 100, 100, 95, 100);
+    g_assert_cmpuint(h->next->next->source, ==, HUNK_SOURCE_B);
+    g_assert_null(h->next->next->next);
+    hunk_free(h);
+    // Undoing the first patch leaves a hunk taking its data from the target
+    // (which is a), as no data is read to see that nothing changed
+    hunk * const undo = hunks_invert(first);
+    assertion_helper(undo, 10, 15, 10, 20);
+    g_assert_null(undo->next);
+    hunk * const round_trip = hunks_compose(first, undo);
+    assertion_helper(round_trip, 10, 20, 10, 20);
+    g_assert_null(round_trip->next);
+    hunk_free(round_trip);
+    hunk_free(undo);
+    hunk_free(first);
+    hunk_free(second);
+}
+
+/*
+ * Patch a with hunks, reading b where they say, checking it gives expected.
+ */
+static void assert_patch_gives(
+        hunk const * const hunks, memory_source * const a,
+        memory_source * const b, memory_source const * const expected) {
+    patched_source * const ps = patched_source_new(
+        hunks, a->length, sizeof(guint32), memory_seeker, memory_fetcher, a,
+        b);
+    g_assert_cmpuint(patched_source_length(ps), ==, expected->length);
+    guint32 * const patched = g_new(guint32, expected->length);
+    patched_source_seeker(ps, 0);
+    g_assert_cmpuint(
+        patched_source_fetcher(ps, (char *) patched, expected->length), ==,
+        expected->length);
+    g_assert_cmpmem(
+        patched, expected->length * sizeof(guint32), expected->data,
+        expected->length * sizeof(guint32));
+    g_free(patched);
+    patched_source_free(ps);
+}
+
+static guint32 * edited(
+        guint32 const * const data, unsigned const cut_start,
+        unsigned const cut_end, unsigned const move_start,
+        unsigned const move_end, unsigned const length, GRand * const g_rand,
+        unsigned * const new_length) {
+    // Replace [cut_start, cut_end) with twice as much new data, and move
+    // [move_start, move_end) (after the cut) to the start
+    unsigned const moved = move_end - move_start;
+    *new_length = length + (cut_end - cut_start);
+    guint32 * const e = g_new(guint32, *new_length);
+    guint32 * out = e;
+    memcpy(out, data + move_start, moved * sizeof(guint32));
+    out += moved;
+    memcpy(out, data, cut_start * sizeof(guint32));
+    out += cut_start;
+    for (unsigned i = 0; i < 2 * (cut_end - cut_start); i++) {
+        *out++ = g_rand_int(g_rand);
+    }
+    memcpy(out, data + cut_end, (move_start - cut_end) * sizeof(guint32));
+    out += move_start - cut_end;
+    memcpy(out, data + move_end, (length - move_end) * sizeof(guint32));
+    return e;
+}
+
+/*! Composed and inverted diffs patch to the right data.
+ */
+static void test_compose_diffed() {
+    unsigned const a_length = 30000;
+    GRand * const g_rand = g_rand_new_with_seed(46);
+    guint32 * const a_data = g_new(guint32, a_length);
+    for (unsigned i = 0; i < a_length; i++) {
+        a_data[i] = g_rand_int(g_rand);
+    }
+    unsigned b_length, c_length;
+    guint32 * const b_data = edited(
+        a_data, 5000, 6000, 20000, 24000, a_length, g_rand, &b_length);
+    guint32 * const c_data = edited(
+        b_data, 2000, 2500, 9000, 12000, b_length, g_rand, &c_length);
+    memory_source a = {.data = a_data, .length = a_length};
+    memory_source b = {.data = b_data, .length = b_length};
+    memory_source c = {.data = c_data, .length = c_length};
+    bdiff_options const opts = {.move_min_chunks = 4};
+    hunk * const ab = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    b.pos = 0;
+    hunk * const bc = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &b, &c, &opts);
+    hunk * const ac = hunks_compose(ab, bc);
+    assert_patch_gives(ac, &a, &c, &c);
+    hunk * const ba = hunks_invert(ab);
+    assert_patch_gives(ba, &b, &a, &a);
+    hunk * const cb = hunks_invert(bc);
+    hunk * const ca = hunks_compose(cb, ba);
+    assert_patch_gives(ca, &c, &a, &a);
+    hunk_free(ab);
+    hunk_free(bc);
+    hunk_free(ac);
+    hunk_free(ba);
+    hunk_free(cb);
+    hunk_free(ca);
+    g_free(a_data);
+    g_free(b_data);
+    g_free(c_data);
+    g_rand_free(g_rand);
+}
+
+/*! Hunks are merged across gaps that cost less to take from b than the
+ * seeks and hunk they save, but copies from a are left alone.
+ */
+static void test_coalesce() {
+    hunk * h = NULL, * tail = NULL;
+    append_hunk(&h, &tail, 10, 12, 10, 13);
+    append_hunk(&h, &tail, 15, 16, 16, 17);
+    append_hunk(&h, &tail, 18, 18, 19, 21);
+    append_hunk(&h, &tail, 100, 101, 103, 104);
+    append_copy_hunk(&h, &tail, 102, 0, 5);
+    // Merging saves 2 * 10 + 4 = 24, so gaps of up to 6 samples of 4 bytes
+    hunk_costs const costs = {.seek_cost = 10, .byte_cost = 1, .hunk_cost = 4};
+    h = hunks_coalesce(h, 4, &costs);
+    assertion_helper(h, 10, 18, 10, 21);
+    assertion_helper(h->next, 100, 101, 103, 104);
+    assertion_helper(h->next->next, 102, 102, 0, 5);
+    g_assert_cmpuint(h->next->next->source, ==, HUNK_SOURCE_A);
+    g_assert_null(h->next->next->next);
+    hunk_free(h);
+}
+
 void add_hunk_tests() {
     g_test_add_func("/hunk/both_null", test_both_null);
     g_test_add_func("/hunk/identical_files", test_identical_files);
@@ -192,4 +504,17 @@ void add_hunk_tests() {
     g_test_add_func(
         "/hunk/consecutive_duplicate_anchors",
         test_consecutive_duplicate_anchors);
+    g_test_add_func("/hunk/refine", test_refine);
+    g_test_add_func("/hunk/detect_moves", test_detect_moves);
+    g_test_add_func("/hunk/patience_both_null", test_patience_both_null);
+    g_test_add_func(
+        "/hunk/patience_moved_chunk", test_patience_moved_chunk);
+    g_test_add_func("/hunk/patience_lcs", test_patience_lcs);
+    g_test_add_func(
+        "/hunk/patience_repeats_between_anchors",
+        test_patience_repeats_between_anchors);
+    g_test_add_func("/hunk/long_positions", test_long_positions);
+    g_test_add_func("/hunk/compose", test_compose);
+    g_test_add_func("/hunk/compose_diffed", test_compose_diffed);
+    g_test_add_func("/hunk/coalesce", test_coalesce);
 }
@@ -0,0 +1,130 @@
+#include "unittest_patched_source.h"
+#include <glib.h>
+#include <string.h>
+#include "../include/patched_source.h"
+#include "fake_fetcher.h"
+#include "hunk.h"
+
+static guint32 * counting_data(unsigned const length, guint32 const first) {
+    guint32 * const data = g_new(guint32, length);
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = first + i;
+    }
+    return data;
+}
+
+/*
+ * Read n items from pos, checking they match expected.
+ */
+static void assert_reads(
+        patched_source * const ps, sample_pos const pos, unsigned const n,
+        guint32 const * const expected, unsigned const expected_length) {
+    guint32 buffer[n];
+    patched_source_seeker(ps, pos);
+    unsigned const n_read = patched_source_fetcher(ps, (char *) buffer, n);
+    unsigned const left = (pos < expected_length) ? expected_length - pos : 0;
+    g_assert_cmpuint(n_read, ==, MIN(n, left));
+    for (unsigned i = 0; i < n_read; i++) {
+        g_assert_cmpuint(buffer[i], ==, expected[pos + i]);
+    }
+}
+
+/*! Hunks replacing, deleting, inserting and copying from a are each read
+ * from the right place, wherever reads start.
+ */
+static void test_hand_made() {
+    guint32 * const a_data = counting_data(100, 0);
+    guint32 * const b_data = counting_data(100, 1000);
+    memory_source a = {.data = a_data, .length = 100};
+    memory_source b = {.data = b_data, .length = 100};
+    hunk * head = NULL, * tail = NULL;
+    append_hunk(&head, &tail, 10, 20, 0, 5);
+    append_hunk(&head, &tail, 30, 40, 5, 5);
+    append_copy_hunk(&head, &tail, 50, 0, 10);
+    append_hunk(&head, &tail, 90, 90, 50, 60);
+    guint32 expected[200];
+    unsigned n = 0;
+    #define Take(data, start, end) \
+        for (unsigned i = start; i < end; i++) { \
+            expected[n++] = data[i]; \
+        }
+    Take(a_data, 0, 10)
+    Take(b_data, 0, 5)
+    Take(a_data, 20, 30)
+    Take(a_data, 40, 50)
+    Take(a_data, 0, 10)
+    Take(a_data, 50, 90)
+    Take(b_data, 50, 60)
+    Take(a_data, 90, 100)
+    #undef Take
+    patched_source * const ps = patched_source_new(
+        head, 100, sizeof(guint32), memory_seeker, memory_fetcher, &a, &b);
+    g_assert_cmpuint(patched_source_length(ps), ==, n);
+    assert_reads(ps, 0, n, expected, n);
+    for (unsigned pos = 0; pos <= n + 1; pos += 3) {
+        assert_reads(ps, pos, 7, expected, n);
+    }
+    patched_source_free(ps);
+    hunk_free(head);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+/*! Reading the patched source in any sized pieces, from anywhere, gives b.
+ */
+static void test_diffed() {
+    unsigned const a_length = 20000, b_length = 21000;
+    GRand * const g_rand = g_rand_new_with_seed(45);
+    guint32 * const a_data = g_new(guint32, a_length);
+    for (unsigned i = 0; i < a_length; i++) {
+        a_data[i] = g_rand_int(g_rand);
+    }
+    // b moves a's first 3000 samples to the end and inserts 1000 new ones
+    guint32 * const b_data = g_new(guint32, b_length);
+    memcpy(b_data, a_data + 3000, 8000 * sizeof(guint32));
+    for (unsigned i = 8000; i < 9000; i++) {
+        b_data[i] = g_rand_int(g_rand);
+    }
+    memcpy(b_data + 9000, a_data + 11000, 9000 * sizeof(guint32));
+    memcpy(b_data + 18000, a_data, 3000 * sizeof(guint32));
+    memory_source a = {.data = a_data, .length = a_length};
+    memory_source b = {.data = b_data, .length = b_length};
+    bdiff_options const opts = {.move_min_chunks = 4};
+    hunk * const hunks = bdiff_with_options(
+        sizeof(guint32), memory_seeker, memory_fetcher, &a, &b, &opts);
+    patched_source * const ps = patched_source_new(
+        hunks, a_length, sizeof(guint32), memory_seeker, memory_fetcher, &a,
+        &b);
+    g_assert_cmpuint(patched_source_length(ps), ==, b_length);
+    patched_source_seeker(ps, 0);
+    guint32 * const patched = g_new(guint32, b_length);
+    unsigned done = 0, piece = 1;
+    while (done < b_length) {
+        unsigned const n_read = patched_source_fetcher(
+            ps, (char *) (patched + done), piece);
+        g_assert_cmpuint(n_read, >, 0);
+        done += n_read;
+        piece = piece * 3 % 1001;
+    }
+    g_assert_cmpuint(
+        patched_source_fetcher(ps, (char *) patched, 1), ==, 0);
+    g_assert_cmpmem(
+        patched, b_length * sizeof(guint32), b_data,
+        b_length * sizeof(guint32));
+    for (unsigned i = 0; i < 100; i++) {
+        assert_reads(
+            ps, g_rand_int_range(g_rand, 0, b_length + 10),
+            g_rand_int_range(g_rand, 1, 500), b_data, b_length);
+    }
+    patched_source_free(ps);
+    hunk_free(hunks);
+    g_free(patched);
+    g_free(a_data);
+    g_free(b_data);
+    g_rand_free(g_rand);
+}
+
+void add_patched_source_tests() {
+    g_test_add_func("/patched_source/hand_made", test_hand_made);
+    g_test_add_func("/patched_source/diffed", test_diffed);
+}
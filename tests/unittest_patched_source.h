@@ -0,0 +1,3 @@
+#pragma once
+
+void add_patched_source_tests();
@@ -0,0 +1,85 @@
+#include "unittest_payload_codec.h"
+#include <glib.h>
+#include "payload_codec.h"
+
+/*
+ * Encode and decode samples, checking they survive, and returning the
+ * encoded size.
+ */
+static size_t assert_round_trip(
+        gint32 const * const samples, unsigned const n_frames,
+        unsigned const channels) {
+    size_t const max_bytes = payload_max_bytes(n_frames, channels);
+    unsigned char * const encoded = g_malloc(max_bytes);
+    size_t const n_bytes = payload_encode(
+        samples, n_frames, channels, encoded);
+    g_assert_cmpuint(n_bytes, <=, max_bytes);
+    gint32 * const decoded = g_new(gint32, n_frames * channels);
+    g_assert_true(payload_decode(
+        encoded, n_bytes, n_frames, channels, decoded));
+    g_assert_cmpmem(
+        decoded, n_frames * channels * sizeof(gint32), samples,
+        n_frames * channels * sizeof(gint32));
+    if (n_bytes > 1) {
+        // A truncated block is caught
+        g_assert_false(payload_decode(
+            encoded, n_bytes - 1, n_frames, channels, decoded));
+    }
+    g_free(decoded);
+    g_free(encoded);
+    return n_bytes;
+}
+
+/*! A smooth 16 bit stereo signal (read as 32 bit samples) with a little
+ * noise shrinks to well under half its size.
+ */
+static void test_smooth() {
+    unsigned const n_frames = payload_block_frames, channels = 2;
+    gint32 * const samples = g_new(gint32, n_frames * channels);
+    GRand * const g_rand = g_rand_new_with_seed(50);
+    // A resonator: y[n] = 2 cos(w) y[n - 1] - y[n - 2]
+    double y0 = 0, y1 = 1000;
+    for (unsigned i = 0; i < n_frames; i++) {
+        double const y = 1.998 * y1 - y0;
+        y0 = y1;
+        y1 = y;
+        gint32 const noise = g_rand_int_range(g_rand, -4, 5);
+        samples[2 * i] = ((gint32) y + noise) * 65536;
+        samples[2 * i + 1] = ((gint32) (y / 2) - noise) * 65536;
+    }
+    size_t const n_bytes = assert_round_trip(samples, n_frames, channels);
+    g_assert_cmpuint(n_bytes, <, n_frames * channels * sizeof(int16_t) / 2);
+    g_rand_free(g_rand);
+    g_free(samples);
+}
+
+/*! Full range noise, extremes, silence and tiny blocks all survive.
+ */
+static void test_awkward() {
+    unsigned const n_frames = 1000;
+    gint32 * const samples = g_new(gint32, n_frames);
+    GRand * const g_rand = g_rand_new_with_seed(51);
+    for (unsigned i = 0; i < n_frames; i++) {
+        samples[i] = g_rand_int(g_rand);
+    }
+    assert_round_trip(samples, n_frames, 1);
+    for (unsigned i = 0; i < n_frames; i++) {
+        samples[i] = (i % 3) ? INT32_MIN : INT32_MAX;
+    }
+    assert_round_trip(samples, n_frames, 1);
+    for (unsigned i = 0; i < n_frames; i++) {
+        samples[i] = 0;
+    }
+    g_assert_cmpuint(assert_round_trip(samples, n_frames, 1), <=, 130);
+    assert_round_trip(samples, n_frames / 4, 4);
+    samples[0] = -7;
+    assert_round_trip(samples, 1, 1);
+    assert_round_trip(samples, 2, 1);
+    g_rand_free(g_rand);
+    g_free(samples);
+}
+
+void add_payload_codec_tests() {
+    g_test_add_func("/payload_codec/smooth", test_smooth);
+    g_test_add_func("/payload_codec/awkward", test_awkward);
+}
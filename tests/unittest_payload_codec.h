@@ -0,0 +1,3 @@
+#pragma once
+
+void add_payload_codec_tests();
@@ -0,0 +1,165 @@
+#include "unittest_raw_source.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/raw_source.h"
+#include "fake_fetcher.h"
+#include "hunk.h"
+
+#define header_bytes 12
+
+/*
+ * Write a header followed by the data to a temporary file, returning its
+ * path.
+ */
+static char * write_raw_file(
+        guint32 const * const data, unsigned const length) {
+    char * const path = g_build_filename(
+        g_get_tmp_dir(), "unittest_raw_source_XXXXXX", NULL);
+    int const fd = g_mkstemp(path);
+    g_assert_cmpint(fd, >=, 0);
+    FILE * const f = fdopen(fd, "wb");
+    char const header[header_bytes] = "raw header!";
+    g_assert_cmpuint(fwrite(header, 1, header_bytes, f), ==, header_bytes);
+    g_assert_cmpuint(fwrite(data, sizeof(guint32), length, f), ==, length);
+    fclose(f);
+    return path;
+}
+
+static guint32 * counting_data(unsigned const length, guint32 const step) {
+    guint32 * const data = g_new(guint32, length);
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = i * step;
+    }
+    return data;
+}
+
+static void assert_reads(
+        raw_source * const rs, guint32 const * const data,
+        unsigned const length, sample_pos const pos, unsigned const n_items) {
+    guint32 buffer[256];
+    g_assert_cmpuint(n_items, <=, 256);
+    raw_source_seeker(rs, pos);
+    unsigned const expected = (pos + n_items <= length) ?
+        n_items : length - pos;
+    g_assert_cmpuint(
+        raw_source_fetcher(rs, (char *) buffer, n_items), ==, expected);
+    g_assert_cmpmem(
+        buffer, expected * sizeof(guint32),
+        data + pos, expected * sizeof(guint32));
+}
+
+static void test_reads() {
+    unsigned const length = 1000;
+    guint32 * const data = counting_data(length, 7);
+    char * const path = write_raw_file(data, length);
+    raw_source * const rs = raw_source_open(
+        path, sizeof(guint32), header_bytes);
+    g_assert_nonnull(rs);
+    assert_reads(rs, data, length, 0, 100);
+    assert_reads(rs, data, length, 950, 100);
+    assert_reads(rs, data, length, 10, 1);
+    view const ranges[] = {
+        {.start = 500, .end = 520}, {.start = 100, .end = 150},
+        {.start = 140, .end = 160}, {.start = 990, .end = 1200},
+        {.start = 30, .end = 30}};
+    raw_source_prefetcher(rs, ranges, 5);
+    // Inside, across and between the prefetched ranges:
+    assert_reads(rs, data, length, 100, 60);
+    assert_reads(rs, data, length, 90, 200);
+    assert_reads(rs, data, length, 510, 20);
+    assert_reads(rs, data, length, 980, 100);
+    assert_reads(rs, data, length, 0, 50);
+    raw_source_prefetcher(rs, NULL, 0);
+    assert_reads(rs, data, length, 120, 10);
+    raw_source_close(rs);
+    remove(path);
+    g_assert_null(raw_source_open(path, sizeof(guint32), 0));
+    g_free(path);
+    g_free(data);
+}
+
+/*
+ * Prefetched ranges are read in full, with or without io_uring, so reads
+ * inside them still work once the file is gone.
+ */
+static void test_prefetch_fallback() {
+    unsigned const length = 1000;
+    guint32 * const data = counting_data(length, 11);
+    for (unsigned use_uring = 0; use_uring < 2; use_uring++) {
+        char * const path = write_raw_file(data, length);
+        raw_source * const rs = raw_source_open(
+            path, sizeof(guint32), header_bytes);
+        g_assert_nonnull(rs);
+        if (!use_uring) {
+            raw_source_disable_io_uring(rs);
+        }
+        view const ranges[] = {
+            {.start = 700, .end = 900}, {.start = 0, .end = 100},
+            {.start = 50, .end = 300}, {.start = 950, .end = 1100}};
+        raw_source_prefetcher(rs, ranges, 4);
+        g_assert_cmpint(truncate(path, header_bytes), ==, 0);
+        assert_reads(rs, data, length, 0, 250);
+        assert_reads(rs, data, length, 200, 100);
+        assert_reads(rs, data, length, 700, 200);
+        assert_reads(rs, data, length, 960, 100);
+        raw_source_close(rs);
+        remove(path);
+        g_free(path);
+    }
+    g_free(data);
+}
+
+/*
+ * Diffing raw files with prefetching gives the same hunks as diffing the
+ * data in memory.
+ */
+static void test_prefetched_diff() {
+    unsigned const length = 30000;
+    guint32 * const a_data = counting_data(length, 2654435761u);
+    guint32 * const b_data = g_new(guint32, length);
+    memcpy(b_data, a_data, length * sizeof(guint32));
+    for (unsigned i = 1000; i < length; i += 3001) {
+        b_data[i] ^= 0xF00F;
+    }
+    char * const a_path = write_raw_file(a_data, length);
+    char * const b_path = write_raw_file(b_data, length);
+    raw_source * const a = raw_source_open(
+        a_path, sizeof(guint32), header_bytes);
+    raw_source * const b = raw_source_open(
+        b_path, sizeof(guint32), header_bytes);
+    bdiff_options const opts = {.prefetcher = raw_source_prefetcher};
+    hunk * const raw_hunks = bdiff_with_options(
+        sizeof(guint32), raw_source_seeker, raw_source_fetcher, a, b, &opts);
+    memory_source ma = {.data = a_data, .length = length};
+    memory_source mb = {.data = b_data, .length = length};
+    hunk * const memory_hunks = bdiff(
+        sizeof(guint32), memory_seeker, memory_fetcher, &ma, &mb);
+    hunk const * r = raw_hunks, * m = memory_hunks;
+    for (; r != NULL && m != NULL; r = r->next, m = m->next) {
+        g_assert_cmpuint(r->a.start, ==, m->a.start);
+        g_assert_cmpuint(r->a.end, ==, m->a.end);
+        g_assert_cmpuint(r->b.start, ==, m->b.start);
+        g_assert_cmpuint(r->b.end, ==, m->b.end);
+    }
+    g_assert_null(r);
+    g_assert_null(m);
+    g_assert_nonnull(raw_hunks);
+    hunk_free(raw_hunks);
+    hunk_free(memory_hunks);
+    raw_source_close(a);
+    raw_source_close(b);
+    remove(a_path);
+    remove(b_path);
+    g_free(a_path);
+    g_free(b_path);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+void add_raw_source_tests() {
+    g_test_add_func("/raw_source/reads", test_reads);
+    g_test_add_func("/raw_source/prefetch_fallback", test_prefetch_fallback);
+    g_test_add_func("/raw_source/prefetched_diff", test_prefetched_diff);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void add_raw_source_tests();
@@ -0,0 +1,60 @@
+#include "unittest_read_ahead.h"
+#include <glib.h>
+#include "read_ahead.h"
+#include "fake_fetcher.h"
+
+/*
+ * Read the whole source through a read_ahead, checking it matches the data.
+ */
+static void read_all(
+        guint32 const * const data, unsigned const length,
+        unsigned const n_buffers, unsigned const buf_items) {
+    memory_source ms = {.data = data, .length = length};
+    read_ahead * const ra = read_ahead_start(
+        sizeof(guint32), memory_fetcher, &ms, n_buffers, buf_items);
+    unsigned pos = 0, n_items;
+    char const * buffer;
+    while ((n_items = read_ahead_next(ra, &buffer))) {
+        g_assert_cmpuint(n_items, <=, buf_items);
+        g_assert_cmpuint(pos + n_items, <=, length);
+        g_assert_cmpmem(
+            buffer, n_items * sizeof(guint32),
+            data + pos, n_items * sizeof(guint32));
+        pos += n_items;
+    }
+    g_assert_cmpuint(pos, ==, length);
+    g_assert_cmpuint(read_ahead_next(ra, &buffer), ==, 0);
+    read_ahead_finish(ra);
+}
+
+static void test_read_all() {
+    unsigned const length = 10000;
+    guint32 * const data = g_new(guint32, length);
+    for (unsigned i = 0; i < length; i++) {
+        data[i] = i * 2654435761u;
+    }
+    read_all(data, length, 1, 100);
+    read_all(data, length, 2, 100);
+    read_all(data, length, 4, 7);
+    read_all(data, length, 3, length * 2);
+    read_all(data, 0, 2, 16);
+    g_free(data);
+}
+
+/*
+ * Stopping before the end of the source must not hang.
+ */
+static void test_finish_early() {
+    guint32 data[64] = {};
+    memory_source ms = {.data = data, .length = 64};
+    read_ahead * const ra = read_ahead_start(
+        sizeof(guint32), memory_fetcher, &ms, 2, 4);
+    char const * buffer;
+    g_assert_cmpuint(read_ahead_next(ra, &buffer), ==, 4);
+    read_ahead_finish(ra);
+}
+
+void add_read_ahead_tests() {
+    g_test_add_func("/read_ahead/read_all", test_read_all);
+    g_test_add_func("/read_ahead/finish_early", test_finish_early);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void add_read_ahead_tests();
@@ -0,0 +1,143 @@
+#include "unittest_trace_source.h"
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "../include/trace_source.h"
+#include "fake_fetcher.h"
+#include "hunk.h"
+
+static char * temp_path() {
+    char * const path = g_build_filename(
+        g_get_tmp_dir(), "unittest_trace_source_XXXXXX", NULL);
+    int const fd = g_mkstemp(path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    return path;
+}
+
+static view prefetched[2];
+
+static void recording_prefetcher(
+        void * source, view const * ranges, unsigned n_ranges) {
+    g_assert_cmpuint(n_ranges, ==, 2);
+    prefetched[0] = ranges[0];
+    prefetched[1] = ranges[1];
+}
+
+static void assert_event(
+        FILE * const f, trace_op const op, unsigned const source,
+        sample_pos const start, sample_pos const end, unsigned const n) {
+    trace_event e;
+    g_assert_true(trace_read_event(f, &e));
+    g_assert_cmpint(e.op, ==, op);
+    g_assert_cmpuint(e.source, ==, source);
+    g_assert_cmpuint(e.v.start, ==, start);
+    g_assert_cmpuint(e.v.end, ==, end);
+    g_assert_cmpuint(e.n, ==, n);
+}
+
+static void test_records() {
+    guint32 data[100];
+    for (unsigned i = 0; i < 100; i++) {
+        data[i] = i;
+    }
+    memory_source ma = {.data = data, .length = 100};
+    memory_source mb = {.data = data, .length = 100};
+    char * const path = temp_path();
+    trace_log * const log = trace_log_open(path);
+    g_assert_nonnull(log);
+    trace_source * const a = trace_source_new(
+        log, sizeof(guint32), memory_seeker, memory_fetcher,
+        recording_prefetcher, &ma);
+    trace_source * const b = trace_source_new(
+        log, sizeof(guint32), memory_seeker, memory_fetcher, NULL, &mb);
+
+    guint32 buffer[20];
+    g_assert_cmpuint(trace_source_fetcher(a, (char *) buffer, 20), ==, 20);
+    g_assert_cmpuint(buffer[19], ==, 19);
+    trace_source_seeker(b, 90);
+    g_assert_cmpuint(trace_source_fetcher(b, (char *) buffer, 20), ==, 10);
+    g_assert_cmpuint(buffer[0], ==, 90);
+    view const ranges[] = {{.start = 5, .end = 10}, {.start = 50, .end = 60}};
+    trace_source_prefetcher(a, ranges, 2);
+    g_assert_cmpuint(prefetched[1].end, ==, 60);
+    trace_source_prefetcher(b, ranges, 2);
+    trace_source_free(a);
+    trace_source_free(b);
+    trace_log_close(log);
+
+    FILE * const f = fopen(path, "r");
+    g_assert_nonnull(f);
+    assert_event(f, TRACE_SOURCE, 0, 0, 0, sizeof(guint32));
+    assert_event(f, TRACE_SOURCE, 1, 0, 0, sizeof(guint32));
+    assert_event(f, TRACE_FETCH, 0, 0, 20, 20);
+    assert_event(f, TRACE_SEEK, 1, 90, 0, 0);
+    assert_event(f, TRACE_FETCH, 1, 90, 100, 20);
+    assert_event(f, TRACE_PREFETCH, 0, 0, 0, 2);
+    assert_event(f, TRACE_RANGE, 0, 5, 10, 0);
+    assert_event(f, TRACE_RANGE, 0, 50, 60, 0);
+    assert_event(f, TRACE_PREFETCH, 1, 0, 0, 2);
+    assert_event(f, TRACE_RANGE, 1, 5, 10, 0);
+    assert_event(f, TRACE_RANGE, 1, 50, 60, 0);
+    trace_event e;
+    g_assert_false(trace_read_event(f, &e));
+    fclose(f);
+    remove(path);
+    g_free(path);
+}
+
+/*
+ * Tracing a diff doesn't change it, and every byte it fetches is in the
+ * trace.
+ */
+static void test_traced_diff() {
+    unsigned const length = 20000;
+    guint32 * const a_data = g_new(guint32, length);
+    guint32 * const b_data = g_new(guint32, length);
+    for (unsigned i = 0; i < length; i++) {
+        a_data[i] = b_data[i] = i * 2654435761u;
+    }
+    b_data[12345] ^= 1;
+    memory_source ma = {.data = a_data, .length = length};
+    memory_source mb = {.data = b_data, .length = length};
+    char * const path = temp_path();
+    trace_log * const log = trace_log_open(path);
+    trace_source * const a = trace_source_new(
+        log, sizeof(guint32), memory_seeker, memory_fetcher, NULL, &ma);
+    trace_source * const b = trace_source_new(
+        log, sizeof(guint32), memory_seeker, memory_fetcher, NULL, &mb);
+    bdiff_stats stats = {};
+    bdiff_options const opts = {.stats = &stats};
+    hunk * const h = bdiff_with_options(
+        sizeof(guint32), trace_source_seeker, trace_source_fetcher, a, b,
+        &opts);
+    trace_source_free(a);
+    trace_source_free(b);
+    trace_log_close(log);
+    g_assert_nonnull(h);
+    g_assert_null(h->next);
+    g_assert_cmpuint(h->a.start, ==, 12345);
+    g_assert_cmpuint(h->a.end, ==, 12346);
+
+    FILE * const f = fopen(path, "r");
+    uint64_t fetched[2] = {};
+    trace_event e;
+    while (trace_read_event(f, &e)) {
+        if (e.op == TRACE_FETCH) {
+            fetched[e.source] += (e.v.end - e.v.start) * sizeof(guint32);
+        }
+    }
+    g_assert_cmpuint(fetched[0], ==, stats.a.bytes_fetched);
+    g_assert_cmpuint(fetched[1], ==, stats.b.bytes_fetched);
+    fclose(f);
+    remove(path);
+    g_free(path);
+    hunk_free(h);
+    g_free(a_data);
+    g_free(b_data);
+}
+
+void add_trace_source_tests() {
+    g_test_add_func("/trace_source/records", test_records);
+    g_test_add_func("/trace_source/traced_diff", test_traced_diff);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void add_trace_source_tests();